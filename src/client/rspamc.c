@@ -48,6 +48,7 @@ static gchar *local_addr = NULL;
 static gint weight = 0;
 static gint flag = 0;
 static gint max_requests = 8;
+static gint batch_size = 0;
 static gdouble timeout = 5.0;
 static gboolean pass_all;
 static gboolean tty = FALSE;
@@ -105,6 +106,8 @@ static GOptionEntry entries[] =
 	  NULL },
 	{ "max-requests", 'n', 0, G_OPTION_ARG_INT, &max_requests,
 	  "Maximum count of parallel requests to rspamd", NULL },
+	{ "batch", 0, 0, G_OPTION_ARG_INT, &batch_size,
+	  "Check files from directories by batches of specified size", NULL },
 	{ "extended-urls", 0, 0, G_OPTION_ARG_NONE, &extended_urls,
 	   "Output urls in extended format", NULL },
 	{ "key", 0, 0, G_OPTION_ARG_STRING, &key,
@@ -261,6 +264,16 @@ struct rspamc_callback_data {
 	gchar *filename;
 };
 
+/*
+ * Messages sent to rspamd in a single request
+ */
+struct rspamc_batch {
+	struct rspamc_command *cmd;
+	struct rspamd_client_connection *conn;
+	FILE *out;
+	GPtrArray *filenames;
+};
+
 /*
  * Parse command line
  */
@@ -709,6 +722,10 @@ rspamc_stat_output (ucl_object_t *obj)
 		ucl_object_toint (ucl_object_find_key (obj, "connections")));
 	rspamd_printf_gstring (out, "Control connections count: %L\n",
 		ucl_object_toint (ucl_object_find_key (obj, "control_connections")));
+	rspamd_printf_gstring (out, "Tasks in progress: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "tasks_active")));
+	rspamd_printf_gstring (out, "Accept pauses due to overload: %L\n",
+		ucl_object_toint (ucl_object_find_key (obj, "accept_paused")));
 	/* Pools */
 	rspamd_printf_gstring (out, "Pools allocated: %L\n",
 		ucl_object_toint (ucl_object_find_key (obj, "pools_allocated")));
@@ -754,13 +771,32 @@ rspamc_output_headers (struct rspamd_http_message *msg)
 	rspamd_fprintf (stdout, "\n");
 }
 
+static void
+rspamc_output_result (struct rspamc_command *cmd, ucl_object_t *result)
+{
+	gchar *out;
+
+	if (raw || cmd->command_output_func == NULL) {
+		if (json) {
+			out = ucl_object_emit (result, UCL_EMIT_JSON);
+		}
+		else {
+			out = ucl_object_emit (result, UCL_EMIT_CONFIG);
+		}
+		printf ("%s", out);
+		free (out);
+	}
+	else {
+		cmd->command_output_func (result);
+	}
+}
+
 static void
 rspamc_client_cb (struct rspamd_client_connection *conn,
 	struct rspamd_http_message *msg,
 	const gchar *name, ucl_object_t *result,
 	gpointer ud, GError *err)
 {
-	gchar *out;
 	struct rspamc_callback_data *cbdata = (struct rspamc_callback_data *)ud;
 	struct rspamc_command *cmd;
 
@@ -775,19 +811,7 @@ rspamc_client_cb (struct rspamd_client_connection *conn,
 		if (headers && msg != NULL) {
 			rspamc_output_headers (msg);
 		}
-		if (raw || cmd->command_output_func == NULL) {
-			if (json) {
-				out = ucl_object_emit (result, UCL_EMIT_JSON);
-			}
-			else {
-				out = ucl_object_emit (result, UCL_EMIT_CONFIG);
-			}
-			printf ("%s", out);
-			free (out);
-		}
-		else {
-			cmd->command_output_func (result);
-		}
+		rspamc_output_result (cmd, result);
 		ucl_object_unref (result);
 	}
 	else if (err != NULL) {
@@ -802,15 +826,12 @@ rspamc_client_cb (struct rspamd_client_connection *conn,
 	g_slice_free1 (sizeof (struct rspamc_callback_data), cbdata);
 }
 
-static void
-rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
-	FILE *in, const gchar *name, GHashTable *attrs)
+static struct rspamd_client_connection *
+rspamc_connect (struct event_base *ev_base, struct rspamc_command *cmd)
 {
 	struct rspamd_client_connection *conn;
 	gchar **connectv;
 	guint16 port;
-	GError *err = NULL;
-	struct rspamc_callback_data *cbdata;
 
 	connectv = g_strsplit_set (connect_str, ":", -1);
 
@@ -833,6 +854,19 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 	conn = rspamd_client_init (ev_base, connectv[0], port, timeout, key);
 	g_strfreev (connectv);
 
+	return conn;
+}
+
+static void
+rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
+	FILE *in, const gchar *name, GHashTable *attrs)
+{
+	struct rspamd_client_connection *conn;
+	GError *err = NULL;
+	struct rspamc_callback_data *cbdata;
+
+	conn = rspamc_connect (ev_base, cmd);
+
 	if (conn != NULL) {
 		cbdata = g_slice_alloc (sizeof (struct rspamc_callback_data));
 		cbdata->cmd = cmd;
@@ -853,6 +887,129 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 	}
 }
 
+static void
+rspamc_batch_cb (struct rspamd_client_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *name, ucl_object_t *result,
+	gpointer ud, GError *err)
+{
+	struct rspamc_batch *batch = (struct rspamc_batch *)ud;
+	const ucl_object_t *elt, *error;
+	guint i;
+
+	for (i = 0; i < batch->filenames->len; i ++) {
+		rspamd_fprintf (stdout, "Results for file: %s\n",
+			(const gchar *)g_ptr_array_index (batch->filenames, i));
+
+		if (result != NULL) {
+			/* Results are returned in the same order as messages */
+			elt = ucl_array_find_index (result, i);
+
+			if (elt == NULL) {
+				rspamd_fprintf (stdout, "no result returned\n");
+			}
+			else if ((error = ucl_object_find_key (elt, "error")) != NULL) {
+				rspamd_fprintf (stdout, "%s\n", ucl_object_tostring (error));
+			}
+			else {
+				rspamc_output_result (batch->cmd, (ucl_object_t *)elt);
+			}
+		}
+		else if (err != NULL) {
+			rspamd_fprintf (stdout, "%s\n", err->message);
+		}
+
+		rspamd_fprintf (stdout, "\n");
+	}
+
+	fflush (stdout);
+
+	if (result != NULL) {
+		ucl_object_unref (result);
+	}
+
+	g_ptr_array_set_size (batch->filenames, 0);
+}
+
+/*
+ * Append message to the batch as its length, CRLF and its content
+ */
+static void
+rspamc_batch_add (struct rspamc_batch *batch, FILE *in, const gchar *name)
+{
+	GByteArray *data;
+	gchar buf[BUFSIZ];
+	gsize r;
+
+	/*
+	 * Size of file could be unknown (e.g. for a pipe) or could be changed
+	 * while it is read, so the message is framed by the data actually read
+	 */
+	data = g_byte_array_new ();
+	while ((r = fread (buf, 1, sizeof (buf), in)) > 0) {
+		g_byte_array_append (data, (const guint8 *)buf, r);
+	}
+
+	if (ferror (in) || data->len == 0) {
+		fprintf (stderr, "skip empty or unreadable file %s\n", name);
+		g_byte_array_free (data, TRUE);
+		return;
+	}
+
+	if (batch->out == NULL) {
+		batch->out = tmpfile ();
+		if (batch->out == NULL) {
+			fprintf (stderr, "cannot create temporary file: %s\n",
+				strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	fprintf (batch->out, "%u\r\n", data->len);
+	fwrite (data->data, 1, data->len, batch->out);
+	g_byte_array_free (data, TRUE);
+
+	g_ptr_array_add (batch->filenames, g_strdup (name));
+}
+
+/*
+ * Send all accumulated messages and wait for the reply
+ */
+static void
+rspamc_batch_flush (struct event_base *ev_base, struct rspamc_batch *batch,
+	GHashTable *attrs)
+{
+	GError *err = NULL;
+
+	if (batch->filenames->len == 0) {
+		return;
+	}
+
+	if (batch->conn == NULL) {
+		batch->conn = rspamc_connect (ev_base, batch->cmd);
+		if (batch->conn == NULL) {
+			fprintf (stderr, "cannot connect to %s\n", connect_str);
+			exit (EXIT_FAILURE);
+		}
+		/* All batches are sent using the same connection */
+		rspamd_client_set_keepalive (batch->conn, TRUE);
+	}
+
+	rewind (batch->out);
+
+	if (!rspamd_client_command (batch->conn, "checkv", attrs, batch->out,
+			rspamc_batch_cb, batch, &err)) {
+		rspamc_batch_cb (batch->conn, NULL, NULL, NULL, batch, err);
+		g_error_free (err);
+	}
+	else {
+		event_base_loop (ev_base, 0);
+	}
+
+	fclose (batch->out);
+	batch->out = NULL;
+}
+
 static void
 rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
 	const gchar *name, GHashTable *attrs)
@@ -865,6 +1022,13 @@ rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
 #endif
 	FILE *in;
 	char filebuf[PATH_MAX];
+	struct rspamc_batch *batch = NULL;
+
+	if (batch_size > 0 && cmd->cmd == RSPAMC_COMMAND_SYMBOLS) {
+		batch = g_slice_alloc0 (sizeof (struct rspamc_batch));
+		batch->cmd = cmd;
+		batch->filenames = g_ptr_array_new_with_free_func (g_free);
+	}
 
 	d = opendir (name);
 
@@ -884,6 +1048,14 @@ rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
 						fprintf (stderr, "cannot open file %s\n", filebuf);
 						exit (EXIT_FAILURE);
 					}
+					if (batch != NULL) {
+						rspamc_batch_add (batch, in, filebuf);
+						fclose (in);
+						if (batch->filenames->len >= (guint)batch_size) {
+							rspamc_batch_flush (ev_base, batch, attrs);
+						}
+						continue;
+					}
 					rspamc_process_input (ev_base, cmd, in, filebuf, attrs);
 					cur_req++;
 					fclose (in);
@@ -902,6 +1074,14 @@ rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
 	}
 
 	closedir (d);
+
+	if (batch != NULL) {
+		rspamc_batch_flush (ev_base, batch, attrs);
+		rspamd_client_destroy (batch->conn);
+		g_ptr_array_free (batch->filenames, TRUE);
+		g_slice_free1 (sizeof (struct rspamc_batch), batch);
+	}
+
 	event_base_loop (ev_base, 0);
 }
 
@@ -35,10 +35,15 @@
 struct rspamd_client_request;
 
 /*
- * Since rspamd uses untagged HTTP we can pass a single message per socket
+ * Since rspamd uses untagged HTTP we can pass a single message per socket at
+ * once, however, a persistent connection can be reused for the next message
  */
 struct rspamd_client_connection {
 	gint fd;
+	gchar *name;
+	guint16 port;
+	gboolean keepalive;
+	gboolean alive;
 	GString *server_name;
 	gpointer key;
 	gpointer keypair;
@@ -57,6 +62,14 @@ struct rspamd_client_request {
 	gpointer ud;
 };
 
+/*
+ * All connections of a client share the same keypair and keys cache, so a
+ * shared key is computed once per server key and servers can find it in their
+ * caches instead of doing key agreement for each connection
+ */
+static gpointer client_keypair = NULL;
+static struct rspamd_keypair_cache *client_keys_cache = NULL;
+
 #define RCLIENT_ERROR rspamd_client_error_quark ()
 GQuark
 rspamd_client_error_quark (void)
@@ -81,6 +94,7 @@ rspamd_client_error_handler (struct rspamd_http_connection *conn, GError *err)
 	struct rspamd_client_connection *c;
 
 	c = req->conn;
+	c->alive = FALSE;
 	req->cb (c, NULL, c->server_name->str, NULL, req->ud, err);
 }
 
@@ -107,6 +121,8 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 		return 0;
 	}
 	else {
+		c->alive = c->keepalive && (msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE);
+
 		if (msg->body == NULL || msg->body->len == 0 || msg->code != 200) {
 			err = g_error_new (RCLIENT_ERROR, msg->code, "HTTP error: %d, %s",
 					msg->code,
@@ -149,8 +165,14 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	conn = g_slice_alloc0 (sizeof (struct rspamd_client_connection));
 	conn->ev_base = ev_base;
 	conn->fd = fd;
+	conn->name = g_strdup (name);
+	conn->port = port;
+	conn->alive = TRUE;
 	conn->req_sent = FALSE;
-	conn->keys_cache = rspamd_keypair_cache_new (32);
+	if (client_keys_cache == NULL) {
+		client_keys_cache = rspamd_keypair_cache_new (32);
+	}
+	conn->keys_cache = client_keys_cache;
 	conn->http_conn = rspamd_http_connection_new (rspamd_client_body_handler,
 			rspamd_client_error_handler,
 			rspamd_client_finish_handler,
@@ -168,7 +190,10 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	if (key) {
 		conn->key = rspamd_http_connection_make_peer_key (key);
 		if (conn->key) {
-			conn->keypair = rspamd_http_connection_gen_key ();
+			if (client_keypair == NULL) {
+				client_keypair = rspamd_http_connection_gen_key ();
+			}
+			conn->keypair = rspamd_http_connection_key_ref (client_keypair);
 			rspamd_http_connection_set_key (conn->http_conn, conn->keypair);
 		}
 		else {
@@ -180,6 +205,41 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	return conn;
 }
 
+void
+rspamd_client_set_keepalive (struct rspamd_client_connection *conn,
+	gboolean keepalive)
+{
+	conn->keepalive = keepalive;
+}
+
+static gboolean
+rspamd_client_reuse (struct rspamd_client_connection *conn, GError **err)
+{
+	gint fd;
+
+	g_slice_free1 (sizeof (struct rspamd_client_request), conn->req);
+	conn->req = NULL;
+	conn->req_sent = FALSE;
+	rspamd_http_connection_reset (conn->http_conn);
+
+	if (!conn->alive) {
+		/* Server has closed connection, so we need to reconnect */
+		fd = rspamd_socket (conn->name, conn->port, SOCK_STREAM, TRUE, FALSE,
+				TRUE);
+		if (fd == -1) {
+			g_set_error (err, RCLIENT_ERROR, errno, "cannot connect to %s: %s",
+					conn->server_name->str, strerror (errno));
+			return FALSE;
+		}
+
+		close (conn->fd);
+		conn->fd = fd;
+		conn->alive = TRUE;
+	}
+
+	return TRUE;
+}
+
 gboolean
 rspamd_client_command (struct rspamd_client_connection *conn,
 	const gchar *command, GHashTable *attrs,
@@ -191,12 +251,19 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	gsize remain, old_len;
 	GHashTableIter it;
 
+	if (conn->req != NULL && !rspamd_client_reuse (conn, err)) {
+		return FALSE;
+	}
+
 	req = g_slice_alloc (sizeof (struct rspamd_client_request));
 	req->conn = conn;
 	req->cb = cb;
 	req->ud = ud;
 
 	req->msg = rspamd_http_new_message (HTTP_REQUEST);
+	if (conn->keepalive) {
+		req->msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+	}
 	if (conn->key) {
 		req->msg->peer_key = rspamd_http_connection_key_ref (conn->key);
 	}
@@ -263,6 +330,7 @@ rspamd_client_destroy (struct rspamd_client_connection *conn)
 			rspamd_http_connection_key_unref (conn->keypair);
 		}
 		g_string_free (conn->server_name, TRUE);
+		g_free (conn->name);
 		g_slice_free1 (sizeof (struct rspamd_client_connection), conn);
 	}
 }
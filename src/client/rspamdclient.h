@@ -62,7 +62,17 @@ struct rspamd_client_connection * rspamd_client_init (
 	const gchar *key);
 
 /**
- *
+ * Use persistent connection: if server agrees, the next command is sent
+ * using the same socket, otherwise client reconnects to the server
+ * @param conn connection object
+ * @param keepalive enable or disable persistent connection
+ */
+void rspamd_client_set_keepalive (struct rspamd_client_connection *conn,
+	gboolean keepalive);
+
+/**
+ * Send command to rspamd, a connection can be used for another command
+ * when the callback for the previous one has been called
  * @param conn connection object
  * @param command command name
  * @param attrs additional attributes
@@ -55,6 +55,7 @@
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_MEMORY "/memory"
 
 /* Graph colors */
 #define COLOR_CLEAN "#58A458"
@@ -1299,6 +1300,10 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (stat->control_connections_count),
 		"control_connections", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->tasks_active), "tasks_active", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->accept_paused), "accept_paused", 0, false);
 
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
@@ -1442,6 +1447,78 @@ rspamd_controller_handle_counters (
 	return 0;
 }
 
+static ucl_object_t *
+rspamd_controller_process_memory_to_ucl (struct rspamd_worker_mem *mem)
+{
+	ucl_object_t *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (mem->pid), "pid", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (mem->title), "title", 0,
+		false);
+	ucl_object_insert_key (obj, ucl_object_fromint (mem->updated), "updated", 0,
+		false);
+	ucl_object_insert_key (obj, ucl_object_fromint (mem->st.rss), "rss", 0,
+		false);
+	ucl_object_insert_key (obj, ucl_object_fromint (mem->st.pss), "pss", 0,
+		false);
+	ucl_object_insert_key (obj, ucl_object_fromint (mem->st.shared), "shared",
+		0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (mem->st.priv), "private", 0,
+		false);
+
+	return obj;
+}
+
+/*
+ * Memory command handler:
+ * request: /memory
+ * headers: Password
+ * reply: json array of memory usage of main process and all workers
+ */
+static int
+rspamd_controller_handle_memory (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_main *srv = session->ctx->srv;
+	struct rspamd_worker_mem mem;
+	ucl_object_t *top;
+	guint i;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+
+	/*
+	 * Memory maps of other processes are not readable by the controller,
+	 * so each process reports its own memory usage to a shared slot
+	 */
+	for (i = 0; i < srv->workers_mem_size; i ++) {
+		memcpy (&mem, &srv->workers_mem[i], sizeof (mem));
+
+		if (mem.pid != 0) {
+			mem.title[sizeof (mem.title) - 1] = '\0';
+			ucl_array_append (top, rspamd_controller_process_memory_to_ucl (&mem));
+		}
+	}
+
+	if (top->len == 0) {
+		ucl_object_unref (top);
+		rspamd_controller_send_error (conn_ent, 501,
+			"Memory usage is not available on this system");
+		return 0;
+	}
+
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
 static int
 rspamd_controller_handle_custom (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
@@ -1626,6 +1703,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	}
 	/* Accept event */
 	cache = rspamd_keypair_cache_new (256);
+	if (worker->srv->keys_cache != NULL) {
+		rspamd_keypair_cache_set_shared (cache, worker->srv->keys_cache);
+	}
 	ctx->http = rspamd_http_router_new (rspamd_controller_error_handler,
 			rspamd_controller_finish_handler, &ctx->io_tv, ctx->ev_base,
 			ctx->static_files_dir, cache);
@@ -1682,6 +1762,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 		rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			  PATH_MEMORY,
+		rspamd_controller_handle_memory);
 
 	if (ctx->key) {
 		rspamd_http_router_set_key (ctx->http, ctx->key);
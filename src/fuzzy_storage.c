@@ -48,6 +48,10 @@
 #define DEFAULT_EXPIRE 172800L
 /* Resync value in seconds */
 #define SYNC_TIMEOUT 60
+/* Number of hashes expired per single event loop iteration */
+#define DEFAULT_EXPIRE_STEP 1000
+/* Interval between expire steps in microseconds */
+#define EXPIRE_STEP_INTERVAL 10000
 /* Number of hash buckets */
 #define BUCKETS 1024
 /* Number of insuccessfull bind retries */
@@ -88,6 +92,10 @@ struct rspamd_fuzzy_storage_ctx {
 	radix_compressed_t *update_ips;
 	gchar *update_map;
 	struct event_base *ev_base;
+	guint32 expire_step;
+	gboolean expire_running;
+	struct event expire_ev;
+	struct timeval expire_tv;
 
 	struct rspamd_fuzzy_backend *backend;
 };
@@ -282,6 +290,32 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 	}
 }
 
+/*
+ * Expire old hashes by small slices to avoid blocking of the event loop
+ */
+static void
+expire_callback (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	gsize expired;
+
+	ctx = worker->ctx;
+	expired = rspamd_fuzzy_backend_expire_step (ctx->backend, ctx->expire,
+			ctx->expire_step);
+
+	server_stat->fuzzy_hashes_expired = rspamd_fuzzy_backend_expired (ctx->backend);
+	server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
+
+	if (expired >= ctx->expire_step) {
+		/* Some more hashes might be expired, continue on the next iteration */
+		evtimer_add (&ctx->expire_ev, &ctx->expire_tv);
+	}
+	else {
+		ctx->expire_running = FALSE;
+	}
+}
+
 static void
 sync_callback (gint fd, short what, void *arg)
 {
@@ -297,10 +331,19 @@ sync_callback (gint fd, short what, void *arg)
 	tmv.tv_usec = 0;
 	evtimer_add (&tev, &tmv);
 
-	/* Call backend sync */
-	rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire);
+	if (ctx->expire_step == 0) {
+		/* Incremental expiration is disabled, expire all hashes at once */
+		rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire);
+		return;
+	}
 
-	server_stat->fuzzy_hashes_expired = rspamd_fuzzy_backend_expired (ctx->backend);
+	/* Call backend sync, expiration is performed incrementally */
+	rspamd_fuzzy_backend_sync (ctx->backend, 0);
+
+	if (!ctx->expire_running && ctx->expire > 0) {
+		ctx->expire_running = TRUE;
+		evtimer_add (&ctx->expire_ev, &ctx->expire_tv);
+	}
 }
 
 gpointer
@@ -315,6 +358,7 @@ init_fuzzy (struct rspamd_config *cfg)
 
 	ctx->max_mods = DEFAULT_MOD_LIMIT;
 	ctx->expire = DEFAULT_EXPIRE;
+	ctx->expire_step = DEFAULT_EXPIRE_STEP;
 
 	rspamd_rcl_register_worker_option (cfg, type, "hashfile",
 		rspamd_rcl_parse_struct_string, ctx,
@@ -348,6 +392,10 @@ init_fuzzy (struct rspamd_config *cfg)
 		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
 		expire), RSPAMD_CL_FLAG_TIME_FLOAT);
 
+	rspamd_rcl_register_worker_option (cfg, type, "expire_step",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+		expire_step), RSPAMD_CL_FLAG_INT_32);
 
 	rspamd_rcl_register_worker_option (cfg, type, "allow_update",
 		rspamd_rcl_parse_struct_string, ctx,
@@ -388,6 +436,12 @@ start_fuzzy (struct rspamd_worker *worker)
 	tmv.tv_usec = 0;
 	evtimer_add (&tev, &tmv);
 
+	/* Expire event is planned by sync callback */
+	evtimer_set (&ctx->expire_ev, expire_callback, worker);
+	event_base_set (ctx->ev_base, &ctx->expire_ev);
+	ctx->expire_tv.tv_sec = 0;
+	ctx->expire_tv.tv_usec = EXPIRE_STEP_INTERVAL;
+
 	/* Create radix tree */
 	if (ctx->update_map != NULL) {
 		if (!rspamd_map_add (worker->srv->cfg, ctx->update_map,
@@ -0,0 +1,131 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <immintrin.h>
+
+/*
+ * Vectorized base64 decoding is based on the algorithm by Wojciech Mula:
+ * characters are validated and translated to 6-bit values by lookups
+ * indexed by nibbles, and then packed by multiply-add instructions
+ */
+
+size_t qp_span_ref (const unsigned char *in, size_t inlen, unsigned char *out);
+
+static inline __m256i
+dec_reshuffle (__m256i in)
+{
+	__m256i out;
+
+	/* Merge 6-bit values into 12-bit and then into 24-bit values */
+	out = _mm256_maddubs_epi16 (in, _mm256_set1_epi32 (0x01400140));
+	out = _mm256_madd_epi16 (out, _mm256_set1_epi32 (0x00011000));
+	/* Pack 3 bytes of each dword in big endian order */
+	out = _mm256_shuffle_epi8 (out, _mm256_setr_epi8 (
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+	return _mm256_permutevar8x32_epi32 (out,
+			_mm256_setr_epi32 (0, 1, 2, 4, 5, 6, -1, -1));
+}
+
+size_t
+base64_decode_blocks_avx2 (const unsigned char *in, size_t inlen,
+		unsigned char *out, size_t *outlen)
+{
+	const unsigned char *p = in;
+	unsigned char *o = out;
+	const __m256i lut_lo = _mm256_setr_epi8 (
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8 (
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8 (
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8 (0x2f);
+	__m256i str, hi_nibbles, lo_nibbles, hi, lo, eq_2f, roll;
+
+	/*
+	 * We write 32 bytes for each 24 bytes decoded, so we need some space
+	 * in output buffer that is guaranteed by the remaining input
+	 */
+	while (inlen >= 45) {
+		str = _mm256_loadu_si256 ((const __m256i *)p);
+		hi_nibbles = _mm256_and_si256 (_mm256_srli_epi32 (str, 4), mask_2f);
+		lo_nibbles = _mm256_and_si256 (str, mask_2f);
+		hi = _mm256_shuffle_epi8 (lut_hi, hi_nibbles);
+		lo = _mm256_shuffle_epi8 (lut_lo, lo_nibbles);
+
+		if (!_mm256_testz_si256 (lo, hi)) {
+			/* Some character is not in base64 alphabet */
+			break;
+		}
+
+		eq_2f = _mm256_cmpeq_epi8 (str, mask_2f);
+		roll = _mm256_shuffle_epi8 (lut_roll,
+				_mm256_add_epi8 (eq_2f, hi_nibbles));
+		str = dec_reshuffle (_mm256_add_epi8 (str, roll));
+		_mm256_storeu_si256 ((__m256i *)o, str);
+
+		p += 32;
+		o += 24;
+		inlen -= 32;
+	}
+
+	*outlen = o - out;
+
+	return p - in;
+}
+
+size_t
+qp_span_avx2 (const unsigned char *in, size_t inlen, unsigned char *out)
+{
+	const unsigned char *p = in;
+	const __m256i eq = _mm256_set1_epi8 ('=');
+	__m256i v;
+	unsigned int mask;
+
+	while (inlen >= 32) {
+		v = _mm256_loadu_si256 ((const __m256i *)p);
+		/* Output is never longer than input, so we can store the whole block */
+		_mm256_storeu_si256 ((__m256i *)(out + (p - in)), v);
+		mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, eq));
+
+		if (mask != 0) {
+			return (p - in) + __builtin_ctz (mask);
+		}
+
+		p += 32;
+		inlen -= 32;
+	}
+
+	return (p - in) + qp_span_ref (p, inlen, out + (p - in));
+}
@@ -0,0 +1,277 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "base64.h"
+#include "platform_config.h"
+
+extern unsigned long cpu_config;
+
+typedef struct base64_impl_t {
+	unsigned long cpu_flags;
+	const char *desc;
+	/* Decodes blocks of valid base64 characters, returns number of bytes read */
+	size_t (*decode_blocks) (const unsigned char *in, size_t inlen,
+			unsigned char *out, size_t *outlen);
+	/* Copies data up to the first '=' character, returns number of bytes copied */
+	size_t (*qp_span) (const unsigned char *in, size_t inlen,
+			unsigned char *out);
+} base64_impl_t;
+
+#define BASE64_DECLARE(ext) \
+		size_t base64_decode_blocks_##ext (const unsigned char *in, size_t inlen, unsigned char *out, size_t *outlen); \
+		size_t qp_span_##ext (const unsigned char *in, size_t inlen, unsigned char *out);
+#define BASE64_IMPL(cpuflags, desc, ext) \
+		{(cpuflags), desc, base64_decode_blocks_##ext, qp_span_##ext}
+
+#if defined(HAVE_BASE64_AVX2)
+	BASE64_DECLARE(avx2)
+	#define BASE64_AVX2 BASE64_IMPL(CPUID_AVX2, "avx2", avx2)
+#endif
+#if defined(HAVE_BASE64_SSSE3)
+	BASE64_DECLARE(ssse3)
+	#define BASE64_SSSE3 BASE64_IMPL(CPUID_SSSE3, "ssse3", ssse3)
+#endif
+
+BASE64_DECLARE(ref)
+#define BASE64_GENERIC BASE64_IMPL(0, "generic", ref)
+
+static const base64_impl_t base64_list[] = {
+	BASE64_GENERIC,
+#if defined(BASE64_AVX2)
+	BASE64_AVX2,
+#endif
+#if defined(BASE64_SSSE3)
+	BASE64_SSSE3,
+#endif
+};
+
+static const base64_impl_t *base64_impl = &base64_list[0];
+
+/* Values of characters: 0-63 for alphabet, 0xfe for padding, 0xff for others */
+#define B64_PAD 0xfe
+#define B64_INV 0xff
+
+const unsigned char base64_table_dec[256] = {
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255, 255, 255,  63,
+	 52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255, 254, 255, 255,
+	255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+	 15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255, 255,
+	255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+	 41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+};
+
+const gchar *
+base64_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 0; i < G_N_ELEMENTS (base64_list); i ++) {
+			if (base64_list[i].cpu_flags & cpu_config) {
+				base64_impl = &base64_list[i];
+				break;
+			}
+		}
+	}
+
+	return base64_impl->desc;
+}
+
+gboolean
+base64_select (const gchar *desc)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (base64_list); i ++) {
+		if (strcmp (base64_list[i].desc, desc) == 0 &&
+				(base64_list[i].cpu_flags == 0 ||
+				(base64_list[i].cpu_flags & cpu_config))) {
+			base64_impl = &base64_list[i];
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+gsize
+rspamd_decode_base64 (const guchar *in, gsize inlen, guchar *out)
+{
+	const guchar *end = in + inlen;
+	guchar *o = out, c;
+	guint32 acc = 0;
+	guint n = 0;
+	gboolean skipped;
+	gsize r, olen;
+
+	while (in < end) {
+		/*
+		 * Vectorized decoder works with whole quantums only, the remaining
+		 * quantums of a line are decoded by the generic one
+		 */
+		if (n == 0) {
+			olen = 0;
+			r = base64_impl->decode_blocks (in, end - in, o, &olen);
+			in += r;
+			o += olen;
+
+			if (base64_impl != &base64_list[0]) {
+				olen = 0;
+				r = base64_decode_blocks_ref (in, end - in, o, &olen);
+				in += r;
+				o += olen;
+			}
+		}
+
+		/*
+		 * Decode characters one by one until we skip some invalid character
+		 * and reach the boundary of quantum, e.g. the end of line
+		 */
+		skipped = FALSE;
+
+		while (in < end) {
+			if (skipped && n == 0 && base64_table_dec[*in] < 64) {
+				break;
+			}
+
+			c = base64_table_dec[*in++];
+
+			if (c < 64) {
+				acc = (acc << 6) | c;
+
+				if (++n == 4) {
+					*o++ = (acc >> 16) & 0xff;
+					*o++ = (acc >> 8) & 0xff;
+					*o++ = acc & 0xff;
+					n = 0;
+					acc = 0;
+				}
+			}
+			else {
+				if (c == B64_PAD) {
+					/* Flush incomplete quantum */
+					if (n == 2) {
+						*o++ = (acc >> 4) & 0xff;
+					}
+					else if (n == 3) {
+						*o++ = (acc >> 10) & 0xff;
+						*o++ = (acc >> 2) & 0xff;
+					}
+					n = 0;
+					acc = 0;
+				}
+
+				skipped = TRUE;
+			}
+		}
+	}
+
+	/* Missing padding at the end of data */
+	if (n == 2) {
+		*o++ = (acc >> 4) & 0xff;
+	}
+	else if (n == 3) {
+		*o++ = (acc >> 10) & 0xff;
+		*o++ = (acc >> 2) & 0xff;
+	}
+
+	return o - out;
+}
+
+static inline gint
+qp_hexval (guchar c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+
+	return -1;
+}
+
+gsize
+rspamd_decode_qp (const guchar *in, gsize inlen, guchar *out)
+{
+	const guchar *end = in + inlen, *p;
+	guchar *o = out;
+	gsize r;
+	gint hi, lo;
+
+	while (in < end) {
+		r = base64_impl->qp_span (in, end - in, o);
+		in += r;
+		o += r;
+
+		if (in == end) {
+			break;
+		}
+
+		/* We are at '=' character */
+		if (end - in >= 3 && (hi = qp_hexval (in[1])) != -1 &&
+				(lo = qp_hexval (in[2])) != -1) {
+			*o++ = (hi << 4) | lo;
+			in += 3;
+			continue;
+		}
+
+		/* Soft line break, transport could add some whitespaces before it */
+		p = in + 1;
+
+		while (p < end && (*p == ' ' || *p == '\t')) {
+			p ++;
+		}
+
+		if (p == end) {
+			in = end;
+		}
+		else if (*p == '\n') {
+			in = p + 1;
+		}
+		else if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+			in = p + 2;
+		}
+		else {
+			/* Invalid escape, copy it as is */
+			*o++ = *in++;
+		}
+	}
+
+	return o - out;
+}
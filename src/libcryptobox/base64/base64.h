@@ -0,0 +1,74 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BASE64_H_
+#define BASE64_H_
+
+#include "config.h"
+
+/*
+ * Transfer decoders for MIME parts. Both decoders have vectorized versions
+ * that are selected at runtime according to the CPU features
+ */
+
+/**
+ * Returns the size of output buffer required to decode `len` bytes of base64
+ */
+#define RSPAMD_BASE64_DECODED_LEN(len) ((len) / 4 * 3 + 3)
+
+/**
+ * Decode base64 encoded data skipping all characters that are not in base64
+ * alphabet, such as line breaks. Padding characters finish the current quantum,
+ * so concatenated base64 strings are decoded as well.
+ * @param in input data
+ * @param inlen length of input
+ * @param out output buffer of at least RSPAMD_BASE64_DECODED_LEN(inlen) bytes
+ * @return number of bytes written to `out`
+ */
+gsize rspamd_decode_base64 (const guchar *in, gsize inlen, guchar *out);
+
+/**
+ * Decode quoted-printable encoded data. Soft line breaks are removed and
+ * invalid escape sequences are copied as is.
+ * @param in input data
+ * @param inlen length of input
+ * @param out output buffer of at least `inlen` bytes
+ * @return number of bytes written to `out`
+ */
+gsize rspamd_decode_qp (const guchar *in, gsize inlen, guchar *out);
+
+/**
+ * Select the best implementation of decoders for this CPU
+ * @return description of the selected implementation
+ */
+const gchar * base64_load (void);
+
+/**
+ * Select the implementation of decoders by its description, e.g. to compare
+ * vectorized versions with the generic one
+ * @param desc description of implementation ("generic", "ssse3" or "avx2")
+ * @return TRUE if implementation is compiled in and supported by this CPU
+ */
+gboolean base64_select (const gchar *desc);
+
+#endif /* BASE64_H_ */
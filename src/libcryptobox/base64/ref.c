@@ -0,0 +1,71 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+extern const unsigned char base64_table_dec[256];
+
+size_t
+base64_decode_blocks_ref (const unsigned char *in, size_t inlen,
+		unsigned char *out, size_t *outlen)
+{
+	const unsigned char *p = in;
+	unsigned char *o = out;
+	unsigned int a, b, c, d;
+
+	while (inlen >= 4) {
+		a = base64_table_dec[p[0]];
+		b = base64_table_dec[p[1]];
+		c = base64_table_dec[p[2]];
+		d = base64_table_dec[p[3]];
+
+		/* Padding or invalid character */
+		if ((a | b | c | d) & 0xc0) {
+			break;
+		}
+
+		o[0] = (a << 2) | (b >> 4);
+		o[1] = (b << 4) | (c >> 2);
+		o[2] = (c << 6) | d;
+		p += 4;
+		o += 3;
+		inlen -= 4;
+	}
+
+	*outlen = o - out;
+
+	return p - in;
+}
+
+size_t
+qp_span_ref (const unsigned char *in, size_t inlen, unsigned char *out)
+{
+	const unsigned char *p;
+	size_t len;
+
+	p = memchr (in, '=', inlen);
+	len = p ? (size_t)(p - in) : inlen;
+	memcpy (out, in, len);
+
+	return len;
+}
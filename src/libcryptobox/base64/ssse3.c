@@ -0,0 +1,113 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <tmmintrin.h>
+
+/*
+ * This is the same algorithm as in avx2.c working with 128 bits vectors
+ */
+
+size_t qp_span_ref (const unsigned char *in, size_t inlen, unsigned char *out);
+
+static inline __m128i
+dec_reshuffle (__m128i in)
+{
+	__m128i out;
+
+	out = _mm_maddubs_epi16 (in, _mm_set1_epi32 (0x01400140));
+	out = _mm_madd_epi16 (out, _mm_set1_epi32 (0x00011000));
+
+	return _mm_shuffle_epi8 (out, _mm_setr_epi8 (
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+size_t
+base64_decode_blocks_ssse3 (const unsigned char *in, size_t inlen,
+		unsigned char *out, size_t *outlen)
+{
+	const unsigned char *p = in;
+	unsigned char *o = out;
+	const __m128i lut_lo = _mm_setr_epi8 (
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8 (
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8 (
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8 (0x2f);
+	__m128i str, hi_nibbles, lo_nibbles, hi, lo, eq_2f, roll;
+
+	/* We write 16 bytes for each 12 bytes decoded */
+	while (inlen >= 24) {
+		str = _mm_loadu_si128 ((const __m128i *)p);
+		hi_nibbles = _mm_and_si128 (_mm_srli_epi32 (str, 4), mask_2f);
+		lo_nibbles = _mm_and_si128 (str, mask_2f);
+		hi = _mm_shuffle_epi8 (lut_hi, hi_nibbles);
+		lo = _mm_shuffle_epi8 (lut_lo, lo_nibbles);
+
+		if (_mm_movemask_epi8 (_mm_cmpgt_epi8 (_mm_and_si128 (lo, hi),
+				_mm_setzero_si128 ())) != 0) {
+			break;
+		}
+
+		eq_2f = _mm_cmpeq_epi8 (str, mask_2f);
+		roll = _mm_shuffle_epi8 (lut_roll, _mm_add_epi8 (eq_2f, hi_nibbles));
+		str = dec_reshuffle (_mm_add_epi8 (str, roll));
+		_mm_storeu_si128 ((__m128i *)o, str);
+
+		p += 16;
+		o += 12;
+		inlen -= 16;
+	}
+
+	*outlen = o - out;
+
+	return p - in;
+}
+
+size_t
+qp_span_ssse3 (const unsigned char *in, size_t inlen, unsigned char *out)
+{
+	const unsigned char *p = in;
+	const __m128i eq = _mm_set1_epi8 ('=');
+	__m128i v;
+	unsigned int mask;
+
+	while (inlen >= 16) {
+		v = _mm_loadu_si128 ((const __m128i *)p);
+		_mm_storeu_si128 ((__m128i *)(out + (p - in)), v);
+		mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, eq));
+
+		if (mask != 0) {
+			return (p - in) + __builtin_ctz (mask);
+		}
+
+		p += 16;
+		inlen -= 16;
+	}
+
+	return (p - in) + qp_span_ref (p, inlen, out + (p - in));
+}
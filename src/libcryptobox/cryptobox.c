@@ -26,6 +26,8 @@
 #include "chacha20/chacha.h"
 #include "poly1305/poly1305.h"
 #include "curve25519/curve25519.h"
+#include "base64/base64.h"
+#include "utf8/utf8.h"
 #include "ottery.h"
 #ifdef HAVE_CPUID_H
 #include <cpuid.h>
@@ -102,6 +104,9 @@ rspamd_cryptobox_init (void)
 			if ((cpu[3] & ((gint)1 << 26))) {
 				cpu_config |= CPUID_SSE2;
 			}
+			if ((cpu[2] & ((gint)1 << 9))) {
+				cpu_config |= CPUID_SSSE3;
+			}
 			if ((cpu[2] & ((gint)1 << 28))) {
 				cpu_config |= CPUID_AVX;
 			}
@@ -117,6 +122,8 @@ rspamd_cryptobox_init (void)
 
 	chacha_load ();
 	poly1305_load ();
+	base64_load ();
+	utf8_load ();
 }
 
 void
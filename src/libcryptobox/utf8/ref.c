@@ -0,0 +1,93 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#define ASCII_MASK 0x8080808080808080ULL
+#define ONES 0x0101010101010101ULL
+
+int
+utf8_validate_ref (const unsigned char *data, size_t len)
+{
+	const unsigned char *p = data, *end = data + len;
+	unsigned char c;
+	uint64_t w;
+
+	while (p < end) {
+		/* Skip ascii words without zero bytes */
+		if (end - p >= 8) {
+			memcpy (&w, p, sizeof (w));
+
+			if (((w | ((w - ONES) & ~w)) & ASCII_MASK) == 0) {
+				p += 8;
+				continue;
+			}
+		}
+
+		c = *p;
+
+		if (c < 0x80) {
+			if (c == 0) {
+				return 0;
+			}
+			p ++;
+		}
+		else if (c < 0xc2) {
+			/* Continuation or overlong two bytes sequence */
+			return 0;
+		}
+		else if (c < 0xe0) {
+			if (end - p < 2 || (p[1] & 0xc0) != 0x80) {
+				return 0;
+			}
+			p += 2;
+		}
+		else if (c < 0xf0) {
+			if (end - p < 3 || (p[1] & 0xc0) != 0x80 ||
+					(p[2] & 0xc0) != 0x80) {
+				return 0;
+			}
+			/* Overlong forms and surrogates */
+			if ((c == 0xe0 && p[1] < 0xa0) || (c == 0xed && p[1] >= 0xa0)) {
+				return 0;
+			}
+			p += 3;
+		}
+		else if (c < 0xf5) {
+			if (end - p < 4 || (p[1] & 0xc0) != 0x80 ||
+					(p[2] & 0xc0) != 0x80 || (p[3] & 0xc0) != 0x80) {
+				return 0;
+			}
+			/* Overlong forms and code points above U+10FFFF */
+			if ((c == 0xf0 && p[1] < 0x90) || (c == 0xf4 && p[1] >= 0x90)) {
+				return 0;
+			}
+			p += 4;
+		}
+		else {
+			return 0;
+		}
+	}
+
+	return 1;
+}
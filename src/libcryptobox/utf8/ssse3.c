@@ -0,0 +1,149 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <tmmintrin.h>
+
+/*
+ * Vectorized validation is based on the lookup algorithm by John Keiser and
+ * Daniel Lemire: errors of each pair of adjacent bytes are found by
+ * intersection of three lookups indexed by their nibbles, and the
+ * lengths of multibyte sequences are checked by saturating subtractions
+ */
+
+#define TOO_SHORT      (1 << 0)
+#define TOO_LONG       (1 << 1)
+#define OVERLONG_3     (1 << 2)
+#define TOO_LARGE      (1 << 3)
+#define SURROGATE      (1 << 4)
+#define OVERLONG_2     (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4     (1 << 6)
+#define TWO_CONTS      (1 << 7)
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+static inline __m128i
+utf8_high_nibbles (__m128i v)
+{
+	return _mm_and_si128 (_mm_srli_epi16 (v, 4), _mm_set1_epi8 (0x0f));
+}
+
+static inline __m128i
+utf8_check_block (__m128i input, __m128i prev_input)
+{
+	__m128i prev1, prev2, prev3, b1h, b1l, b2h, special, must23;
+	const __m128i b1h_lut = _mm_setr_epi8 (
+			TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+			TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+			TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+			TOO_SHORT | OVERLONG_2,
+			TOO_SHORT,
+			TOO_SHORT | OVERLONG_3 | SURROGATE,
+			TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+	const __m128i b1l_lut = _mm_setr_epi8 (
+			CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+			CARRY | OVERLONG_2,
+			CARRY,
+			CARRY,
+			CARRY | TOO_LARGE,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000);
+	const __m128i b2h_lut = _mm_setr_epi8 (
+			TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+			TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+				OVERLONG_4,
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+			TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+	prev1 = _mm_alignr_epi8 (input, prev_input, 15);
+	b1h = _mm_shuffle_epi8 (b1h_lut, utf8_high_nibbles (prev1));
+	b1l = _mm_shuffle_epi8 (b1l_lut, _mm_and_si128 (prev1, _mm_set1_epi8 (0x0f)));
+	b2h = _mm_shuffle_epi8 (b2h_lut, utf8_high_nibbles (input));
+	special = _mm_and_si128 (_mm_and_si128 (b1h, b1l), b2h);
+
+	/* The third and the fourth bytes of sequences must be continuations */
+	prev2 = _mm_alignr_epi8 (input, prev_input, 14);
+	prev3 = _mm_alignr_epi8 (input, prev_input, 13);
+	must23 = _mm_or_si128 (
+			_mm_subs_epu8 (prev2, _mm_set1_epi8 ((char)(0xe0 - 0x80))),
+			_mm_subs_epu8 (prev3, _mm_set1_epi8 ((char)(0xf0 - 0x80))));
+	must23 = _mm_and_si128 (must23, _mm_set1_epi8 ((char)0x80));
+
+	return _mm_xor_si128 (must23, special);
+}
+
+int
+utf8_validate_ssse3 (const unsigned char *data, size_t len)
+{
+	const unsigned char *p = data, *end = data + len;
+	unsigned char tail[16];
+	__m128i input, prev_input = _mm_setzero_si128 (),
+			error = _mm_setzero_si128 (), prev_incomplete = _mm_setzero_si128 ();
+	const __m128i max_value = _mm_setr_epi8 (
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			(char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+	const __m128i zero = _mm_setzero_si128 ();
+
+	while (p < end) {
+		if (end - p >= 16) {
+			input = _mm_loadu_si128 ((const __m128i *)p);
+		}
+		else {
+			/* Pad the last block with ascii characters */
+			memset (tail, ' ', sizeof (tail));
+			memcpy (tail, p, end - p);
+			input = _mm_loadu_si128 ((const __m128i *)tail);
+		}
+
+		/* Zero bytes are not allowed */
+		error = _mm_or_si128 (error, _mm_cmpeq_epi8 (input, zero));
+
+		if (_mm_movemask_epi8 (input) == 0) {
+			/* Ascii block cannot continue a multibyte sequence */
+			error = _mm_or_si128 (error, prev_incomplete);
+		}
+		else {
+			error = _mm_or_si128 (error, utf8_check_block (input, prev_input));
+			prev_incomplete = _mm_subs_epu8 (input, max_value);
+		}
+
+		prev_input = input;
+		p += 16;
+	}
+
+	error = _mm_or_si128 (error, prev_incomplete);
+
+	return _mm_movemask_epi8 (_mm_cmpeq_epi8 (error, zero)) == 0xffff;
+}
@@ -0,0 +1,105 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "utf8.h"
+#include "platform_config.h"
+
+extern unsigned long cpu_config;
+
+typedef struct utf8_impl_t {
+	unsigned long cpu_flags;
+	const char *desc;
+	/* Returns 1 if data is valid UTF-8 without zero bytes */
+	int (*validate) (const unsigned char *data, size_t len);
+} utf8_impl_t;
+
+#define UTF8_DECLARE(ext) \
+		int utf8_validate_##ext (const unsigned char *data, size_t len);
+#define UTF8_IMPL(cpuflags, desc, ext) \
+		{(cpuflags), desc, utf8_validate_##ext}
+
+#if defined(HAVE_UTF8_AVX2)
+	UTF8_DECLARE(avx2)
+	#define UTF8_AVX2 UTF8_IMPL(CPUID_AVX2, "avx2", avx2)
+#endif
+#if defined(HAVE_UTF8_SSSE3)
+	UTF8_DECLARE(ssse3)
+	#define UTF8_SSSE3 UTF8_IMPL(CPUID_SSSE3, "ssse3", ssse3)
+#endif
+
+UTF8_DECLARE(ref)
+#define UTF8_GENERIC UTF8_IMPL(0, "generic", ref)
+
+static const utf8_impl_t utf8_list[] = {
+	UTF8_GENERIC,
+#if defined(UTF8_AVX2)
+	UTF8_AVX2,
+#endif
+#if defined(UTF8_SSSE3)
+	UTF8_SSSE3,
+#endif
+};
+
+static const utf8_impl_t *utf8_impl = &utf8_list[0];
+
+const gchar *
+utf8_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 0; i < G_N_ELEMENTS (utf8_list); i ++) {
+			if (utf8_list[i].cpu_flags & cpu_config) {
+				utf8_impl = &utf8_list[i];
+				break;
+			}
+		}
+	}
+
+	return utf8_impl->desc;
+}
+
+gboolean
+utf8_select (const gchar *desc)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (utf8_list); i ++) {
+		if (strcmp (utf8_list[i].desc, desc) == 0 &&
+				(utf8_list[i].cpu_flags == 0 ||
+				(utf8_list[i].cpu_flags & cpu_config))) {
+			utf8_impl = &utf8_list[i];
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+gboolean
+rspamd_fast_utf8_validate (const guchar *data, gsize len)
+{
+	return utf8_impl->validate (data, len) != 0;
+}
@@ -0,0 +1,58 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef UTF8_H_
+#define UTF8_H_
+
+#include "config.h"
+
+/*
+ * UTF-8 validation for text parts. Validator has vectorized versions that are
+ * selected at runtime according to the CPU features
+ */
+
+/**
+ * Check that data is valid UTF-8: overlong forms, surrogates and code points
+ * above U+10FFFF are rejected as well as zero bytes (the same way as
+ * g_utf8_validate does for data with the specified length)
+ * @param data input data
+ * @param len length of input
+ * @return TRUE if data is valid UTF-8
+ */
+gboolean rspamd_fast_utf8_validate (const guchar *data, gsize len);
+
+/**
+ * Select the best implementation of validator for this CPU
+ * @return description of the selected implementation
+ */
+const gchar * utf8_load (void);
+
+/**
+ * Select the implementation of validator by its description, e.g. to compare
+ * vectorized versions with the generic one
+ * @param desc description of implementation ("generic", "ssse3" or "avx2")
+ * @return TRUE if implementation is compiled in and supported by this CPU
+ */
+gboolean utf8_select (const gchar *desc);
+
+#endif /* UTF8_H_ */
@@ -25,10 +25,21 @@
 #include "images.h"
 #include "main.h"
 #include "message.h"
+#include "cfg_file.h"
+
+/* Number of bytes decoded to read headers of png, gif and bmp images */
+#define RSPAMD_IMAGE_HEADER_LEN 64
+/* Jpeg headers are scanned by chunks starting from this size */
+#define RSPAMD_JPEG_CHUNK_LEN 4096
+/* Maximum number of 8x8 blocks decoded to compute perceptual hash */
+#define RSPAMD_PHASH_MAX_BLOCKS (1024 * 1024)
+/* Minimum difference of DC values between the brightest and the darkest cells */
+#define RSPAMD_PHASH_MIN_CONTRAST 64
+/* Minimum number of bits set (and unset) in a perceptual hash */
+#define RSPAMD_PHASH_MIN_BITS 8
 
 static const guint8 png_signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
-static const guint8 jpg_sig1[] = {0xff, 0xd8};
-static const guint8 jpg_sig2[] = {'J', 'F', 'I', 'F'};
+static const guint8 jpg_signature[] = {0xff, 0xd8, 0xff};
 static const guint8 gif_signature[] = {'G', 'I', 'F', '8'};
 static const guint8 bmp_signature[] = {'B', 'M'};
 
@@ -45,7 +56,8 @@ process_images (struct rspamd_task *task)
 	while (cur) {
 		part = cur->data;
 		if (g_mime_content_type_is_type (part->type, "image",
-			"*") && part->content->len > 0) {
+			"*") && (part->content != NULL ?
+			part->content->len > 0 : part->encoded_len > 0)) {
 			process_image (task, part);
 		}
 		cur = g_list_next (cur);
@@ -54,27 +66,26 @@ process_images (struct rspamd_task *task)
 }
 
 static enum known_image_types
-detect_image_type (GByteArray *data)
+detect_image_type (const guint8 *data, gsize len)
 {
-	if (data->len > sizeof (png_signature) / sizeof (png_signature[0])) {
-		if (memcmp (data->data, png_signature, sizeof (png_signature)) == 0) {
+	if (len > sizeof (png_signature) / sizeof (png_signature[0])) {
+		if (memcmp (data, png_signature, sizeof (png_signature)) == 0) {
 			return IMAGE_TYPE_PNG;
 		}
 	}
-	if (data->len > 10) {
-		if (memcmp (data->data, jpg_sig1, sizeof (jpg_sig1)) == 0) {
-			if (memcmp (data->data + 6, jpg_sig2, sizeof (jpg_sig2)) == 0) {
-				return IMAGE_TYPE_JPG;
-			}
+	if (len > 10) {
+		/* Do not require JFIF as the first segment, e.g. photos start with Exif */
+		if (memcmp (data, jpg_signature, sizeof (jpg_signature)) == 0) {
+			return IMAGE_TYPE_JPG;
 		}
 	}
-	if (data->len > sizeof (gif_signature) / sizeof (gif_signature[0])) {
-		if (memcmp (data->data, gif_signature, sizeof (gif_signature)) == 0) {
+	if (len > sizeof (gif_signature) / sizeof (gif_signature[0])) {
+		if (memcmp (data, gif_signature, sizeof (gif_signature)) == 0) {
 			return IMAGE_TYPE_GIF;
 		}
 	}
-	if (data->len > sizeof (bmp_signature) / sizeof (bmp_signature[0])) {
-		if (memcmp (data->data, bmp_signature, sizeof (bmp_signature)) == 0) {
+	if (len > sizeof (bmp_signature) / sizeof (bmp_signature[0])) {
+		if (memcmp (data, bmp_signature, sizeof (bmp_signature)) == 0) {
 			return IMAGE_TYPE_BMP;
 		}
 	}
@@ -84,28 +95,27 @@ detect_image_type (GByteArray *data)
 
 
 static struct rspamd_image *
-process_png_image (struct rspamd_task *task, GByteArray *data)
+process_png_image (struct rspamd_task *task, const guint8 *data, gsize len)
 {
 	struct rspamd_image *img;
 	guint32 t;
-	guint8 *p;
+	const guint8 *p;
 
-	if (data->len < 24) {
+	if (len < 24) {
 		msg_info ("bad png detected (maybe striped): <%s>", task->message_id);
 		return NULL;
 	}
 
 	/* In png we should find iHDR section and get data from it */
 	/* Skip signature and read header section */
-	p = data->data + 12;
+	p = data + 12;
 	if (memcmp (p, "IHDR", 4) != 0) {
 		msg_info ("png doesn't begins with IHDR section", task->message_id);
 		return NULL;
 	}
 
-	img = rspamd_mempool_alloc (task->task_pool, sizeof (struct rspamd_image));
+	img = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_PNG;
-	img->data = data;
 
 	p += 4;
 	memcpy (&t, p, sizeof (guint32));
@@ -117,53 +127,129 @@ process_png_image (struct rspamd_task *task, GByteArray *data)
 	return img;
 }
 
+enum rspamd_jpeg_scan_result {
+	JPEG_SCAN_FOUND = 0,
+	JPEG_SCAN_NEED_MORE,
+	JPEG_SCAN_INVALID
+};
+
+#define JPEG_BE16(p) (((guint)(p)[0] << 8) | (p)[1])
+/* SOF markers except DHT, JPG and DAC that share the same range */
+#define JPEG_IS_SOF(m) ((m) >= 0xC0 && (m) <= 0xCF && \
+	(m) != 0xC4 && (m) != 0xC8 && (m) != 0xCC)
+
+/*
+ * Walks jpeg segments starting from `*off` up to the frame header. Segments
+ * are skipped by their lengths, so frame headers of thumbnails embedded to
+ * Exif or other application segments are not confused with the frame header
+ * of an image. If data is not enough, `*off` is set to the segment that
+ * should be checked with more data.
+ */
+static enum rspamd_jpeg_scan_result
+rspamd_jpeg_find_sof (const guint8 *data, gsize len, gsize *off,
+	const guint8 **sof)
+{
+	gsize pos = *off;
+	guint marker;
+
+	for (;;) {
+		if (pos + 4 > len) {
+			*off = pos;
+			return JPEG_SCAN_NEED_MORE;
+		}
+
+		if (data[pos] != 0xFF) {
+			return JPEG_SCAN_INVALID;
+		}
+
+		marker = data[pos + 1];
+
+		if (marker == 0xFF) {
+			/* Fill byte */
+			pos ++;
+			continue;
+		}
+
+		if (JPEG_IS_SOF (marker)) {
+			if (pos + 10 > len) {
+				*off = pos;
+				return JPEG_SCAN_NEED_MORE;
+			}
+
+			*sof = data + pos;
+			*off = pos;
+
+			return JPEG_SCAN_FOUND;
+		}
+		else if (marker == 0xD8 || marker == 0x01 ||
+				(marker >= 0xD0 && marker <= 0xD7)) {
+			/* Markers without segments */
+			pos += 2;
+		}
+		else if (marker == 0xDA || marker == 0xD9 || JPEG_BE16 (data + pos + 2) < 2) {
+			/* Scan data or end of image before frame header */
+			return JPEG_SCAN_INVALID;
+		}
+		else {
+			pos += 2 + JPEG_BE16 (data + pos + 2);
+		}
+	}
+}
+
 static struct rspamd_image *
-process_jpg_image (struct rspamd_task *task, GByteArray *data)
+process_jpg_image (struct rspamd_task *task, struct mime_part *part)
 {
-	guint8 *p;
-	guint16 t;
-	gsize remain;
+	const guint8 *data, *sof = NULL;
+	gsize len, want = RSPAMD_JPEG_CHUNK_LEN, off = 0;
+	enum rspamd_jpeg_scan_result r;
 	struct rspamd_image *img;
 
-	img = rspamd_mempool_alloc (task->task_pool, sizeof (struct rspamd_image));
-	img->type = IMAGE_TYPE_JPG;
-	img->data = data;
-
-	p = data->data;
-	remain = data->len;
-	/* In jpeg we should find any data stream (ff c0 .. ff c3) and extract its height and width */
-	while (remain--) {
-		if (*p == 0xFF && remain > 8 &&
-			(*(p + 1) >= 0xC0 && *(p + 1) <= 0xC3)) {
-			memcpy (&t, p + 5, sizeof (guint16));
-			img->height = ntohs (t);
-			memcpy (&t, p + 7, sizeof (guint16));
-			img->width = ntohs (t);
-			return img;
+	/*
+	 * Decode parts of an image incrementally until the frame header is found,
+	 * it is usually within the first few kilobytes
+	 */
+	for (;;) {
+		len = want;
+		data = rspamd_mime_part_get_prefix (part, &len);
+		r = rspamd_jpeg_find_sof (data, len, &off, &sof);
+
+		if (r != JPEG_SCAN_NEED_MORE || len < want) {
+			break;
 		}
-		p++;
+
+		want *= 4;
 	}
 
-	return NULL;
+	if (r != JPEG_SCAN_FOUND) {
+		msg_info ("bad jpeg detected (no frame header): <%s>",
+			task->message_id);
+		return NULL;
+	}
+
+	img = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_image));
+	img->type = IMAGE_TYPE_JPG;
+	img->height = JPEG_BE16 (sof + 5);
+	img->width = JPEG_BE16 (sof + 7);
+
+	return img;
 }
 
 static struct rspamd_image *
-process_gif_image (struct rspamd_task *task, GByteArray *data)
+process_gif_image (struct rspamd_task *task, const guint8 *data, gsize len)
 {
 	struct rspamd_image *img;
-	guint8 *p;
+	const guint8 *p;
 	guint16 t;
 
-	if (data->len < 10) {
+	if (len < 10) {
 		msg_info ("bad gif detected (maybe striped): <%s>", task->message_id);
 		return NULL;
 	}
 
-	img = rspamd_mempool_alloc (task->task_pool, sizeof (struct rspamd_image));
+	img = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_GIF;
-	img->data = data;
 
-	p = data->data + 6;
+	p = data + 6;
 	memcpy (&t, p,	   sizeof (guint16));
 	img->width = GUINT16_FROM_LE (t);
 	memcpy (&t, p + 2, sizeof (guint16));
@@ -173,23 +259,22 @@ process_gif_image (struct rspamd_task *task, GByteArray *data)
 }
 
 static struct rspamd_image *
-process_bmp_image (struct rspamd_task *task, GByteArray *data)
+process_bmp_image (struct rspamd_task *task, const guint8 *data, gsize len)
 {
 	struct rspamd_image *img;
 	gint32 t;
-	guint8 *p;
+	const guint8 *p;
 
 
 
-	if (data->len < 28) {
+	if (len < 28) {
 		msg_info ("bad bmp detected (maybe striped): <%s>", task->message_id);
 		return NULL;
 	}
 
-	img = rspamd_mempool_alloc (task->task_pool, sizeof (struct rspamd_image));
+	img = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct rspamd_image));
 	img->type = IMAGE_TYPE_BMP;
-	img->data = data;
-	p = data->data + 18;
+	p = data + 18;
 	memcpy (&t, p,	   sizeof (gint32));
 	img->width = abs (GINT32_FROM_LE (t));
 	memcpy (&t, p + 4, sizeof (gint32));
@@ -203,19 +288,25 @@ process_image (struct rspamd_task *task, struct mime_part *part)
 {
 	enum known_image_types type;
 	struct rspamd_image *img = NULL;
-	if ((type = detect_image_type (part->content)) != IMAGE_TYPE_UNKNOWN) {
+	const guint8 *data;
+	gsize len = RSPAMD_IMAGE_HEADER_LEN;
+
+	/* Only headers are decoded here, the whole image is decoded on demand */
+	data = rspamd_mime_part_get_prefix (part, &len);
+
+	if ((type = detect_image_type (data, len)) != IMAGE_TYPE_UNKNOWN) {
 		switch (type) {
 		case IMAGE_TYPE_PNG:
-			img = process_png_image (task, part->content);
+			img = process_png_image (task, data, len);
 			break;
 		case IMAGE_TYPE_JPG:
-			img = process_jpg_image (task, part->content);
+			img = process_jpg_image (task, part);
 			break;
 		case IMAGE_TYPE_GIF:
-			img = process_gif_image (task, part->content);
+			img = process_gif_image (task, data, len);
 			break;
 		case IMAGE_TYPE_BMP:
-			img = process_bmp_image (task, part->content);
+			img = process_bmp_image (task, data, len);
 			break;
 		default:
 			img = NULL;
@@ -228,11 +319,532 @@ process_image (struct rspamd_task *task, struct mime_part *part)
 			image_type_str (img->type),
 			img->width, img->height,
 			task->message_id);
+		img->part = part;
 		img->filename = part->filename;
 		task->images = g_list_prepend (task->images, img);
 	}
 }
 
+/*
+ * Perceptual hash of jpeg images: entropy coded data is decoded just enough
+ * to get DC coefficients of luminance blocks, which are the averages of 8x8
+ * blocks. The resulting image is reduced to 8x8 cells and each bit of the
+ * hash is set if a cell is brighter than the average of all cells.
+ */
+struct rspamd_jpeg_huffman {
+	gint32 maxcode[18];
+	gint32 valptr[17];
+	guint8 vals[256];
+	gboolean defined;
+};
+
+struct rspamd_jpeg_component {
+	guint id;
+	guint h;
+	guint v;
+	guint dc_tbl;
+	guint ac_tbl;
+	gint pred;
+};
+
+struct rspamd_jpeg_decoder {
+	const guint8 *p;
+	const guint8 *end;
+	guint32 bits;
+	gint nbits;
+	gboolean marker;
+	struct rspamd_jpeg_huffman dc[4];
+	struct rspamd_jpeg_huffman ac[4];
+	struct rspamd_jpeg_component comps[4];
+	guint ncomps;
+	guint width;
+	guint height;
+	guint restart_interval;
+};
+
+static gboolean
+rspamd_jpeg_build_huffman (struct rspamd_jpeg_huffman *tbl,
+	const guint8 *counts, const guint8 *vals, guint nvals)
+{
+	gint32 code = 0;
+	guint i, k = 0;
+
+	memcpy (tbl->vals, vals, nvals);
+
+	for (i = 1; i <= 16; i ++) {
+		tbl->valptr[i] = k - code;
+		k += counts[i - 1];
+		code += counts[i - 1];
+		/* The largest code of this length, -1 if there are no such codes */
+		tbl->maxcode[i] = counts[i - 1] ? code - 1 : -1;
+
+		if (code > (1 << i)) {
+			return FALSE;
+		}
+
+		code <<= 1;
+	}
+
+	tbl->maxcode[17] = G_MAXINT32;
+	tbl->defined = TRUE;
+
+	return TRUE;
+}
+
+static inline void
+rspamd_jpeg_fill_bits (struct rspamd_jpeg_decoder *dec)
+{
+	guint c;
+
+	while (dec->nbits <= 24) {
+		c = 0;
+
+		if (!dec->marker && dec->p < dec->end) {
+			c = *dec->p;
+
+			if (c == 0xFF) {
+				if (dec->p + 1 < dec->end && dec->p[1] == 0) {
+					/* Stuffed zero byte */
+					dec->p += 2;
+				}
+				else {
+					/* Marker, feed zeroes until restart */
+					dec->marker = TRUE;
+					c = 0;
+				}
+			}
+			else {
+				dec->p ++;
+			}
+		}
+
+		dec->bits |= c << (24 - dec->nbits);
+		dec->nbits += 8;
+	}
+}
+
+static inline guint
+rspamd_jpeg_get_bits (struct rspamd_jpeg_decoder *dec, gint n)
+{
+	guint r;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	rspamd_jpeg_fill_bits (dec);
+	r = dec->bits >> (32 - n);
+	dec->bits <<= n;
+	dec->nbits -= n;
+
+	return r;
+}
+
+static inline gint
+rspamd_jpeg_decode_huffman (struct rspamd_jpeg_decoder *dec,
+	const struct rspamd_jpeg_huffman *tbl)
+{
+	gint32 code;
+	guint i;
+
+	rspamd_jpeg_fill_bits (dec);
+
+	for (i = 1; i <= 16; i ++) {
+		code = dec->bits >> (32 - i);
+
+		if (code <= tbl->maxcode[i]) {
+			dec->bits <<= i;
+			dec->nbits -= i;
+
+			return tbl->vals[(tbl->valptr[i] + code) & 0xFF];
+		}
+	}
+
+	return -1;
+}
+
+static inline gint
+rspamd_jpeg_extend (guint v, gint s)
+{
+	return (s > 0 && v < (1U << (s - 1))) ? (gint)v - (1 << s) + 1 : (gint)v;
+}
+
+/* Decodes a block and returns its DC coefficient */
+static gboolean
+rspamd_jpeg_decode_block (struct rspamd_jpeg_decoder *dec,
+	struct rspamd_jpeg_component *comp, gint *dc)
+{
+	gint s, r, k;
+
+	s = rspamd_jpeg_decode_huffman (dec, &dec->dc[comp->dc_tbl]);
+
+	if (s < 0 || s > 11) {
+		return FALSE;
+	}
+
+	comp->pred += rspamd_jpeg_extend (rspamd_jpeg_get_bits (dec, s), s);
+	*dc = comp->pred;
+
+	/* Skip AC coefficients */
+	for (k = 1; k < 64; k ++) {
+		s = rspamd_jpeg_decode_huffman (dec, &dec->ac[comp->ac_tbl]);
+
+		if (s < 0) {
+			return FALSE;
+		}
+
+		r = s >> 4;
+		s &= 15;
+
+		if (s == 0) {
+			if (r != 15) {
+				break;
+			}
+
+			k += 15;
+		}
+		else {
+			k += r;
+			rspamd_jpeg_get_bits (dec, s);
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_jpeg_restart (struct rspamd_jpeg_decoder *dec)
+{
+	guint i;
+
+	/*
+	 * Discard remaining bits and skip RSTn marker, bits reader never reads
+	 * beyond markers, so it must be the next byte
+	 */
+	dec->bits = 0;
+	dec->nbits = 0;
+
+	if (dec->p + 1 >= dec->end || dec->p[0] != 0xFF ||
+			dec->p[1] < 0xD0 || dec->p[1] > 0xD7) {
+		return FALSE;
+	}
+
+	dec->p += 2;
+	dec->marker = FALSE;
+
+	for (i = 0; i < dec->ncomps; i ++) {
+		dec->comps[i].pred = 0;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Decodes the first scan that contains luminance and reduces the image
+ * formed by DC coefficients to 8x8 cells
+ */
+static guint64
+rspamd_jpeg_decode_scan (struct rspamd_task *task,
+	struct rspamd_jpeg_decoder *dec,
+	struct rspamd_jpeg_component **scomps, guint ns)
+{
+	struct rspamd_jpeg_component *comp, *y = &dec->comps[0];
+	guint hmax = 1, vmax = 1, mcux, mcuy, mx, my, i, h, v, bw, bh, vis_w, vis_h;
+	guint x0, x1, y0, y1, bx, by, nmcu = 0, nbits = 0;
+	gint dc, *blocks;
+	gdouble cells[64], mean = 0, sum, cmin = G_MAXDOUBLE, cmax = -G_MAXDOUBLE;
+	gsize plane;
+	guint64 res = 0;
+
+	for (i = 0; i < dec->ncomps; i ++) {
+		hmax = MAX (hmax, dec->comps[i].h);
+		vmax = MAX (vmax, dec->comps[i].v);
+	}
+
+	/* Size of luminance plane in blocks */
+	vis_w = ((dec->width * y->h + hmax - 1) / hmax + 7) / 8;
+	vis_h = ((dec->height * y->v + vmax - 1) / vmax + 7) / 8;
+
+	if (ns == 1) {
+		/* Non interleaved scan consists of single blocks */
+		mcux = vis_w;
+		mcuy = vis_h;
+		bw = vis_w;
+		bh = vis_h;
+	}
+	else {
+		mcux = (dec->width + 8 * hmax - 1) / (8 * hmax);
+		mcuy = (dec->height + 8 * vmax - 1) / (8 * vmax);
+		bw = mcux * y->h;
+		bh = mcuy * y->v;
+	}
+
+	if (vis_w == 0 || vis_h == 0 || (gsize)bw * bh > RSPAMD_PHASH_MAX_BLOCKS) {
+		return 0;
+	}
+
+	/* Decoding is charged as the size of luminance plane */
+	plane = (gsize)bw * bh * 64;
+
+	if (task->cfg->mime_max_bytes != 0 &&
+			task->mime_budget.bytes + plane > task->cfg->mime_max_bytes) {
+		rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_BYTES);
+		return 0;
+	}
+
+	task->mime_budget.bytes += plane;
+	blocks = g_malloc (bw * bh * sizeof (gint));
+
+	for (my = 0; my < mcuy; my ++) {
+		for (mx = 0; mx < mcux; mx ++) {
+			if (dec->restart_interval > 0 && nmcu == dec->restart_interval) {
+				if (!rspamd_jpeg_restart (dec)) {
+					goto err;
+				}
+
+				nmcu = 0;
+			}
+
+			nmcu ++;
+
+			for (i = 0; i < ns; i ++) {
+				comp = scomps[i];
+
+				for (v = 0; v < (ns == 1 ? 1 : comp->v); v ++) {
+					for (h = 0; h < (ns == 1 ? 1 : comp->h); h ++) {
+						if (!rspamd_jpeg_decode_block (dec, comp, &dc)) {
+							goto err;
+						}
+
+						if (comp == y) {
+							if (ns == 1) {
+								blocks[my * bw + mx] = dc;
+							}
+							else {
+								blocks[(my * y->v + v) * bw + mx * y->h + h] = dc;
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	if (!dec->marker && dec->p >= dec->end) {
+		/* Truncated image */
+		goto err;
+	}
+
+	/* Reduce visible part of the image to 8x8 cells */
+	for (i = 0; i < 64; i ++) {
+		x0 = (i % 8) * vis_w / 8;
+		x1 = MAX (x0 + 1, ((i % 8) + 1) * vis_w / 8);
+		y0 = (i / 8) * vis_h / 8;
+		y1 = MAX (y0 + 1, ((i / 8) + 1) * vis_h / 8);
+		sum = 0;
+
+		for (by = y0; by < y1; by ++) {
+			for (bx = x0; bx < x1; bx ++) {
+				sum += blocks[by * bw + bx];
+			}
+		}
+
+		cells[i] = sum / ((x1 - x0) * (y1 - y0));
+		cmin = MIN (cmin, cells[i]);
+		cmax = MAX (cmax, cells[i]);
+		mean += cells[i];
+	}
+
+	g_free (blocks);
+
+	if (cmax - cmin < RSPAMD_PHASH_MIN_CONTRAST) {
+		/* Bits of low detail images are mostly noise */
+		return 0;
+	}
+
+	mean /= 64.0;
+
+	for (i = 0; i < 64; i ++) {
+		if (cells[i] > mean) {
+			res |= 1ULL << i;
+			nbits ++;
+		}
+	}
+
+	if (nbits < RSPAMD_PHASH_MIN_BITS || nbits > 64 - RSPAMD_PHASH_MIN_BITS) {
+		/* Too few cells differ from the rest of image */
+		return 0;
+	}
+
+	return res;
+
+err:
+	g_free (blocks);
+
+	return 0;
+}
+
+static guint64
+rspamd_jpeg_phash (struct rspamd_task *task, const guint8 *data, gsize len)
+{
+	struct rspamd_jpeg_decoder dec;
+	struct rspamd_jpeg_component *scomps[4];
+	const guint8 *p = data + 2, *end = data + len, *seg;
+	guint marker, seglen, i, j, n, total, ns;
+	gboolean have_frame = FALSE;
+
+	memset (&dec, 0, sizeof (dec));
+
+	while (p + 4 <= end) {
+		if (p[0] != 0xFF) {
+			return 0;
+		}
+
+		marker = p[1];
+
+		if (marker == 0xFF) {
+			p ++;
+			continue;
+		}
+
+		seglen = JPEG_BE16 (p + 2);
+		seg = p + 4;
+
+		if (seglen < 2 || seg + seglen - 2 > end) {
+			return 0;
+		}
+
+		switch (marker) {
+		case 0xC0:
+		case 0xC1:
+			/* Baseline and extended sequential huffman frames */
+			if (seglen < 8 || seg[0] != 8) {
+				return 0;
+			}
+
+			dec.height = JPEG_BE16 (seg + 1);
+			dec.width = JPEG_BE16 (seg + 3);
+			dec.ncomps = seg[5];
+
+			if (dec.ncomps == 0 || dec.ncomps > 4 ||
+					seglen < 8 + dec.ncomps * 3) {
+				return 0;
+			}
+
+			for (i = 0; i < dec.ncomps; i ++) {
+				dec.comps[i].id = seg[6 + i * 3];
+				dec.comps[i].h = seg[7 + i * 3] >> 4;
+				dec.comps[i].v = seg[7 + i * 3] & 15;
+
+				if (dec.comps[i].h == 0 || dec.comps[i].h > 4 ||
+						dec.comps[i].v == 0 || dec.comps[i].v > 4) {
+					return 0;
+				}
+			}
+
+			have_frame = TRUE;
+			break;
+		case 0xC4:
+			for (i = 0; i + 17 <= seglen - 2; i += 17 + total) {
+				n = seg[i] & 15;
+
+				for (j = 0, total = 0; j < 16; j ++) {
+					total += seg[i + 1 + j];
+				}
+
+				if (n > 3 || total > 256 || i + 17 + total > seglen - 2) {
+					return 0;
+				}
+
+				if (!rspamd_jpeg_build_huffman (
+						(seg[i] >> 4) ? &dec.ac[n] : &dec.dc[n],
+						seg + i + 1, seg + i + 17, total)) {
+					return 0;
+				}
+			}
+			break;
+		case 0xDD:
+			if (seglen < 4) {
+				return 0;
+			}
+
+			dec.restart_interval = JPEG_BE16 (seg);
+			break;
+		case 0xDA:
+			if (!have_frame || seglen < 3) {
+				return 0;
+			}
+
+			ns = seg[0];
+
+			if (ns == 0 || ns > dec.ncomps || seglen < 6 + ns * 2) {
+				return 0;
+			}
+
+			for (i = 0; i < ns; i ++) {
+				scomps[i] = NULL;
+
+				for (j = 0; j < dec.ncomps; j ++) {
+					if (dec.comps[j].id == seg[1 + i * 2]) {
+						scomps[i] = &dec.comps[j];
+					}
+				}
+
+				if (scomps[i] == NULL) {
+					return 0;
+				}
+
+				scomps[i]->dc_tbl = seg[2 + i * 2] >> 4;
+				scomps[i]->ac_tbl = seg[2 + i * 2] & 15;
+
+				if (scomps[i]->dc_tbl > 3 || scomps[i]->ac_tbl > 3 ||
+						!dec.dc[scomps[i]->dc_tbl].defined ||
+						!dec.ac[scomps[i]->ac_tbl].defined) {
+					return 0;
+				}
+			}
+
+			if (scomps[0] != &dec.comps[0]) {
+				/* The first scan does not contain luminance */
+				return 0;
+			}
+
+			dec.p = seg + seglen - 2;
+			dec.end = end;
+
+			return rspamd_jpeg_decode_scan (task, &dec, scomps, ns);
+		default:
+			if (JPEG_IS_SOF (marker) || marker == 0xD9) {
+				/* Progressive, lossless or arithmetic coded images */
+				return 0;
+			}
+			break;
+		}
+
+		p = seg + seglen - 2;
+	}
+
+	return 0;
+}
+
+guint64
+rspamd_image_get_phash (struct rspamd_image *img)
+{
+	GByteArray *content;
+
+	if (!(img->computed & RSPAMD_IMAGE_HAS_PHASH)) {
+		img->computed |= RSPAMD_IMAGE_HAS_PHASH;
+
+		if (img->type == IMAGE_TYPE_JPG) {
+			content = rspamd_mime_part_get_content (img->part);
+			img->phash = rspamd_jpeg_phash (img->part->task,
+					content->data, content->len);
+		}
+	}
+
+	return img->phash;
+}
+
 const gchar *
 image_type_str (enum known_image_types type)
 {
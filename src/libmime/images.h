@@ -12,12 +12,19 @@ enum known_image_types {
 	IMAGE_TYPE_UNKNOWN = 9000
 };
 
+/* Properties of image that are computed on demand */
+#define RSPAMD_IMAGE_HAS_PHASH (1 << 0)
+
+struct mime_part;
+
 struct rspamd_image {
 	enum known_image_types type;
-	GByteArray *data;
+	struct mime_part *part;		/**< part that contains this image				*/
 	guint32 width;
 	guint32 height;
 	const gchar *filename;
+	guint64 phash;				/**< perceptual hash, 0 if it is not available	*/
+	guint computed;				/**< properties that are already computed		*/
 };
 
 /*
@@ -25,6 +32,16 @@ struct rspamd_image {
  */
 void process_images (struct rspamd_task *task);
 
+/*
+ * Get perceptual hash of an image, it is computed on the first call. Only
+ * baseline jpeg images are supported: the hash is built from DC coefficients
+ * of luminance that form the image scaled down by 8. Decoding is charged
+ * against the bytes limit of a task.
+ * Returns 0 if the hash cannot be computed, the image has too low detail or
+ * the limit has been reached
+ */
+guint64 rspamd_image_get_phash (struct rspamd_image *img);
+
 /*
  * Get textual representation of an image's type
  */
@@ -0,0 +1,314 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "languages.h"
+#include "hash.h"
+#include "xxhash.h"
+#include "libstemmer.h"
+
+/* Maximum number of cached stems for each language */
+#define RSPAMD_STEM_CACHE_SIZE 8192
+/* Minimum number of common words required to select a language */
+#define RSPAMD_LANGUAGE_MIN_HITS 2
+
+struct rspamd_language_profile {
+	const gchar *code;
+	const gchar *name;
+	const gchar *words[26];
+};
+
+/* Names are the names of snowball stemmers */
+static const struct rspamd_language_profile language_profiles[] = {
+	{"en", "english", {"the", "and", "of", "to", "is", "in", "that", "it",
+			"for", "you", "with", "this", "are", "was", "have", "be", "not",
+			"on", "your", "we", "will", "from", "our", NULL}},
+	{"de", "german", {"der", "die", "und", "das", "ist", "nicht", "ein",
+			"eine", "sie", "ich", "mit", "den", "dem", "auf", "für", "sich",
+			"auch", "wir", "zu", "von", "werden", "wird", "bei", "oder", NULL}},
+	{"fr", "french", {"le", "la", "les", "et", "des", "est", "une", "pour",
+			"que", "qui", "dans", "pas", "sur", "vous", "nous", "avec", "du",
+			"au", "ce", "il", "sont", "être", "votre", NULL}},
+	{"es", "spanish", {"el", "la", "los", "las", "y", "que", "de", "en", "es",
+			"por", "para", "con", "una", "del", "se", "su", "al", "como", "más",
+			"pero", "está", "usted", NULL}},
+	{"it", "italian", {"il", "di", "che", "è", "la", "per", "non", "una",
+			"sono", "del", "della", "con", "gli", "le", "si", "alla", "questo",
+			"anche", "più", "ma", "ci", NULL}},
+	{"pt", "portuguese", {"o", "os", "as", "que", "de", "não", "uma", "para",
+			"com", "por", "em", "do", "da", "é", "se", "mais", "você", "são",
+			"ao", "pelo", NULL}},
+	{"nl", "dutch", {"de", "het", "een", "en", "van", "is", "dat", "niet",
+			"op", "te", "zijn", "voor", "met", "ook", "je", "wij", "dit", "er",
+			"maar", "aan", NULL}},
+	{"sv", "swedish", {"och", "att", "det", "som", "är", "en", "på", "för",
+			"med", "inte", "av", "till", "den", "har", "jag", "vi", "om", "ett",
+			"kan", "du", NULL}},
+	{"da", "danish", {"og", "at", "det", "er", "en", "til", "på", "for",
+			"med", "ikke", "af", "den", "har", "jeg", "vi", "som", "de", "et",
+			"kan", "du", NULL}},
+	{"no", "norwegian", {"og", "at", "det", "er", "en", "til", "på", "for",
+			"med", "ikke", "av", "som", "har", "jeg", "vi", "ei", "den", "kan",
+			"du", "eller", NULL}},
+	{"fi", "finnish", {"ja", "on", "ei", "se", "että", "oli", "ovat", "kun",
+			"mutta", "tai", "myös", "sen", "hän", "tämä", "ole", "voi", "jos",
+			"niin", "kuin", NULL}},
+	{"hu", "hungarian", {"a", "az", "és", "hogy", "nem", "egy", "is", "van",
+			"meg", "el", "de", "ez", "csak", "már", "mint", "volt", "vagy",
+			"kell", "még", NULL}},
+	{"ro", "romanian", {"și", "în", "de", "la", "cu", "nu", "pe", "un", "o",
+			"este", "să", "pentru", "care", "mai", "sunt", "din", "ce", "se",
+			"sau", NULL}},
+	{"tr", "turkish", {"ve", "bir", "bu", "da", "de", "için", "ile", "ne",
+			"çok", "daha", "gibi", "olarak", "ama", "var", "değil", "ben",
+			"sen", "kadar", NULL}},
+};
+
+/* Maps common words to bitsets of languages */
+static GHashTable *language_words = NULL;
+static gsize language_words_ready = 0;
+
+static void
+rspamd_language_init_profiles (void)
+{
+	guint i, j;
+	guint32 mask;
+
+	if (g_once_init_enter (&language_words_ready)) {
+		language_words = g_hash_table_new (g_str_hash, g_str_equal);
+
+		for (i = 0; i < G_N_ELEMENTS (language_profiles); i ++) {
+			for (j = 0; language_profiles[i].words[j] != NULL; j ++) {
+				mask = GPOINTER_TO_UINT (g_hash_table_lookup (language_words,
+						language_profiles[i].words[j]));
+				mask |= 1U << i;
+				g_hash_table_insert (language_words,
+						(gpointer)language_profiles[i].words[j],
+						GUINT_TO_POINTER (mask));
+			}
+		}
+
+		g_once_init_leave (&language_words_ready, 1);
+	}
+}
+
+gboolean
+rspamd_language_detect_latin (const gchar *text, gsize len,
+	const gchar **code, const gchar **name)
+{
+	const guchar *p, *end, *wstart;
+	guint hits[G_N_ELEMENTS (language_profiles)], i, best = 0;
+	gchar word[16];
+	gsize wlen;
+	guint32 mask;
+
+	rspamd_language_init_profiles ();
+	memset (hits, 0, sizeof (hits));
+
+	p = (const guchar *)text;
+	end = p + MIN (len, RSPAMD_LANGUAGE_MAX_BYTES);
+
+	while (p < end) {
+		/* Words consist of letters and any non-ascii characters */
+		while (p < end && *p < 0x80 && !g_ascii_isalpha (*p)) {
+			p ++;
+		}
+
+		wstart = p;
+
+		while (p < end && (*p >= 0x80 || g_ascii_isalpha (*p))) {
+			p ++;
+		}
+
+		wlen = p - wstart;
+
+		if (wlen == 0 || wlen >= sizeof (word)) {
+			continue;
+		}
+
+		for (i = 0; i < wlen; i ++) {
+			word[i] = g_ascii_tolower (wstart[i]);
+		}
+
+		word[wlen] = '\0';
+		mask = GPOINTER_TO_UINT (g_hash_table_lookup (language_words, word));
+
+		for (i = 0; mask != 0; i ++, mask >>= 1) {
+			if (mask & 1) {
+				hits[i] ++;
+			}
+		}
+	}
+
+	for (i = 1; i < G_N_ELEMENTS (language_profiles); i ++) {
+		if (hits[i] > hits[best]) {
+			best = i;
+		}
+	}
+
+	if (hits[best] < RSPAMD_LANGUAGE_MIN_HITS) {
+		return FALSE;
+	}
+
+	*code = language_profiles[best].code;
+	*name = language_profiles[best].name;
+
+	return TRUE;
+}
+
+/*
+ * Stemmers are not thread safe, so each thread has its own set of stemmers
+ * and caches of stems
+ */
+struct rspamd_stemmer {
+	struct sb_stemmer *stem;
+	rspamd_lru_hash_t *cache;
+};
+
+/* Both word and its stem are stored in a single chunk of memory */
+struct rspamd_stem_elt {
+	rspamd_fstring_t word;
+	rspamd_fstring_t stem;
+};
+
+static void
+rspamd_stemmer_dtor (gpointer p)
+{
+	struct rspamd_stemmer *st = p;
+
+	if (st->stem != NULL) {
+		sb_stemmer_delete (st->stem);
+		rspamd_lru_hash_destroy (st->cache);
+	}
+
+	g_slice_free1 (sizeof (*st), st);
+}
+
+static rspamd_private_t stemmers_key =
+	RSPAMD_PRIVATE_INIT (g_hash_table_unref);
+
+static guint
+rspamd_stem_hash (gconstpointer key)
+{
+	const rspamd_fstring_t *w = key;
+
+	return XXH64 (w->begin, w->len, 0);
+}
+
+static gboolean
+rspamd_stem_equal (gconstpointer a, gconstpointer b)
+{
+	const rspamd_fstring_t *w1 = a, *w2 = b;
+
+	return w1->len == w2->len && memcmp (w1->begin, w2->begin, w1->len) == 0;
+}
+
+static struct rspamd_stemmer *
+rspamd_language_get_stemmer (const gchar *language)
+{
+	GHashTable *stemmers;
+	struct rspamd_stemmer *st;
+
+	stemmers = rspamd_private_get (&stemmers_key);
+
+	if (stemmers == NULL) {
+		stemmers = g_hash_table_new_full (g_str_hash, g_str_equal,
+				g_free, rspamd_stemmer_dtor);
+		rspamd_private_set (&stemmers_key, stemmers);
+	}
+
+	st = g_hash_table_lookup (stemmers, language);
+
+	if (st == NULL) {
+		/* Languages without stemmers are cached as well */
+		st = g_slice_alloc0 (sizeof (*st));
+		st->stem = sb_stemmer_new (language, "UTF_8");
+
+		if (st->stem == NULL) {
+			msg_info ("cannot create lemmatizer for %s language", language);
+		}
+		else {
+			st->cache = rspamd_lru_hash_new_full (RSPAMD_STEM_CACHE_SIZE, 0,
+					g_free, NULL, rspamd_stem_hash, rspamd_stem_equal);
+		}
+
+		g_hash_table_insert (stemmers, g_strdup (language), st);
+	}
+
+	return st;
+}
+
+gboolean
+rspamd_language_stem_words (const gchar *language, GArray *words,
+	rspamd_mempool_t *pool)
+{
+	struct rspamd_stemmer *st;
+	struct rspamd_stem_elt *elt;
+	rspamd_fstring_t *w, *stem;
+	const guchar *r;
+	gsize rlen;
+	guint i;
+
+	st = rspamd_language_get_stemmer (language);
+
+	if (st->stem == NULL) {
+		return FALSE;
+	}
+
+	for (i = 0; i < words->len; i ++) {
+		w = &g_array_index (words, rspamd_fstring_t, i);
+		stem = rspamd_lru_hash_lookup (st->cache, w, 0);
+
+		if (stem == NULL) {
+			r = sb_stemmer_stem (st->stem, w->begin, w->len);
+
+			if (r == NULL) {
+				continue;
+			}
+
+			rlen = sb_stemmer_length (st->stem);
+			elt = g_malloc (sizeof (*elt) + w->len + rlen);
+			elt->word.begin = (gchar *)(elt + 1);
+			elt->word.len = w->len;
+			elt->word.size = w->len;
+			memcpy (elt->word.begin, w->begin, w->len);
+			elt->stem.begin = elt->word.begin + w->len;
+			elt->stem.len = rlen;
+			elt->stem.size = rlen;
+			memcpy (elt->stem.begin, r, rlen);
+			stem = &elt->stem;
+			rspamd_lru_hash_insert (st->cache, &elt->word, stem, 0, 0);
+		}
+
+		if (stem->len > w->len) {
+			w->begin = rspamd_mempool_alloc (pool, stem->len);
+		}
+
+		memcpy (w->begin, stem->begin, stem->len);
+		w->len = stem->len;
+		w->size = stem->len;
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,26 @@
+#ifndef LANGUAGES_H_
+#define LANGUAGES_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/*
+ * Detect language of text written in latin script by the frequencies of the
+ * most common words in the first RSPAMD_LANGUAGE_MAX_BYTES of text.
+ * Returns FALSE if language cannot be detected
+ */
+#define RSPAMD_LANGUAGE_MAX_BYTES 4096
+
+gboolean rspamd_language_detect_latin (const gchar *text, gsize len,
+	const gchar **code, const gchar **name);
+
+/*
+ * Replace words (rspamd_fstring_t) in lower case with their stems. Stemmers
+ * and results of stemming are cached by each thread, the array is modified
+ * in place and new strings are allocated from the pool if needed.
+ * Returns FALSE if there is no stemmer for this language
+ */
+gboolean rspamd_language_stem_words (const gchar *language, GArray *words,
+	rspamd_mempool_t *pool);
+
+#endif /* LANGUAGES_H_ */
@@ -31,265 +31,15 @@
 #include "images.h"
 #include "utlist.h"
 #include "tokenizers/tokenizers.h"
-#include "libstemmer.h"
+#include "languages.h"
+#include "base64/base64.h"
+#include "utf8/utf8.h"
 
 #include <iconv.h>
 
 #define RECURSION_LIMIT 30
 #define UTF8_CHARSET "UTF-8"
 
-GByteArray *
-strip_html_tags (struct rspamd_task *task,
-	rspamd_mempool_t * pool,
-	struct mime_text_part *part,
-	GByteArray * src,
-	gint *stateptr)
-{
-	uint8_t *p, *rp, *tbegin = NULL, *end, c, lc, *estart = NULL;
-	gint br, i = 0, depth = 0, in_q = 0;
-	gint state = 0;
-	guint dlen;
-	GByteArray *buf;
-	GNode *level_ptr = NULL;
-	gboolean erase = FALSE, html_decode = FALSE;
-
-	if (stateptr)
-		state = *stateptr;
-
-	buf = g_byte_array_sized_new (src->len);
-	g_byte_array_append (buf, src->data, src->len);
-
-	c = *src->data;
-	lc = '\0';
-	p = src->data;
-	rp = buf->data;
-	end = src->data + src->len;
-	br = 0;
-
-	while (i < (gint)src->len) {
-		switch (c) {
-		case '\0':
-			break;
-		case '<':
-			if (g_ascii_isspace (*(p + 1))) {
-				goto reg_char;
-			}
-			if (state == 0) {
-				lc = '<';
-				tbegin = p + 1;
-				state = 1;
-			}
-			else if (state == 1) {
-				/* Opening bracket without closing one */
-				p--;
-				while (g_ascii_isspace (*p) && p > src->data) {
-					p--;
-				}
-				p++;
-				goto unbreak_tag;
-			}
-			break;
-
-		case '(':
-			if (state == 2) {
-				if (lc != '"' && lc != '\'') {
-					lc = '(';
-					br++;
-				}
-			}
-			else if (state == 0 && !erase) {
-				*(rp++) = c;
-			}
-			break;
-
-		case ')':
-			if (state == 2) {
-				if (lc != '"' && lc != '\'') {
-					lc = ')';
-					br--;
-				}
-			}
-			else if (state == 0 && !erase) {
-				*(rp++) = c;
-			}
-			break;
-
-		case '>':
-			if (depth) {
-				depth--;
-				break;
-			}
-
-			if (in_q) {
-				break;
-			}
-unbreak_tag:
-			switch (state) {
-			case 1:         /* HTML/XML */
-				lc = '>';
-				in_q = state = 0;
-				erase = !add_html_node (task,
-						pool,
-						part,
-						tbegin,
-						p - tbegin,
-						end - tbegin,
-						&level_ptr);
-				break;
-
-			case 2:         /* PHP */
-				if (!br && lc != '\"' && *(p - 1) == '?') {
-					in_q = state = 0;
-				}
-				break;
-
-			case 3:
-				in_q = state = 0;
-				break;
-
-			case 4:         /* JavaScript/CSS/etc... */
-				if (p >= src->data + 2 && *(p - 1) == '-' && *(p - 2) == '-') {
-					in_q = state = 0;
-				}
-				break;
-
-			default:
-				if (!erase) {
-					*(rp++) = c;
-				}
-				break;
-			}
-			break;
-
-		case '"':
-		case '\'':
-			if (state == 2 && *(p - 1) != '\\') {
-				if (lc == c) {
-					lc = '\0';
-				}
-				else if (lc != '\\') {
-					lc = c;
-				}
-			}
-			else if (state == 0 && !erase) {
-				*(rp++) = c;
-			}
-			if (state && p != src->data && *(p - 1) != '\\' &&
-				(!in_q || *p == in_q)) {
-				if (in_q) {
-					in_q = 0;
-				}
-				else {
-					in_q = *p;
-				}
-			}
-			break;
-
-		case '!':
-			/* JavaScript & Other HTML scripting languages */
-			if (state == 1 && *(p - 1) == '<') {
-				state = 3;
-				lc = c;
-			}
-			else {
-				if (state == 0 && !erase) {
-					*(rp++) = c;
-				}
-			}
-			break;
-
-		case '-':
-			if (state == 3 && p >= src->data + 2 && *(p - 1) == '-' &&
-				*(p - 2) == '!') {
-				state = 4;
-			}
-			else {
-				goto reg_char;
-			}
-			break;
-
-		case '&':
-			/* Decode entitle */
-			html_decode = TRUE;
-			estart = rp;
-			goto reg_char;
-			break;
-
-		case ';':
-			if (html_decode) {
-				html_decode = FALSE;
-				*rp = ';';
-				if (rp - estart > 0) {
-					dlen = rp - estart + 1;
-					decode_entitles (estart, &dlen);
-					rp = estart + dlen;
-				}
-			}
-			break;
-
-		case '?':
-
-			if (state == 1 && *(p - 1) == '<') {
-				br = 0;
-				state = 2;
-				break;
-			}
-		case 'E':
-		case 'e':
-			/* !DOCTYPE exception */
-			if (state == 3 && p > src->data + 6
-				&& g_ascii_tolower (*(p - 1)) == 'p'
-				&& g_ascii_tolower (*(p - 2)) == 'y'
-				&& g_ascii_tolower (*(p - 3)) == 't' &&
-				g_ascii_tolower (*(p - 4)) == 'c' &&
-				g_ascii_tolower (*(p - 5)) == 'o' &&
-				g_ascii_tolower (*(p - 6)) == 'd') {
-				state = 1;
-				break;
-			}
-		/* fall-through */
-		case 'l':
-
-			/* swm: If we encounter '<?xml' then we shouldn't be in
-			 * state == 2 (PHP). Switch back to HTML.
-			 */
-
-			if (state == 2 && p > src->data + 2 && *(p - 1) == 'm' &&
-				*(p - 2) == 'x') {
-				state = 1;
-				break;
-			}
-
-		/* fall-through */
-		default:
-reg_char:
-			if (state == 0 && !erase) {
-				*(rp++) = c;
-			}
-			break;
-		}
-		i++;
-		if (i < (gint)src->len) {
-			c = *(++p);
-		}
-	}
-	if (rp < buf->data + src->len) {
-		*rp = '\0';
-		g_byte_array_set_size (buf, rp - buf->data);
-	}
-
-	/* Check tag balancing */
-	if (level_ptr && level_ptr->data != NULL) {
-		part->is_balanced = FALSE;
-	}
-
-	if (stateptr) {
-		*stateptr = state;
-	}
-
-	return buf;
-}
-
 static void
 parse_qmail_recv (rspamd_mempool_t * pool,
 	gchar *line,
@@ -607,36 +357,136 @@ parse_recv_header (rspamd_mempool_t * pool,
 	return;
 }
 
+static inline guint
+rspamd_header_name_hash (const gchar *name, gsize len)
+{
+	guint h = 2166136261U;
+	gsize i;
+
+	/* FNV-1a of lowercased name */
+	for (i = 0; i < len; i ++) {
+		h ^= (guchar)g_ascii_tolower (name[i]);
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+void
+rspamd_header_name_init (struct rspamd_header_name *hn, const gchar *name)
+{
+	hn->name = name;
+	hn->len = strlen (name);
+	hn->hash = rspamd_header_name_hash (name, hn->len);
+}
+
+struct rspamd_headers *
+rspamd_headers_new (rspamd_mempool_t *pool)
+{
+	struct rspamd_headers *hdrs;
+
+	hdrs = rspamd_mempool_alloc0 (pool, sizeof (*hdrs));
+	hdrs->list = g_ptr_array_new ();
+	rspamd_mempool_add_destructor (pool,
+		(rspamd_mempool_destruct_t)g_ptr_array_unref, hdrs->list);
+
+	return hdrs;
+}
+
+static struct raw_header **
+rspamd_headers_slot (struct rspamd_headers *hdrs, const gchar *name,
+	guint len, guint hash)
+{
+	struct raw_header *rh;
+	guint i;
+
+	/* Linear probing, the index is at most half full */
+	for (i = hash & hdrs->mask; (rh = hdrs->index[i]) != NULL;
+			i = (i + 1) & hdrs->mask) {
+		if (rh->name_hash == hash && rh->name_len == len &&
+				g_ascii_strncasecmp (rh->name, name, len) == 0) {
+			break;
+		}
+	}
+
+	return &hdrs->index[i];
+}
+
+struct raw_header *
+rspamd_headers_lookup (struct rspamd_headers *hdrs,
+	const struct rspamd_header_name *hn)
+{
+	if (hdrs == NULL || hdrs->index == NULL) {
+		return NULL;
+	}
+
+	return *rspamd_headers_slot (hdrs, hn->name, hn->len, hn->hash);
+}
+
+struct raw_header *
+rspamd_headers_find (struct rspamd_headers *hdrs, const gchar *name)
+{
+	struct rspamd_header_name hn;
+
+	rspamd_header_name_init (&hn, name);
+
+	return rspamd_headers_lookup (hdrs, &hn);
+}
+
 static void
-append_raw_header (GHashTable *target, struct raw_header *rh)
+rspamd_headers_build_index (struct rspamd_headers *hdrs,
+	rspamd_mempool_t *pool)
 {
-	struct raw_header *lp;
+	struct raw_header *rh, **slot;
+	guint i, nslots = 16;
 
-	rh->next = NULL;
-	rh->prev = rh;
-	if ((lp =
-			g_hash_table_lookup (target, rh->name)) != NULL) {
-		DL_APPEND (lp, rh);
+	while (nslots < hdrs->list->len * 2) {
+		nslots <<= 1;
 	}
-	else {
-		g_hash_table_insert (target, rh->name, rh);
+
+	hdrs->index = rspamd_mempool_alloc0 (pool, nslots * sizeof (*hdrs->index));
+	hdrs->mask = nslots - 1;
+
+	for (i = 0; i < hdrs->list->len; i ++) {
+		rh = g_ptr_array_index (hdrs->list, i);
+		rh->next = NULL;
+		rh->prev = rh;
+		slot = rspamd_headers_slot (hdrs, rh->name, rh->name_len,
+				rh->name_hash);
+
+		if (*slot != NULL) {
+			DL_APPEND (*slot, rh);
+		}
+		else {
+			*slot = rh;
+		}
 	}
+}
+
+static void
+append_raw_header (struct rspamd_headers *target, struct raw_header *rh)
+{
+	rh->name_len = strlen (rh->name);
+	rh->name_hash = rspamd_header_name_hash (rh->name, rh->name_len);
+	g_ptr_array_add (target->list, rh);
 	debug_task ("add raw header %s: %s", rh->name, rh->value);
 }
 
 /* Convert raw headers to a list of struct raw_header * */
 static void
-process_raw_headers (GHashTable *target, rspamd_mempool_t *pool, const gchar *in)
+process_raw_headers (struct rspamd_headers *target, rspamd_mempool_t *pool,
+	const gchar *in, gsize len)
 {
 	struct raw_header *new = NULL;
-	const gchar *p, *c;
+	const gchar *p, *c, *end;
 	gchar *tmp, *tp;
 	gint state = 0, l, next_state = 100, err_state = 100, t_state;
 	gboolean valid_folding = FALSE;
 
 	p = in;
+	end = in + len;
 	c = p;
-	while (*p) {
+	while (p < end) {
 		/* FSM for processing headers */
 		switch (state) {
 		case 0:
@@ -719,7 +569,7 @@ process_raw_headers (GHashTable *target, rspamd_mempool_t *pool, const gchar *in
 				next_state = 3;
 				err_state = 4;
 			}
-			else if (*(p + 1) == '\0') {
+			else if (p + 1 == end) {
 				state = 4;
 			}
 			else {
@@ -776,7 +626,7 @@ process_raw_headers (GHashTable *target, rspamd_mempool_t *pool, const gchar *in
 			break;
 		case 99:
 			/* Folding state */
-			if (*(p + 1) == '\0') {
+			if (p + 1 == end) {
 				state = err_state;
 			}
 			else {
@@ -805,20 +655,20 @@ process_raw_headers (GHashTable *target, rspamd_mempool_t *pool, const gchar *in
 		case 100:
 			/* Fail state, skip line */
 			if (*p == '\r') {
-				if (*(p + 1) == '\n') {
+				if (p + 1 < end && *(p + 1) == '\n') {
 					p++;
 				}
 				p++;
 				state = next_state;
 			}
 			else if (*p == '\n') {
-				if (*(p + 1) == '\r') {
+				if (p + 1 < end && *(p + 1) == '\r') {
 					p++;
 				}
 				p++;
 				state = next_state;
 			}
-			else if (*(p + 1) == '\0') {
+			else if (p + 1 == end) {
 				state = next_state;
 				p++;
 			}
@@ -828,6 +678,252 @@ process_raw_headers (GHashTable *target, rspamd_mempool_t *pool, const gchar *in
 			break;
 		}
 	}
+
+	rspamd_headers_build_index (target, pool);
+}
+
+/*
+ * Returns length of headers block of a message, the empty line that separates
+ * headers from the body is not included
+ */
+static gsize
+rspamd_message_headers_len (const gchar *in, gsize len)
+{
+	const gchar *p = in, *end = in + len, *nl;
+
+	if (len > 0 && *p == '\n') {
+		return 0;
+	}
+	else if (len > 1 && p[0] == '\r' && p[1] == '\n') {
+		return 0;
+	}
+
+	while (p < end && (nl = memchr (p, '\n', end - p)) != NULL) {
+		p = nl + 1;
+
+		if (p < end && *p == '\n') {
+			return p - in;
+		}
+		else if (p + 1 < end && p[0] == '\r' && p[1] == '\n') {
+			return p - in;
+		}
+	}
+
+	/* No body, the whole message is headers */
+	return len;
+}
+
+#ifdef GMIME24
+/*
+ * Finds the content of a part in the message buffer, gmime parser creates
+ * substreams of the message stream for parts
+ */
+static gboolean
+rspamd_mime_part_get_bounds (struct rspamd_task *task,
+	GMimeDataWrapper *wrapper, const guchar **pdata, gsize *plen)
+{
+	GMimeStream *stream;
+	GByteArray *buf;
+	gint64 start, end;
+
+	stream = g_mime_data_wrapper_get_stream (wrapper);
+
+	if (stream == NULL || !GMIME_IS_STREAM_MEM (stream)) {
+		return FALSE;
+	}
+
+	buf = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (stream));
+
+	if (buf == NULL || buf->data != (guint8 *)task->msg.start) {
+		return FALSE;
+	}
+
+	start = stream->bound_start;
+	end = stream->bound_end == -1 ? (gint64)buf->len : stream->bound_end;
+
+	if (start < 0 || end < start || end > (gint64)buf->len) {
+		return FALSE;
+	}
+
+	*pdata = buf->data + start;
+	*plen = end - start;
+
+	return TRUE;
+}
+#endif
+
+/*
+ * Returns the number of bytes that can be decoded without exceeding the limit
+ */
+static gsize
+rspamd_mime_bytes_left (struct rspamd_task *task)
+{
+	if (task->cfg->mime_max_bytes == 0) {
+		return G_MAXSIZE;
+	}
+
+	if (task->mime_budget.bytes >= task->cfg->mime_max_bytes) {
+		return 0;
+	}
+
+	return task->cfg->mime_max_bytes - task->mime_budget.bytes;
+}
+
+/*
+ * Parts with identity transfer encoding are referenced in the message buffer
+ * directly instead of copying them through gmime streams. Base64 and
+ * quoted-printable parts are decoded from the message buffer by our own
+ * decoders which are much faster than gmime filters.
+ */
+static GByteArray *
+rspamd_mime_part_decode (struct rspamd_task *task,
+	GMimeDataWrapper *wrapper)
+{
+#ifdef GMIME24
+	GMimeContentEncoding enc;
+	GByteArray *res;
+	const guchar *data;
+	gsize len, left;
+
+	enc = g_mime_data_wrapper_get_encoding (wrapper);
+
+	switch (enc) {
+	case GMIME_CONTENT_ENCODING_DEFAULT:
+	case GMIME_CONTENT_ENCODING_7BIT:
+	case GMIME_CONTENT_ENCODING_8BIT:
+	case GMIME_CONTENT_ENCODING_BINARY:
+	case GMIME_CONTENT_ENCODING_BASE64:
+	case GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE:
+		break;
+	default:
+		return NULL;
+	}
+
+	if (!rspamd_mime_part_get_bounds (task, wrapper, &data, &len)) {
+		return NULL;
+	}
+
+	/* Input is cut so that its decoded size cannot exceed the limit */
+	left = rspamd_mime_bytes_left (task);
+
+	if (enc == GMIME_CONTENT_ENCODING_BASE64 && len / 4 * 3 > left) {
+		len = left / 3 * 4;
+		rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_BYTES);
+	}
+	else if (enc != GMIME_CONTENT_ENCODING_BASE64 && len > left) {
+		len = left;
+		rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_BYTES);
+	}
+
+	res = rspamd_mempool_alloc (task->task_pool, sizeof (GByteArray));
+
+	switch (enc) {
+	case GMIME_CONTENT_ENCODING_BASE64:
+		res->data = rspamd_mempool_alloc (task->task_pool,
+				RSPAMD_BASE64_DECODED_LEN (len));
+		res->len = rspamd_decode_base64 (data, len, res->data);
+		break;
+	case GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE:
+		res->data = rspamd_mempool_alloc (task->task_pool, len + 1);
+		res->len = rspamd_decode_qp (data, len, res->data);
+		break;
+	default:
+		res->data = (guint8 *)data;
+		res->len = len;
+		break;
+	}
+
+	return res;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Returns base64 content of a part in the message buffer, such parts can be
+ * decoded later when their content is required
+ */
+static const guchar *
+rspamd_mime_part_get_base64 (struct rspamd_task *task,
+	GMimeDataWrapper *wrapper, gsize *len)
+{
+#ifdef GMIME24
+	const guchar *data;
+	gsize left;
+
+	if (g_mime_data_wrapper_get_encoding (wrapper) ==
+			GMIME_CONTENT_ENCODING_BASE64 &&
+			rspamd_mime_part_get_bounds (task, wrapper, &data, len)) {
+		left = rspamd_mime_bytes_left (task);
+
+		if (*len / 4 * 3 > left) {
+			*len = left / 3 * 4;
+			rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_BYTES);
+		}
+
+		return data;
+	}
+#endif
+
+	return NULL;
+}
+
+GByteArray *
+rspamd_mime_part_get_content (struct mime_part *part)
+{
+	GByteArray *res;
+	rspamd_mempool_t *pool;
+
+	if (part->content == NULL) {
+		pool = part->task->task_pool;
+		res = rspamd_mempool_alloc (pool, sizeof (GByteArray));
+		res->data = rspamd_mempool_alloc (pool,
+				RSPAMD_BASE64_DECODED_LEN (part->encoded_len));
+		res->len = rspamd_decode_base64 (part->encoded, part->encoded_len,
+				res->data);
+		part->content = res;
+	}
+
+	return part->content;
+}
+
+const guchar *
+rspamd_mime_part_get_prefix (struct mime_part *part, gsize *len)
+{
+	guchar *res;
+	gsize i, nchars, need;
+	guchar c;
+
+	if (part->content != NULL) {
+		*len = MIN (*len, part->content->len);
+
+		return part->content->data;
+	}
+
+	/* Find the shortest input that contains enough of complete quanta */
+	need = (*len + 2) / 3 * 4;
+
+	for (i = 0, nchars = 0; i < part->encoded_len && nchars < need; i ++) {
+		c = part->encoded[i];
+
+		if (g_ascii_isalnum (c) || c == '+' || c == '/' || c == '=') {
+			nchars ++;
+		}
+	}
+
+	if (i == part->encoded_len) {
+		/* Short part, decode all of it */
+		rspamd_mime_part_get_content (part);
+		*len = MIN (*len, part->content->len);
+
+		return part->content->data;
+	}
+
+	res = rspamd_mempool_alloc (part->task->task_pool,
+			RSPAMD_BASE64_DECODED_LEN (i));
+	*len = MIN (*len, rspamd_decode_base64 (part->encoded, i, res));
+
+	return res;
 }
 
 static void
@@ -896,22 +992,202 @@ converter_error_quark (void)
 	return g_quark_from_static_string ("conversion error");
 }
 
+/*
+ * Converters are opened once for each charset and cached by threads that
+ * parse messages. For single byte charsets we also build a table of
+ * their characters in utf8 to convert text without iconv
+ */
+#define RSPAMD_CONVERTERS_MAX 64
+
+struct rspamd_charset_converter {
+	iconv_t ic;
+	gboolean is_ascii_compat;	/**< ascii characters are not changed		*/
+	gboolean is_single_byte;	/**< table conversion is possible			*/
+	guint max_len;				/**< maximum length of a character in table	*/
+	guchar table_len[256];
+	gchar table[256][4];
+};
+
+static void
+rspamd_charset_converter_dtor (gpointer p)
+{
+	struct rspamd_charset_converter *conv = p;
+
+	if (conv->ic != (iconv_t)-1) {
+		iconv_close (conv->ic);
+	}
+
+	g_slice_free1 (sizeof (*conv), conv);
+}
+
+static rspamd_private_t converters_key =
+	RSPAMD_PRIVATE_INIT (g_hash_table_unref);
+
+static void
+rspamd_charset_converter_probe (struct rspamd_charset_converter *conv)
+{
+	gchar c, buf[16], *in, *out;
+	gsize inlen, outlen, ret, len;
+	guint i;
+
+	conv->is_ascii_compat = TRUE;
+	conv->is_single_byte = TRUE;
+	conv->table[0][0] = '\0';
+	conv->table_len[0] = 1;
+	conv->max_len = 1;
+
+	/* Convert each byte separately to find out the properties of charset */
+	for (i = 1; i < 256; i ++) {
+		c = i;
+		in = &c;
+		inlen = 1;
+		out = buf;
+		outlen = sizeof (buf);
+
+		iconv (conv->ic, NULL, NULL, NULL, NULL);
+		ret = iconv (conv->ic, &in, &inlen, &out, &outlen);
+		len = out - buf;
+
+		if (ret == (gsize)-1 && errno == EILSEQ) {
+			/* Bad characters are replaced with '?' */
+			buf[0] = '?';
+			len = 1;
+		}
+		else if (ret == (gsize)-1 || inlen != 0 || len == 0 ||
+				len > sizeof (conv->table[0])) {
+			/* Multibyte or stateful charset */
+			conv->is_single_byte = FALSE;
+			conv->is_ascii_compat = FALSE;
+			break;
+		}
+
+		if (i < 0x80 && (len != 1 || buf[0] != c)) {
+			conv->is_ascii_compat = FALSE;
+		}
+
+		memcpy (conv->table[i], buf, len);
+		conv->table_len[i] = len;
+		conv->max_len = MAX (conv->max_len, len);
+	}
+
+	if (!conv->is_single_byte) {
+		conv->is_ascii_compat = TRUE;
+
+		/* Multibyte charsets can still keep ascii characters as is */
+		for (i = 1; i < 0x80; i ++) {
+			c = i;
+			in = &c;
+			inlen = 1;
+			out = buf;
+			outlen = sizeof (buf);
+
+			iconv (conv->ic, NULL, NULL, NULL, NULL);
+			ret = iconv (conv->ic, &in, &inlen, &out, &outlen);
+
+			if (ret == (gsize)-1 || out - buf != 1 || buf[0] != c) {
+				conv->is_ascii_compat = FALSE;
+				break;
+			}
+		}
+	}
+
+	iconv (conv->ic, NULL, NULL, NULL, NULL);
+}
+
+static struct rspamd_charset_converter *
+rspamd_charset_converter_get (const gchar *charset)
+{
+	GHashTable *cache;
+	struct rspamd_charset_converter *conv;
+
+	cache = rspamd_private_get (&converters_key);
+
+	if (cache == NULL) {
+		cache = g_hash_table_new_full (rspamd_strcase_hash,
+				rspamd_strcase_equal, g_free, rspamd_charset_converter_dtor);
+		rspamd_private_set (&converters_key, cache);
+	}
+
+	conv = g_hash_table_lookup (cache, charset);
+
+	if (conv == NULL) {
+		if (g_hash_table_size (cache) >= RSPAMD_CONVERTERS_MAX) {
+			g_hash_table_remove_all (cache);
+		}
+
+		/* Charsets that cannot be opened are cached as well */
+		conv = g_slice_alloc0 (sizeof (*conv));
+		conv->ic = iconv_open (UTF8_CHARSET, charset);
+
+		if (conv->ic != (iconv_t)-1) {
+			rspamd_charset_converter_probe (conv);
+		}
+
+		g_hash_table_insert (cache, g_strdup (charset), conv);
+	}
+
+	if (conv->ic == (iconv_t)-1) {
+		return NULL;
+	}
+
+	return conv;
+}
+
+static gboolean
+rspamd_text_is_ascii (const guchar *p, gsize len)
+{
+	const guchar *end = p + len;
+	guint64 w, acc = 0;
+
+	while (end - p >= (gssize)sizeof (w)) {
+		memcpy (&w, p, sizeof (w));
+		acc |= w;
+		p += sizeof (w);
+	}
+
+	while (p < end) {
+		acc |= *p++;
+	}
+
+	return (acc & 0x8080808080808080ULL) == 0;
+}
+
 static gchar *
 rspamd_text_to_utf8 (struct rspamd_task *task,
-		gchar *input, gsize len, const gchar *in_enc,
-		gsize *olen, GError **err)
+		struct rspamd_charset_converter *conv,
+		gchar *input, gsize len, gsize *olen, GError **err)
 {
 	gchar *res, *s, *d;
+	const guchar *p, *end;
 	gsize outlen;
-	iconv_t ic;
+	iconv_t ic = conv->ic;
 	gsize processed, ret;
+	guint clen;
 
-	ic = iconv_open (UTF8_CHARSET, in_enc);
+	if (conv->is_single_byte) {
+		res = rspamd_mempool_alloc (task->task_pool, len * conv->max_len + 1);
+		p = (const guchar *)input;
+		end = p + len;
+		d = res;
 
-	if (ic == (iconv_t)-1) {
-		g_set_error (err, converter_error_quark(), EINVAL,
-				"cannot open iconv for: %s", in_enc);
-		return NULL;
+		while (p < end) {
+			clen = conv->table_len[*p];
+
+			if (clen == 1) {
+				*d++ = conv->table[*p][0];
+			}
+			else {
+				memcpy (d, conv->table[*p], clen);
+				d += clen;
+			}
+
+			p ++;
+		}
+
+		*d = '\0';
+		*olen = d - res;
+
+		return res;
 	}
 
 	/* For the most of charsets utf8 notation is larger than native one */
@@ -922,6 +1198,9 @@ rspamd_text_to_utf8 (struct rspamd_task *task,
 	d = res;
 	processed = outlen - 1;
 
+	/* Reset state of the cached converter */
+	iconv (ic, NULL, NULL, NULL, NULL);
+
 	while (len > 0 && processed > 0) {
 		ret = iconv (ic, &s, &len, &d, &processed);
 		if (ret == (gsize)-1) {
@@ -930,7 +1209,6 @@ rspamd_text_to_utf8 (struct rspamd_task *task,
 				g_set_error (err, converter_error_quark(), EINVAL,
 						"output of size %zd is not enough to handle "
 						"converison of %zd bytes", outlen, len);
-				iconv_close (ic);
 				return NULL;
 			case EILSEQ:
 			case EINVAL:
@@ -952,8 +1230,6 @@ rspamd_text_to_utf8 (struct rspamd_task *task,
 	*d = '\0';
 	*olen = d - res;
 
-	iconv_close (ic);
-
 	return res;
 }
 
@@ -968,6 +1244,7 @@ convert_text_to_utf (struct rspamd_task *task,
 	const gchar *charset;
 	gchar *res_str, *ocharset;
 	GByteArray *result_array;
+	struct rspamd_charset_converter *conv;
 
 	if (task->cfg->raw_mode) {
 		text_part->is_raw = TRUE;
@@ -988,7 +1265,7 @@ convert_text_to_utf (struct rspamd_task *task,
 	}
 	if (g_ascii_strcasecmp (ocharset,
 		"utf-8") == 0 || g_ascii_strcasecmp (ocharset, "utf8") == 0) {
-		if (g_utf8_validate (part_content->data, part_content->len, NULL)) {
+		if (rspamd_fast_utf8_validate (part_content->data, part_content->len)) {
 			text_part->is_raw = FALSE;
 			text_part->is_utf = TRUE;
 			return part_content;
@@ -1002,11 +1279,27 @@ convert_text_to_utf (struct rspamd_task *task,
 		}
 	}
 
-	res_str = rspamd_text_to_utf8 (task, part_content->data,
-			part_content->len,
-			ocharset,
-			&write_bytes,
-			&err);
+	conv = rspamd_charset_converter_get (ocharset);
+
+	if (conv == NULL) {
+		g_set_error (&err, converter_error_quark(), EINVAL,
+				"cannot open iconv for: %s", ocharset);
+		res_str = NULL;
+	}
+	else if (conv->is_ascii_compat &&
+			rspamd_text_is_ascii (part_content->data, part_content->len)) {
+		/* Nothing to convert */
+		text_part->is_raw = FALSE;
+		text_part->is_utf = TRUE;
+		return part_content;
+	}
+	else {
+		res_str = rspamd_text_to_utf8 (task, conv, part_content->data,
+				part_content->len,
+				&write_bytes,
+				&err);
+	}
+
 	if (res_str == NULL) {
 		msg_warn ("<%s>: cannot convert from %s to utf8: %s",
 			task->message_id,
@@ -1166,6 +1459,12 @@ detect_text_language (struct mime_text_part *part)
 				part->lang_code = lm->code;
 				part->language = lm->name;
 			}
+
+			if (sel == G_UNICODE_SCRIPT_LATIN) {
+				/* Many languages share latin script, check common words */
+				rspamd_language_detect_latin (part->content->data,
+						part->content->len, &part->lang_code, &part->language);
+			}
 		}
 	}
 }
@@ -1174,48 +1473,13 @@ static void
 rspamd_normalize_text_part (struct rspamd_task *task,
 		struct mime_text_part *part)
 {
-	struct sb_stemmer *stem = NULL;
-	rspamd_fstring_t *w, stw;
-	const guchar *r;
-	guint i;
-
-	if (part->language && part->language[0] != '\0' && part->is_utf) {
-		stem = sb_stemmer_new (part->language, "UTF_8");
-		if (stem == NULL) {
-			msg_info ("<%s> cannot create lemmatizer for %s language",
-				task->message_id, part->language);
-		}
-	}
-
-	part->normalized_words = g_array_sized_new (FALSE, FALSE,
-			sizeof (rspamd_fstring_t), part->words->len);
-	for (i = 0; i < part->words->len; i ++) {
-		w = &g_array_index (part->words, rspamd_fstring_t, i);
-		if (stem) {
-			r = sb_stemmer_stem (stem, w->begin, w->len);
-		}
-
-		if (stem == NULL || r == NULL) {
-			stw.begin = rspamd_mempool_fstrdup (task->task_pool, w);
-			stw.len = w->len;
-		}
-		else {
-			stw.begin = rspamd_mempool_strdup (task->task_pool, r);
-			stw.len = strlen (r);
-		}
-
-		if (part->is_utf) {
-			rspamd_str_lc_utf8 (stw.begin, stw.len);
-		}
-		else {
-			rspamd_str_lc (stw.begin, stw.len);
-		}
-		g_array_append_val (part->normalized_words, stw);
+	if (part->language == NULL || part->language[0] == '\0' || !part->is_utf) {
+		return;
 	}
 
-	if (stem != NULL) {
-		sb_stemmer_delete (stem);
-	}
+	/* Words are already in lower case, so we can stem them in place */
+	rspamd_language_stem_words (part->language, part->normalized_words,
+			task->task_pool);
 }
 
 static void
@@ -1268,23 +1532,14 @@ process_text_part (struct rspamd_task *task,
 				text_part->orig,
 				type,
 				text_part);
-		text_part->is_balanced = TRUE;
-		text_part->html_nodes = NULL;
 		text_part->parent = parent;
 
-		text_part->content = strip_html_tags (task,
+		text_part->content = rspamd_html_process_part (task,
 				task->task_pool,
 				text_part,
-				part_content,
-				NULL);
-
-		if (text_part->html_nodes != NULL) {
-			decode_entitles (text_part->content->data,
-				&text_part->content->len);
-		}
+				part_content);
 		rspamd_url_text_extract (task->task_pool, task, text_part, TRUE);
 
-		rspamd_fuzzy_from_text_part (text_part, task->task_pool, task->cfg->max_diff);
 		rspamd_mempool_add_destructor (task->task_pool,
 			(rspamd_mempool_destruct_t) free_byte_array_callback,
 			text_part->content);
@@ -1310,19 +1565,92 @@ process_text_part (struct rspamd_task *task,
 				text_part);
 		text_part->orig = part_content;
 		rspamd_url_text_extract (task->task_pool, task, text_part, FALSE);
-		rspamd_fuzzy_from_text_part (text_part, task->task_pool, task->cfg->max_diff);
 		task->text_parts = g_list_prepend (task->text_parts, text_part);
 	}
 	else {
 		return;
 	}
 
-	/* Post process part */
+	/* Fuzzy hashes and words are computed when they are requested */
+	text_part->task = task;
 	detect_text_language (text_part);
-	text_part->words = rspamd_tokenize_text (text_part->content->data,
-			text_part->content->len, text_part->is_utf, task->cfg->min_word_len,
-			&text_part->urls_offset);
-	rspamd_normalize_text_part (task, text_part);
+}
+
+rspamd_fuzzy_t *
+rspamd_text_part_get_fuzzy (struct mime_text_part *part)
+{
+	struct rspamd_task *task = part->task;
+
+	if (part->is_empty) {
+		return NULL;
+	}
+
+	if (!(part->computed & RSPAMD_TEXT_PART_HAS_FUZZY)) {
+		rspamd_fuzzy_from_text_part (part, task->task_pool,
+			task->cfg->max_diff);
+		part->computed |= RSPAMD_TEXT_PART_HAS_FUZZY;
+	}
+
+	return part->fuzzy;
+}
+
+GArray *
+rspamd_text_part_get_words (struct mime_text_part *part)
+{
+	struct rspamd_task *task = part->task;
+	guint32 max_words = 0;
+
+	if (part->is_empty) {
+		return NULL;
+	}
+
+	if (!(part->computed & RSPAMD_TEXT_PART_HAS_WORDS)) {
+		part->computed |= RSPAMD_TEXT_PART_HAS_WORDS;
+
+		if (task->cfg->mime_max_words != 0) {
+			if (task->mime_budget.words >= task->cfg->mime_max_words) {
+				rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_WORDS);
+				return NULL;
+			}
+
+			max_words = task->cfg->mime_max_words - task->mime_budget.words;
+		}
+
+		/* Words in lower case are produced in the same pass */
+		part->words = rspamd_tokenize_text (part->content->data,
+				part->content->len, part->is_utf, task->cfg->min_word_len,
+				max_words, part->urls_offset, task->task_pool,
+				&part->normalized_words);
+
+		if (part->words != NULL) {
+			task->mime_budget.words += part->words->len;
+
+			if (max_words != 0 && part->words->len >= max_words) {
+				rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_WORDS);
+			}
+		}
+	}
+
+	return part->words;
+}
+
+GArray *
+rspamd_text_part_get_normalized_words (struct mime_text_part *part)
+{
+	if (part->is_empty) {
+		return NULL;
+	}
+
+	if (!(part->computed & RSPAMD_TEXT_PART_HAS_NORMALIZED)) {
+		rspamd_text_part_get_words (part);
+
+		if (part->normalized_words != NULL) {
+			rspamd_normalize_text_part (part->task, part);
+		}
+		part->computed |= RSPAMD_TEXT_PART_HAS_NORMALIZED;
+	}
+
+	return part->normalized_words;
 }
 
 #ifdef GMIME24
@@ -1341,9 +1669,17 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 	GMimeDataWrapper *wrapper;
 	GMimeStream *part_stream;
 	GByteArray *part_content;
+	const guchar *encoded;
+	gsize encoded_len;
 
 	task->parts_count++;
 
+	if (task->cfg->mime_max_parts != 0 &&
+			task->parts_count > task->cfg->mime_max_parts) {
+		rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_PARTS);
+		return;
+	}
+
 	/* 'part' points to the current part node that g_mime_message_foreach_part() is iterating over */
 
 	/* find out what class 'part' is... */
@@ -1426,34 +1762,73 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 #else
 		if (wrapper != NULL) {
 #endif
-			part_stream = g_mime_stream_mem_new ();
-			if (g_mime_data_wrapper_write_to_stream (wrapper,
-				part_stream) != -1) {
-				gchar *hdrs;
+			if (task->cfg->mime_max_bytes != 0 &&
+					task->mime_budget.bytes >= task->cfg->mime_max_bytes) {
+				rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_BYTES);
+				return;
+			}
+
+			part_content = NULL;
+			encoded = NULL;
+			encoded_len = 0;
+
+			if (g_mime_content_type_is_type (type, "image", "*")) {
+				/* Headers of images are enough to get their size */
+				encoded = rspamd_mime_part_get_base64 (task, wrapper,
+						&encoded_len);
+			}
+
+			if (encoded == NULL) {
+				part_content = rspamd_mime_part_decode (task, wrapper);
+			}
+
+			if (part_content == NULL && encoded == NULL) {
+				/* Decode part content */
+				part_stream = g_mime_stream_mem_new ();
+				if (g_mime_data_wrapper_write_to_stream (wrapper,
+					part_stream) != -1) {
+					g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (
+							part_stream), FALSE);
+					part_content = g_mime_stream_mem_get_byte_array (
+						GMIME_STREAM_MEM (part_stream));
+					rspamd_mempool_add_destructor (task->task_pool,
+						(rspamd_mempool_destruct_t) free_byte_array_callback,
+						part_content);
 
-				g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (
-						part_stream), FALSE);
-				part_content = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (
-							part_stream));
+					/* Other encodings are decoded by gmime, so cut the result */
+					if (part_content->len > rspamd_mime_bytes_left (task)) {
+						g_byte_array_set_size (part_content,
+								rspamd_mime_bytes_left (task));
+						rspamd_task_limit_exceeded (task,
+								RSPAMD_MIME_LIMIT_BYTES);
+					}
+				}
 				g_object_unref (part_stream);
+			}
+
+			if (part_content != NULL || encoded != NULL) {
+				gchar *hdrs;
+
+				task->mime_budget.bytes += part_content != NULL ?
+						part_content->len : encoded_len / 4 * 3;
+
 				mime_part =
 					rspamd_mempool_alloc (task->task_pool,
 						sizeof (struct mime_part));
 
 				hdrs = g_mime_object_get_headers (GMIME_OBJECT (part));
-				mime_part->raw_headers = g_hash_table_new (rspamd_strcase_hash,
-						rspamd_strcase_equal);
-				rspamd_mempool_add_destructor (task->task_pool,
-					(rspamd_mempool_destruct_t) g_hash_table_destroy,
-					mime_part->raw_headers);
+				mime_part->raw_headers = rspamd_headers_new (task->task_pool);
 				if (hdrs != NULL) {
 					process_raw_headers (mime_part->raw_headers,
-							task->task_pool, hdrs);
+							task->task_pool, hdrs, strlen (hdrs));
 					g_free (hdrs);
 				}
 
 				mime_part->type = type;
 				mime_part->content = part_content;
+				mime_part->encoded = encoded;
+				mime_part->encoded_len = encoded_len;
+				mime_part->task = task;
 				mime_part->parent = task->parser_parent_part;
 				mime_part->filename = g_mime_part_get_filename (GMIME_PART (
 							part));
@@ -1462,13 +1837,16 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 					type->type,
 					type->subtype);
 				task->parts = g_list_prepend (task->parts, mime_part);
-				/* Skip empty parts */
-				process_text_part (task,
-					part_content,
-					type,
-					part,
-					task->parser_parent_part,
-					(part_content->len <= 0));
+
+				if (part_content != NULL) {
+					/* Skip empty parts */
+					process_text_part (task,
+						part_content,
+						type,
+						part,
+						task->parser_parent_part,
+						(part_content->len <= 0));
+				}
 			}
 			else {
 				msg_warn ("write to stream failed: %d, %s", errno,
@@ -1511,7 +1889,7 @@ process_message (struct rspamd_task *task)
 	struct received_header *recv;
 	gchar *mid, *url_str, *p, *end, *url_end;
 	struct rspamd_url *subject_url;
-	gsize len;
+	gsize len, hdrs_len;
 	gint rc;
 
 	tmp = rspamd_mempool_alloc (task->task_pool, sizeof (GByteArray));
@@ -1569,19 +1947,14 @@ process_message (struct rspamd_task *task)
 			task->queue_id = "undef";
 		}
 
-#ifdef GMIME24
-		task->raw_headers_str =
-			g_mime_object_get_headers (GMIME_OBJECT (task->message));
-#else
-		task->raw_headers_str = g_mime_message_get_headers (task->message);
-#endif
-
-		if (task->raw_headers_str) {
-			rspamd_mempool_add_destructor (task->task_pool,
-					(rspamd_mempool_destruct_t) g_free, task->raw_headers_str);
-			process_raw_headers (task->raw_headers, task->task_pool,
-					task->raw_headers_str);
-		}
+		/* Parse headers from the message itself, not from gmime output */
+		hdrs_len = rspamd_message_headers_len (task->msg.start, task->msg.len);
+		task->raw_headers_str = rspamd_mempool_alloc (task->task_pool,
+				hdrs_len + 1);
+		memcpy (task->raw_headers_str, task->msg.start, hdrs_len);
+		task->raw_headers_str[hdrs_len] = '\0';
+		process_raw_headers (task->raw_headers, task->task_pool,
+				task->msg.start, hdrs_len);
 		process_images (task);
 
 		/* Parse received headers */
@@ -1721,14 +2094,14 @@ process_message (struct rspamd_task *task)
 
 
 GList *
-message_get_header (struct rspamd_task *task,
-	const gchar *field,
+message_get_header_name (struct rspamd_task *task,
+	const struct rspamd_header_name *hn,
 	gboolean strong)
 {
 	GList *gret = NULL;
 	struct raw_header *rh;
 
-	rh = g_hash_table_lookup (task->raw_headers, field);
+	rh = rspamd_headers_lookup (task->raw_headers, hn);
 
 	if (rh == NULL) {
 		return NULL;
@@ -1736,7 +2109,7 @@ message_get_header (struct rspamd_task *task,
 
 	while (rh) {
 		if (strong) {
-			if (strcmp (rh->name, field) == 0) {
+			if (strcmp (rh->name, hn->name) == 0) {
 				gret = g_list_prepend (gret, rh);
 			}
 		}
@@ -1753,3 +2126,15 @@ message_get_header (struct rspamd_task *task,
 
 	return gret;
 }
+
+GList *
+message_get_header (struct rspamd_task *task,
+	const gchar *field,
+	gboolean strong)
+{
+	struct rspamd_header_name hn;
+
+	rspamd_header_name_init (&hn, field);
+
+	return message_get_header_name (task, &hn, strong);
+}
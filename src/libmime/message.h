@@ -11,16 +11,26 @@
 
 struct rspamd_task;
 struct controller_session;
+struct html_content;
+struct rspamd_headers;
 
 struct mime_part {
 	GMimeContentType *type;
-	GByteArray *content;
+	GByteArray *content;		/**< decoded content, NULL until it is required	*/
+	const guchar *encoded;		/**< base64 content decoded on demand			*/
+	gsize encoded_len;
 	GMimeObject *parent;
-	GHashTable *raw_headers;
+	struct rspamd_headers *raw_headers;
 	gchar *checksum;
 	const gchar *filename;
+	struct rspamd_task *task;	/**< task that owns this part					*/
 };
 
+/* Properties of text part that are computed on demand */
+#define RSPAMD_TEXT_PART_HAS_FUZZY (1 << 0)
+#define RSPAMD_TEXT_PART_HAS_WORDS (1 << 1)
+#define RSPAMD_TEXT_PART_HAS_NORMALIZED (1 << 2)
+
 struct mime_text_part {
 	gboolean is_html;
 	gboolean is_raw;
@@ -33,7 +43,7 @@ struct mime_text_part {
 	const gchar *real_charset;
 	GByteArray *orig;
 	GByteArray *content;
-	GNode *html_nodes;
+	struct html_content *html;	/**< structure of html parts					*/
 	GList *urls_offset;	/**< list of offsets of urls						*/
 	rspamd_fuzzy_t *fuzzy;
 	rspamd_fuzzy_t *double_fuzzy;
@@ -41,6 +51,8 @@ struct mime_text_part {
 	rspamd_fstring_t *diff_str;
 	GArray *words;
 	GArray *normalized_words;
+	struct rspamd_task *task;	/**< task that owns this part						*/
+	guint computed;				/**< properties that are already computed			*/
 };
 
 struct received_header {
@@ -59,9 +71,25 @@ struct raw_header {
 	gboolean empty_separator;
 	gchar *separator;
 	gchar *decoded;
+	guint name_len;
+	guint name_hash;			/**< caseless hash of name						*/
 	struct raw_header *prev, *next;
 };
 
+/* Header name with the precomputed hash, can be reused for many lookups */
+struct rspamd_header_name {
+	const gchar *name;
+	guint len;
+	guint hash;
+};
+
+/* Headers in order of appearance and an index of them by names */
+struct rspamd_headers {
+	GPtrArray *list;
+	struct raw_header **index;	/**< first header for each name				*/
+	guint mask;
+};
+
 /**
  * Process message with all filters/statfiles, extract mime parts, urls and
  * call metrics consolidation functions
@@ -70,6 +98,73 @@ struct raw_header {
  */
 gint process_message (struct rspamd_task *task);
 
+/**
+ * Get fuzzy hashes of a text part, they are computed on the first call
+ * @param part text part
+ * @return fuzzy hash or NULL for empty parts
+ */
+rspamd_fuzzy_t * rspamd_text_part_get_fuzzy (struct mime_text_part *part);
+
+/**
+ * Get words of a text part, text is tokenized on the first call
+ * @param part text part
+ * @return array of rspamd_fstring_t or NULL for empty parts
+ */
+GArray * rspamd_text_part_get_words (struct mime_text_part *part);
+
+/**
+ * Get stemmed and lowercased words of a text part, they are computed on the
+ * first call
+ * @param part text part
+ * @return array of rspamd_fstring_t or NULL for empty parts
+ */
+GArray * rspamd_text_part_get_normalized_words (struct mime_text_part *part);
+
+/**
+ * Get decoded content of a mime part, images are decoded on the first call
+ * @param part mime part
+ * @return decoded content
+ */
+GByteArray * rspamd_mime_part_get_content (struct mime_part *part);
+
+/**
+ * Get the beginning of decoded content of a mime part without decoding the
+ * whole part
+ * @param part mime part
+ * @param len number of bytes required, set to the number of bytes available
+ * @return decoded data
+ */
+const guchar * rspamd_mime_part_get_prefix (struct mime_part *part, gsize *len);
+
+/**
+ * Compute caseless hash of a header name
+ * @param hn header name to initialize
+ * @param name name of header
+ */
+void rspamd_header_name_init (struct rspamd_header_name *hn,
+	const gchar *name);
+
+/**
+ * Create new empty set of headers
+ * @param pool memory pool
+ */
+struct rspamd_headers * rspamd_headers_new (rspamd_mempool_t *pool);
+
+/**
+ * Find the first header with the specified name, other headers with the same
+ * name are linked by `next` field
+ * @param hdrs headers
+ * @param hn header name
+ * @return header or NULL if not found
+ */
+struct raw_header * rspamd_headers_lookup (struct rspamd_headers *hdrs,
+	const struct rspamd_header_name *hn);
+
+/**
+ * Same as `rspamd_headers_lookup` but hash of name is computed for each call
+ */
+struct raw_header * rspamd_headers_find (struct rspamd_headers *hdrs,
+	const gchar *name);
 
 /*
  * Get a list of header's values with specified header's name using raw headers
@@ -82,4 +177,11 @@ GList * message_get_header (struct rspamd_task *task,
 	const gchar *field,
 	gboolean strong);
 
+/*
+ * Same as `message_get_header` but uses header name with the precomputed hash
+ */
+GList * message_get_header_name (struct rspamd_task *task,
+	const struct rspamd_header_name *hn,
+	gboolean strong);
+
 #endif
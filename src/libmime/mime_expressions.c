@@ -114,6 +114,7 @@ struct rspamd_regexp_atom {
 	gchar *regexp_text;                             /**< regexp text representation							*/
 	rspamd_regexp_t *regexp;                        /**< regexp structure									*/
 	gchar *header;                                  /**< header name for header regexps						*/
+	struct rspamd_header_name header_name;          /**< header name with the precomputed hash				*/
 	gboolean is_test;                               /**< true if this expression must be tested				*/
 	gboolean is_strong;                             /**< true if headers search must be case sensitive		*/
 	gboolean is_multiple;                           /**< true if we need to match all inclusions of atom	*/
@@ -255,6 +256,11 @@ rspamd_mime_expr_parse_regexp_atom (rspamd_mempool_t * pool, const gchar *line)
 		result->type = REGEXP_HEADER;
 		line = start;
 	}
+
+	if (result->header != NULL) {
+		rspamd_header_name_init (&result->header_name, result->header);
+	}
+
 	/* Find begin of regexp */
 	while (*line && *line != '/') {
 		line++;
@@ -265,6 +271,7 @@ rspamd_mime_expr_parse_regexp_atom (rspamd_mempool_t * pool, const gchar *line)
 	else if (result->header == NULL) {
 		/* Assume that line without // is just a header name */
 		result->header = rspamd_mempool_strdup (pool, line);
+		rspamd_header_name_init (&result->header_name, result->header);
 		result->type = REGEXP_HEADER;
 		return result;
 	}
@@ -803,8 +810,8 @@ rspamd_mime_expr_process_regexp (struct rspamd_regexp_atom *re,
 			re->regexp_text);
 
 		/* Get list of specified headers */
-		headerlist = message_get_header (task,
-				re->header,
+		headerlist = message_get_header_name (task,
+				&re->header_name,
 				re->is_strong);
 		if (headerlist == NULL) {
 			/* Header is not found */
@@ -1078,7 +1085,6 @@ gboolean
 rspamd_header_exists (struct rspamd_task * task, GArray * args, void *unused)
 {
 	struct expression_argument *arg;
-	GList *headerlist;
 
 	if (args == NULL || task == NULL) {
 		return FALSE;
@@ -1091,13 +1097,7 @@ rspamd_header_exists (struct rspamd_task * task, GArray * args, void *unused)
 	}
 
 	debug_task ("try to get header %s", (gchar *)arg->data);
-	headerlist = message_get_header (task,
-			(gchar *)arg->data,
-			FALSE);
-	if (headerlist) {
-		return TRUE;
-	}
-	return FALSE;
+	return rspamd_headers_find (task->raw_headers, arg->data) != NULL;
 }
 
 /*
@@ -1219,6 +1219,9 @@ rspamd_parts_distance (struct rspamd_task * task, GArray * args, void *unused)
 			return FALSE;
 		}
 		if (!p1->is_empty && !p2->is_empty) {
+			rspamd_text_part_get_fuzzy (p1);
+			rspamd_text_part_get_fuzzy (p2);
+
 			if (p1->diff_str != NULL && p2->diff_str != NULL) {
 				diff = rspamd_diff_distance_normalized (p1->diff_str,
 						p2->diff_str);
@@ -1587,28 +1590,6 @@ rspamd_is_html_balanced (struct rspamd_task * task, GArray * args, void *unused)
 
 }
 
-struct html_callback_data {
-	struct html_tag *tag;
-	gboolean *res;
-};
-
-static gboolean
-search_html_node_callback (GNode * node, gpointer data)
-{
-	struct html_callback_data *cd = data;
-	struct html_node *nd;
-
-	nd = node->data;
-	if (nd) {
-		if (nd->tag == cd->tag) {
-			*cd->res = TRUE;
-			return TRUE;
-		}
-	}
-
-	return FALSE;
-}
-
 gboolean
 rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 {
@@ -1617,7 +1598,6 @@ rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 	struct expression_argument *arg;
 	struct html_tag *tag;
 	gboolean res = FALSE;
-	struct html_callback_data cd;
 
 	if (args == NULL) {
 		msg_warn ("no parameters to function");
@@ -1638,18 +1618,11 @@ rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 	}
 
 	cur = g_list_first (task->text_parts);
-	cd.res = &res;
-	cd.tag = tag;
 
 	while (cur && res == FALSE) {
 		p = cur->data;
-		if (!p->is_empty && p->is_html && p->html_nodes) {
-			g_node_traverse (p->html_nodes,
-				G_PRE_ORDER,
-				G_TRAVERSE_ALL,
-				-1,
-				search_html_node_callback,
-				&cd);
+		if (!p->is_empty && p->is_html && p->html) {
+			res = rspamd_html_tag_seen (p->html, tag->id);
 		}
 		cur = g_list_next (cur);
 	}
@@ -1669,7 +1642,8 @@ rspamd_has_fake_html (struct rspamd_task * task, GArray * args, void *unused)
 
 	while (cur && res == FALSE) {
 		p = cur->data;
-		if (!p->is_empty && p->is_html && p->html_nodes == NULL) {
+		if (!p->is_empty && p->is_html &&
+			(p->html == NULL || p->html->ntags == 0)) {
 			res = TRUE;
 		}
 		cur = g_list_next (cur);
@@ -1694,7 +1668,7 @@ rspamd_raw_header_exists (struct rspamd_task *task, GArray * args, void *unused)
 		return FALSE;
 	}
 
-	return g_hash_table_lookup (task->raw_headers, arg->data) != NULL;
+	return rspamd_headers_find (task->raw_headers, arg->data) != NULL;
 }
 
 static gboolean
@@ -2166,18 +2140,22 @@ compare_subtype (struct rspamd_task *task, GMimeContentType * ct,
 static gboolean
 compare_len (struct mime_part *part, guint min, guint max)
 {
+	gsize len;
+
 	if (min == 0 && max == 0) {
 		return TRUE;
 	}
 
+	len = rspamd_mime_part_get_content (part)->len;
+
 	if (min == 0) {
-		return part->content->len <= max;
+		return len <= max;
 	}
 	else if (max == 0) {
-		return part->content->len >= min;
+		return len >= min;
 	}
 	else {
-		return part->content->len >= min && part->content->len <= max;
+		return len >= min && len <= max;
 	}
 }
 
@@ -160,6 +160,8 @@ struct rspamd_worker_conf {
 	GHashTable *params;                             /**< params for worker									*/
 	GQueue *active_workers;                         /**< linked list of spawned workers						*/
 	gboolean has_socket;                            /**< whether we should make listening socket in main process */
+	gboolean reuseport;                             /**< create listening sockets for each worker process	*/
+	gboolean cpu_affinity;                          /**< bind each worker process to a separate CPU		*/
 	gpointer *ctx;                                  /**< worker's context									*/
 	ucl_object_t *options;                  /**< other worker's options								*/
 };
@@ -266,6 +268,14 @@ struct rspamd_config {
 	gdouble upstream_revive_time;					/**< revive timeout for upstreams						*/
 
 	guint32 min_word_len;							/**< minimum length of the word to be considered		*/
+	guint32 keypair_cache_size;						/**< size of encryption keys cache shared by workers	*/
+
+	guint32 mime_max_parts;							/**< maximum number of mime parts in a message			*/
+	gsize mime_max_bytes;							/**< maximum size of decoded mime parts					*/
+	guint32 mime_max_words;							/**< maximum number of words in text parts				*/
+	guint32 mime_max_urls;							/**< maximum number of urls in a message				*/
+	guint32 mime_max_html_tags;						/**< maximum number of html tags in a message			*/
+	gchar *mime_limits_symbol;						/**< symbol to insert when some limit is reached		*/
 };
 
 
@@ -41,6 +41,13 @@
 #define DEFAULT_RLIMIT_MAXCORE 0
 #define DEFAULT_MAP_TIMEOUT 10
 #define DEFAULT_MIN_WORD 4
+#define DEFAULT_KEYPAIR_CACHE_SIZE 1024
+#define DEFAULT_MIME_MAX_PARTS 1024
+#define DEFAULT_MIME_MAX_BYTES (64 * 1024 * 1024)
+#define DEFAULT_MIME_MAX_WORDS 200000
+#define DEFAULT_MIME_MAX_URLS 8192
+#define DEFAULT_MIME_MAX_HTML_TAGS 65536
+#define DEFAULT_MIME_LIMITS_SYMBOL "MIME_LIMITS_EXCEEDED"
 
 struct rspamd_ucl_map_cbdata {
 	struct rspamd_config *cfg;
@@ -171,6 +178,14 @@ rspamd_config_defaults (struct rspamd_config *cfg)
 	cfg->log_extended = TRUE;
 
 	cfg->min_word_len = DEFAULT_MIN_WORD;
+	cfg->keypair_cache_size = DEFAULT_KEYPAIR_CACHE_SIZE;
+
+	cfg->mime_max_parts = DEFAULT_MIME_MAX_PARTS;
+	cfg->mime_max_bytes = DEFAULT_MIME_MAX_BYTES;
+	cfg->mime_max_words = DEFAULT_MIME_MAX_WORDS;
+	cfg->mime_max_urls = DEFAULT_MIME_MAX_URLS;
+	cfg->mime_max_html_tags = DEFAULT_MIME_MAX_HTML_TAGS;
+	cfg->mime_limits_symbol = DEFAULT_MIME_LIMITS_SYMBOL;
 }
 
 void
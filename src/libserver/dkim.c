@@ -1511,7 +1511,7 @@ rspamd_dkim_canonize_header (rspamd_dkim_context_t *ctx,
 				   is_sig);
 	}
 	else {
-		rh = g_hash_table_lookup (task->raw_headers, header_name);
+		rh = rspamd_headers_find (task->raw_headers, header_name);
 		if (rh) {
 			if (!is_sig) {
 				rh_iter = rh;
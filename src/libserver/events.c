@@ -193,9 +193,8 @@ destroy_session (struct rspamd_async_session *session)
 	}
 
 	g_mutex_lock (session->mtx);
-	if (session->threads > 0) {
+	while (g_atomic_int_get (&session->threads) > 0) {
 		/* Wait for conditional variable to finish processing */
-		g_mutex_unlock (session->mtx);
 		g_cond_wait (session->cond, session->mtx);
 	}
 
@@ -220,7 +219,7 @@ check_session_pending (struct rspamd_async_session *session)
 	g_mutex_lock (session->mtx);
 	if (session->wanna_die && g_hash_table_size (session->events) == 0) {
 		session->wanna_die = FALSE;
-		if (session->threads > 0) {
+		while (g_atomic_int_get (&session->threads) > 0) {
 			/* Wait for conditional variable to finish processing */
 			g_cond_wait (session->cond, session->mtx);
 		}
@@ -265,11 +264,15 @@ register_async_thread (struct rspamd_async_session *session)
 void
 remove_async_thread (struct rspamd_async_session *session)
 {
+	msg_debug ("removing thread: pending %d thread", session->threads);
+	/*
+	 * Decrease counter under the lock, as the session can be destroyed as
+	 * soon as a waiter is signalled
+	 */
+	g_mutex_lock (session->mtx);
 	if (g_atomic_int_dec_and_test (&session->threads)) {
 		/* Signal if there are any sessions waiting */
-		g_mutex_lock (session->mtx);
 		g_cond_signal (session->cond);
-		g_mutex_unlock (session->mtx);
 	}
-	msg_debug ("removed thread: pending %d thread", session->threads);
+	g_mutex_unlock (session->mtx);
 }
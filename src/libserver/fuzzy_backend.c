@@ -25,11 +25,18 @@
 #include "main.h"
 #include "fuzzy_backend.h"
 #include "fuzzy_storage.h"
+#include "xxhash.h"
 
 #include <sqlite3.h>
 
 /* Magic sequence for hashes file */
 #define FUZZY_FILE_MAGIC "rsh"
+/*
+ * Shingles are grouped into LSH bands: two digests share a band key only if
+ * all shingles of that band are equal
+ */
+#define FUZZY_BANDS 8
+#define FUZZY_BAND_ROWS (RSPAMD_SHINGLE_SIZE / FUZZY_BANDS)
 
 struct rspamd_legacy_fuzzy_node {
 	gint32 value;
@@ -59,12 +66,30 @@ static const char *create_tables_sql =
 		"number INTEGER NOT NULL,"
 		"digest_id INTEGER REFERENCES digests(id) ON DELETE CASCADE "
 		"ON UPDATE CASCADE);"
+		"CREATE TABLE shingle_bands("
+		"value INTEGER NOT NULL,"
+		"band INTEGER NOT NULL,"
+		"digest_id INTEGER REFERENCES digests(id) ON DELETE CASCADE "
+		"ON UPDATE CASCADE);"
 		"COMMIT;";
 static const char *create_index_sql =
 		"BEGIN;"
 		"CREATE UNIQUE INDEX IF NOT EXISTS d ON digests(digest);"
 		"CREATE INDEX IF NOT EXISTS t ON digests(time);"
 		"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
+		"CREATE INDEX IF NOT EXISTS b ON shingle_bands(value, band);"
+		"CREATE INDEX IF NOT EXISTS bd ON shingle_bands(digest_id);"
+		"COMMIT;";
+/* Used to upgrade databases created before bands index was introduced */
+static const char *create_bands_sql =
+		"BEGIN;"
+		"CREATE TABLE IF NOT EXISTS shingle_bands("
+		"value INTEGER NOT NULL,"
+		"band INTEGER NOT NULL,"
+		"digest_id INTEGER REFERENCES digests(id) ON DELETE CASCADE "
+		"ON UPDATE CASCADE);"
+		"CREATE INDEX IF NOT EXISTS b ON shingle_bands(value, band);"
+		"CREATE INDEX IF NOT EXISTS bd ON shingle_bands(digest_id);"
 		"COMMIT;";
 enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_START = 0,
@@ -74,11 +99,19 @@ enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_UPDATE,
 	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
 	RSPAMD_FUZZY_BACKEND_CHECK,
-	RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
+	RSPAMD_FUZZY_BACKEND_INSERT_BAND,
+	RSPAMD_FUZZY_BACKEND_CHECK_BAND,
+	RSPAMD_FUZZY_BACKEND_COUNT_BANDS,
+	RSPAMD_FUZZY_BACKEND_ALL_SHINGLES,
 	RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
 	RSPAMD_FUZZY_BACKEND_DELETE,
+	RSPAMD_FUZZY_BACKEND_DELETE_BANDS,
 	RSPAMD_FUZZY_BACKEND_COUNT,
 	RSPAMD_FUZZY_BACKEND_EXPIRE,
+	RSPAMD_FUZZY_BACKEND_EXPIRE_BANDS,
+	RSPAMD_FUZZY_BACKEND_EXPIRE_STEP,
+	RSPAMD_FUZZY_BACKEND_EXPIRE_STEP_BANDS,
+	RSPAMD_FUZZY_BACKEND_CLEANUP_BANDS,
 	RSPAMD_FUZZY_BACKEND_VACUUM,
 	RSPAMD_FUZZY_BACKEND_MAX
 };
@@ -143,12 +176,35 @@ static struct rspamd_fuzzy_stmts {
 		.result = SQLITE_ROW
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-		.sql = "SELECT digest_id FROM shingles WHERE value=?1 AND number=?2",
+		.idx = RSPAMD_FUZZY_BACKEND_INSERT_BAND,
+		.sql = "INSERT INTO shingle_bands(value, band, digest_id) "
+				"VALUES (?1, ?2, ?3);",
+		.args = "ISI",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_CHECK_BAND,
+		.sql = "SELECT digest_id FROM shingle_bands WHERE value=?1 AND band=?2;",
 		.args = "IS",
 		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_COUNT_BANDS,
+		.sql = "SELECT COUNT(*) FROM shingle_bands;",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_ALL_SHINGLES,
+		.sql = "SELECT digest_id, number, value FROM shingles "
+				"ORDER BY digest_id;",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
 		.sql = "SELECT digest, value, time, flag FROM digests WHERE id=?1",
@@ -163,6 +219,15 @@ static struct rspamd_fuzzy_stmts {
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
+	{
+		/* Foreign keys are not enabled, so bands are deleted explicitly */
+		.idx = RSPAMD_FUZZY_BACKEND_DELETE_BANDS,
+		.sql = "DELETE FROM shingle_bands WHERE digest_id IN "
+				"(SELECT id FROM digests WHERE digest==?1);",
+		.args = "D",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_COUNT,
 		.sql = "SELECT COUNT(*) FROM digests;",
@@ -177,6 +242,41 @@ static struct rspamd_fuzzy_stmts {
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_EXPIRE_BANDS,
+		.sql = "DELETE FROM shingle_bands WHERE digest_id IN "
+				"(SELECT id FROM digests WHERE time < ?1);",
+		.args = "I",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_EXPIRE_STEP,
+		.sql = "DELETE FROM digests WHERE id IN "
+				"(SELECT id FROM digests WHERE time < ?1 "
+				"ORDER BY time, id LIMIT ?2);",
+		.args = "IS",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		/* Must select the same digests as the previous statement */
+		.idx = RSPAMD_FUZZY_BACKEND_EXPIRE_STEP_BANDS,
+		.sql = "DELETE FROM shingle_bands WHERE digest_id IN "
+				"(SELECT id FROM digests WHERE time < ?1 "
+				"ORDER BY time, id LIMIT ?2);",
+		.args = "IS",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_CLEANUP_BANDS,
+		.sql = "DELETE FROM shingle_bands WHERE digest_id NOT IN "
+				"(SELECT id FROM digests);",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
 	{
 		.idx = RSPAMD_FUZZY_BACKEND_VACUUM,
 		.sql = "VACUUM;",
@@ -324,6 +424,82 @@ rspamd_fuzzy_backend_run_sql (const gchar *sql, struct rspamd_fuzzy_backend *bk,
 	return TRUE;
 }
 
+static gint64
+rspamd_fuzzy_backend_band_hash (const struct rspamd_shingle *sgl, gint band)
+{
+	return (gint64)XXH64 (&sgl->hashes[band * FUZZY_BAND_ROWS],
+			sizeof (sgl->hashes[0]) * FUZZY_BAND_ROWS, band);
+}
+
+static void
+rspamd_fuzzy_backend_insert_bands (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_shingle *sgl, gint64 id)
+{
+	gint i;
+
+	for (i = 0; i < FUZZY_BANDS; i ++) {
+		rspamd_fuzzy_backend_run_stmt (bk,
+				RSPAMD_FUZZY_BACKEND_INSERT_BAND,
+				rspamd_fuzzy_backend_band_hash (sgl, i), i, id);
+	}
+}
+
+/*
+ * Fill bands index from the shingles of the digests stored before the index
+ * has been introduced
+ */
+static void
+rspamd_fuzzy_backend_build_bands (struct rspamd_fuzzy_backend *bk)
+{
+	struct rspamd_shingle sgl;
+	sqlite3_stmt *stmt;
+	gint64 id, cur_id = -1, nbands = 0;
+	guint32 seen = 0;
+	gint number, rc;
+
+	if (rspamd_fuzzy_backend_run_stmt (bk, RSPAMD_FUZZY_BACKEND_COUNT_BANDS)
+			!= SQLITE_OK) {
+		return;
+	}
+
+	if (sqlite3_column_int64 (
+			prepared_stmts[RSPAMD_FUZZY_BACKEND_COUNT_BANDS].stmt, 0) > 0) {
+		/* Already indexed */
+		return;
+	}
+
+	rc = rspamd_fuzzy_backend_run_stmt (bk, RSPAMD_FUZZY_BACKEND_ALL_SHINGLES);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_ALL_SHINGLES].stmt;
+
+	while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+		id = sqlite3_column_int64 (stmt, 0);
+		number = sqlite3_column_int (stmt, 1);
+
+		if (id != cur_id) {
+			cur_id = id;
+			seen = 0;
+		}
+
+		if (number >= 0 && number < RSPAMD_SHINGLE_SIZE) {
+			sgl.hashes[number] = sqlite3_column_int64 (stmt, 2);
+			seen |= 1U << number;
+
+			if (seen == G_MAXUINT32) {
+				/* All shingles of this digest are still in place */
+				rspamd_fuzzy_backend_insert_bands (bk, &sgl, id);
+				nbands ++;
+				seen = 0;
+			}
+		}
+
+		rc = sqlite3_step (stmt);
+	}
+
+	if (nbands > 0) {
+		msg_info ("indexed shingle bands for %L fuzzy hashes", nbands);
+	}
+}
+
 static struct rspamd_fuzzy_backend *
 rspamd_fuzzy_backend_create_db (const gchar *path, gboolean add_index,
 		GError **err)
@@ -390,11 +566,19 @@ rspamd_fuzzy_backend_open_db (const gchar *path, GError **err)
 
 	bk = g_slice_alloc (sizeof (*bk));
 	bk->path = g_strdup (path);
-	bk = g_slice_alloc (sizeof (*bk));
 	bk->db = sqlite;
 	bk->expired = 0;
+	bk->count = 0;
+
+	/* Upgrade database if needed */
+	if (!rspamd_fuzzy_backend_run_sql (create_bands_sql, bk, err)) {
+		rspamd_fuzzy_backend_close (bk);
+		return NULL;
+	}
 
-	/* Cleanup database */
+	/* Cleanup database, bands of digests deleted by older versions as well */
+	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_CLEANUP_BANDS, bk,
+			NULL);
 	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_VACUUM, bk, NULL);
 
 	if (rspamd_fuzzy_backend_run_stmt (bk, RSPAMD_FUZZY_BACKEND_COUNT)
@@ -405,6 +589,7 @@ rspamd_fuzzy_backend_open_db (const gchar *path, GError **err)
 
 	rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_START,
 				bk, NULL);
+	rspamd_fuzzy_backend_build_bands (bk);
 
 	return bk;
 }
@@ -541,12 +726,138 @@ rspamd_fuzzy_backend_open (const gchar *path, GError **err)
 	return res;
 }
 
+/*
+ * Delete digest with its bands in the current transaction
+ */
 static gint
-rspamd_fuzzy_backend_int64_cmp (const void *a, const void *b)
+rspamd_fuzzy_backend_delete_digest (struct rspamd_fuzzy_backend *backend,
+		const gchar *digest)
 {
-	gint64 ia = *(gint64 *)a, ib = *(gint64 *)b;
+	rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE_BANDS,
+			digest);
+
+	return rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
+			digest);
+}
+
+struct rspamd_fuzzy_band_candidate {
+	gint64 id;
+	gint matched;
+};
+
+static gint
+rspamd_fuzzy_backend_candidate_cmp (const void *a, const void *b)
+{
+	const struct rspamd_fuzzy_band_candidate *ca = a, *cb = b;
+
+	if (cb->matched != ca->matched) {
+		return (cb->matched - ca->matched);
+	}
+
+	/* Prefer the most recently added digests */
+	return (cb->id > ca->id) ? 1 : ((cb->id < ca->id) ? -1 : 0);
+}
+
+guint
+rspamd_fuzzy_backend_similar (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_shingle *sgl,
+		gint64 expire,
+		struct rspamd_fuzzy_backend_match *matches,
+		guint max_matches)
+{
+	struct rspamd_fuzzy_band_candidate *cand;
+	GHashTable *votes;
+	GHashTableIter it;
+	gpointer k, v;
+	sqlite3_stmt *stmt;
+	gint64 id, timestamp;
+	const guchar *digest;
+	guint ncand = 0, nmatches = 0, i;
+	gint band, rc, dlen;
+
+	/* Each band is a single index lookup and a vote for all digests found */
+	votes = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+
+	for (band = 0; band < FUZZY_BANDS; band ++) {
+		rc = rspamd_fuzzy_backend_run_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_CHECK_BAND,
+				rspamd_fuzzy_backend_band_hash (sgl, band), band);
+		stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_BAND].stmt;
+
+		while (rc == SQLITE_OK || rc == SQLITE_ROW) {
+			id = sqlite3_column_int64 (stmt, 0);
+
+			if (g_hash_table_lookup_extended (votes, &id, &k, &v)) {
+				g_hash_table_insert (votes, k,
+						GINT_TO_POINTER (GPOINTER_TO_INT (v) + 1));
+			}
+			else {
+				k = g_malloc (sizeof (gint64));
+				memcpy (k, &id, sizeof (id));
+				g_hash_table_insert (votes, k, GINT_TO_POINTER (1));
+			}
+
+			rc = sqlite3_step (stmt);
+		}
+
+		msg_debug ("looking for band %d: %d candidates", band,
+				g_hash_table_size (votes));
+	}
+
+	if (g_hash_table_size (votes) == 0) {
+		g_hash_table_unref (votes);
+		return 0;
+	}
+
+	cand = g_malloc (g_hash_table_size (votes) * sizeof (*cand));
+	g_hash_table_iter_init (&it, votes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		memcpy (&cand[ncand].id, k, sizeof (gint64));
+		cand[ncand].matched = GPOINTER_TO_INT (v);
+		ncand ++;
+	}
+
+	g_hash_table_unref (votes);
+	qsort (cand, ncand, sizeof (cand[0]), rspamd_fuzzy_backend_candidate_cmp);
+
+	for (i = 0; i < ncand && nmatches < max_matches; i ++) {
+		rc = rspamd_fuzzy_backend_run_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID, cand[i].id);
+
+		if (rc != SQLITE_OK) {
+			continue;
+		}
+
+		stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt;
+		digest = sqlite3_column_text (stmt, 0);
+		dlen = MIN (sqlite3_column_bytes (stmt, 0),
+				(gint)sizeof (matches[0].digest));
+		timestamp = sqlite3_column_int64 (stmt, 2);
 
-	return (ia - ib);
+		if (time (NULL) - timestamp > expire) {
+			/* Expire element */
+			msg_debug ("requested hash has been expired");
+			backend->expired ++;
+			rspamd_fuzzy_backend_delete_digest (backend, (const gchar *)digest);
+			continue;
+		}
+
+		memset (matches[nmatches].digest, 0, sizeof (matches[0].digest));
+		memcpy (matches[nmatches].digest, digest, dlen);
+		matches[nmatches].value = sqlite3_column_int64 (stmt, 1);
+		matches[nmatches].flag = sqlite3_column_int (stmt, 3);
+		/* Probability of match is the fraction of bands voted for a digest */
+		matches[nmatches].prob = (gdouble)cand[i].matched /
+				(gdouble)FUZZY_BANDS;
+		msg_debug ("found fuzzy hash with probability %.2f",
+				matches[nmatches].prob);
+		nmatches ++;
+	}
+
+	g_free (cand);
+
+	return nmatches;
 }
 
 struct rspamd_fuzzy_reply
@@ -555,11 +866,9 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 {
 	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_backend_match match;
 	int rc;
 	gint64 timestamp;
-	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id, cur_id,
-		cur_cnt, max_cnt;
-	const char *digest;
 
 	/* Try direct match first of all */
 	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK,
@@ -571,8 +880,7 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 		if (time (NULL) - timestamp > expire) {
 			/* Expire element */
 			msg_debug ("requested hash has been expired");
-			rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
-				cmd->digest);
+			rspamd_fuzzy_backend_delete_digest (backend, cmd->digest);
 			backend->expired ++;
 		}
 		else {
@@ -586,76 +894,12 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *backend,
 	else if (cmd->shingles_count > 0) {
 		/* Fuzzy match */
 		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			rc = rspamd_fuzzy_backend_run_stmt (backend,
-					RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-					shcmd->sgl.hashes[i], i);
-			if (rc == SQLITE_OK) {
-				shingle_values[i] = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE].stmt,
-						0);
-			}
-			else {
-				shingle_values[i] = -1;
-			}
-			msg_debug ("looking for shingle %d -> %L: %d", i, shcmd->sgl.hashes[i], rc);
-		}
-		qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
-				rspamd_fuzzy_backend_int64_cmp);
-		sel_id = -1;
-		cur_id = -1;
-		cur_cnt = 0;
-		max_cnt = 0;
-
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			if (shingle_values[i] == -1) {
-				continue;
-			}
 
-			/* We have some value here, so we need to check it */
-			if (shingle_values[i] == cur_id) {
-				cur_cnt ++;
-			}
-			else {
-				cur_id = shingle_values[i];
-				if (cur_cnt >= max_cnt) {
-					max_cnt = cur_cnt;
-					sel_id = cur_id;
-				}
-				cur_cnt = 0;
-			}
-		}
-
-		if (cur_cnt > max_cnt) {
-			max_cnt = cur_cnt;
-		}
-
-		if (sel_id != -1) {
-			/* We have some id selected here */
-			rep.prob = (gdouble)max_cnt / (gdouble)RSPAMD_SHINGLE_SIZE;
-			msg_debug ("found fuzzy hash with probability %.2f", rep.prob);
-			rc = rspamd_fuzzy_backend_run_stmt (backend,
-					RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID, sel_id);
-			if (rc == SQLITE_OK) {
-				digest = sqlite3_column_text (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 0);
-				timestamp = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 2);
-				if (time (NULL) - timestamp > expire) {
-					/* Expire element */
-					msg_debug ("requested hash has been expired");
-					backend->expired ++;
-					rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
-							digest);
-					rep.prob = 0.0;
-				}
-				else {
-					rep.value = sqlite3_column_int64 (
-							prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 1);
-					rep.flag = sqlite3_column_int (
-							prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt, 3);
-				}
-			}
+		if (rspamd_fuzzy_backend_similar (backend, &shcmd->sgl, expire,
+				&match, 1) > 0) {
+			rep.value = match.value;
+			rep.flag = match.flag;
+			rep.prob = match.prob;
 		}
 	}
 
@@ -695,6 +939,8 @@ rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 							shcmd->sgl.hashes[i], i, id);
 					msg_debug ("add shingle %d -> %L: %d", i, shcmd->sgl.hashes[i], id);
 				}
+
+				rspamd_fuzzy_backend_insert_bands (backend, &shcmd->sgl, id);
 			}
 		}
 	}
@@ -709,8 +955,7 @@ rspamd_fuzzy_backend_del (struct rspamd_fuzzy_backend *backend,
 {
 	int rc;
 
-	rc = rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_DELETE,
-			cmd->digest);
+	rc = rspamd_fuzzy_backend_delete_digest (backend, cmd->digest);
 
 	backend->count -= sqlite3_changes (backend->db);
 
@@ -721,12 +966,19 @@ gboolean
 rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend, gint64 expire)
 {
 	gboolean ret = FALSE;
+	gint64 now;
 
 	/* Perform expire */
 	if (expire > 0) {
-		rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_EXPIRE,
-				backend, NULL);
-		backend->expired += sqlite3_changes (backend->db);
+		now = time (NULL);
+		rspamd_fuzzy_backend_run_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_EXPIRE_BANDS, now - expire);
+
+		if (rspamd_fuzzy_backend_run_stmt (backend, RSPAMD_FUZZY_BACKEND_EXPIRE,
+				now - expire) == SQLITE_OK) {
+			backend->expired += sqlite3_changes (backend->db);
+			backend->count -= sqlite3_changes (backend->db);
+		}
 	}
 	ret = rspamd_fuzzy_backend_run_simple (RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
 			backend, NULL);
@@ -739,6 +991,41 @@ rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend, gint64 expire)
 	return ret;
 }
 
+gsize
+rspamd_fuzzy_backend_expire_step (struct rspamd_fuzzy_backend *backend,
+		gint64 expire, guint max_rows)
+{
+	gsize expired = 0;
+	gint64 now;
+
+	/*
+	 * Time index is used as a cursor here: expired rows are removed from it,
+	 * so each step starts from the oldest digests still stored
+	 */
+	if (expire > 0 && max_rows > 0) {
+		now = time (NULL);
+		rspamd_fuzzy_backend_run_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_EXPIRE_STEP_BANDS,
+				now - expire, (gint)max_rows);
+
+		if (rspamd_fuzzy_backend_run_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_EXPIRE_STEP,
+				now - expire, (gint)max_rows) == SQLITE_OK) {
+			expired = sqlite3_changes (backend->db);
+			backend->expired += expired;
+			backend->count -= expired;
+		}
+
+		/* Commit each step, so deleted rows are not kept in a transaction */
+		if (expired > 0 && rspamd_fuzzy_backend_run_simple (
+				RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT, backend, NULL)) {
+			rspamd_fuzzy_backend_run_simple (
+					RSPAMD_FUZZY_BACKEND_TRANSACTION_START, backend, NULL);
+		}
+	}
+
+	return expired;
+}
 
 void
 rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend)
@@ -29,6 +29,13 @@
 
 struct rspamd_fuzzy_backend;
 
+struct rspamd_fuzzy_backend_match {
+	gchar digest[64];
+	gint64 value;
+	guint32 flag;
+	gdouble prob;
+};
+
 /**
  * Open fuzzy backend
  * @param path file to open (legacy file will be converted automatically)
@@ -49,6 +56,21 @@ struct rspamd_fuzzy_reply rspamd_fuzzy_backend_check (
 		const struct rspamd_fuzzy_cmd *cmd,
 		gint64 expire);
 
+/**
+ * Find digests similar to the specified shingles using LSH bands index
+ * @param backend
+ * @param sgl shingles to look for
+ * @param expire expire time for digests
+ * @param matches output array of matches sorted by similarity
+ * @param max_matches size of output array
+ * @return number of matches found
+ */
+guint rspamd_fuzzy_backend_similar (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_shingle *sgl,
+		gint64 expire,
+		struct rspamd_fuzzy_backend_match *matches,
+		guint max_matches);
+
 /**
  * Add digest to the database
  * @param backend
@@ -77,6 +99,18 @@ gboolean rspamd_fuzzy_backend_del (
 gboolean rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend,
 		gint64 expire);
 
+/**
+ * Expire a bounded number of old digests, should be called repeatedly
+ * until it returns a value less than `max_rows`. Deletion is committed
+ * before returning.
+ * @param backend
+ * @param expire expire time for digests
+ * @param max_rows maximum number of digests to delete (nothing is deleted if 0)
+ * @return number of digests expired
+ */
+gsize rspamd_fuzzy_backend_expire_step (struct rspamd_fuzzy_backend *backend,
+		gint64 expire, guint max_rows);
+
 /**
  * Close storage
  * @param backend
@@ -29,7 +29,7 @@
 #include "html.h"
 #include "url.h"
 
-static sig_atomic_t tags_sorted = 0;
+static gsize html_tables_ready = 0;
 
 static struct html_tag tag_defs[] = {
 	/* W3C defined elements */
@@ -157,7 +157,6 @@ static struct html_tag tag_defs[] = {
 	{Tag_WBR, "wbr", (CM_INLINE | CM_EMPTY)},
 };
 
-static sig_atomic_t entities_sorted = 0;
 struct _entity;
 typedef struct _entity entity;
 
@@ -439,145 +438,312 @@ static entity entities_defs[] = {
 	{"euro", 8364, "E"},
 };
 
-static entity entities_defs_num[ (G_N_ELEMENTS (entities_defs)) ];
+/*
+ * Tags and entities are looked up by perfect hashes that are built when
+ * the first html part is processed: we select a seed for which all keys
+ * occupy different slots, so a lookup requires a single comparison
+ */
+#define HTML_PHASH_MAX_SEEDS 4096
+
+struct html_phash {
+	guint32 seed;
+	guint32 mask;
+	gint16 *slots;
+};
 
-static gint
-tag_cmp (const void *m1, const void *m2)
+static struct html_phash tags_hash;
+static struct html_phash entities_hash;
+static struct html_phash entities_num_hash;
+
+static inline guint32
+html_phash_func (const gchar *key, gsize len, guint32 seed, gboolean icase)
 {
-	const struct html_tag *p1 = m1;
-	const struct html_tag *p2 = m2;
+	guint32 h = 2166136261U ^ seed;
+	gsize i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i ++) {
+		h ^= icase ? (guchar)g_ascii_tolower (key[i]) : (guchar)key[i];
+		h *= 16777619U;
+	}
+
+	h ^= h >> 15;
+	h *= 0x2c1b3c6dU;
+	h ^= h >> 12;
 
-	return g_ascii_strcasecmp (p1->name, p2->name);
+	return h;
 }
 
-static gint
-entity_cmp (const void *m1, const void *m2)
+static void
+html_phash_build (struct html_phash *ph, const gchar **keys, const gsize *lens,
+		guint nkeys, gboolean icase)
 {
-	const entity *p1 = m1;
-	const entity *p2 = m2;
+	guint32 size, seed, slot;
+	guint i;
+	gint16 *slots;
+	gboolean found = FALSE;
+
+	for (size = 2; size < nkeys * 2; size <<= 1);
+
+	slots = g_malloc (size * sizeof (gint16));
+
+	while (!found) {
+		for (seed = 1; seed < HTML_PHASH_MAX_SEEDS; seed ++) {
+			memset (slots, 0xff, size * sizeof (gint16));
 
-	return g_ascii_strcasecmp (p1->name, p2->name);
+			for (i = 0; i < nkeys; i ++) {
+				slot = html_phash_func (keys[i], lens[i], seed, icase) & (size - 1);
+
+				if (slots[slot] == -1) {
+					slots[slot] = i;
+				}
+				else if (lens[slots[slot]] != lens[i] ||
+						(icase ?
+						g_ascii_strncasecmp (keys[slots[slot]], keys[i], lens[i]) :
+						memcmp (keys[slots[slot]], keys[i], lens[i])) != 0) {
+					/* Collision of different keys */
+					break;
+				}
+				/* Duplicate keys are resolved to the first one */
+			}
+
+			if (i == nkeys) {
+				found = TRUE;
+				break;
+			}
+		}
+
+		if (!found) {
+			size <<= 1;
+			slots = g_realloc (slots, size * sizeof (gint16));
+		}
+	}
+
+	ph->seed = seed;
+	ph->mask = size - 1;
+	ph->slots = slots;
 }
 
-static gint
-entity_cmp_num (const void *m1, const void *m2)
+static inline gint
+html_phash_lookup (const struct html_phash *ph, const gchar *key, gsize len,
+		gboolean icase)
 {
-	const entity *p1 = m1;
-	const entity *p2 = m2;
+	return ph->slots[html_phash_func (key, len, ph->seed, icase) & ph->mask];
+}
 
-	return p1->code - p2->code;
+static void
+html_init_tables (void)
+{
+	const gchar **keys;
+	gsize *lens;
+	guint i, n;
+
+	/* Tables are built once, as html can be parsed from several threads */
+	if (g_once_init_enter (&html_tables_ready)) {
+		n = MAX (G_N_ELEMENTS (tag_defs), G_N_ELEMENTS (entities_defs));
+		keys = g_malloc (n * sizeof (*keys));
+		lens = g_malloc (n * sizeof (*lens));
+
+		for (i = 0; i < G_N_ELEMENTS (tag_defs); i ++) {
+			keys[i] = tag_defs[i].name;
+			lens[i] = strlen (tag_defs[i].name);
+		}
+
+		html_phash_build (&tags_hash, keys, lens, G_N_ELEMENTS (tag_defs), TRUE);
+
+		for (i = 0; i < G_N_ELEMENTS (entities_defs); i ++) {
+			keys[i] = entities_defs[i].name;
+			lens[i] = strlen (entities_defs[i].name);
+		}
+
+		html_phash_build (&entities_hash, keys, lens,
+				G_N_ELEMENTS (entities_defs), FALSE);
+
+		for (i = 0; i < G_N_ELEMENTS (entities_defs); i ++) {
+			keys[i] = (const gchar *)&entities_defs[i].code;
+			lens[i] = sizeof (entities_defs[i].code);
+		}
+
+		html_phash_build (&entities_num_hash, keys, lens,
+				G_N_ELEMENTS (entities_defs), FALSE);
+
+		g_free (keys);
+		g_free (lens);
+		g_once_init_leave (&html_tables_ready, 1);
+	}
 }
 
-static GNode *
-construct_html_node (rspamd_mempool_t * pool, gchar *text, gsize tag_len)
+static struct html_tag *
+html_find_tag (const gchar *name, gsize len)
 {
-	struct html_node *html;
-	GNode *n = NULL;
-	struct html_tag key, *found;
-	gchar t;
+	struct html_tag *tag;
+	gint idx;
 
-	if (text == NULL || *text == '\0') {
+	if (len == 0) {
 		return NULL;
 	}
 
-	html = rspamd_mempool_alloc0 (pool, sizeof (struct html_node));
+	idx = html_phash_lookup (&tags_hash, name, len, TRUE);
 
-	/* Check whether this tag is fully closed */
-	if (*(text + tag_len - 1) == '/') {
-		html->flags |= FL_CLOSED;
-	}
+	if (idx != -1) {
+		tag = &tag_defs[idx];
 
-	/* Check xml tag */
-	if (*text == '?' &&
-		g_ascii_strncasecmp (text + 1, "xml", sizeof ("xml") - 1) == 0) {
-		html->flags |= FL_XML;
-		html->tag = NULL;
-	}
-	else if (*text == '!') {
-		html->flags |= FL_SGML;
-		html->tag = NULL;
-	}
-	else {
-		if (*text == '/') {
-			html->flags |= FL_CLOSING;
-			text++;
+		if (g_ascii_strncasecmp (tag->name, name, len) == 0 &&
+				tag->name[len] == '\0') {
+			return tag;
 		}
+	}
 
-		/* Find end of tag name */
-		key.name = text;
-		while (*text && g_ascii_isalnum (*(++text))) ;
+	return NULL;
+}
 
-		t = *text;
-		*text = '\0';
+static entity *
+html_find_entity (const gchar *name, gsize len)
+{
+	entity *e;
+	gchar lc[16];
+	gint idx;
+	gsize i;
 
-		/* Match tag id by tag name */
-		if ((found =
-			bsearch (&key, tag_defs, G_N_ELEMENTS (tag_defs),
-			sizeof (struct html_tag), tag_cmp)) != NULL) {
-			*text = t;
-			html->tag = found;
-		}
-		else {
-			*text = t;
-			return NULL;
+	idx = html_phash_lookup (&entities_hash, name, len, FALSE);
+
+	if (idx != -1) {
+		e = &entities_defs[idx];
+
+		if (memcmp (e->name, name, len) == 0 && e->name[len] == '\0') {
+			return e;
 		}
 	}
 
-	n = g_node_new (html);
+	/* Entities are case sensitive but we also accept them in lowercase */
+	if (len < sizeof (lc)) {
+		for (i = 0; i < len; i ++) {
+			lc[i] = g_ascii_tolower (name[i]);
+		}
 
-	return n;
+		if (memcmp (lc, name, len) != 0) {
+			return html_find_entity (lc, len);
+		}
+	}
+
+	return NULL;
 }
 
-static gboolean
-check_balance (GNode * node, GNode ** cur_level)
+static entity *
+html_find_entity_num (guint code)
 {
-	struct html_node *arg = node->data, *tmp;
-	GNode *cur;
-
-	if (arg->flags & FL_CLOSING) {
-		/* First of all check whether this tag is closing tag for parent node */
-		cur = node->parent;
-		while (cur && cur->data) {
-			tmp = cur->data;
-			if ((tmp->tag &&
-				arg->tag) && tmp->tag->id == arg->tag->id &&
-				(tmp->flags & FL_CLOSED) == 0) {
-				tmp->flags |= FL_CLOSED;
-				/* Destroy current node as we find corresponding parent node */
-				g_node_destroy (node);
-				/* Change level */
-				*cur_level = cur->parent;
-				return TRUE;
-			}
-			cur = cur->parent;
+	entity *e;
+	gint idx;
+
+	idx = html_phash_lookup (&entities_num_hash, (const gchar *)&code,
+			sizeof (code), FALSE);
+
+	if (idx != -1) {
+		e = &entities_defs[idx];
+
+		if (e->code == code) {
+			return e;
 		}
 	}
-	else {
-		return TRUE;
-	}
 
-	return FALSE;
+	return NULL;
 }
 
 struct html_tag *
 get_tag_by_name (const gchar *name)
 {
-	struct html_tag key;
+	html_init_tables ();
+
+	return html_find_tag (name, strlen (name));
+}
+
+/*
+ * Parse an entity starting at `p` ('&' character). Returns the length of
+ * entity text or 0 if it is not an entity, sets replacement to NULL for the
+ * entities that have no replacement. `chbuf` is used to store replacements
+ * of numeric ascii entities
+ */
+static gsize
+html_parse_entity (const gchar *p, const gchar *end, const gchar **repl,
+		gchar chbuf[2])
+{
+	const gchar *c = p + 1, *name;
+	entity *found;
+	guint code = 0, base = 10, digit;
 
-	key.name = name;
+	*repl = NULL;
+
+	if (c < end && *c == '#') {
+		c ++;
+
+		if (c < end && (*c == 'x' || *c == 'X')) {
+			base = 16;
+			c ++;
+		}
+
+		name = c;
+
+		while (c < end && c - name < 8) {
+			if (g_ascii_isdigit (*c)) {
+				digit = *c - '0';
+			}
+			else if (base == 16 && g_ascii_isxdigit (*c)) {
+				digit = g_ascii_tolower (*c) - 'a' + 10;
+			}
+			else {
+				break;
+			}
+
+			code = code * base + digit;
+			c ++;
+		}
+
+		if (c == name || c == end || *c != ';') {
+			return 0;
+		}
+
+		if ((found = html_find_entity_num (code)) != NULL) {
+			*repl = found->replacement;
+		}
+		else if (code > 0 && code < 128) {
+			/* Replace ascii characters with themselves */
+			chbuf[0] = code;
+			chbuf[1] = '\0';
+			*repl = chbuf;
+		}
+	}
+	else {
+		name = c;
+
+		while (c < end && c - name < 10 && g_ascii_isalnum (*c)) {
+			c ++;
+		}
+
+		if (c == name || c == end || *c != ';') {
+			return 0;
+		}
 
-	return bsearch (&key, tag_defs, G_N_ELEMENTS (tag_defs),
-			   sizeof (struct html_tag), tag_cmp);
+		if ((found = html_find_entity (name, c - name)) == NULL) {
+			return 0;
+		}
+
+		*repl = found->replacement;
+	}
+
+	return c - p + 1;
 }
 
 /* Decode HTML entitles in text */
 void
 decode_entitles (gchar *s, guint * len)
 {
-	guint l, rep_len;
-	gchar *t = s, *h = s, *e = s, *end_ptr;
-	gint state = 0, val, base;
-	entity *found, key;
+	gchar *t = s, *h = s, *end;
+	const gchar *repl;
+	gchar chbuf[2];
+	gsize elen, rlen;
+	guint l;
+
+	html_init_tables ();
 
 	if (len == NULL || *len == 0) {
 		l = strlen (s);
@@ -586,82 +752,24 @@ decode_entitles (gchar *s, guint * len)
 		l = *len;
 	}
 
-	while (h - s < (gint)l) {
-		switch (state) {
-		/* Out of entitle */
-		case 0:
-			if (*h == '&') {
-				state = 1;
-				e = h;
-				h++;
+	end = s + l;
+
+	while (h < end) {
+		if (*h == '&' && (elen = html_parse_entity (h, end, &repl, chbuf)) > 0) {
+			rlen = repl ? strlen (repl) : 0;
+
+			/* Text is decoded in place, so we cannot make it longer */
+			if (rlen <= (gsize)(h + elen - t)) {
+				memcpy (t, repl, rlen);
+				t += rlen;
+				h += elen;
 				continue;
 			}
-			else {
-				*t = *h;
-				h++;
-				t++;
-			}
-			break;
-		case 1:
-			if (*h == ';') {
-				/* Determine base */
-				/* First find in entities table */
-
-				key.name = e + 1;
-				*h = '\0';
-				if (*(e + 1) != '#' &&
-					(found =
-					bsearch (&key, entities_defs, G_N_ELEMENTS (entities_defs),
-					sizeof (entity), entity_cmp)) != NULL) {
-					if (found->replacement) {
-						rep_len = strlen (found->replacement);
-						memcpy (t, found->replacement, rep_len);
-						t += rep_len;
-					}
-				}
-				else {
-					if (*(e + 2) == 'x' || *(e + 2) == 'X') {
-						base = 16;
-					}
-					else if (*(e + 2) == 'o' || *(e + 2) == 'O') {
-						base = 8;
-					}
-					else {
-						base = 10;
-					}
-					if (base == 10) {
-						val = strtoul ((e + 2), &end_ptr, base);
-					}
-					else {
-						val = strtoul ((e + 3), &end_ptr, base);
-					}
-					if (end_ptr != NULL && *end_ptr != '\0') {
-						/* Skip undecoded */
-						t = h;
-					}
-					else {
-						/* Search for a replacement */
-						key.code = val;
-						found =
-							bsearch (&key, entities_defs_num, G_N_ELEMENTS (
-									entities_defs), sizeof (entity),
-								entity_cmp_num);
-						if (found) {
-							if (found->replacement) {
-								rep_len = strlen (found->replacement);
-								memcpy (t, found->replacement, rep_len);
-								t += rep_len;
-							}
-						}
-					}
-				}
-				*h = ';';
-				state = 0;
-			}
-			h++;
-			break;
 		}
+
+		*t++ = *h++;
 	}
+
 	*t = '\0';
 
 	if (len != NULL) {
@@ -801,6 +909,13 @@ parse_tag_url (struct rspamd_task *task,
 	struct rspamd_url *url;
 	gboolean got_single_quote = FALSE, got_double_quote = FALSE;
 
+	/* Urls of tags are counted in the same limit as urls of text */
+	if (task->cfg->mime_max_urls != 0 &&
+			task->mime_budget.urls >= task->cfg->mime_max_urls) {
+		rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_URLS);
+		return;
+	}
+
 	/* For A tags search for href= and for IMG tags search for src= */
 	if (id == Tag_A) {
 		c = rspamd_strncasestr (tag_text, "href=", tag_len);
@@ -883,6 +998,7 @@ parse_tag_url (struct rspamd_task *task,
 		rc = rspamd_url_parse (url, url_text, len, task->task_pool);
 
 		if (rc != URI_ERRNO_EMPTY && url->hostlen != 0) {
+			task->mime_budget.urls ++;
 			/*
 			 * Check for phishing
 			 */
@@ -906,99 +1022,304 @@ parse_tag_url (struct rspamd_task *task,
 	}
 }
 
+
+static void
+html_set_tag_seen (struct html_content *hc, tag_id_t id)
+{
+	hc->tags_seen[id / 8] |= 1 << (id % 8);
+}
+
 gboolean
-add_html_node (struct rspamd_task *task,
-	rspamd_mempool_t * pool,
+rspamd_html_tag_seen (struct html_content *hc, tag_id_t id)
+{
+	g_assert (id < N_TAGS);
+
+	return (hc->tags_seen[id / 8] & (1 << (id % 8))) != 0;
+}
+
+/*
+ * Process a single tag: `text` points to the content between angle brackets.
+ * Returns FALSE if the text after this tag should be skipped
+ */
+static gboolean
+html_process_tag (struct rspamd_task *task,
 	struct mime_text_part *part,
-	gchar *tag_text,
-	gsize tag_len,
-	gsize remain,
-	GNode ** cur_level)
+	struct html_content *hc,
+	GArray *open_tags,
+	const gchar *text,
+	gsize len,
+	gsize remain)
 {
-	GNode *new;
-	struct html_node *data;
-
-	if (!tags_sorted) {
-		qsort (tag_defs, G_N_ELEMENTS (
-				tag_defs), sizeof (struct html_tag), tag_cmp);
-		tags_sorted = 1;
-	}
-	if (!entities_sorted) {
-		qsort (entities_defs, G_N_ELEMENTS (
-				entities_defs), sizeof (entity), entity_cmp);
-		memcpy (entities_defs_num, entities_defs, sizeof (entities_defs));
-		qsort (entities_defs_num, G_N_ELEMENTS (
-				entities_defs), sizeof (entity), entity_cmp_num);
-		entities_sorted = 1;
-	}
-
-	/* First call of this function */
-	if (part->html_nodes == NULL) {
-		/* Insert root node */
-		new = g_node_new (NULL);
-		*cur_level = new;
-		part->html_nodes = new;
-		rspamd_mempool_add_destructor (pool,
-			(rspamd_mempool_destruct_t) g_node_destroy,
-			part->html_nodes);
-		/* Call once again with root node */
-		return add_html_node (task,
-				   pool,
-				   part,
-				   tag_text,
-				   tag_len,
-				   remain,
-				   cur_level);
+	struct html_tag *tag;
+	const gchar *name = text, *c;
+	gboolean closing = FALSE;
+	guint16 id, *st;
+	gint i;
+
+	hc->ntags ++;
+
+	if (task->cfg->mime_max_html_tags != 0) {
+		if (task->mime_budget.html_tags >= task->cfg->mime_max_html_tags) {
+			/* Skip the rest of tags keeping their content as text */
+			rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_HTML_TAGS);
+			return TRUE;
+		}
+
+		task->mime_budget.html_tags ++;
 	}
-	else {
-		new = construct_html_node (pool, tag_text, tag_len);
-		if (new == NULL) {
-			debug_task ("cannot construct HTML node for text '%*s'",
-				tag_len,
-				tag_text);
-			return FALSE;
+
+	if (len == 0) {
+		return FALSE;
+	}
+
+	if (*name == '!' || *name == '?') {
+		/* SGML and XML tags are ignored */
+		return TRUE;
+	}
+
+	if (*name == '/') {
+		closing = TRUE;
+		name ++;
+	}
+
+	for (c = name; c < text + len && g_ascii_isalnum (*c); c ++);
+
+	tag = html_find_tag (name, c - name);
+
+	if (tag == NULL) {
+		debug_task ("unknown HTML tag '%*s'", (gint)len, text);
+		return FALSE;
+	}
+
+	id = tag->id;
+	html_set_tag_seen (hc, tag->id);
+
+	if (closing) {
+		/* Find the nearest opened tag with the same id and close all above */
+		st = (guint16 *)open_tags->data;
+
+		for (i = (gint)open_tags->len - 1; i >= 0; i --) {
+			if (st[i] == id) {
+				g_array_set_size (open_tags, i);
+				break;
+			}
 		}
-		data = new->data;
-		if (data->tag &&
-			(data->tag->id == Tag_A ||
-			data->tag->id == Tag_IMG) && ((data->flags & FL_CLOSING) == 0)) {
-			parse_tag_url (task, part, data->tag->id, tag_text, tag_len,
-				remain);
+
+		if (i < 0) {
+			debug_task (
+				"mark part as unbalanced as it has not pairable closing tags");
+			part->is_balanced = FALSE;
 		}
 
-		if (data->flags & FL_CLOSING) {
-			if (!*cur_level) {
-				debug_task ("bad parent node");
-				return FALSE;
+		return TRUE;
+	}
+
+	if (id == Tag_A || id == Tag_IMG) {
+		parse_tag_url (task, part, id, (gchar *)text, len, remain);
+	}
+
+	/* Fully closed tags, e.g. <br/>, and elements with no content */
+	if (text[len - 1] != '/' && (tag->flags & CM_EMPTY) == 0) {
+		g_array_append_val (open_tags, id);
+	}
+
+	/* Skip content of some tags */
+	if (id == Tag_STYLE || id == Tag_SCRIPT || id == Tag_OBJECT ||
+			id == Tag_TITLE) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static inline guchar *
+html_reserve (GByteArray *buf, guchar *pos, gsize len)
+{
+	gsize off = pos - buf->data;
+
+	if (off + len > buf->len) {
+		g_byte_array_set_size (buf, MAX (buf->len * 2, off + len));
+	}
+
+	return buf->data + off;
+}
+
+GByteArray *
+rspamd_html_process_part (struct rspamd_task *task,
+	rspamd_mempool_t *pool,
+	struct mime_text_part *part,
+	GByteArray *in)
+{
+	const gchar *p, *end, *c, *tag_start = NULL, *repl;
+	gchar in_q = 0, prev = 0, chbuf[2];
+	guchar *rp;
+	gsize elen, rlen;
+	GByteArray *dest;
+	GArray *open_tags;
+	struct html_content *hc;
+	gboolean erase = FALSE;
+	enum {
+		html_text = 0,
+		html_tag,
+		html_comment,
+		html_xml
+	} state = html_text;
+
+	html_init_tables ();
+
+	hc = rspamd_mempool_alloc0 (pool, sizeof (*hc));
+	part->html = hc;
+	part->is_balanced = TRUE;
+
+	/* Decoded text is normally shorter than html */
+	dest = g_byte_array_sized_new (in->len + 1);
+	g_byte_array_set_size (dest, in->len + 1);
+	open_tags = g_array_sized_new (FALSE, FALSE, sizeof (guint16), 32);
+
+	p = (const gchar *)in->data;
+	end = p + in->len;
+	rp = dest->data;
+
+	while (p < end) {
+		switch (state) {
+		case html_text:
+			/* Copy text up to the next special character */
+			for (c = p; c < end && *c != '<' && *c != '&' && *c != '\0'; c ++);
+
+			if (!erase && c > p) {
+				rp = html_reserve (dest, rp, c - p);
+				memcpy (rp, p, c - p);
+				rp += c - p;
 			}
-			g_node_append (*cur_level, new);
-			if (!check_balance (new, cur_level)) {
-				debug_task (
-					"mark part as unbalanced as it has not pairable closing tags");
-				part->is_balanced = FALSE;
+
+			p = c;
+
+			if (p == end) {
+				break;
 			}
-		}
-		else if ((data->flags & (FL_XML|FL_SGML)) == 0) {
 
-			g_node_append (*cur_level, new);
-			if ((data->flags & FL_CLOSED) == 0) {
-				*cur_level = new;
+			if (*p == '\0') {
+				p ++;
+			}
+			else if (*p == '&') {
+				elen = html_parse_entity (p, end, &repl, chbuf);
+
+				if (elen == 0) {
+					elen = 1;
+					repl = "&";
+				}
+
+				if (!erase && repl != NULL) {
+					rlen = strlen (repl);
+					rp = html_reserve (dest, rp, rlen);
+					memcpy (rp, repl, rlen);
+					rp += rlen;
+				}
+
+				p += elen;
+			}
+			else if (p + 1 == end || g_ascii_isspace (p[1])) {
+				/* Not a tag */
+				if (!erase) {
+					rp = html_reserve (dest, rp, 1);
+					*rp++ = '<';
+				}
+
+				p ++;
 			}
-			/* Skip some tags */
-			if (data->tag && (data->tag->id == Tag_STYLE ||
-				data->tag->id == Tag_SCRIPT ||
-				data->tag->id == Tag_OBJECT ||
-				data->tag->id == Tag_TITLE)) {
-				return FALSE;
+			else if (end - p >= 4 && memcmp (p, "<!--", 4) == 0) {
+				state = html_comment;
+				p += 4;
 			}
-		}
-		else {
-			/* Destroy ignored nodes */
-			g_node_destroy (new);
+			else if (p[1] == '?') {
+				state = html_xml;
+				p += 2;
+			}
+			else {
+				state = html_tag;
+				tag_start = p + 1;
+				in_q = 0;
+				prev = 0;
+				p ++;
+			}
+			break;
+
+		case html_tag:
+			/* Quotes are taken into account for values of attributes only */
+			while (p < end) {
+				if (in_q) {
+					if (*p == in_q) {
+						in_q = 0;
+					}
+				}
+				else if ((*p == '"' || *p == '\'') && prev == '=') {
+					in_q = *p;
+				}
+				else if (*p == '>' || *p == '<') {
+					break;
+				}
+
+				if (!g_ascii_isspace (*p)) {
+					prev = *p;
+				}
+
+				p ++;
+			}
+
+			if (p < end) {
+				erase = !html_process_tag (task, part, hc, open_tags,
+						tag_start, p - tag_start, end - tag_start);
+
+				if (*p == '<') {
+					/* Opening bracket without closing one starts a new tag */
+					tag_start = p + 1;
+					prev = 0;
+				}
+				else {
+					state = html_text;
+				}
+
+				p ++;
+			}
+			break;
+
+		case html_comment:
+			c = rspamd_strncasestr (p, "-->", end - p);
+
+			if (c == NULL) {
+				p = end;
+			}
+			else {
+				p = c + 3;
+				state = html_text;
+			}
+			break;
+
+		case html_xml:
+			c = rspamd_strncasestr (p, "?>", end - p);
+
+			if (c == NULL) {
+				p = end;
+			}
+			else {
+				p = c + 2;
+				state = html_text;
+			}
+			break;
 		}
 	}
 
-	return TRUE;
+	/* Check tag balancing */
+	if (open_tags->len > 0) {
+		part->is_balanced = FALSE;
+	}
+
+	g_array_free (open_tags, TRUE);
+	rp = html_reserve (dest, rp, 1);
+	*rp = '\0';
+	g_byte_array_set_size (dest, rp - dest->data);
+
+	return dest;
 }
 
 /*
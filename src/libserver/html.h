@@ -201,27 +201,34 @@ struct html_tag {
 	gint flags;
 };
 
-struct html_node {
-	struct html_tag *tag;
-	gint flags;
+/*
+ * Structural summary of a html part
+ */
+struct html_content {
+	guchar tags_seen[N_TAGS / 8 + 1];   /**< bitset of tags found in a part	*/
+	guint ntags;                        /**< total number of tags				*/
 };
 
 /* Forwarded declaration */
 struct rspamd_task;
+struct mime_text_part;
 
 /*
- * Add a single node to the tags tree
+ * Parse html part in a single pass: returns text content with entities
+ * decoded, extracts urls from tags and fills part->html and part->is_balanced
  */
-gboolean add_html_node (struct rspamd_task *task,
+GByteArray * rspamd_html_process_part (struct rspamd_task *task,
 	rspamd_mempool_t *pool,
 	struct mime_text_part *part,
-	gchar *tag_text,
-	gsize tag_len,
-	gsize remain,
-	GNode **cur_level);
+	GByteArray *in);
+
+/*
+ * Returns TRUE if a tag with the specified id has been found in html content
+ */
+gboolean rspamd_html_tag_seen (struct html_content *hc, tag_id_t id);
 
 /*
- * Get tag structure by its name (binary search is used)
+ * Get tag structure by its name (perfect hash is used)
  */
 struct html_tag * get_tag_by_name (const gchar *name);
 
@@ -36,6 +36,11 @@
  * described below
  */
 #define MSG_CMD_CHECK "check"
+/*
+ * Check several messages passed in a single request, each message is prefixed
+ * by its length and CRLF, return an array of results
+ */
+#define MSG_CMD_CHECK_V "checkv"
 /*
  * Check if message is spam or not, and return score plus list
  * of symbols hit
@@ -96,6 +101,7 @@
 #define HOSTNAME_HEADER "Hostname"
 #define DELIVER_TO_HEADER "Deliver-To"
 #define NO_LOG_HEADER "Log"
+#define FILE_HEADER "File"
 
 static GList *custom_commands = NULL;
 
@@ -153,10 +159,13 @@ rspamd_protocol_handle_url (struct rspamd_task *task,
 	switch (*p) {
 	case 'c':
 	case 'C':
-		/* check */
+		/* check, checkv */
 		if (g_ascii_strcasecmp (p + 1, MSG_CMD_CHECK + 1) == 0) {
 			task->cmd = CMD_CHECK;
 		}
+		else if (g_ascii_strcasecmp (p + 1, MSG_CMD_CHECK_V + 1) == 0) {
+			task->cmd = CMD_CHECK_V;
+		}
 		else {
 			goto err;
 		}
@@ -227,6 +236,115 @@ err:
 	return FALSE;
 }
 
+static gboolean
+rspamd_protocol_file_allowed (struct rspamd_task *task, const gchar *path)
+{
+	GList *cur;
+	const gchar *dir;
+	gsize dlen;
+
+	for (cur = task->local_dirs; cur != NULL; cur = g_list_next (cur)) {
+		dir = cur->data;
+		dlen = strlen (dir);
+
+		if (strncmp (path, dir, dlen) == 0 &&
+				(path[dlen] == '/' || dir[dlen - 1] == '/')) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Read a local file to scan it instead of body. File is copied to the task's
+ * pool and is not mapped, since it could be truncated while being scanned.
+ */
+static gboolean
+rspamd_protocol_read_file (struct rspamd_task *task, const gchar *path)
+{
+	struct stat st;
+	gchar *realp, *buf;
+	gsize len = 0;
+	gssize r;
+	gint fd;
+
+	if (task->local_dirs == NULL || task->client_addr == NULL ||
+			rspamd_inet_address_get_af (task->client_addr) != AF_UNIX) {
+		msg_err ("deny scanning of local file %s", path);
+		task->last_error = "scanning of local files is not allowed";
+		task->error_code = 403;
+		return FALSE;
+	}
+
+	realp = realpath (path, NULL);
+
+	if (realp == NULL || !rspamd_protocol_file_allowed (task, realp)) {
+		msg_err ("deny scanning of file %s: %s", path,
+				realp == NULL ? strerror (errno) : "not in allowed directories");
+		free (realp);
+		task->last_error = "file is not allowed to be scanned";
+		task->error_code = 403;
+		return FALSE;
+	}
+
+	fd = open (realp, O_RDONLY | O_NOFOLLOW);
+	free (realp);
+
+	if (fd == -1) {
+		msg_err ("cannot open file %s: %s", path, strerror (errno));
+		task->last_error = "cannot open file";
+		task->error_code = 404;
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || !S_ISREG (st.st_mode) || st.st_size == 0) {
+		msg_err ("cannot scan file %s: not a regular file or empty", path);
+		close (fd);
+		task->last_error = "cannot scan file";
+		task->error_code = 400;
+		return FALSE;
+	}
+
+	buf = rspamd_mempool_alloc (task->task_pool, st.st_size);
+
+	/* File could be changed after fstat, so use the data actually read */
+	while (len < (gsize)st.st_size) {
+		r = read (fd, buf + len, st.st_size - len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err ("cannot read file %s: %s", path, strerror (errno));
+			close (fd);
+			task->last_error = "cannot read file";
+			task->error_code = 500;
+			return FALSE;
+		}
+		else if (r == 0) {
+			break;
+		}
+
+		len += r;
+	}
+
+	close (fd);
+
+	task->msg.start = buf;
+	task->msg.len = len;
+	debug_task ("scan file %s of length %z", path, task->msg.len);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_protocol_has_file (struct rspamd_http_message *msg)
+{
+	return rspamd_http_message_find_header (msg, FILE_HEADER) != NULL;
+}
+
 gboolean
 rspamd_protocol_handle_headers (struct rspamd_task *task,
 	struct rspamd_http_message *msg)
@@ -276,6 +394,11 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 					validh = FALSE;
 				}
 			}
+			else if (g_ascii_strcasecmp (headern, FILE_HEADER) == 0) {
+				if (!rspamd_protocol_read_file (task, h->value->str)) {
+					return FALSE;
+				}
+			}
 			else {
 				debug_task ("wrong header: %s", headern);
 				validh = FALSE;
@@ -447,21 +570,25 @@ static void
 write_hashes_to_log (struct rspamd_task *task, GString *logbuf)
 {
 	GList *cur;
-	struct mime_text_part *text_part;
+	struct mime_text_part *part;
+	rspamd_fuzzy_t *fuzzy;
 
 	cur = task->text_parts;
 
 	while (cur) {
-		text_part = cur->data;
-		if (text_part->fuzzy) {
+		part = cur->data;
+		/* Hashes are computed on demand, so only computed ones are logged */
+		fuzzy = (part->computed & RSPAMD_TEXT_PART_HAS_FUZZY) ?
+				part->fuzzy : NULL;
+		if (fuzzy) {
 			if (cur->next != NULL) {
 				rspamd_printf_gstring (logbuf,
 					" part: %Xd,",
-					text_part->fuzzy->h);
+					fuzzy->h);
 			}
 			else {
 				rspamd_printf_gstring (logbuf, " part: %Xd",
-					text_part->fuzzy->h);
+					fuzzy->h);
 			}
 		}
 		cur = g_list_next (cur);
@@ -469,6 +596,19 @@ write_hashes_to_log (struct rspamd_task *task, GString *logbuf)
 }
 
 
+static void
+rspamd_protocol_log_url (struct rspamd_task *task, struct rspamd_url *url)
+{
+	if (task->cfg->log_urls) {
+		msg_info ("<%s> URL: %s - %s: %s",
+			task->message_id,
+			task->user ?
+			task->user : "unknown",
+			rspamd_inet_address_to_string (task->from_addr),
+			struri (url));
+	}
+}
+
 /* Structure for writing tree data */
 struct tree_cb_data {
 	ucl_object_t *top;
@@ -508,15 +648,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 		ucl_object_insert_key (obj, elt, "phished", 0, false);
 	}
 	ucl_array_append (cb->top, obj);
-
-	if (cb->task->cfg->log_urls) {
-		msg_info ("<%s> URL: %s - %s: %s",
-			cb->task->message_id,
-			cb->task->user ?
-			cb->task->user : "unknown",
-			rspamd_inet_address_to_string (cb->task->from_addr),
-			struri (url));
-	}
+	rspamd_protocol_log_url (cb->task, url);
 
 	return FALSE;
 }
@@ -623,12 +755,11 @@ rspamd_str_list_ucl (GList *str_list)
 
 static ucl_object_t *
 rspamd_metric_symbol_ucl (struct rspamd_task *task, struct metric *m,
-	struct symbol *sym, GString *logbuf)
+	struct symbol *sym)
 {
 	ucl_object_t *obj = NULL;
 	const gchar *description = NULL;
 
-	rspamd_printf_gstring (logbuf, "%s,", sym->name);
 	description = g_hash_table_lookup (m->descriptions, sym->name);
 
 	obj = ucl_object_typed_new (UCL_OBJECT);
@@ -648,39 +779,38 @@ rspamd_metric_symbol_ucl (struct rspamd_task *task, struct metric *m,
 	return obj;
 }
 
-static ucl_object_t *
-rspamd_metric_result_ucl (struct rspamd_task *task,
+static enum rspamd_metric_action
+rspamd_metric_result_action (struct rspamd_task *task,
 	struct metric_result *mres,
-	GString *logbuf)
+	gdouble *required_score)
 {
-	GHashTableIter hiter;
-	struct symbol *sym;
-	struct metric *m;
-	gboolean is_spam;
-	enum rspamd_metric_action action = METRIC_ACTION_NOACTION;
-	ucl_object_t *obj = NULL, *sobj;;
-	gpointer h, v;
-	double required_score;
-	const gchar *subject;
-	gchar action_char;
-
-	m = mres->metric;
-
 	/* XXX: handle settings */
 	if (mres->action == METRIC_ACTION_MAX) {
 		mres->action = rspamd_check_action_metric (task, mres->score,
-				&required_score, m);
+				required_score, mres->metric);
 	}
 	else {
-		required_score = mres->metric->actions[mres->action].score;
+		*required_score = mres->metric->actions[mres->action].score;
 	}
-	action = mres->action;
-	is_spam = (action == METRIC_ACTION_REJECT);
+
+	return mres->action;
+}
+
+static void
+rspamd_metric_result_log (struct rspamd_task *task,
+	struct metric_result *mres,
+	gdouble required_score,
+	GString *logbuf)
+{
+	GHashTableIter hiter;
+	struct symbol *sym;
+	gpointer h, v;
+	gchar action_char;
 
 	if (RSPAMD_TASK_IS_SKIPPED (task)) {
 		action_char = 'S';
 	}
-	else if (is_spam) {
+	else if (mres->action == METRIC_ACTION_REJECT) {
 		action_char = 'T';
 	}
 	else {
@@ -688,10 +818,54 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 	}
 
 	rspamd_printf_gstring (logbuf, "(%s: %c (%s): [%.2f/%.2f] [",
-		m->name, action_char,
-		rspamd_action_to_str (action),
+		mres->metric->name, action_char,
+		rspamd_action_to_str (mres->action),
 		mres->score, required_score);
 
+	g_hash_table_iter_init (&hiter, mres->symbols);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		sym = (struct symbol *)v;
+		rspamd_printf_gstring (logbuf, "%s,", sym->name);
+	}
+
+	/* Cut the trailing comma if needed */
+	if (logbuf->str[logbuf->len - 1] == ',') {
+		logbuf->len--;
+	}
+
+#ifdef HAVE_CLOCK_GETTIME
+	rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d,",
+		task->msg.len, calculate_check_time (&task->tv, &task->ts,
+		task->cfg->clock_res, &task->scan_milliseconds), task->dns_requests);
+#else
+	rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d,",
+		task->msg.len,
+		calculate_check_time (&task->tv, task->cfg->clock_res,
+		&task->scan_milliseconds),
+		task->dns_requests);
+#endif
+}
+
+static ucl_object_t *
+rspamd_metric_result_ucl (struct rspamd_task *task,
+	struct metric_result *mres,
+	GString *logbuf)
+{
+	GHashTableIter hiter;
+	struct symbol *sym;
+	struct metric *m;
+	gboolean is_spam;
+	enum rspamd_metric_action action;
+	ucl_object_t *obj = NULL, *sobj;
+	gpointer h, v;
+	double required_score;
+	const gchar *subject;
+
+	m = mres->metric;
+	action = rspamd_metric_result_action (task, mres, &required_score);
+	is_spam = (action == METRIC_ACTION_REJECT);
+	rspamd_metric_result_log (task, mres, required_score, logbuf);
+
 	obj = ucl_object_typed_new (UCL_OBJECT);
 	ucl_object_insert_key (obj,	  ucl_object_frombool (is_spam),
 		"is_spam", 0, false);
@@ -714,28 +888,273 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 	g_hash_table_iter_init (&hiter, mres->symbols);
 	while (g_hash_table_iter_next (&hiter, &h, &v)) {
 		sym = (struct symbol *)v;
-		sobj = rspamd_metric_symbol_ucl (task, m, sym, logbuf);
+		sobj = rspamd_metric_symbol_ucl (task, m, sym);
 		ucl_object_insert_key (obj, sobj, h, 0, false);
 	}
 
-	/* Cut the trailing comma if needed */
-	if (logbuf->str[logbuf->len - 1] == ',') {
-		logbuf->len--;
+	return obj;
+}
+
+/*
+ * Direct JSON output: replies are written from task results to the output
+ * buffer without building of ucl objects
+ */
+static void
+rspamd_json_append_string (GString *out, const gchar *str, gsize len)
+{
+	const gchar *p = str, *c = str, *end = str + len;
+	static const gchar hexdigits[] = "0123456789abcdef";
+
+	g_string_append_c (out, '"');
+
+	while (p < end) {
+		if ((guchar)*p < 0x20 || *p == '"' || *p == '\\') {
+			if (p > c) {
+				g_string_append_len (out, c, p - c);
+			}
+
+			switch (*p) {
+			case '\n':
+				g_string_append_len (out, "\\n", 2);
+				break;
+			case '\r':
+				g_string_append_len (out, "\\r", 2);
+				break;
+			case '\t':
+				g_string_append_len (out, "\\t", 2);
+				break;
+			case '\b':
+				g_string_append_len (out, "\\b", 2);
+				break;
+			case '\f':
+				g_string_append_len (out, "\\f", 2);
+				break;
+			case '"':
+				g_string_append_len (out, "\\\"", 2);
+				break;
+			case '\\':
+				g_string_append_len (out, "\\\\", 2);
+				break;
+			default:
+				g_string_append_len (out, "\\u00", 4);
+				g_string_append_c (out, hexdigits[((guchar)*p >> 4) & 0xf]);
+				g_string_append_c (out, hexdigits[(guchar)*p & 0xf]);
+				break;
+			}
+
+			c = p + 1;
+		}
+		p ++;
 	}
 
-#ifdef HAVE_CLOCK_GETTIME
-	rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d,",
-		task->msg.len, calculate_check_time (&task->tv, &task->ts,
-		task->cfg->clock_res, &task->scan_milliseconds), task->dns_requests);
-#else
-	rspamd_printf_gstring (logbuf, "]), len: %z, time: %s, dns req: %d,",
-		task->msg.len,
-		calculate_check_time (&task->tv, task->cfg->clock_res,
-		&task->scan_milliseconds),
-		task->dns_requests);
-#endif
+	if (p > c) {
+		g_string_append_len (out, c, p - c);
+	}
 
-	return obj;
+	g_string_append_c (out, '"');
+}
+
+static inline void
+rspamd_json_append_cstring (GString *out, const gchar *str)
+{
+	rspamd_json_append_string (out, str, strlen (str));
+}
+
+/* Doubles are written in the same format as ucl emitter does */
+static void
+rspamd_json_append_double (GString *out, gdouble val)
+{
+	gchar numbuf[G_ASCII_DTOSTR_BUF_SIZE];
+	const gdouble delta = 0.0000001;
+
+	if (val == (gdouble)(gint)val) {
+		g_ascii_formatd (numbuf, sizeof (numbuf), "%.1f", val);
+	}
+	else if (fabs (val - (gdouble)(gint)val) < delta) {
+		g_ascii_formatd (numbuf, sizeof (numbuf), "%.15g", val);
+	}
+	else {
+		g_ascii_formatd (numbuf, sizeof (numbuf), "%f", val);
+	}
+
+	g_string_append (out, numbuf);
+}
+
+static inline void
+rspamd_json_append_bool (GString *out, gboolean val)
+{
+	if (val) {
+		g_string_append_len (out, "true", 4);
+	}
+	else {
+		g_string_append_len (out, "false", 5);
+	}
+}
+
+static void
+rspamd_json_append_key (GString *out, const gchar *key, gboolean *first)
+{
+	if (!*first) {
+		g_string_append_c (out, ',');
+	}
+
+	*first = FALSE;
+	rspamd_json_append_cstring (out, key);
+	g_string_append_c (out, ':');
+}
+
+static void
+rspamd_str_list_json (GList *str_list, GString *out)
+{
+	GList *cur;
+
+	g_string_append_c (out, '[');
+
+	for (cur = str_list; cur != NULL; cur = g_list_next (cur)) {
+		if (cur != str_list) {
+			g_string_append_c (out, ',');
+		}
+		rspamd_json_append_cstring (out, cur->data);
+	}
+
+	g_string_append_c (out, ']');
+}
+
+/* Structure for writing tree data as JSON */
+struct tree_json_cb_data {
+	GString *out;
+	struct rspamd_task *task;
+	gboolean first;
+};
+
+static gboolean
+urls_json_cb (gpointer key, gpointer value, gpointer ud)
+{
+	struct tree_json_cb_data *cb = ud;
+	struct rspamd_url *url = value;
+	GString *out = cb->out;
+	gboolean first = TRUE;
+
+	if (!cb->first) {
+		g_string_append_c (out, ',');
+	}
+	cb->first = FALSE;
+
+	if (!(cb->task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+		rspamd_json_append_string (out, url->host, url->hostlen);
+	}
+	else {
+		g_string_append_c (out, '{');
+
+		if (url->string != NULL) {
+			rspamd_json_append_key (out, "url", &first);
+			rspamd_json_append_cstring (out, url->string);
+		}
+		if (url->hostlen > 0) {
+			rspamd_json_append_key (out, "host", &first);
+			rspamd_json_append_string (out, url->host, url->hostlen);
+		}
+		if (url->surbllen > 0) {
+			rspamd_json_append_key (out, "surbl", &first);
+			rspamd_json_append_string (out, url->surbl, url->surbllen);
+		}
+
+		rspamd_json_append_key (out, "phished", &first);
+		rspamd_json_append_bool (out, url->is_phished);
+		g_string_append_c (out, '}');
+	}
+
+	rspamd_protocol_log_url (cb->task, url);
+
+	return FALSE;
+}
+
+static gboolean
+emails_json_cb (gpointer key, gpointer value, gpointer ud)
+{
+	struct tree_json_cb_data *cb = ud;
+	struct rspamd_url *url = value;
+
+	if (!cb->first) {
+		g_string_append_c (cb->out, ',');
+	}
+	cb->first = FALSE;
+
+	rspamd_json_append_string (cb->out, url->user,
+		url->userlen + url->hostlen + 1);
+
+	return FALSE;
+}
+
+static void
+rspamd_metric_symbol_json (struct rspamd_task *task, struct metric *m,
+	struct symbol *sym, GString *out)
+{
+	const gchar *description;
+	gboolean first = TRUE;
+
+	description = g_hash_table_lookup (m->descriptions, sym->name);
+
+	g_string_append_c (out, '{');
+	rspamd_json_append_key (out, "name", &first);
+	rspamd_json_append_cstring (out, sym->name);
+	rspamd_json_append_key (out, "score", &first);
+	rspamd_json_append_double (out, sym->score);
+
+	if (description) {
+		rspamd_json_append_key (out, "description", &first);
+		rspamd_json_append_cstring (out, description);
+	}
+	if (sym->options != NULL) {
+		rspamd_json_append_key (out, "options", &first);
+		rspamd_str_list_json (sym->options, out);
+	}
+
+	g_string_append_c (out, '}');
+}
+
+static void
+rspamd_metric_result_json (struct rspamd_task *task,
+	struct metric_result *mres,
+	GString *logbuf,
+	GString *out)
+{
+	GHashTableIter hiter;
+	struct symbol *sym;
+	enum rspamd_metric_action action;
+	gpointer h, v;
+	gdouble required_score;
+	gboolean first = TRUE;
+
+	action = rspamd_metric_result_action (task, mres, &required_score);
+	rspamd_metric_result_log (task, mres, required_score, logbuf);
+
+	g_string_append_c (out, '{');
+	rspamd_json_append_key (out, "is_spam", &first);
+	rspamd_json_append_bool (out, action == METRIC_ACTION_REJECT);
+	rspamd_json_append_key (out, "is_skipped", &first);
+	rspamd_json_append_bool (out, RSPAMD_TASK_IS_SKIPPED (task));
+	rspamd_json_append_key (out, "score", &first);
+	rspamd_json_append_double (out, mres->score);
+	rspamd_json_append_key (out, "required_score", &first);
+	rspamd_json_append_double (out, required_score);
+	rspamd_json_append_key (out, "action", &first);
+	rspamd_json_append_cstring (out, rspamd_action_to_str (action));
+
+	if (action == METRIC_ACTION_REWRITE_SUBJECT) {
+		rspamd_json_append_key (out, "subject", &first);
+		rspamd_json_append_cstring (out,
+			make_rewritten_subject (mres->metric, task));
+	}
+
+	g_hash_table_iter_init (&hiter, mres->symbols);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		sym = (struct symbol *)v;
+		rspamd_json_append_key (out, h, &first);
+		rspamd_metric_symbol_json (task, mres->metric, sym, out);
+	}
+
+	g_string_append_c (out, '}');
 }
 
 static void
@@ -831,17 +1250,10 @@ rspamd_ucl_tospamc_output (struct rspamd_task *task,
 	}
 }
 
-void
-rspamd_protocol_http_reply (struct rspamd_http_message *msg,
-	struct rspamd_task *task)
+static GString *
+rspamd_protocol_log_start (struct rspamd_task *task)
 {
 	GString *logbuf;
-	struct metric_result *metric_res;
-	GHashTableIter hiter;
-	gpointer h, v;
-	ucl_object_t *top = NULL, *obj;
-	gdouble required_score;
-	gint action;
 
 	/* Output the first line - check status */
 	logbuf = g_string_sized_new (BUFSIZ);
@@ -858,13 +1270,46 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		rspamd_roll_history_update (task->worker->srv->history, task);
 	}
 
-	/* Write custom headers */
-	g_hash_table_iter_init (&hiter, task->reply_headers);
-	while (g_hash_table_iter_next (&hiter, &h, &v)) {
-		GString *hn = (GString *)h, *hv = (GString *)v;
+	return logbuf;
+}
 
-		rspamd_http_message_add_header (msg, hn->str, hv->str);
+static void
+rspamd_protocol_log_finish (struct rspamd_task *task, GString *logbuf)
+{
+	struct metric_result *metric_res;
+	gdouble required_score;
+	gint action;
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
+		write_hashes_to_log (task, logbuf);
+		msg_info ("%v", logbuf);
 	}
+	g_string_free (logbuf, TRUE);
+
+	/* Update stat for default metric */
+	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+	if (metric_res != NULL) {
+		action = rspamd_check_action_metric (task, metric_res->score, &required_score,
+				metric_res->metric);
+		if (action <= METRIC_ACTION_NOACTION) {
+			task->worker->srv->stat->actions_stat[action]++;
+		}
+	}
+
+	/* Increase counters */
+	task->worker->srv->stat->messages_scanned++;
+}
+
+ucl_object_t *
+rspamd_protocol_write_ucl (struct rspamd_task *task)
+{
+	GString *logbuf;
+	struct metric_result *metric_res;
+	GHashTableIter hiter;
+	gpointer h, v;
+	ucl_object_t *top = NULL, *obj;
+
+	logbuf = rspamd_protocol_log_start (task);
 
 	g_hash_table_iter_init (&hiter, task->results);
 
@@ -892,39 +1337,166 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	ucl_object_insert_key (top, ucl_object_fromstring (task->message_id),
 		"message-id", 0, false);
 
-	write_hashes_to_log (task, logbuf);
-	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
-		msg_info ("%v", logbuf);
+	rspamd_protocol_log_finish (task, logbuf);
+
+	return top;
+}
+
+void
+rspamd_protocol_write_json (struct rspamd_task *task, GString *out)
+{
+	GString *logbuf;
+	struct tree_json_cb_data cb;
+	GHashTableIter hiter;
+	gpointer h, v;
+	gboolean first = TRUE;
+
+	logbuf = rspamd_protocol_log_start (task);
+
+	g_string_append_c (out, '{');
+
+	g_hash_table_iter_init (&hiter, task->results);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		rspamd_json_append_key (out, h, &first);
+		rspamd_metric_result_json (task, (struct metric_result *)v, logbuf,
+			out);
+	}
+
+	if (task->messages != NULL) {
+		rspamd_json_append_key (out, "messages", &first);
+		rspamd_str_list_json (task->messages, out);
+	}
+
+	cb.out = out;
+	cb.task = task;
+
+	if (g_tree_nnodes (task->urls) > 0) {
+		rspamd_json_append_key (out, "urls", &first);
+		g_string_append_c (out, '[');
+		cb.first = TRUE;
+		g_tree_foreach (task->urls, urls_json_cb, &cb);
+		g_string_append_c (out, ']');
+	}
+	if (g_tree_nnodes (task->emails) > 0) {
+		rspamd_json_append_key (out, "emails", &first);
+		g_string_append_c (out, '[');
+		cb.first = TRUE;
+		g_tree_foreach (task->emails, emails_json_cb, &cb);
+		g_string_append_c (out, ']');
+	}
+
+	if (task->message_id != NULL) {
+		rspamd_json_append_key (out, "message-id", &first);
+		rspamd_json_append_cstring (out, task->message_id);
+	}
+
+	g_string_append_c (out, '}');
+
+	rspamd_protocol_log_finish (task, logbuf);
+}
+
+/*
+ * Estimate size of JSON reply to allocate output buffer at once
+ */
+static gsize
+rspamd_protocol_reply_size (struct rspamd_task *task)
+{
+	struct metric_result *mres;
+	GHashTableIter hiter;
+	gpointer h, v;
+	gsize size = BUFSIZ;
+
+	g_hash_table_iter_init (&hiter, task->results);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		mres = (struct metric_result *)v;
+		size += g_hash_table_size (mres->symbols) * 128;
 	}
-	g_string_free (logbuf, TRUE);
 
-	msg->body = g_string_sized_new (BUFSIZ);
+	if (task->flags & RSPAMD_TASK_FLAG_EXT_URLS) {
+		size += g_tree_nnodes (task->urls) * 256;
+	}
+	else {
+		size += g_tree_nnodes (task->urls) * 64;
+	}
+
+	size += g_tree_nnodes (task->emails) * 64;
+
+	return size;
+}
+
+void
+rspamd_protocol_http_reply (struct rspamd_http_message *msg,
+	struct rspamd_task *task)
+{
+	GHashTableIter hiter;
+	gpointer h, v;
+	ucl_object_t *top;
+
+	/* Write custom headers */
+	g_hash_table_iter_init (&hiter, task->reply_headers);
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		GString *hn = (GString *)h, *hv = (GString *)v;
+
+		rspamd_http_message_add_header (msg, hn->str, hv->str);
+	}
 
 	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
-		rspamd_ucl_emit_gstring (top, UCL_EMIT_JSON_COMPACT, msg->body);
+		msg->body = g_string_sized_new (rspamd_protocol_reply_size (task));
+		rspamd_protocol_write_json (task, msg->body);
 	}
 	else {
+		top = rspamd_protocol_write_ucl (task);
+		msg->body = g_string_sized_new (BUFSIZ);
+
 		if (RSPAMD_TASK_IS_SPAMC (task)) {
 			rspamd_ucl_tospamc_output (task, top, msg->body);
 		}
 		else {
 			rspamd_ucl_torspamc_output (task, top, msg->body);
 		}
+
+		ucl_object_unref (top);
 	}
-	ucl_object_unref (top);
+}
 
-	/* Update stat for default metric */
-	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
-	if (metric_res != NULL) {
-		action = rspamd_check_action_metric (task, metric_res->score, &required_score,
-				metric_res->metric);
-		if (action <= METRIC_ACTION_NOACTION) {
-			task->worker->srv->stat->actions_stat[action]++;
+static void
+rspamd_protocol_batch_reply (struct rspamd_http_message *msg,
+	struct rspamd_task *task)
+{
+	struct rspamd_task *sub;
+	gsize size = 0;
+	guint i, nsub;
+
+	nsub = task->subtasks != NULL ? task->subtasks->len : 0;
+
+	for (i = 0; i < nsub; i ++) {
+		sub = g_ptr_array_index (task->subtasks, i);
+		size += rspamd_protocol_reply_size (sub);
+	}
+
+	msg->body = g_string_sized_new (size + 2);
+	g_string_append_c (msg->body, '[');
+
+	/* Results are written in the same order as messages in request */
+	for (i = 0; i < nsub; i ++) {
+		sub = g_ptr_array_index (task->subtasks, i);
+
+		if (i > 0) {
+			g_string_append_c (msg->body, ',');
+		}
+
+		if (sub->error_code != 0) {
+			g_string_append (msg->body, "{\"error\":");
+			rspamd_json_append_cstring (msg->body,
+				sub->last_error ? sub->last_error : "unknown error");
+			g_string_append_c (msg->body, '}');
+		}
+		else {
+			rspamd_protocol_write_json (sub, msg->body);
 		}
 	}
 
-	/* Increase counters */
-	task->worker->srv->stat->messages_scanned++;
+	g_string_append_c (msg->body, ']');
 }
 
 void
@@ -946,6 +1518,9 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 	if (RSPAMD_TASK_IS_SPAMC (task)) {
 		msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
+	else if (task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+	}
 
 	msg->date = time (NULL);
 
@@ -974,6 +1549,9 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 		case CMD_SKIP:
 			rspamd_protocol_http_reply (msg, task);
 			break;
+		case CMD_CHECK_V:
+			rspamd_protocol_batch_reply (msg, task);
+			break;
 		case CMD_PING:
 			msg->body = g_string_new ("pong" CRLF);
 			ctype = "text/plain";
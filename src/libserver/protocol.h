@@ -20,6 +20,13 @@
 
 struct metric;
 
+/**
+ * Check whether a request asks to scan a local file instead of its body
+ * @param msg
+ * @return TRUE if message should be read from a local file
+ */
+gboolean rspamd_protocol_has_file (struct rspamd_http_message *msg);
+
 /**
  * Process headers into HTTP message and set appropriate task fields
  * @param task
@@ -38,6 +45,21 @@ gboolean rspamd_protocol_handle_headers (struct rspamd_task *task,
 gboolean rspamd_protocol_handle_request (struct rspamd_task *task,
 	struct rspamd_http_message *msg);
 
+/**
+ * Convert task results to ucl object, log them and update statistics
+ * @param task
+ * @return new ucl object
+ */
+ucl_object_t * rspamd_protocol_write_ucl (struct rspamd_task *task);
+
+/**
+ * Write task results as JSON directly to the output buffer, log them and
+ * update statistics
+ * @param task
+ * @param out output buffer
+ */
+void rspamd_protocol_write_json (struct rspamd_task *task, GString *out);
+
 /**
  * Write task results to http message
  * @param msg
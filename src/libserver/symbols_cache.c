@@ -84,6 +84,15 @@ cache_logic_cmp (const void *p1, const void *p2)
 	return (gint)w2 - w1;
 }
 
+static gint
+cache_logic_ptr_cmp (gconstpointer p1, gconstpointer p2)
+{
+	const struct cache_item *i1 = *(struct cache_item **)p1,
+		*i2 = *(struct cache_item **)p2;
+
+	return cache_logic_cmp (i1, i2);
+}
+
 /**
  * Set counter for a symbol
  */
@@ -147,6 +156,29 @@ get_mem_cksum (struct symbols_cache *cache)
 	return result;
 }
 
+static GPtrArray *
+rspamd_symbols_cache_order (GPtrArray *order, GList *items)
+{
+	GList *cur;
+
+	if (order != NULL && order->len == g_list_length (items)) {
+		return order;
+	}
+
+	if (order != NULL) {
+		g_ptr_array_free (order, TRUE);
+	}
+
+	order = g_ptr_array_sized_new (g_list_length (items));
+	cur = g_list_first (items);
+	while (cur) {
+		g_ptr_array_add (order, cur->data);
+		cur = g_list_next (cur);
+	}
+
+	return order;
+}
+
 /* Sort items in logical order */
 static void
 post_cache_init (struct symbols_cache *cache)
@@ -169,9 +201,13 @@ post_cache_init (struct symbols_cache *cache)
 		cur = g_list_next (cur);
 	}
 
-	cache->negative_items =
-		g_list_sort (cache->negative_items, cache_logic_cmp);
-	cache->static_items = g_list_sort (cache->static_items, cache_logic_cmp);
+	/* Lists are not modified here, as they are shared with other workers */
+	cache->negative_order = rspamd_symbols_cache_order (cache->negative_order,
+			cache->negative_items);
+	cache->static_order = rspamd_symbols_cache_order (cache->static_order,
+			cache->static_items);
+	g_ptr_array_sort (cache->negative_order, cache_logic_ptr_cmp);
+	g_ptr_array_sort (cache->static_order, cache_logic_ptr_cmp);
 }
 
 /* Unmap cache file */
@@ -520,6 +556,12 @@ free_cache (gpointer arg)
 	if (cache->negative_items) {
 		g_list_free (cache->negative_items);
 	}
+	if (cache->negative_order) {
+		g_ptr_array_free (cache->negative_order, TRUE);
+	}
+	if (cache->static_order) {
+		g_ptr_array_free (cache->static_order, TRUE);
+	}
 	g_hash_table_destroy (cache->items_by_symbol);
 	rspamd_mempool_delete (cache->static_pool);
 
@@ -792,7 +834,7 @@ struct symbol_callback_data {
 		CACHE_STATE_STATIC
 	} state;
 	struct cache_item *saved_item;
-	GList *list_pointer;
+	guint idx;
 };
 
 gboolean
@@ -809,11 +851,12 @@ call_symbol_callback (struct rspamd_task * task,
 	struct cache_item *item = NULL;
 	struct symbol_callback_data *s = *save;
 
+	if (cache == NULL) {
+		return FALSE;
+	}
+
 	if (s == NULL) {
-		if (cache == NULL) {
-			return FALSE;
-		}
-		if (cache->uses++ >= MAX_USES) {
+		if (cache->uses++ >= MAX_USES || cache->negative_order == NULL) {
 			msg_info ("resort symbols cache");
 			cache->uses = 0;
 			/* Resort while having write lock */
@@ -823,58 +866,31 @@ call_symbol_callback (struct rspamd_task * task,
 			rspamd_mempool_alloc0 (task->task_pool,
 				sizeof (struct symbol_callback_data));
 		*save = s;
-		if (cache->negative_items != NULL) {
-			s->list_pointer = g_list_first (cache->negative_items);
-			s->saved_item = s->list_pointer->data;
-			s->state = CACHE_STATE_NEGATIVE;
+		s->state = CACHE_STATE_NEGATIVE;
+		s->idx = 0;
+	}
+	else {
+		s->idx++;
+	}
+
+	if (s->state == CACHE_STATE_NEGATIVE) {
+		if (s->idx < cache->negative_order->len) {
+			item = g_ptr_array_index (cache->negative_order, s->idx);
 		}
 		else {
 			s->state = CACHE_STATE_STATIC;
-			s->list_pointer = g_list_first (cache->static_items);
-			if (s->list_pointer) {
-				s->saved_item = s->list_pointer->data;
-			}
-			else {
-				return FALSE;
-			}
+			s->idx = 0;
 		}
-		item = s->saved_item;
 	}
-	else {
-		if (cache == NULL) {
-			return FALSE;
+	if (s->state == CACHE_STATE_STATIC) {
+		if (s->idx < cache->static_order->len) {
+			item = g_ptr_array_index (cache->static_order, s->idx);
 		}
-		switch (s->state) {
-		case CACHE_STATE_NEGATIVE:
-			s->list_pointer = g_list_next (s->list_pointer);
-			if (s->list_pointer == NULL) {
-				s->state = CACHE_STATE_STATIC;
-				s->list_pointer = g_list_first (cache->static_items);
-				if (s->list_pointer) {
-					s->saved_item = s->list_pointer->data;
-				}
-				else {
-					return FALSE;
-				}
-			}
-			else {
-				s->saved_item = s->list_pointer->data;
-			}
-			item = s->saved_item;
-			break;
-		case CACHE_STATE_STATIC:
-			/* Next pointer */
-			s->list_pointer = g_list_next (s->list_pointer);
-			if (s->list_pointer) {
-				s->saved_item = s->list_pointer->data;
-			}
-			else {
-				return FALSE;
-			}
-			item = s->saved_item;
-			break;
+		else {
+			return FALSE;
 		}
 	}
+
 	if (!item) {
 		return FALSE;
 	}
@@ -73,6 +73,13 @@ struct symbols_cache {
 	/* Hash table for fast access */
 	GHashTable *items_by_symbol;
 
+	/*
+	 * Items in order of checking, they are resorted by each worker, so
+	 * keep them apart from the rest of cache to avoid copying on write
+	 */
+	GPtrArray *negative_order;
+	GPtrArray *static_order;
+
 	rspamd_mempool_t *static_pool;
 
 	guint cur_items;
@@ -36,6 +36,23 @@ gstring_destruct (gpointer ptr)
 	g_string_free (s, TRUE);
 }
 
+void
+rspamd_task_reset_time (struct rspamd_task *task)
+{
+#ifdef HAVE_CLOCK_GETTIME
+# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &task->ts);
+# elif defined(HAVE_CLOCK_VIRTUAL)
+	clock_gettime (CLOCK_VIRTUAL,			 &task->ts);
+# else
+	clock_gettime (CLOCK_REALTIME,			 &task->ts);
+# endif
+#endif
+	if (gettimeofday (&task->tv, NULL) == -1) {
+		msg_warn ("gettimeofday failed: %s", strerror (errno));
+	}
+}
+
 /*
  * Create new task
  */
@@ -54,18 +71,7 @@ rspamd_task_new (struct rspamd_worker *worker)
 			new_task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
 		}
 	}
-#ifdef HAVE_CLOCK_GETTIME
-# ifdef HAVE_CLOCK_PROCESS_CPUTIME_ID
-	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &new_task->ts);
-# elif defined(HAVE_CLOCK_VIRTUAL)
-	clock_gettime (CLOCK_VIRTUAL,			 &new_task->ts);
-# else
-	clock_gettime (CLOCK_REALTIME,			 &new_task->ts);
-# endif
-#endif
-	if (gettimeofday (&new_task->tv, NULL) == -1) {
-		msg_warn ("gettimeofday failed: %s", strerror (errno));
-	}
+	rspamd_task_reset_time (new_task);
 
 	new_task->task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
 
@@ -77,8 +83,7 @@ rspamd_task_new (struct rspamd_worker *worker)
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
 		new_task->re_cache);
-	new_task->raw_headers = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
+	new_task->raw_headers = rspamd_headers_new (new_task->task_pool);
 	new_task->request_headers = g_hash_table_new_full ((GHashFunc)g_string_hash,
 		(GEqualFunc)g_string_equal, gstring_destruct, gstring_destruct);
 	rspamd_mempool_add_destructor (new_task->task_pool,
@@ -89,9 +94,6 @@ rspamd_task_new (struct rspamd_worker *worker)
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
 		new_task->reply_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->raw_headers);
 	new_task->emails = g_tree_new (rspamd_emails_cmp);
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_tree_destroy,
@@ -110,9 +112,37 @@ rspamd_task_new (struct rspamd_worker *worker)
 }
 
 
+/*
+ * Limits can be reached after filters are processed, e.g. when words are
+ * requested by statistics, so the symbol is inserted just before the reply
+ */
+static void
+rspamd_task_insert_limits_symbol (struct rspamd_task *task)
+{
+	GList *opts = NULL;
+	guint limit;
+
+	for (limit = RSPAMD_MIME_LIMIT_PARTS; limit < RSPAMD_MIME_LIMIT_MAX;
+			limit <<= 1) {
+		if (task->mime_budget.exceeded & limit) {
+			opts = g_list_prepend (opts,
+					(gpointer)rspamd_task_limit_name (limit));
+		}
+	}
+
+	rspamd_task_insert_result_single (task, task->cfg->mime_limits_symbol,
+			1.0, g_list_reverse (opts));
+}
+
 static void
 rspamd_task_reply (struct rspamd_task *task)
 {
+	if ((task->flags & RSPAMD_TASK_FLAG_LIMITS_EXCEEDED) &&
+			!RSPAMD_TASK_IS_SKIPPED (task) &&
+			task->cfg->mime_limits_symbol != NULL) {
+		rspamd_task_insert_limits_symbol (task);
+	}
+
 	if (task->fin_callback) {
 		task->fin_callback (task->fin_arg);
 	}
@@ -121,6 +151,26 @@ rspamd_task_reply (struct rspamd_task *task)
 	}
 }
 
+/*
+ * Words of text parts are computed on demand, so we compute them before
+ * passing task to a classify thread as filters' callbacks could request
+ * them from the main thread at the same time
+ */
+static void
+rspamd_task_prepare_words (struct rspamd_task *task)
+{
+	GList *cur;
+	struct mime_text_part *part;
+
+	cur = task->text_parts;
+
+	while (cur) {
+		part = (struct mime_text_part *)cur->data;
+		rspamd_text_part_get_normalized_words (part);
+		cur = g_list_next (cur);
+	}
+}
+
 /*
  * Called if all filters are processed
  * @return TRUE if session should be terminated
@@ -184,6 +234,7 @@ rspamd_task_fin (void *arg)
 			}
 			/* Add task to classify to classify pool */
 			if (!RSPAMD_TASK_IS_SKIPPED (task) && task->classify_pool) {
+				rspamd_task_prepare_words (task);
 				register_async_thread (task->s);
 				g_thread_pool_push (task->classify_pool, task, &err);
 				if (err != NULL) {
@@ -227,17 +278,22 @@ void
 rspamd_task_free (struct rspamd_task *task, gboolean is_soft)
 {
 	GList *part;
-	struct mime_part *p;
 	struct mime_text_part *tp;
+	struct rspamd_task *sub;
+	guint i;
 
 	if (task) {
 		debug_task ("free pointer %p", task);
-		while ((part = g_list_first (task->parts))) {
-			task->parts = g_list_remove_link (task->parts, part);
-			p = (struct mime_part *) part->data;
-			g_byte_array_free (p->content, TRUE);
-			g_list_free_1 (part);
+		if (task->subtasks) {
+			for (i = 0; i < task->subtasks->len; i ++) {
+				sub = g_ptr_array_index (task->subtasks, i);
+				destroy_session (sub->s);
+			}
+			g_ptr_array_free (task->subtasks, TRUE);
 		}
+		/* Content of parts is either owned by the pool or by the message */
+		g_list_free (task->parts);
+		task->parts = NULL;
 		if (task->text_parts) {
 			part = task->text_parts;
 			while (part) {
@@ -303,14 +359,9 @@ rspamd_task_free_soft (gpointer ud)
 
 
 gboolean
-rspamd_task_process (struct rspamd_task *task,
-	struct rspamd_http_message *msg, const gchar *start, gsize len,
-	GThreadPool *classify_pool,
-	gboolean process_extra_filters)
+rspamd_task_load_message (struct rspamd_task *task,
+	struct rspamd_http_message *msg, const gchar *start, gsize len)
 {
-	gint r;
-	GError *err = NULL;
-
 	task->msg.start = start;
 	task->msg.len = len;
 	debug_task ("got string of length %z", task->msg.len);
@@ -318,16 +369,22 @@ rspamd_task_process (struct rspamd_task *task,
 	/* We got body, set wanna_die flag */
 	task->s->wanna_die = TRUE;
 
-	rspamd_protocol_handle_headers (task, msg);
-
-	r = process_message (task);
-	if (r == -1) {
-		msg_warn ("processing of message failed");
-		task->last_error = "MIME processing error";
-		task->error_code = RSPAMD_FILTER_ERROR;
+	if (!rspamd_protocol_handle_headers (task, msg) && task->error_code != 0) {
 		task->state = WRITE_REPLY;
 		return FALSE;
 	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_task_process_filters (struct rspamd_task *task,
+	GThreadPool *classify_pool,
+	gboolean process_extra_filters)
+{
+	gint r;
+	GError *err = NULL;
+
 	if (!process_extra_filters) {
 		task->flags |= RSPAMD_TASK_FLAG_SKIP_EXTRA;
 	}
@@ -341,6 +398,7 @@ rspamd_task_process (struct rspamd_task *task,
 		}
 		/* Add task to classify to classify pool */
 		if (!RSPAMD_TASK_IS_SKIPPED (task) && classify_pool) {
+			rspamd_task_prepare_words (task);
 			register_async_thread (task->s);
 			g_thread_pool_push (classify_pool, task, &err);
 			if (err != NULL) {
@@ -368,6 +426,31 @@ rspamd_task_process (struct rspamd_task *task,
 	return TRUE;
 }
 
+gboolean
+rspamd_task_process (struct rspamd_task *task,
+	struct rspamd_http_message *msg, const gchar *start, gsize len,
+	GThreadPool *classify_pool,
+	gboolean process_extra_filters)
+{
+	gint r;
+
+	if (!rspamd_task_load_message (task, msg, start, len)) {
+		return FALSE;
+	}
+
+	r = process_message (task);
+	if (r == -1) {
+		msg_warn ("processing of message failed");
+		task->last_error = "MIME processing error";
+		task->error_code = RSPAMD_FILTER_ERROR;
+		task->state = WRITE_REPLY;
+		return FALSE;
+	}
+
+	return rspamd_task_process_filters (task, classify_pool,
+			process_extra_filters);
+}
+
 const gchar *
 rspamd_task_get_sender (struct rspamd_task *task)
 {
@@ -451,6 +534,39 @@ rspamd_task_add_sender (struct rspamd_task *task, const gchar *sender)
 	return FALSE;
 }
 
+const gchar *
+rspamd_task_limit_name (enum rspamd_mime_limit limit)
+{
+	switch (limit) {
+	case RSPAMD_MIME_LIMIT_PARTS:
+		return "parts";
+	case RSPAMD_MIME_LIMIT_BYTES:
+		return "bytes";
+	case RSPAMD_MIME_LIMIT_WORDS:
+		return "words";
+	case RSPAMD_MIME_LIMIT_URLS:
+		return "urls";
+	case RSPAMD_MIME_LIMIT_HTML_TAGS:
+		return "html_tags";
+	default:
+		break;
+	}
+
+	return "unknown";
+}
+
+void
+rspamd_task_limit_exceeded (struct rspamd_task *task,
+		enum rspamd_mime_limit limit)
+{
+	if (!(task->mime_budget.exceeded & limit)) {
+		task->mime_budget.exceeded |= limit;
+		task->flags |= RSPAMD_TASK_FLAG_LIMITS_EXCEEDED;
+		msg_info ("<%s>: limit of %s has been reached, skip the rest of them",
+				task->message_id, rspamd_task_limit_name (limit));
+	}
+}
+
 
 guint
 rspamd_task_re_cache_add (struct rspamd_task *task, const gchar *re,
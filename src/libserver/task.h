@@ -38,6 +38,7 @@ enum rspamd_command {
 	CMD_SKIP,
 	CMD_PING,
 	CMD_PROCESS,
+	CMD_CHECK_V,
 	CMD_OTHER
 };
 
@@ -59,6 +60,18 @@ enum rspamd_metric_action {
 #define RSPAMD_TASK_FLAG_SPAMC (1 << 5)
 #define RSPAMD_TASK_FLAG_PASS_ALL (1 << 6)
 #define RSPAMD_TASK_FLAG_NO_LOG (1 << 7)
+#define RSPAMD_TASK_FLAG_KEEPALIVE (1 << 8)
+#define RSPAMD_TASK_FLAG_LIMITS_EXCEEDED (1 << 9)
+
+/* Limits of message processing */
+enum rspamd_mime_limit {
+	RSPAMD_MIME_LIMIT_PARTS = (1 << 0),
+	RSPAMD_MIME_LIMIT_BYTES = (1 << 1),
+	RSPAMD_MIME_LIMIT_WORDS = (1 << 2),
+	RSPAMD_MIME_LIMIT_URLS = (1 << 3),
+	RSPAMD_MIME_LIMIT_HTML_TAGS = (1 << 4),
+	RSPAMD_MIME_LIMIT_MAX = (1 << 5)
+};
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_JSON(task) (((task)->flags & RSPAMD_TASK_FLAG_JSON))
@@ -118,7 +131,7 @@ struct rspamd_task {
 	GTree *urls;                                                /**< list of parsed urls							*/
 	GTree *emails;                                              /**< list of parsed emails							*/
 	GList *images;                                              /**< list of images									*/
-	GHashTable *raw_headers;                                    /**< list of raw headers							*/
+	struct rspamd_headers *raw_headers;                         /**< index of raw headers							*/
 	GHashTable *results;                                        /**< hash table of metric_result indexed by
 	                                                             *    metric's name									*/
 	GHashTable *tokens;                                         /**< hash table of tokens indexed by tokenizer
@@ -145,11 +158,15 @@ struct rspamd_task {
 	void *fin_arg;                                              /**< argument for fin callback						*/
 
 	guint32 dns_requests;                                       /**< number of DNS requests per this task			*/
+	guint32 conn_requests;                                      /**< number of this request within a connection		*/
+
+	GPtrArray *subtasks;                                        /**< tasks for messages of a batch request			*/
 
 	struct rspamd_dns_resolver *resolver;                       /**< DNS resolver									*/
 	struct event_base *ev_base;                                 /**< Event base										*/
 
 	GThreadPool *classify_pool;                                 /**< A pool of classify threads                     */
+	GList *local_dirs;                                          /**< Directories of local files allowed to scan		*/
 	gpointer classify_data;										/**< Opaque classifiers data						*/
 
 	struct {
@@ -157,6 +174,14 @@ struct rspamd_task {
 		gchar *str;                                             /**< String describing action						*/
 	} pre_result;                                               /**< Result of pre-filters							*/
 
+	struct {
+		gsize bytes;                                            /**< Size of decoded parts							*/
+		guint32 words;                                          /**< Number of words in text parts					*/
+		guint32 urls;                                           /**< Number of urls extracted						*/
+		guint32 html_tags;                                      /**< Number of html tags							*/
+		guint32 exceeded;                                       /**< Mask of limits that have been reached			*/
+	} mime_budget;                                              /**< Resources used by message processing			*/
+
 	ucl_object_t *settings;                                     /**< Settings applied to task						*/
 	gpointer peer_key;											/**< Peer's pubkey									*/
 };
@@ -165,6 +190,13 @@ struct rspamd_task {
  * Construct new task for worker
  */
 struct rspamd_task * rspamd_task_new (struct rspamd_worker *worker);
+
+/**
+ * Set the start time of task to the current time, e.g. when a request starts
+ * on a persistent connection
+ * @param task task object
+ */
+void rspamd_task_reset_time (struct rspamd_task *task);
 /**
  * Destroy task object and remove its IO dispatcher if it exists
  */
@@ -183,6 +215,26 @@ void rspamd_task_restore (void *arg);
  */
 gboolean rspamd_task_fin (void *arg);
 
+/**
+ * Attach message to a task and handle headers of the request
+ * @param task task to process
+ * @param msg incoming http message
+ * @return FALSE if reply should be written immediately
+ */
+gboolean rspamd_task_load_message (struct rspamd_task *task,
+	struct rspamd_http_message *msg, const gchar *start, gsize len);
+
+/**
+ * Process filters for a task which message has been already parsed
+ * @param task task to process
+ * @param classify_pool classify pool (or NULL)
+ * @param process_extra_filters whether to check pre and post filters
+ * @return FALSE if reply should be written immediately
+ */
+gboolean rspamd_task_process_filters (struct rspamd_task *task,
+	GThreadPool *classify_pool,
+	gboolean process_extra_filters);
+
 /**
  * Process task from http message and write reply or call task->fin_handler
  * @param task task to process
@@ -218,6 +270,21 @@ gboolean rspamd_task_add_recipient (struct rspamd_task *task, const gchar *rcpt)
  */
 gboolean rspamd_task_add_sender (struct rspamd_task *task, const gchar *sender);
 
+/**
+ * Mark that some limit of message processing has been reached for a task
+ * @param task task object
+ * @param limit limit reached
+ */
+void rspamd_task_limit_exceeded (struct rspamd_task *task,
+		enum rspamd_mime_limit limit);
+
+/**
+ * Get the name of a limit of message processing
+ * @param limit limit
+ * @return string name of limit
+ */
+const gchar *rspamd_task_limit_name (enum rspamd_mime_limit limit);
+
 #define RSPAMD_TASK_CACHE_NO_VALUE ((guint)-1)
 
 /**
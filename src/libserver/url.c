@@ -826,8 +826,10 @@ url_init (void)
 {
 	guint i;
 	gchar patbuf[128];
+	static gsize scanner_initialized = 0;
 
-	if (url_scanner == NULL) {
+	/* Urls can be extracted from several threads, so init scanner once */
+	if (g_once_init_enter (&scanner_initialized)) {
 		url_scanner = g_malloc (sizeof (struct url_match_scanner));
 		url_scanner->matchers = matchers;
 		url_scanner->matchers_count = G_N_ELEMENTS (matchers);
@@ -861,6 +863,8 @@ url_init (void)
 					i);
 			}
 		}
+
+		g_once_init_leave (&scanner_initialized, 1);
 	}
 
 	return 0;
@@ -1778,6 +1782,12 @@ rspamd_url_text_extract (rspamd_mempool_t * pool,
 		end = begin + part->content->len;
 		p = begin;
 		while (p < end) {
+			if (task->cfg->mime_max_urls != 0 &&
+					task->mime_budget.urls >= task->cfg->mime_max_urls) {
+				rspamd_task_limit_exceeded (task, RSPAMD_MIME_LIMIT_URLS);
+				break;
+			}
+
 			if (rspamd_url_find (pool, p, end - p, &url_start, &url_end, &url_str,
 				is_html)) {
 				if (url_str != NULL) {
@@ -1792,6 +1802,7 @@ rspamd_url_text_extract (rspamd_mempool_t * pool,
 							new->hostlen > 0) {
 							ex->pos = url_start - begin;
 							ex->len = url_end - url_start;
+							task->mime_budget.urls ++;
 							if (new->protocol == PROTOCOL_MAILTO) {
 								if (new->userlen > 0) {
 									if (!g_tree_lookup (task->emails, new)) {
@@ -49,6 +49,11 @@ rspamd_get_worker_by_type (GQuark type)
 
 sig_atomic_t wanna_die = 0;
 
+/* Interval of memory usage updates in seconds */
+#define RSPAMD_WORKER_MEM_INTERVAL 10
+
+static struct event mem_update_ev;
+
 /*
  * Config reload is designed by sending sigusr2 to active workers and pending shutdown of them
  */
@@ -180,6 +185,32 @@ rspamd_worker_init_signals (struct rspamd_worker *worker, struct event_base *bas
 	sigprocmask (SIG_UNBLOCK, &signals.sa_mask, NULL);
 }
 
+void
+rspamd_worker_update_mem (struct rspamd_worker_mem *mem, const gchar *title)
+{
+	struct rspamd_process_mem_stat st;
+
+	if (mem != NULL && rspamd_get_process_memory (getpid (), &st)) {
+		memcpy (&mem->st, &st, sizeof (st));
+		rspamd_strlcpy (mem->title, title, sizeof (mem->title));
+		mem->updated = time (NULL);
+		mem->pid = getpid ();
+	}
+}
+
+static void
+rspamd_worker_mem_handler (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = arg;
+	struct timeval tv;
+
+	rspamd_worker_update_mem (worker->mem, worker->cf->worker->name);
+
+	tv.tv_sec = RSPAMD_WORKER_MEM_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add (&mem_update_ev, &tv);
+}
+
 struct event_base *
 rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	void (*accept_handler)(int, short, void *))
@@ -204,6 +235,13 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 
 	rspamd_worker_init_signals (worker, ev_base);
 
+	if (worker->mem != NULL) {
+		/* Memory usage is reported periodically starting from now */
+		evtimer_set (&mem_update_ev, rspamd_worker_mem_handler, worker);
+		event_base_set (ev_base, &mem_update_ev);
+		rspamd_worker_mem_handler (-1, EV_TIMEOUT, worker);
+	}
+
 	/* Accept all sockets */
 	cur = worker->cf->listen_socks;
 	while (cur) {
@@ -243,6 +281,7 @@ rspamd_worker_stop_accept (struct rspamd_worker *worker)
 
 	if (worker->accept_events != NULL) {
 		g_list_free (worker->accept_events);
+		worker->accept_events = NULL;
 	}
 
 	g_hash_table_iter_init (&it, worker->signal_events);
@@ -41,6 +41,7 @@ typedef void (*rspamd_sig_handler_t) (gint, siginfo_t *, void *);
 #endif
 
 struct rspamd_worker;
+struct rspamd_worker_mem;
 
 /**
  * Prepare worker's startup
@@ -60,6 +61,14 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
  */
 void rspamd_worker_stop_accept (struct rspamd_worker *worker);
 
+/**
+ * Write memory usage of the current process to a shared slot
+ * @param mem slot or NULL
+ * @param title type of process
+ */
+void rspamd_worker_update_mem (struct rspamd_worker_mem *mem,
+	const gchar *title);
+
 typedef gint (*rspamd_controller_func_t) (
 	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg,
@@ -193,6 +193,7 @@ rspamd_stat_cache_sqlite3_process (struct rspamd_task *task,
 	rspamd_fstring_t *word;
 	guchar out[BLAKE2B_OUTBYTES];
 	GList *cur;
+	GArray *words;
 	guint i;
 
 	if (ctx != NULL && ctx->db != NULL) {
@@ -201,9 +202,10 @@ rspamd_stat_cache_sqlite3_process (struct rspamd_task *task,
 
 		while (cur) {
 			part = (struct mime_text_part *)cur->data;
+			words = rspamd_text_part_get_words (part);
 
-			for (i = 0; i < part->words->len; i ++) {
-				word = &g_array_index (part->words, rspamd_fstring_t, i);
+			for (i = 0; words != NULL && i < words->len; i ++) {
+				word = &g_array_index (words, rspamd_fstring_t, i);
 				blake2b_update (&st, word->begin, word->len);
 			}
 
@@ -307,18 +307,15 @@ rspamd_stat_process_tokenize (struct rspamd_tokenizer_config *cf,
 	while (cur != NULL) {
 		part = (struct mime_text_part *)cur->data;
 
-		if (!part->is_empty && part->words != NULL) {
-			/*
-			 * XXX: Use normalized words if needed here
-			 */
-
+		if (!part->is_empty && rspamd_text_part_get_words (part) != NULL) {
 			if (compat) {
 				tok->tokenizer->tokenize_func (cf, task->task_pool,
 					part->words, tok->tokens, part->is_utf);
 			}
 			else {
 				tok->tokenizer->tokenize_func (cf, task->task_pool,
-					part->normalized_words, tok->tokens, part->is_utf);
+					rspamd_text_part_get_normalized_words (part),
+					tok->tokens, part->is_utf);
 			}
 		}
 
@@ -333,7 +330,8 @@ rspamd_stat_process_tokenize (struct rspamd_tokenizer_config *cf,
 	}
 
 	if (sub != NULL) {
-		words = rspamd_tokenize_text (sub, strlen (sub), TRUE, 0, NULL);
+		words = rspamd_tokenize_text (sub, strlen (sub), TRUE, 0, 0, NULL,
+				NULL, NULL);
 		if (words != NULL) {
 			tok->tokenizer->tokenize_func (cf,
 					task->task_pool,
@@ -30,35 +30,104 @@
 #include "tokenizers.h"
 #include "stat_internal.h"
 
-const gchar t_delimiters[255] = {
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
-	1, 0, 0, 1, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 1, 0, 1, 1, 1, 1, 1, 0,
-	1, 1, 1, 1, 1, 1, 1, 1, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
-	1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 1, 1, 1, 1, 1, 1, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 1, 1, 1, 1, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0
+/*
+ * Ascii characters: 1 - word character, 0 - delimiter, 2 - upper case letter
+ */
+static const guchar t_ascii_class[128] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/*   ! " # $ % & ' ( ) * + , - . / */
+	0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0 - 9, : ; < = > ? */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+	/* @ A - Z [ \ ] ^ _ */
+	0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0,
+	/* ` a - z { | } ~ */
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+
+/*
+ * Ranges of non-ascii characters that separate words: punctuation, symbols,
+ * spaces and controls (a compact subset of Unicode word boundaries rules)
+ */
+static const struct {
+	gunichar start;
+	gunichar end;
+} t_unicode_delimiters[] = {
+	{0x0080, 0x00A9}, {0x00AB, 0x00AC}, /* 0x00AD is soft hyphen */
+	{0x00AE, 0x00B1}, {0x00B4, 0x00B4}, {0x00B6, 0x00B8},
+	{0x00BB, 0x00BB}, {0x00BF, 0x00BF}, {0x00D7, 0x00D7}, {0x00F7, 0x00F7},
+	{0x037E, 0x037E}, {0x0387, 0x0387}, {0x055A, 0x055F}, {0x0589, 0x058A},
+	{0x05BE, 0x05BE}, {0x05C0, 0x05C0}, {0x05C3, 0x05C3}, {0x05C6, 0x05C6},
+	{0x05F3, 0x05F4}, {0x0600, 0x060F}, {0x061B, 0x061F}, {0x066A, 0x066D},
+	{0x06D4, 0x06D4}, {0x0964, 0x0965}, {0x0970, 0x0970}, {0x0E3F, 0x0E3F},
+	{0x0E4F, 0x0E4F}, {0x0E5A, 0x0E5B}, {0x1680, 0x1680}, {0x2000, 0x206F},
+	{0x20A0, 0x20CF}, {0x2190, 0x2BFF}, {0x2E00, 0x2E7F}, {0x3000, 0x3003},
+	{0x3008, 0x3020}, {0x3030, 0x3030}, {0x303D, 0x303D}, {0x30FB, 0x30FB},
+	{0xFD3E, 0xFD3F}, {0xFE10, 0xFE1F}, {0xFE30, 0xFE6F}, {0xFEFF, 0xFEFF},
+	{0xFF00, 0xFF0F}, {0xFF1A, 0xFF20}, {0xFF3B, 0xFF40}, {0xFF5B, 0xFF65},
+	{0xFFF0, 0xFFFF}, {0x1F000, 0x1FAFF}
 };
 
+static inline gboolean
+rspamd_tokenizer_is_delimiter (gunichar c)
+{
+	gint lo = 0, hi = G_N_ELEMENTS (t_unicode_delimiters) - 1, mid;
+
+	if (c > 0x1FAFF || (c > 0xFFFF && c < 0x1F000)) {
+		return FALSE;
+	}
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+
+		if (c < t_unicode_delimiters[mid].start) {
+			hi = mid - 1;
+		}
+		else if (c > t_unicode_delimiters[mid].end) {
+			lo = mid + 1;
+		}
+		else {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Lower case for non-ascii characters with fast paths for common alphabets */
+static inline gunichar
+rspamd_tokenizer_tolower (gunichar c)
+{
+	if (c < 0x100) {
+		if (c >= 0xC0 && c <= 0xDE && c != 0xD7) {
+			return c + 0x20;
+		}
+		return c;
+	}
+	else if (c >= 0x400 && c < 0x460) {
+		/* Cyrillic */
+		if (c < 0x410) {
+			return c + 0x50;
+		}
+		else if (c < 0x430) {
+			return c + 0x20;
+		}
+		return c;
+	}
+	else if (c >= 0x391 && c <= 0x3A9 && c != 0x3A2) {
+		/* Greek */
+		return c + 0x20;
+	}
+	else if (c >= 0x3AC && c <= 0x3CE) {
+		return c;
+	}
+
+	return g_unichar_tolower (c);
+}
+
 int
 token_node_compare_func (gconstpointer a, gconstpointer b)
 {
@@ -71,115 +140,246 @@ token_node_compare_func (gconstpointer a, gconstpointer b)
 	return memcmp (aa->data, bb->data, aa->datalen);
 }
 
-/* Get next word from specified f_str_t buf */
-gchar *
-rspamd_tokenizer_get_word (rspamd_fstring_t * buf, rspamd_fstring_t * token, GList **exceptions)
+/* Decode a single utf8 character, returns its length or 0 if it is invalid */
+static inline gint
+rspamd_tokenizer_decode_utf8 (const guchar *p, const guchar *end, gunichar *uc)
 {
-	gsize remain, pos;
-	guchar *p;
-	struct process_exception *ex = NULL;
+	guchar c = *p;
 
-	if (buf == NULL) {
-		return NULL;
-	}
-
-	if (exceptions != NULL && *exceptions != NULL) {
-		ex = (*exceptions)->data;
+	if (c >= 0xC2 && c < 0xE0) {
+		if (end - p >= 2 && (p[1] & 0xC0) == 0x80) {
+			*uc = ((c & 0x1F) << 6) | (p[1] & 0x3F);
+			return 2;
+		}
 	}
-
-	if (token->begin == NULL) {
-		if (ex != NULL) {
-			if (ex->pos == 0) {
-				token->begin = buf->begin + ex->len;
-				token->len = ex->len;
-			}
-			else {
-				token->begin = buf->begin;
-				token->len = 0;
-			}
+	else if (c >= 0xE0 && c < 0xF0) {
+		if (end - p >= 3 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+			*uc = ((c & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+			return 3;
 		}
-		else {
-			token->begin = buf->begin;
-			token->len = 0;
+	}
+	else if (c >= 0xF0 && c < 0xF5) {
+		if (end - p >= 4 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80 &&
+				(p[3] & 0xC0) == 0x80) {
+			*uc = ((c & 0x07) << 18) | ((p[1] & 0x3F) << 12) |
+					((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+			return 4;
 		}
 	}
 
-	token->len = 0;
+	return 0;
+}
 
-	pos = token->begin - buf->begin;
-	if (pos >= buf->len) {
-		return NULL;
+/*
+ * Encode a character to utf8, if it requires more than `max` bytes, then
+ * the original character `orig` is copied
+ */
+static inline gint
+rspamd_tokenizer_encode_utf8 (gunichar c, gchar *out, gint max,
+		const guchar *orig, gint olen)
+{
+	if (c < 0x80) {
+		out[0] = c;
+		return 1;
+	}
+	else if (c < 0x800) {
+		out[0] = 0xC0 | (c >> 6);
+		out[1] = 0x80 | (c & 0x3F);
+		return 2;
+	}
+	else if (c < 0x10000 && max >= 3) {
+		out[0] = 0xE0 | (c >> 12);
+		out[1] = 0x80 | ((c >> 6) & 0x3F);
+		out[2] = 0x80 | (c & 0x3F);
+		return 3;
+	}
+	else if (c >= 0x10000 && c < 0x110000 && max >= 4) {
+		out[0] = 0xF0 | (c >> 18);
+		out[1] = 0x80 | ((c >> 12) & 0x3F);
+		out[2] = 0x80 | ((c >> 6) & 0x3F);
+		out[3] = 0x80 | (c & 0x3F);
+		return 4;
 	}
 
-	remain = buf->len - pos;
-	p = token->begin;
-	/* Skip non delimiters symbols */
-	do {
-		if (ex != NULL && ex->pos == pos) {
-			/* Go to the next exception */
-			*exceptions = g_list_next (*exceptions);
-			return p + ex->len;
-		}
-		pos++;
-		p++;
-		remain--;
-	} while (remain > 0 && t_delimiters[*p]);
+	memcpy (out, orig, olen);
 
-	token->begin = p;
+	return olen;
+}
 
-	while (remain > 0 && !t_delimiters[*p]) {
-		if (ex != NULL && ex->pos == pos) {
-			*exceptions = g_list_next (*exceptions);
-			return p + ex->len;
-		}
-		token->len++;
-		pos++;
-		remain--;
-		p++;
-	}
+static inline void
+rspamd_tokenizer_add_word (GArray *res, GArray *lc_res, gchar *begin,
+		gchar *end, gchar *lc_begin, gchar *lc_end)
+{
+	rspamd_fstring_t token;
 
-	if (remain == 0) {
-		return NULL;
-	}
+	token.begin = begin;
+	token.len = end - begin;
+	token.size = token.len;
+	g_array_append_val (res, token);
 
-	return p;
+	if (lc_res != NULL) {
+		token.begin = lc_begin;
+		token.len = lc_end - lc_begin;
+		token.size = token.len;
+		g_array_append_val (lc_res, token);
+	}
 }
 
 GArray *
 rspamd_tokenize_text (gchar *text, gsize len, gboolean is_utf,
-		gsize min_len, GList **exceptions)
+		gsize min_len, gsize max_words, GList *exceptions,
+		rspamd_mempool_t *pool, GArray **lc_words)
 {
-	rspamd_fstring_t token, buf;
-	gchar *pos;
-	gsize l;
-	GArray *res;
+	guchar *p, *end, *wstart = NULL, cls;
+	gchar *lc = NULL, *lc_char, *lc_start = NULL;
+	struct process_exception *ex;
+	gsize ex_pos = G_MAXSIZE, wlen = 0;
+	gunichar uc, luc;
+	gint clen;
+	GArray *res, *lc_res = NULL;
+	gboolean is_word;
 
 	if (len == 0 || text == NULL) {
 		return NULL;
 	}
 
-	buf.begin = text;
-	buf.len = len;
-	buf.size = buf.len;
-	token.begin = NULL;
-	token.len = 0;
+	res = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_fstring_t),
+			len / 8 + 1);
+
+	if (lc_words != NULL && pool != NULL) {
+		/*
+		 * All lower case words are written to a single buffer, lower case
+		 * characters are at most 1.5 times longer than upper case ones
+		 */
+		lc = rspamd_mempool_alloc (pool, len + len / 2 + 1);
+		lc_res = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_fstring_t),
+				len / 8 + 1);
+		*lc_words = lc_res;
+	}
+
+	if (exceptions != NULL) {
+		ex = exceptions->data;
+		ex_pos = ex->pos;
+	}
+
+	p = (guchar *)text;
+	end = p + len;
+
+	while (p < end) {
+		lc_char = lc;
+
+		if ((gsize)(p - (guchar *)text) >= ex_pos) {
+			/* Skip exception, e.g. url, and finish the current word */
+			is_word = FALSE;
+			clen = 0;
+		}
+		else if (*p < 0x80) {
+			cls = t_ascii_class[*p];
+			is_word = cls != 0;
+			clen = 1;
+
+			if (is_word && lc != NULL) {
+				*lc++ = cls == 2 ? *p + ('a' - 'A') : *p;
+			}
+		}
+		else if (!is_utf) {
+			/* Nothing is known about 8 bit characters in raw text */
+			is_word = TRUE;
+			clen = 1;
 
-	res = g_array_new (FALSE, FALSE, sizeof (rspamd_fstring_t));
-	while ((pos = rspamd_tokenizer_get_word (&buf,
-			&token, exceptions)) != NULL) {
-		if (is_utf) {
-			l = g_utf8_strlen (token.begin, token.len);
+			if (lc != NULL) {
+				*lc++ = *p;
+			}
 		}
 		else {
-			l = token.len;
+			clen = rspamd_tokenizer_decode_utf8 (p, end, &uc);
+
+			if (clen == 0) {
+				/* Invalid sequence is a delimiter */
+				is_word = FALSE;
+				clen = 1;
+			}
+			else if (uc == 0xAD) {
+				/* Soft hyphen is an invisible hint for hyphenation of a word */
+				if (wstart != NULL) {
+					p += clen;
+					continue;
+				}
+
+				is_word = FALSE;
+			}
+			else {
+				is_word = !rspamd_tokenizer_is_delimiter (uc);
+
+				if (is_word && lc != NULL) {
+					luc = rspamd_tokenizer_tolower (uc);
+
+					if (luc != uc) {
+						lc += rspamd_tokenizer_encode_utf8 (luc, lc, clen + 1,
+								p, clen);
+					}
+					else {
+						memcpy (lc, p, clen);
+						lc += clen;
+					}
+				}
+			}
 		}
-		if (min_len > 0 && l < min_len) {
-			token.begin = pos;
+
+		if (is_word) {
+			if (wstart == NULL) {
+				wstart = p;
+				lc_start = lc_char;
+				wlen = 0;
+			}
+
+			wlen ++;
+			p += clen;
 			continue;
 		}
-		g_array_append_val (res, token);
 
-		token.begin = pos;
+		if (wstart != NULL) {
+			if (min_len == 0 || wlen >= min_len) {
+				rspamd_tokenizer_add_word (res, lc_res, (gchar *)wstart,
+						(gchar *)p, lc_start, lc);
+
+				if (max_words > 0 && res->len >= max_words) {
+					return res;
+				}
+			}
+			else if (lc != NULL) {
+				/* Reuse buffer of the skipped word */
+				lc = lc_start;
+			}
+
+			wstart = NULL;
+		}
+
+		if (clen == 0) {
+			p = (guchar *)text + ex_pos + ex->len;
+			exceptions = g_list_next (exceptions);
+			ex_pos = G_MAXSIZE;
+
+			/* Skip exceptions that are inside of the skipped one */
+			while (exceptions != NULL) {
+				ex = exceptions->data;
+
+				if (ex->pos >= (gsize)(p - (guchar *)text)) {
+					ex_pos = ex->pos;
+					break;
+				}
+
+				exceptions = g_list_next (exceptions);
+			}
+		}
+		else {
+			p += clen;
+		}
+	}
+
+	if (wstart != NULL && (min_len == 0 || wlen >= min_len)) {
+		rspamd_tokenizer_add_word (res, lc_res, (gchar *)wstart,
+				(gchar *)end, lc_start, lc);
 	}
 
 	return res;
@@ -22,13 +22,15 @@ struct rspamd_stat_tokenizer {
 /* Compare two token nodes */
 int token_node_compare_func (gconstpointer a, gconstpointer b);
 
-/* Get next word from specified f_str_t buf */
-gchar * rspamd_tokenizer_get_word (rspamd_fstring_t *buf,
-		rspamd_fstring_t *token, GList **exceptions);
-
-/* Tokenize text into array of words (rspamd_fstring_t type) */
+/*
+ * Tokenize text into array of at most max_words (0 - unlimited) words
+ * (rspamd_fstring_t type) skipping exceptions (list of struct process_exception).
+ * If lc_words is not NULL, then it is set to the array of the same words in
+ * lower case, allocated in a single buffer from the pool
+ */
 GArray * rspamd_tokenize_text (gchar *text, gsize len, gboolean is_utf,
-		gsize min_len, GList **exceptions);
+		gsize min_len, gsize max_words, GList *exceptions,
+		rspamd_mempool_t *pool, GArray **lc_words);
 
 /* OSB tokenize function */
 int rspamd_tokenizer_osb (struct rspamd_tokenizer_config *cf,
@@ -197,12 +197,21 @@ rspamd_ip_is_valid (const rspamd_inet_addr_t *addr)
 gint
 rspamd_accept_from_socket (gint sock, rspamd_inet_addr_t **target)
 {
-	gint nfd, serrno;
+	gint nfd;
+#ifndef HAVE_ACCEPT4
+	gint serrno;
+#endif
 	union sa_union su;
 	socklen_t len = sizeof (su);
 	rspamd_inet_addr_t *addr = NULL;
 
-	if ((nfd = accept (sock, &su.sa, &len)) == -1) {
+#ifdef HAVE_ACCEPT4
+	nfd = accept4 (sock, &su.sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	nfd = accept (sock, &su.sa, &len);
+#endif
+
+	if (nfd == -1) {
 		if (target) {
 			*target = NULL;
 		}
@@ -224,6 +233,7 @@ rspamd_accept_from_socket (gint sock, rspamd_inet_addr_t **target)
 		memcpy (&addr->u.in.addr, &su, MIN (len, sizeof (addr->u.in.addr)));
 	}
 
+#ifndef HAVE_ACCEPT4
 	if (rspamd_socket_nonblocking (nfd) < 0) {
 		goto out;
 	}
@@ -233,6 +243,7 @@ rspamd_accept_from_socket (gint sock, rspamd_inet_addr_t **target)
 		msg_warn ("fcntl failed: %d, '%s'", errno, strerror (errno));
 		goto out;
 	}
+#endif
 
 	if (target) {
 		*target = addr;
@@ -244,6 +255,7 @@ rspamd_accept_from_socket (gint sock, rspamd_inet_addr_t **target)
 
 	return (nfd);
 
+#ifndef HAVE_ACCEPT4
 out:
 	serrno = errno;
 	close (nfd);
@@ -251,6 +263,7 @@ out:
 	rspamd_inet_address_destroy (addr);
 
 	return (-1);
+#endif
 
 }
 
@@ -460,7 +473,7 @@ rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
 
 int
 rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
-		gboolean async)
+		gboolean async, gboolean reuseport)
 {
 	gint fd, r;
 	gint on = 1;
@@ -490,6 +503,16 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 
 	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (gint));
 
+#ifdef HAVE_SO_REUSEPORT
+	if (reuseport && addr->af != AF_UNIX) {
+		if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+				sizeof (gint)) == -1) {
+			msg_warn ("cannot set SO_REUSEPORT: %d, '%s'", errno,
+					strerror (errno));
+		}
+	}
+#endif
+
 #ifdef HAVE_IPV6_V6ONLY
 	if (addr->af == AF_INET6) {
 		/* We need to set this flag to avoid errors */
@@ -128,10 +128,12 @@ int rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
  * @param addr
  * @param type
  * @param async
+ * @param reuseport allow other sockets to listen on the same address and
+ * port (ignored for unix sockets and if SO_REUSEPORT is not supported)
  * @return
  */
 int rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
-	gboolean async);
+	gboolean async, gboolean reuseport);
 /**
  * Check whether specified ip is valid (not INADDR_ANY or INADDR_NONE) for ipv4 or ipv6
  * @param ptr pointer to struct in_addr or struct in6_addr
@@ -45,32 +45,29 @@ struct roll_state {
 	gint n;
 };
 
-static struct roll_state rs;
-
-
 /* Rolling hash function based on Adler-32 checksum */
 static guint32
-fuzzy_roll_hash (guint c)
+fuzzy_roll_hash (struct roll_state *rs, guint c)
 {
 	/* Check window position */
-	if (rs.n == ROLL_WINDOW_SIZE) {
-		rs.n = 0;
+	if (rs->n == ROLL_WINDOW_SIZE) {
+		rs->n = 0;
 	}
 
-	rs.h[1] -= rs.h[0];
-	rs.h[1] += ROLL_WINDOW_SIZE * c;
+	rs->h[1] -= rs->h[0];
+	rs->h[1] += ROLL_WINDOW_SIZE * c;
 
-	rs.h[0] += c;
-	rs.h[0] -= rs.window[rs.n];
+	rs->h[0] += c;
+	rs->h[0] -= rs->window[rs->n];
 
 	/* Save current symbol */
-	rs.window[rs.n] = c;
-	rs.n++;
+	rs->window[rs->n] = c;
+	rs->n++;
 
-	rs.h[2] <<= 5;
-	rs.h[2] ^= c;
+	rs->h[2] <<= 5;
+	rs->h[2] ^= c;
 
-	return rs.h[0] + rs.h[1] + rs.h[2];
+	return rs->h[0] + rs->h[1] + rs->h[2];
 }
 
 /* A simple non-rolling hash, based on the FNV hash */
@@ -98,9 +95,9 @@ fuzzy_blocksize (guint32 len)
 
 /* Update hash with new symbol */
 static void
-fuzzy_update (rspamd_fuzzy_t * h, guint c)
+fuzzy_update (struct roll_state *rs, rspamd_fuzzy_t * h, guint c)
 {
-	h->rh = fuzzy_roll_hash (c);
+	h->rh = fuzzy_roll_hash (rs, c);
 	h->h = fuzzy_fnv_hash (c, h->h);
 
 	if (h->rh % h->block_size == (h->block_size - 1)) {
@@ -113,9 +110,10 @@ fuzzy_update (rspamd_fuzzy_t * h, guint c)
 }
 
 static void
-fuzzy_update2 (rspamd_fuzzy_t * h1, rspamd_fuzzy_t *h2, guint c)
+fuzzy_update2 (struct roll_state *rs, rspamd_fuzzy_t * h1, rspamd_fuzzy_t *h2,
+	guint c)
 {
-	h1->rh = fuzzy_roll_hash (c);
+	h1->rh = fuzzy_roll_hash (rs, c);
 	h1->h = fuzzy_fnv_hash (c, h1->h);
 	h2->rh = h1->rh;
 	h2->h = fuzzy_fnv_hash (c, h2->h);
@@ -259,6 +257,7 @@ rspamd_fuzzy_t *
 rspamd_fuzzy_init (rspamd_fstring_t * in, rspamd_mempool_t * pool)
 {
 	rspamd_fuzzy_t *new;
+	struct roll_state rs;
 	guint i, repeats = 0;
 	gchar *c = in->begin, last = '\0';
 	gsize real_len = 0;
@@ -290,7 +289,7 @@ rspamd_fuzzy_init (rspamd_fstring_t * in, rspamd_mempool_t * pool)
 			repeats = 0;
 		}
 		if (!g_ascii_isspace (*c) && !g_ascii_ispunct (*c) && repeats < 3) {
-			fuzzy_update (new, *c);
+			fuzzy_update (&rs, new, *c);
 		}
 		last = *c;
 		c++;
@@ -321,6 +320,7 @@ rspamd_fuzzy_from_text_part (struct mime_text_part *part,
 	gsize max_diff)
 {
 	rspamd_fuzzy_t *new, *new2;
+	struct roll_state rs;
 	gchar *c, *end, *begin, *p;
 	gsize real_len = 0, len = part->content->len;
 	GList *cur_offset;
@@ -413,7 +413,7 @@ rspamd_fuzzy_from_text_part (struct mime_text_part *part,
 			else {
 				uc = g_utf8_get_char (c);
 				if (g_unichar_isalnum (uc)) {
-					fuzzy_update2 (new, new2, uc);
+					fuzzy_update2 (&rs, new, new2, uc);
 					if (write_diff) {
 						rspamd_fstrappend_u (part->diff_str, uc);
 					}
@@ -433,7 +433,7 @@ rspamd_fuzzy_from_text_part (struct mime_text_part *part,
 			}
 			else {
 				if (!g_ascii_isspace (*c) && !g_ascii_ispunct (*c)) {
-					fuzzy_update2 (new, new2, *c);
+					fuzzy_update2 (&rs, new, new2, *c);
 					if (write_diff) {
 						rspamd_fstrappend_c (part->diff_str, *c);
 					}
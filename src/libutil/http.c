@@ -41,6 +41,7 @@ struct rspamd_http_connection_private {
 	} *buf;
 	gboolean new_header;
 	gboolean encrypted;
+	gboolean body_direct;
 	gpointer peer_key;
 	struct rspamd_http_keypair *local_key;
 	struct rspamd_http_header *header;
@@ -54,6 +55,8 @@ struct rspamd_http_connection_private {
 	guint outlen;
 	gsize wr_pos;
 	gsize wr_total;
+	/* Pipelined data read after the end of the current message */
+	GString *pending;
 };
 
 enum http_magic_type {
@@ -553,6 +556,8 @@ rspamd_http_on_headers_complete (http_parser * parser)
 
 	if (parser->content_length != 0 && parser->content_length != ULLONG_MAX) {
 		priv->msg->body = g_string_sized_new (parser->content_length + 1);
+		/* The rest of body is read from the socket directly to this buffer */
+		priv->body_direct = TRUE;
 	}
 	else {
 		priv->msg->body = g_string_sized_new (BUFSIZ);
@@ -561,11 +566,28 @@ rspamd_http_on_headers_complete (http_parser * parser)
 	if (parser->flags & F_SPAMC) {
 		priv->msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
+	else if (conn->type == RSPAMD_HTTP_CLIENT) {
+		if (http_should_keep_alive (parser)) {
+			priv->msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+		}
+	}
+	else if ((parser->flags & F_CONNECTION_KEEP_ALIVE) &&
+			parser->method < HTTP_SYMBOLS) {
+		/*
+		 * Requests are persistent only if a client asks for it explicitly,
+		 * even for HTTP/1.1, as older clients expect connection to be closed
+		 */
+		priv->msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+	}
 
 	priv->msg->body_buf.str = priv->msg->body->str;
 	priv->msg->method = parser->method;
 	priv->msg->code = parser->status_code;
 
+	if (conn->headers_handler != NULL) {
+		return conn->headers_handler (conn, priv->msg);
+	}
+
 	return 0;
 }
 
@@ -578,7 +600,15 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 
 	priv = conn->priv;
 
-	g_string_append_len (priv->msg->body, at, length);
+	if (at == priv->msg->body->str + priv->msg->body->len) {
+		/* Data has been read in place */
+		priv->msg->body->len += length;
+		priv->msg->body->str[priv->msg->body->len] = '\0';
+	}
+	else {
+		g_string_append_len (priv->msg->body, at, length);
+		priv->msg->body_buf.str = priv->msg->body->str;
+	}
 
 	if ((conn->opts & RSPAMD_HTTP_BODY_PARTIAL) && !priv->encrypted) {
 		/* Incremental update is basically impossible for encrypted requests */
@@ -598,8 +628,20 @@ rspamd_http_on_message_complete (http_parser * parser)
 	guchar *nonce, *m;
 	gsize dec_len;
 	struct rspamd_http_keypair *peer_key = NULL;
+	gboolean keepalive = FALSE;
 
 	priv = conn->priv;
+	priv->body_direct = FALSE;
+
+	if (conn->type == RSPAMD_HTTP_SERVER &&
+			(priv->msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE)) {
+		/*
+		 * Do not read the next request until this one is replied, the parser
+		 * is paused after this callback and the rest of data is saved
+		 */
+		keepalive = TRUE;
+		event_del (&priv->ev);
+	}
 
 	if (conn->body_handler != NULL) {
 
@@ -662,6 +704,10 @@ rspamd_http_on_message_complete (http_parser * parser)
 		rspamd_http_connection_unref (conn);
 	}
 
+	if (ret == 0 && keepalive) {
+		http_parser_pause (parser, 1);
+	}
+
 	return ret;
 }
 
@@ -768,8 +814,10 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	struct rspamd_http_connection *conn = (struct rspamd_http_connection *)ud;
 	struct rspamd_http_connection_private *priv;
 	struct _rspamd_http_privbuf *pbuf;
-	GString *buf;
+	GString *buf, *body;
+	gchar *rbuf;
 	gssize r;
+	gsize nparsed;
 	GError *err;
 
 	priv = conn->priv;
@@ -779,7 +827,26 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	buf = priv->buf->data;
 
 	if (what == EV_READ) {
-		r = read (fd, buf->str, buf->allocated_len);
+		if (priv->pending != NULL && priv->pending->len > 0) {
+			/* Process pipelined request before reading from the socket */
+			g_string_truncate (buf, 0);
+			g_string_append_len (buf, priv->pending->str, priv->pending->len);
+			g_string_truncate (priv->pending, 0);
+			rbuf = buf->str;
+			r = buf->len;
+		}
+		else if (priv->body_direct) {
+			/* Avoid copying of body, but do not read beyond its end */
+			body = priv->msg->body;
+			rbuf = body->str + body->len;
+			r = read (fd, rbuf, MIN (priv->parser.content_length,
+					body->allocated_len - body->len - 1));
+		}
+		else {
+			rbuf = buf->str;
+			r = read (fd, rbuf, buf->allocated_len);
+		}
+
 		if (r == -1) {
 			err = g_error_new (HTTP_ERROR,
 					errno,
@@ -806,10 +873,22 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 			return;
 		}
 		else {
-			buf->len = r;
-
-			if (http_parser_execute (&priv->parser, &priv->parser_cb, buf->str,
-				r) != (size_t)r) {
+			if (rbuf == buf->str) {
+				buf->len = r;
+			}
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb,
+					rbuf, r);
+
+			if (nparsed != (size_t)r &&
+					HTTP_PARSER_ERRNO (&priv->parser) == HPE_PAUSED) {
+				/* Keep the rest of data for the next message */
+				if (priv->pending == NULL) {
+					priv->pending = g_string_sized_new (r - nparsed);
+				}
+				g_string_append_len (priv->pending, rbuf + nparsed,
+						r - nparsed);
+			}
+			else if (nparsed != (size_t)r) {
 				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
@@ -914,6 +993,8 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 		priv->msg = NULL;
 	}
 	conn->finished = FALSE;
+	priv->encrypted = FALSE;
+	priv->body_direct = FALSE;
 	/* Clear priv */
 	event_del (&priv->ev);
 	if (priv->buf != NULL) {
@@ -944,6 +1025,9 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 		peer_key = (struct rspamd_http_keypair *)priv->peer_key;
 		REF_RELEASE (peer_key);
 	}
+	if (priv->pending) {
+		g_string_free (priv->pending, TRUE);
+	}
 
 	g_slice_free1 (sizeof (struct rspamd_http_connection_private), priv);
 	g_slice_free1 (sizeof (struct rspamd_http_connection),		   conn);
@@ -963,9 +1047,15 @@ rspamd_http_connection_read_message (struct rspamd_http_connection *conn,
 	priv->msg = req;
 
 	if (priv->peer_key) {
-		priv->msg->peer_key = priv->peer_key;
+		if (conn->type == RSPAMD_HTTP_CLIENT) {
+			priv->msg->peer_key = priv->peer_key;
+			priv->encrypted = TRUE;
+		}
+		else {
+			/* Key of a new request is defined by its own headers */
+			rspamd_http_connection_key_unref (priv->peer_key);
+		}
 		priv->peer_key = NULL;
-		priv->encrypted = TRUE;
 	}
 
 	if (timeout == NULL) {
@@ -990,6 +1080,11 @@ rspamd_http_connection_read_message (struct rspamd_http_connection *conn,
 		event_base_set (base, &priv->ev);
 	}
 	event_add (&priv->ev, priv->ptv);
+
+	if (priv->pending != NULL && priv->pending->len > 0) {
+		/* We have already got (a part of) the next message */
+		event_active (&priv->ev, EV_READ, 0);
+	}
 }
 
 void
@@ -1029,7 +1124,12 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 	buf = priv->buf->data;
 
 	if (priv->peer_key && priv->local_key) {
-		priv->msg->peer_key = priv->peer_key;
+		if (priv->msg->peer_key == NULL) {
+			priv->msg->peer_key = priv->peer_key;
+		}
+		else {
+			rspamd_http_connection_key_unref (priv->peer_key);
+		}
 		priv->peer_key = NULL;
 		priv->encrypted = TRUE;
 	}
@@ -1092,7 +1192,7 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				mime_type = "text/plain";
 			}
 			rspamd_printf_gstring (buf, "HTTP/1.1 %d %s\r\n"
-				"Connection: close\r\n"
+				"Connection: %s\r\n"
 				"Server: %s\r\n"
 				"Date: %s\r\n"
 				"Content-Length: %z\r\n"
@@ -1100,6 +1200,7 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				msg->code,
 				msg->status ? msg->status->str : rspamd_http_code_to_str (msg->
 				code),
+				(msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE) ? "keep-alive" : "close",
 				"rspamd/" RVERSION,
 				datebuf,
 				bodylen,
@@ -1122,13 +1223,17 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 			rspamd_printf_gstring (buf, "%s %v HTTP/1.0\r\n"
 					"Content-Length: %z\r\n",
 					http_method_str (msg->method), msg->url, bodylen);
+			if (msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE) {
+				rspamd_printf_gstring (buf, "Connection: keep-alive\r\n");
+			}
 		}
 		else {
 			rspamd_printf_gstring (buf, "%s %v HTTP/1.1\r\n"
-				"Connection: close\r\n"
+				"Connection: %s\r\n"
 				"Host: %s\r\n"
 				"Content-Length: %z\r\n",
 				http_method_str (msg->method), msg->url,
+				(msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE) ? "keep-alive" : "close",
 				host != NULL ? host : msg->host->str,
 				bodylen);
 		}
@@ -53,6 +53,10 @@ struct rspamd_http_header {
  * Legacy spamc protocol
  */
 #define RSPAMD_HTTP_FLAG_SPAMC 1 << 1
+/**
+ * Keep connection alive after this message
+ */
+#define RSPAMD_HTTP_FLAG_KEEPALIVE 1 << 2
 
 /**
  * HTTP message structure, used for requests and replies
@@ -93,6 +97,9 @@ typedef int (*rspamd_http_body_handler_t) (struct rspamd_http_connection *conn,
 	const gchar *chunk,
 	gsize len);
 
+typedef int (*rspamd_http_headers_handler_t) (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg);
+
 typedef void (*rspamd_http_error_handler_t) (struct rspamd_http_connection *conn,
 	GError *err);
 
@@ -116,6 +123,7 @@ struct rspamd_http_connection {
 	rspamd_http_body_handler_t body_handler;
 	rspamd_http_error_handler_t error_handler;
 	rspamd_http_finish_handler_t finish_handler;
+	rspamd_http_headers_handler_t headers_handler; /**< Optional, called when headers are read */
 	struct rspamd_keypair_cache *cache;
 	gpointer ud;
 	unsigned opts;
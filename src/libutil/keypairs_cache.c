@@ -35,8 +35,26 @@ struct rspamd_keypair_elt {
 	guchar pair[rspamd_cryptobox_PKBYTES + rspamd_cryptobox_SKBYTES];
 };
 
+/* Number of elements in a bucket of shared cache */
+#define RSPAMD_KEYPAIR_SHARED_WAYS 4
+#define RSPAMD_KEYPAIR_SHARED_IDBYTES 32
+
+struct rspamd_keypair_shared_elt {
+	guchar id[RSPAMD_KEYPAIR_SHARED_IDBYTES];
+	guchar nm[rspamd_cryptobox_NMBYTES];
+	guint64 used;
+};
+
+struct rspamd_keypair_shared_cache {
+	rspamd_mempool_mutex_t *mtx;
+	guint nbuckets;
+	guint64 generation;
+	struct rspamd_keypair_shared_elt *elts;
+};
+
 struct rspamd_keypair_cache {
 	rspamd_lru_hash_t *hash;
+	struct rspamd_keypair_shared_cache *shared;
 };
 
 static void
@@ -73,12 +91,99 @@ rspamd_keypair_cache_new (guint max_items)
 	g_assert (max_items > 0);
 
 	c = g_slice_alloc (sizeof (*c));
+	c->shared = NULL;
 	c->hash = rspamd_lru_hash_new_full (max_items, -1, NULL,
 			rspamd_keypair_destroy, rspamd_keypair_hash, rspamd_keypair_equal);
 
 	return c;
 }
 
+struct rspamd_keypair_shared_cache *
+rspamd_keypair_shared_cache_new (rspamd_mempool_t *pool, guint max_items)
+{
+	struct rspamd_keypair_shared_cache *sc;
+
+	g_assert (max_items > 0);
+
+	sc = rspamd_mempool_alloc0_shared (pool, sizeof (*sc));
+	sc->nbuckets = MAX (max_items / RSPAMD_KEYPAIR_SHARED_WAYS, 1);
+	sc->elts = rspamd_mempool_alloc0_shared (pool,
+			sizeof (*sc->elts) * sc->nbuckets * RSPAMD_KEYPAIR_SHARED_WAYS);
+	sc->mtx = rspamd_mempool_get_mutex (pool);
+
+	return sc;
+}
+
+void
+rspamd_keypair_cache_set_shared (struct rspamd_keypair_cache *c,
+		struct rspamd_keypair_shared_cache *sc)
+{
+	c->shared = sc;
+}
+
+static struct rspamd_keypair_shared_elt *
+rspamd_keypair_shared_bucket (struct rspamd_keypair_shared_cache *sc,
+		const guchar *id)
+{
+	guint32 h;
+
+	/* Id is a digest, so its bytes are uniformly distributed */
+	memcpy (&h, id, sizeof (h));
+
+	return &sc->elts[(h % sc->nbuckets) * RSPAMD_KEYPAIR_SHARED_WAYS];
+}
+
+static gboolean
+rspamd_keypair_shared_lookup (struct rspamd_keypair_shared_cache *sc,
+		const guchar *id, guchar *nm)
+{
+	struct rspamd_keypair_shared_elt *bucket;
+	gboolean ret = FALSE;
+	guint i;
+
+	bucket = rspamd_keypair_shared_bucket (sc, id);
+	rspamd_mempool_lock_mutex (sc->mtx);
+
+	for (i = 0; i < RSPAMD_KEYPAIR_SHARED_WAYS; i ++) {
+		if (bucket[i].used != 0 &&
+				memcmp (bucket[i].id, id, sizeof (bucket[i].id)) == 0) {
+			memcpy (nm, bucket[i].nm, sizeof (bucket[i].nm));
+			bucket[i].used = ++sc->generation;
+			ret = TRUE;
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (sc->mtx);
+
+	return ret;
+}
+
+static void
+rspamd_keypair_shared_insert (struct rspamd_keypair_shared_cache *sc,
+		const guchar *id, const guchar *nm)
+{
+	struct rspamd_keypair_shared_elt *bucket, *victim;
+	guint i;
+
+	bucket = rspamd_keypair_shared_bucket (sc, id);
+	rspamd_mempool_lock_mutex (sc->mtx);
+	victim = &bucket[0];
+
+	/* Replace the least recently used element of the bucket */
+	for (i = 1; i < RSPAMD_KEYPAIR_SHARED_WAYS; i ++) {
+		if (bucket[i].used < victim->used) {
+			victim = &bucket[i];
+		}
+	}
+
+	memcpy (victim->id, id, sizeof (victim->id));
+	memcpy (victim->nm, nm, sizeof (victim->nm));
+	victim->used = ++sc->generation;
+
+	rspamd_mempool_unlock_mutex (sc->mtx);
+}
+
 void
 rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		gpointer lk, gpointer rk)
@@ -86,6 +191,7 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	struct rspamd_http_keypair *kp_local = (struct rspamd_http_keypair *)lk,
 			*kp_remote = (struct rspamd_http_keypair *)rk;
 	struct rspamd_keypair_elt search, *new;
+	guchar pks[rspamd_cryptobox_PKBYTES * 2], id[RSPAMD_KEYPAIR_SHARED_IDBYTES];
 
 	g_assert (kp_local != NULL);
 	g_assert (kp_remote != NULL);
@@ -100,7 +206,23 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		memcpy (new->pair, kp_remote->pk, rspamd_cryptobox_PKBYTES);
 		memcpy (&new->pair[rspamd_cryptobox_PKBYTES], kp_local->sk,
 				rspamd_cryptobox_SKBYTES);
-		rspamd_cryptobox_nm (new->nm, kp_remote->pk, kp_local->sk);
+
+		if (c->shared != NULL) {
+			/* Shared keys are identified by both public keys */
+			memcpy (pks, kp_remote->pk, rspamd_cryptobox_PKBYTES);
+			memcpy (&pks[rspamd_cryptobox_PKBYTES], kp_local->pk,
+					rspamd_cryptobox_PKBYTES);
+			blake2b (id, pks, NULL, sizeof (id), sizeof (pks), 0);
+
+			if (!rspamd_keypair_shared_lookup (c->shared, id, new->nm)) {
+				rspamd_cryptobox_nm (new->nm, kp_remote->pk, kp_local->sk);
+				rspamd_keypair_shared_insert (c->shared, id, new->nm);
+			}
+		}
+		else {
+			rspamd_cryptobox_nm (new->nm, kp_remote->pk, kp_local->sk);
+		}
+
 		rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
 	}
 
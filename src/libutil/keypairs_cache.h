@@ -27,7 +27,10 @@
 
 #include "config.h"
 
+#include "mem_pool.h"
+
 struct rspamd_keypair_cache;
+struct rspamd_keypair_shared_cache;
 
 /**
  * Create new keypair cache of the specified size
@@ -37,6 +40,24 @@ struct rspamd_keypair_cache;
 struct rspamd_keypair_cache * rspamd_keypair_cache_new (guint max_items);
 
 
+/**
+ * Create cache of shared keys in shared memory, so it can be used by all
+ * processes forked after its creation
+ * @param pool memory pool used for shared allocations
+ * @param max_items defines maximum count of elements in the cache
+ * @return new shared cache
+ */
+struct rspamd_keypair_shared_cache * rspamd_keypair_shared_cache_new (
+		rspamd_mempool_t *pool, guint max_items);
+
+/**
+ * Use shared cache if a key is not found in the local cache
+ * @param c cache of keypairs
+ * @param sc shared cache
+ */
+void rspamd_keypair_cache_set_shared (struct rspamd_keypair_cache *c,
+		struct rspamd_keypair_shared_cache *sc);
+
 /**
  * Process local and remote keypair setting beforenm value as appropriate
  * @param c cache of keypairs
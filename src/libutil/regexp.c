@@ -42,11 +42,6 @@ struct rspamd_regexp_s {
 	gchar *pattern;
 	pcre *re;
 	pcre_extra *extra;
-#ifdef HAVE_PCRE_JIT
-	pcre_jit_stack *jstack;
-	pcre_jit_stack *raw_jstack;
-	rspamd_mutex_t *mtx;
-#endif
 	pcre *raw_re;
 	pcre_extra *raw_extra;
 	regexp_id_t id;
@@ -61,6 +56,43 @@ struct rspamd_regexp_cache {
 
 static struct rspamd_regexp_cache *global_re_cache = NULL;
 
+#ifdef HAVE_PCRE_JIT
+/*
+ * JIT stack is shared by all regexps used in a thread, so regexps are not
+ * modified on matching and their memory is kept shared by forked workers
+ */
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+static GStaticPrivate jit_stack_key = G_STATIC_PRIVATE_INIT;
+#else
+static GPrivate jit_stack_key =
+	G_PRIVATE_INIT ((GDestroyNotify)pcre_jit_stack_free);
+#endif
+
+static pcre_jit_stack *
+rspamd_regexp_jit_stack (gpointer unused)
+{
+	pcre_jit_stack *st;
+
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+	st = g_static_private_get (&jit_stack_key);
+#else
+	st = g_private_get (&jit_stack_key);
+#endif
+
+	if (st == NULL) {
+		st = pcre_jit_stack_alloc (32 * 1024, 512 * 1024);
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
+		g_static_private_set (&jit_stack_key, st,
+			(GDestroyNotify)pcre_jit_stack_free);
+#else
+		g_private_set (&jit_stack_key, st);
+#endif
+	}
+
+	return st;
+}
+#endif
+
 static GQuark
 rspamd_regexp_quark (void)
 {
@@ -91,7 +123,6 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 			pcre_free (re->re);
 #ifdef HAVE_PCRE_JIT
 			pcre_free_study (re->extra);
-			pcre_jit_stack_free (re->jstack);
 #else
 			pcre_free (re->extra);
 #endif
@@ -100,16 +131,10 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 			pcre_free (re->raw_re);
 #ifdef HAVE_PCRE_JIT
 			pcre_free_study (re->raw_extra);
-			pcre_jit_stack_free (re->raw_jstack);
 #else
 			pcre_free (re->raw_extra);
 #endif
 		}
-#ifdef HAVE_PCRE_JIT
-		if (re->mtx) {
-			rspamd_mutex_free (re->mtx);
-		}
-#endif
 		if (re->pattern) {
 			g_free (re->pattern);
 		}
@@ -246,14 +271,12 @@ fin:
 		/* Optimize regexp */
 #ifdef HAVE_PCRE_JIT
 		study_flags |= PCRE_STUDY_JIT_COMPILE;
-		res->mtx = rspamd_mutex_new ();
 #endif
 		if (res->re) {
 			res->extra = pcre_study (res->re, study_flags, &err_str);
 			if (res->extra != NULL) {
 #ifdef HAVE_PCRE_JIT
-				res->jstack = pcre_jit_stack_alloc (32 * 1024, 512 * 1024);
-				pcre_assign_jit_stack (res->extra, NULL, res->jstack);
+				pcre_assign_jit_stack (res->extra, rspamd_regexp_jit_stack, NULL);
 #endif
 			}
 			else {
@@ -265,8 +288,8 @@ fin:
 			res->raw_extra = pcre_study (res->raw_re, study_flags, &err_str);
 			if (res->raw_extra != NULL) {
 #ifdef HAVE_PCRE_JIT
-				res->raw_jstack = pcre_jit_stack_alloc (32 * 1024, 512 * 1024);
-				pcre_assign_jit_stack (res->raw_extra, NULL, res->raw_jstack);
+				pcre_assign_jit_stack (res->raw_extra, rspamd_regexp_jit_stack,
+					NULL);
 #endif
 			}
 			else {
@@ -322,25 +345,17 @@ rspamd_regexp_search (rspamd_regexp_t *re, const gchar *text, gsize len,
 	if ((re->flags & RSPAMD_REGEXP_FLAG_RAW) || raw) {
 		r = re->raw_re;
 		ext = re->raw_extra;
-#if defined(HAVE_PCRE_JIT) && (PCRE_MAJOR == 8 && PCRE_MINOR >= 32)
-		st = re->raw_jstack;
-#endif
 	}
 	else {
 		match_flags |= PCRE_NO_UTF8_CHECK;
 		r = re->re;
 		ext = re->extra;
-#if defined(HAVE_PCRE_JIT) && (PCRE_MAJOR == 8 && PCRE_MINOR >= 32)
-		st = re->jstack;
-#endif
 	}
 
 	g_assert (r != NULL);
 
-#ifdef HAVE_PCRE_JIT
-	if (re->mtx) {
-		rspamd_mutex_lock (re->mtx);
-	}
+#if defined(HAVE_PCRE_JIT) && (PCRE_MAJOR == 8 && PCRE_MINOR >= 32)
+	st = rspamd_regexp_jit_stack (NULL);
 #endif
 
 	if (!(re->flags & RSPAMD_REGEXP_FLAG_NOOPT)) {
@@ -362,11 +377,6 @@ rspamd_regexp_search (rspamd_regexp_t *re, const gchar *text, gsize len,
 		rc = pcre_exec (r, ext, mt, remain, 0, match_flags, ovec,
 				G_N_ELEMENTS (ovec));
 	}
-#ifdef HAVE_PCRE_JIT
-	if (re->mtx) {
-		rspamd_mutex_unlock (re->mtx);
-	}
-#endif
 	if (rc > 0) {
 		if (start) {
 			*start = mt + ovec[0];
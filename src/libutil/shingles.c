@@ -23,54 +23,72 @@
 
 #include "shingles.h"
 #include "fstring.h"
+#include "util.h"
 #include "siphash.h"
 #include "blake2.h"
+#include "xxhash.h"
 
 #define SHINGLES_WINDOW 3
+/* Number of shingles keys sets cached */
+#define SHINGLES_KEYS_CACHE 4
+/* Seed of gear table used for chunking, must be the same for all hosts */
+#define SHINGLES_GEAR_SEED 0x7275737061686461ULL
 
-static void
-rspamd_shingles_update_row (rspamd_fstring_t *in, struct siphash *h)
-{
-	int i;
+struct rspamd_shingles_keys {
+	guchar key[16];
+	struct sipkey keys[RSPAMD_SHINGLE_SIZE];
+	guint64 lanes[RSPAMD_SHINGLE_SIZE];
+	gboolean valid;
+};
 
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		sip24_update (&h[i], in->begin, in->len);
-	}
-}
+struct rspamd_shingles_keys_cache {
+	struct rspamd_shingles_keys keys[SHINGLES_KEYS_CACHE];
+	guint next;
+};
 
-struct rspamd_shingle*
-rspamd_shingles_generate (GArray *input,
-		const guchar key[16],
-		rspamd_mempool_t *pool,
-		rspamd_shingles_filter filter,
-		gpointer filterd)
+/* Shingles are generated by mime parser threads as well */
+static rspamd_private_t keys_cache_key = RSPAMD_PRIVATE_INIT (g_free);
+
+/*
+ * Derive keys for all shingles from the input key. Derivation is rather
+ * expensive, so we cache derived keys for a small number of input keys
+ * in each thread
+ */
+static const struct rspamd_shingles_keys *
+rspamd_shingles_get_keys (const guchar key[16])
 {
-	struct rspamd_shingle *res;
-	GArray *hashes[RSPAMD_SHINGLE_SIZE];
-	struct sipkey keys[RSPAMD_SHINGLE_SIZE];
-	struct siphash h[RSPAMD_SHINGLE_SIZE];
+	struct rspamd_shingles_keys *k;
 	guchar shabuf[BLAKE2B_OUTBYTES], *out_key;
 	const guchar *cur_key;
 	blake2b_state bs;
-	gint i, j, beg = 0;
+	struct rspamd_shingles_keys_cache *cache;
 	guint8 shalen;
+	gint i, j;
 
-	if (pool != NULL) {
-		res = rspamd_mempool_alloc (pool, sizeof (*res));
+	cache = rspamd_private_get (&keys_cache_key);
+
+	if (cache == NULL) {
+		cache = g_malloc0 (sizeof (*cache));
+		rspamd_private_set (&keys_cache_key, cache);
 	}
-	else {
-		res = g_malloc (sizeof (*res));
+
+	for (i = 0; i < SHINGLES_KEYS_CACHE; i ++) {
+		k = &cache->keys[i];
+
+		if (k->valid && memcmp (k->key, key, sizeof (k->key)) == 0) {
+			return k;
+		}
 	}
 
+	k = &cache->keys[cache->next];
+	cache->next = (cache->next + 1) % SHINGLES_KEYS_CACHE;
+	memcpy (k->key, key, sizeof (k->key));
+
 	blake2b_init (&bs, BLAKE2B_OUTBYTES);
-	memset (h, 0, sizeof (h));
 	cur_key = key;
-	out_key = (guchar *)&keys[0];
+	out_key = (guchar *)&k->keys[0];
 
-	/* Init hashes pipes and keys */
 	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		hashes[i] = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
-				input->len + SHINGLES_WINDOW);
 		/*
 		 * To generate a set of hashes we just apply sha256 to the
 		 * initial key as many times as many hashes are required and
@@ -83,10 +101,47 @@ rspamd_shingles_generate (GArray *input,
 		for (j = 0; j < 16; j ++) {
 			out_key[j] = shabuf[j];
 		}
+		/* Lanes keys for fast algorithm are taken from the rest of digest */
+		memcpy (&k->lanes[i], shabuf + 16, sizeof (k->lanes[i]));
 		blake2b_init (&bs, BLAKE2B_OUTBYTES);
 		cur_key = out_key;
 		out_key += 16;
-		sip24_init (&h[i], &keys[i]);
+	}
+
+	k->valid = TRUE;
+
+	return k;
+}
+
+static void
+rspamd_shingles_update_row (rspamd_fstring_t *in, struct siphash *h)
+{
+	int i;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		sip24_update (&h[i], in->begin, in->len);
+	}
+}
+
+static void
+rspamd_shingles_generate_siphash (GArray *input,
+		const guchar key[16],
+		const struct rspamd_shingles_keys *k,
+		struct rspamd_shingle *res,
+		rspamd_shingles_filter filter,
+		gpointer filterd)
+{
+	GArray *hashes[RSPAMD_SHINGLE_SIZE];
+	struct siphash h[RSPAMD_SHINGLE_SIZE];
+	gint i, j, beg = 0;
+
+	memset (h, 0, sizeof (h));
+
+	/* Init hashes pipes */
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		hashes[i] = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
+				input->len + SHINGLES_WINDOW);
+		sip24_init (&h[i], &k->keys[i]);
 	}
 
 	/* Now parse input words into a vector of hashes using rolling window */
@@ -105,7 +160,7 @@ rspamd_shingles_generate (GArray *input,
 				val = sip24_final (&h[j]);
 				/* Reinit siphash state */
 				memset (&h[j], 0, sizeof (h[0]));
-				sip24_init (&h[j], &keys[j]);
+				sip24_init (&h[j], &k->keys[j]);
 				g_array_append_val (hashes[j], val);
 			}
 		}
@@ -117,11 +172,213 @@ rspamd_shingles_generate (GArray *input,
 				i, key, filterd);
 		g_array_free (hashes[i], TRUE);
 	}
+}
+
+/*
+ * Permute window hash for all shingles at once: keyed multiply-xorshift
+ * (murmur3 finalizer) is a bijection, so distinct windows stay distinct
+ */
+static inline void
+rspamd_shingles_fast_row (guint64 val, const guint64 *lanes, guint64 *out)
+{
+	guint64 x;
+	gint i;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		x = val ^ lanes[i];
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		out[i] = x;
+	}
+}
+
+static void
+rspamd_shingles_generate_fast (GArray *input,
+		const guchar key[16],
+		const struct rspamd_shingles_keys *k,
+		struct rspamd_shingle *res,
+		rspamd_shingles_filter filter,
+		gpointer filterd)
+{
+	GArray *hashes[RSPAMD_SHINGLE_SIZE];
+	guint64 *words, row[RSPAMD_SHINGLE_SIZE], val;
+	struct siphash h;
+	rspamd_fstring_t *w;
+	gboolean minimize;
+	gint i, j, beg = 0;
+
+	/* Default filter just selects minimum, so we can avoid temporary arrays */
+	minimize = (filter == rspamd_shingles_default_filter);
+	words = g_malloc (sizeof (guint64) * (input->len + 1));
+
+	/* Each word is hashed only once */
+	for (i = 0; i < (gint)input->len; i ++) {
+		w = &g_array_index (input, rspamd_fstring_t, i);
+		sip24_init (&h, &k->keys[0]);
+		sip24_update (&h, w->begin, w->len);
+		words[i] = sip24_final (&h);
+	}
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		if (minimize) {
+			res->hashes[i] = G_MAXUINT64;
+		}
+		else {
+			hashes[i] = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
+					input->len + SHINGLES_WINDOW);
+		}
+	}
+
+	for (i = 0; i <= (gint)input->len; i ++) {
+		if (i - beg >= SHINGLES_WINDOW || i == (gint)input->len) {
+			val = 0;
+
+			for (j = beg; j < i; j ++) {
+				val = ((val << 21) | (val >> 43)) ^ words[j];
+			}
+			beg++;
+
+			rspamd_shingles_fast_row (val, k->lanes, row);
+
+			for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+				if (minimize) {
+					if (row[j] < res->hashes[j]) {
+						res->hashes[j] = row[j];
+					}
+				}
+				else {
+					g_array_append_val (hashes[j], row[j]);
+				}
+			}
+		}
+	}
+
+	if (!minimize) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			res->hashes[i] = filter ((guint64 *)hashes[i]->data, hashes[i]->len,
+					i, key, filterd);
+			g_array_free (hashes[i], TRUE);
+		}
+	}
+
+	g_free (words);
+}
+
+struct rspamd_shingle*
+rspamd_shingles_generate (GArray *input,
+		const guchar key[16],
+		rspamd_mempool_t *pool,
+		rspamd_shingles_filter filter,
+		gpointer filterd,
+		enum rspamd_shingle_alg alg)
+{
+	struct rspamd_shingle *res;
+	const struct rspamd_shingles_keys *k;
+
+	if (pool != NULL) {
+		res = rspamd_mempool_alloc (pool, sizeof (*res));
+	}
+	else {
+		res = g_malloc (sizeof (*res));
+	}
+
+	k = rspamd_shingles_get_keys (key);
+
+	switch (alg) {
+	case RSPAMD_SHINGLES_FAST:
+		rspamd_shingles_generate_fast (input, key, k, res, filter, filterd);
+		break;
+	case RSPAMD_SHINGLES_SIPHASH:
+	default:
+		rspamd_shingles_generate_siphash (input, key, k, res, filter, filterd);
+		break;
+	}
 
 	return res;
 }
 
 
+static guint64 gear_table[256];
+/* Chunks are generated by mime parser threads as well */
+static gsize gear_table_ready = 0;
+
+static void
+rspamd_shingles_init_gear (void)
+{
+	guint64 x = SHINGLES_GEAR_SEED, z;
+	gint i;
+
+	if (g_once_init_enter (&gear_table_ready)) {
+		/* Splitmix64 sequence gives the same table everywhere */
+		for (i = 0; i < (gint)G_N_ELEMENTS (gear_table); i ++) {
+			x += 0x9e3779b97f4a7c15ULL;
+			z = x;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			gear_table[i] = z ^ (z >> 31);
+		}
+
+		g_once_init_leave (&gear_table_ready, 1);
+	}
+}
+
+GArray *
+rspamd_shingles_chunk_data (const guchar *data, gsize len,
+		gsize avg_chunk,
+		rspamd_mempool_t *pool)
+{
+	GArray *res;
+	rspamd_fstring_t w;
+	guint64 h = 0, mask = 1, *hval;
+	gsize i, start = 0, min_chunk, max_chunk;
+
+	rspamd_shingles_init_gear ();
+
+	/* Boundary mask is the average chunk size rounded to power of two */
+	while (mask < MAX (avg_chunk, 64)) {
+		mask <<= 1;
+	}
+
+	min_chunk = mask / 4;
+	max_chunk = mask * 4;
+	mask --;
+
+	res = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_fstring_t),
+			len / (mask + 1) + 1);
+
+	for (i = 0; i < len; i ++) {
+		/* Gear rolling hash depends on the last 64 bytes only */
+		h = (h << 1) + gear_table[data[i]];
+
+		if (i + 1 - start < min_chunk) {
+			continue;
+		}
+
+		if ((h & mask) == 0 || i + 1 - start >= max_chunk || i + 1 == len) {
+			hval = rspamd_mempool_alloc (pool, sizeof (*hval));
+			*hval = XXH64 (data + start, i + 1 - start, 0);
+			w.begin = (gchar *)hval;
+			w.len = w.size = sizeof (*hval);
+			g_array_append_val (res, w);
+			start = i + 1;
+		}
+	}
+
+	if (start < len) {
+		/* Tail is shorter than a minimal chunk */
+		hval = rspamd_mempool_alloc (pool, sizeof (*hval));
+		*hval = XXH64 (data + start, len - start, 0);
+		w.begin = (gchar *)hval;
+		w.len = w.size = sizeof (*hval);
+		g_array_append_val (res, w);
+	}
+
+	return res;
+}
+
 guint64
 rspamd_shingles_default_filter (guint64 *input, gsize count,
 		gint shno, const guchar *key, gpointer ud)
@@ -32,6 +32,15 @@ struct rspamd_shingle {
 	guint64 hashes[RSPAMD_SHINGLE_SIZE];
 };
 
+/**
+ * Shingles generation algorithms, hashes produced by different algorithms
+ * are not comparable
+ */
+enum rspamd_shingle_alg {
+	RSPAMD_SHINGLES_SIPHASH = 0, /**< siphash of each window for each shingle */
+	RSPAMD_SHINGLES_FAST         /**< single hash per word, permuted per shingle */
+};
+
 /**
  * Shingles filtering function
  * @param input input array of hashes
@@ -49,13 +58,29 @@ typedef guint64 (*rspamd_shingles_filter) (guint64 *input, gsize count,
  * @param pool pool to allocate shigles array
  * @param filter hashes filtering function
  * @param filterd opaque data for filtering function
+ * @param alg algorithm used to generate shingles
  * @return shingles array
  */
 struct rspamd_shingle* rspamd_shingles_generate (GArray *input,
 		const guchar key[16],
 		rspamd_mempool_t *pool,
 		rspamd_shingles_filter filter,
-		gpointer filterd);
+		gpointer filterd,
+		enum rspamd_shingle_alg alg);
+
+/**
+ * Split binary data into content defined chunks using gear rolling hash, so
+ * that local changes of data affect merely the nearest chunks
+ * @param data input data
+ * @param len length of data
+ * @param avg_chunk desired average size of chunk (rounded to power of two)
+ * @param pool pool to allocate chunks hashes
+ * @return array of `rspamd_fstring_t` pointing to 64 bit chunks hashes, which
+ * is suitable as input for `rspamd_shingles_generate`
+ */
+GArray * rspamd_shingles_chunk_data (const guchar *data, gsize len,
+		gsize avg_chunk,
+		rspamd_mempool_t *pool);
 
 /**
  * Compares two shingles and return result as a floating point value - 1.0
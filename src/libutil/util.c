@@ -1771,6 +1771,26 @@ rspamd_rwlock_free (rspamd_rwlock_t *mtx)
 	g_slice_free1 (sizeof (rspamd_rwlock_t), mtx);
 }
 
+gpointer
+rspamd_private_get (rspamd_private_t *priv)
+{
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+	return g_private_get (&priv->key);
+#else
+	return g_static_private_get (&priv->key);
+#endif
+}
+
+void
+rspamd_private_set (rspamd_private_t *priv, gpointer value)
+{
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+	g_private_set (&priv->key, value);
+#else
+	g_static_private_set (&priv->key, value, priv->dtor);
+#endif
+}
+
 struct rspamd_thread_data {
 	gchar *name;
 	gint id;
@@ -2269,3 +2289,49 @@ rspamd_ptr_array_free_hard (gpointer p)
 
 	g_ptr_array_free (ar, TRUE);
 }
+
+gboolean
+rspamd_get_process_memory (pid_t pid, struct rspamd_process_mem_stat *st)
+{
+	FILE *f;
+	gchar path[PATH_MAX], line[256];
+	gulong val;
+
+	g_assert (st != NULL);
+	memset (st, 0, sizeof (*st));
+
+	/* Rollup contains the same fields summed over all mappings */
+	rspamd_snprintf (path, sizeof (path), "/proc/%P/smaps_rollup", pid);
+	f = fopen (path, "r");
+
+	if (f == NULL) {
+		rspamd_snprintf (path, sizeof (path), "/proc/%P/smaps", pid);
+		f = fopen (path, "r");
+
+		if (f == NULL) {
+			return FALSE;
+		}
+	}
+
+	while (fgets (line, sizeof (line), f) != NULL) {
+		/* All values are in kilobytes */
+		if (sscanf (line, "Rss: %lu kB", &val) == 1) {
+			st->rss += val * 1024;
+		}
+		else if (sscanf (line, "Pss: %lu kB", &val) == 1) {
+			st->pss += val * 1024;
+		}
+		else if (sscanf (line, "Shared_Clean: %lu kB", &val) == 1 ||
+				sscanf (line, "Shared_Dirty: %lu kB", &val) == 1) {
+			st->shared += val * 1024;
+		}
+		else if (sscanf (line, "Private_Clean: %lu kB", &val) == 1 ||
+				sscanf (line, "Private_Dirty: %lu kB", &val) == 1) {
+			st->priv += val * 1024;
+		}
+	}
+
+	fclose (f);
+
+	return TRUE;
+}
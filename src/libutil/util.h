@@ -294,6 +294,24 @@ typedef struct rspamd_rwlock_s {
 #endif
 } rspamd_rwlock_t;
 
+/*
+ * Per thread value that is destroyed when a thread exits, it should be defined
+ * as a static variable initialized by RSPAMD_PRIVATE_INIT
+ */
+typedef struct rspamd_private_s {
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+	GPrivate key;
+#else
+	GStaticPrivate key;
+	GDestroyNotify dtor;
+#endif
+} rspamd_private_t;
+
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+#define RSPAMD_PRIVATE_INIT(dtor) { G_PRIVATE_INIT ((GDestroyNotify)(dtor)) }
+#else
+#define RSPAMD_PRIVATE_INIT(dtor) { G_STATIC_PRIVATE_INIT, (GDestroyNotify)(dtor) }
+#endif
 
 /**
  * Create new mutex
@@ -355,6 +373,20 @@ void rspamd_rwlock_reader_unlock (rspamd_rwlock_t *mtx);
  */
 void rspamd_rwlock_free (rspamd_rwlock_t *mtx);
 
+/**
+ * Get value of a per thread variable for the current thread
+ * @param priv
+ * @return value or NULL if it has not been set in this thread
+ */
+gpointer rspamd_private_get (rspamd_private_t *priv);
+
+/**
+ * Set value of a per thread variable for the current thread
+ * @param priv
+ * @param value value that is destroyed on thread exit
+ */
+void rspamd_private_set (rspamd_private_t *priv, gpointer value);
+
 static inline void
 rspamd_cond_wait (GCond *cond, rspamd_mutex_t *mtx)
 {
@@ -447,4 +479,23 @@ gdouble rspamd_get_ticks (void);
  */
 void rspamd_ptr_array_free_hard (gpointer p);
 
+/**
+ * Memory usage of a process
+ */
+struct rspamd_process_mem_stat {
+	gsize rss;                  /**< resident set size							*/
+	gsize pss;                  /**< proportional set size						*/
+	gsize shared;               /**< resident memory shared with other processes	*/
+	gsize priv;                 /**< resident memory private to the process		*/
+};
+
+/**
+ * Get memory usage of a process (supported on systems with /proc/<pid>/smaps)
+ * @param pid process id
+ * @param st structure to fill
+ * @return TRUE if memory usage has been read
+ */
+gboolean rspamd_get_process_memory (pid_t pid,
+	struct rspamd_process_mem_stat *st);
+
 #endif
@@ -69,6 +69,23 @@ LUA_FUNCTION_DEF (task, create_empty);
  * @return {rspamd_task} task object
  */
 LUA_FUNCTION_DEF (task, create_from_buffer);
+/***
+ * @function rspamd_task.intern_header(name)
+ * Creates header name object with the precomputed hash that can be passed to
+ * `task:get_header` functions instead of a string. It is useful for rules that
+ * query the same headers for each message.
+ * @param {string} name name of header
+ * @return {rspamd_header_name} header name object
+@example
+local rspamd_task = require "rspamd_task"
+local h_subject = rspamd_task.intern_header('Subject')
+
+rspamd_config.EMPTY_SUBJECT = function(task)
+	local subj = task:get_header(h_subject)
+	return subj and subj == ''
+end
+ */
+LUA_FUNCTION_DEF (task, intern_header);
 /* Task methods */
 LUA_FUNCTION_DEF (task, get_message);
 LUA_FUNCTION_DEF (task, process_message);
@@ -184,7 +201,7 @@ LUA_FUNCTION_DEF (task, get_parts);
  * @method task:get_header(name[, case_sensitive])
  * Get decoded value of a header specified with optional case_sensitive flag.
  * By default headers are searched in caseless matter.
- * @param {string} name name of header to get
+ * @param {string|rspamd_header_name} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
  * @return {string} decoded value of a header
  */
@@ -193,7 +210,7 @@ LUA_FUNCTION_DEF (task, get_header);
  * @method task:get_header_raw(name[, case_sensitive])
  * Get raw value of a header specified with optional case_sensitive flag.
  * By default headers are searched in caseless matter.
- * @param {string} name name of header to get
+ * @param {string|rspamd_header_name} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
  * @return {string} raw value of a header
  */
@@ -209,7 +226,7 @@ LUA_FUNCTION_DEF (task, get_header_raw);
  * - `decoded` - decoded value of a header
  * - `tab_separated` - `true` if a header and a value are separated by `tab` character
  * - `empty_separator` - `true` if there are no separator between a header and a value
- * @param {string} name name of header to get
+ * @param {string|rspamd_header_name} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
  * @return {list of tables} all values of a header as specified above
 @example
@@ -424,6 +441,12 @@ LUA_FUNCTION_DEF (task, set_settings);
 static const struct luaL_reg tasklib_f[] = {
 	LUA_INTERFACE_DEF (task, create_empty),
 	LUA_INTERFACE_DEF (task, create_from_buffer),
+	LUA_INTERFACE_DEF (task, intern_header),
+	{NULL, NULL}
+};
+
+static const struct luaL_reg headernamelib_m[] = {
+	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
 
@@ -563,7 +586,7 @@ end
  * @method mimepart:get_header(name[, case_sensitive])
  * Get decoded value of a header specified with optional case_sensitive flag.
  * By default headers are searched in caseless matter.
- * @param {string} name name of header to get
+ * @param {string|rspamd_header_name} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
  * @return {string} decoded value of a header
  */
@@ -572,7 +595,7 @@ LUA_FUNCTION_DEF (mimepart, get_header);
  * @method mimepart:get_header_raw(name[, case_sensitive])
  * Get raw value of a header specified with optional case_sensitive flag.
  * By default headers are searched in caseless matter.
- * @param {string} name name of header to get
+ * @param {string|rspamd_header_name} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
  * @return {string} raw value of a header
  */
@@ -588,7 +611,7 @@ LUA_FUNCTION_DEF (mimepart, get_header_raw);
  * - `decoded` - decoded value of a header
  * - `tab_separated` - `true` if a header and a value are separated by `tab` character
  * - `empty_separator` - `true` if there are no separator between a header and a value
- * @param {string} name name of header to get
+ * @param {string|rspamd_header_name} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
  * @return {list of tables} all values of a header as specified above
 @example
@@ -729,6 +752,54 @@ lua_task_create_from_buffer (lua_State *L)
 	return 1;
 }
 
+static int
+lua_task_intern_header (lua_State *L)
+{
+	struct rspamd_header_name *hn;
+	const gchar *name;
+	size_t len;
+	gchar *dst;
+
+	name = luaL_checklstring (L, 1, &len);
+
+	if (name) {
+		/* Name is stored in the same userdata */
+		hn = lua_newuserdata (L, sizeof (*hn) + len + 1);
+		dst = (gchar *)(hn + 1);
+		rspamd_strlcpy (dst, name, len + 1);
+		rspamd_header_name_init (hn, dst);
+		rspamd_lua_setclass (L, "rspamd{header_name}", -1);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static const struct rspamd_header_name *
+lua_check_header_name (lua_State *L, gint pos, struct rspamd_header_name *tmp)
+{
+	struct rspamd_header_name *hn;
+	const gchar *name;
+
+	hn = rspamd_lua_check_class (L, pos, "rspamd{header_name}");
+
+	if (hn != NULL) {
+		return hn;
+	}
+
+	name = luaL_checkstring (L, pos);
+
+	if (name == NULL) {
+		return NULL;
+	}
+
+	rspamd_header_name_init (tmp, name);
+
+	return tmp;
+}
+
 static int
 lua_task_process_message (lua_State *L)
 {
@@ -1046,8 +1117,8 @@ lua_task_get_parts (lua_State * L)
 
 static gint
 lua_push_header (lua_State * L,
-		GHashTable *hdrs,
-		const gchar *name,
+		struct rspamd_headers *hdrs,
+		const struct rspamd_header_name *hn,
 		gboolean strong,
 		gboolean full,
 		gboolean raw)
@@ -1057,7 +1128,7 @@ lua_push_header (lua_State * L,
 	gint i = 1;
 	const gchar *val;
 
-	rh = g_hash_table_lookup (hdrs, name);
+	rh = rspamd_headers_lookup (hdrs, hn);
 
 	if (rh == NULL) {
 		lua_pushnil (L);
@@ -1075,7 +1146,7 @@ lua_push_header (lua_State * L,
 		}
 		/* Check case sensivity */
 		if (strong) {
-			if (strcmp (rh->name, name) != 0) {
+			if (strcmp (rh->name, hn->name) != 0) {
 				rh = rh->next;
 				continue;
 			}
@@ -1126,15 +1197,16 @@ lua_task_get_header_common (lua_State *L, gboolean full, gboolean raw)
 {
 	gboolean strong = FALSE;
 	struct rspamd_task *task = lua_check_task (L, 1);
-	const gchar *name;
+	const struct rspamd_header_name *hn;
+	struct rspamd_header_name tmp;
 
-	name = luaL_checkstring (L, 2);
+	hn = lua_check_header_name (L, 2, &tmp);
 
-	if (name && task) {
+	if (hn && task) {
 		if (lua_gettop (L) == 3) {
 			strong = lua_toboolean (L, 3);
 		}
-		return lua_push_header (L, task->raw_headers, name, strong, full, raw);
+		return lua_push_header (L, task->raw_headers, hn, strong, full, raw);
 	}
 	lua_pushnil (L);
 	return 1;
@@ -2073,6 +2145,7 @@ lua_textpart_get_fuzzy (lua_State * L)
 		return 1;
 	}
 
+	rspamd_text_part_get_fuzzy (part);
 	out = rspamd_encode_base32 (part->fuzzy->hash_pipe,
 			strlen (part->fuzzy->hash_pipe));
 	lua_pushstring (L, out);
@@ -2139,6 +2212,9 @@ lua_textpart_compare_distance (lua_State * L)
 		}
 		else {
 			if (!part->is_empty && !other->is_empty) {
+				rspamd_text_part_get_fuzzy (part);
+				rspamd_text_part_get_fuzzy (other);
+
 				if (part->diff_str != NULL && other->diff_str != NULL) {
 					diff = rspamd_diff_distance (part->diff_str,
 							other->diff_str);
@@ -2170,13 +2246,15 @@ static gint
 lua_mimepart_get_content (lua_State * L)
 {
 	struct mime_part *part = lua_check_mimepart (L);
+	GByteArray *content;
 
 	if (part == NULL) {
 		lua_pushnil (L);
 		return 1;
 	}
 
-	lua_pushlstring (L, (const gchar *)part->content->data, part->content->len);
+	content = rspamd_mime_part_get_content (part);
+	lua_pushlstring (L, (const gchar *)content->data, content->len);
 
 	return 1;
 }
@@ -2191,7 +2269,7 @@ lua_mimepart_get_length (lua_State * L)
 		return 1;
 	}
 
-	lua_pushinteger (L, part->content->len);
+	lua_pushinteger (L, rspamd_mime_part_get_content (part)->len);
 
 	return 1;
 }
@@ -2237,15 +2315,16 @@ lua_mimepart_get_header_common (lua_State *L, gboolean full, gboolean raw)
 {
 	gboolean strong = FALSE;
 	struct mime_part *part = lua_check_mimepart (L);
-	const gchar *name;
+	const struct rspamd_header_name *hn;
+	struct rspamd_header_name tmp;
 
-	name = luaL_checkstring (L, 2);
+	hn = lua_check_header_name (L, 2, &tmp);
 
-	if (name && part) {
+	if (hn && part) {
 		if (lua_gettop (L) == 3) {
 			strong = lua_toboolean (L, 3);
 		}
-		return lua_push_header (L, part->raw_headers, name, strong, full, raw);
+		return lua_push_header (L, part->raw_headers, hn, strong, full, raw);
 	}
 	lua_pushnil (L);
 	return 1;
@@ -2320,7 +2399,7 @@ lua_image_get_size (lua_State *L)
 	struct rspamd_image *img = lua_check_image (L);
 
 	if (img != NULL) {
-		lua_pushinteger (L, img->data->len);
+		lua_pushinteger (L, rspamd_mime_part_get_content (img->part)->len);
 	}
 	else {
 		lua_pushnil (L);
@@ -2468,6 +2547,8 @@ luaopen_task (lua_State * L)
 {
 	rspamd_lua_new_class (L, "rspamd{task}", tasklib_m);
 	lua_pop (L, 1);                      /* remove metatable from stack */
+	rspamd_lua_new_class (L, "rspamd{header_name}", headernamelib_m);
+	lua_pop (L, 1);                      /* remove metatable from stack */
 
 	rspamd_lua_add_preload (L, "rspamd_task", lua_load_task);
 }
@@ -56,7 +56,7 @@
 #define HARD_TERMINATION_TIME 10
 
 static struct rspamd_worker * fork_worker (struct rspamd_main *,
-	struct rspamd_worker_conf *);
+	struct rspamd_worker_conf *, guint, struct rspamd_worker *);
 static gboolean load_rspamd_config (struct rspamd_config *cfg,
 	gboolean init_modules);
 static void init_cfg_cache (struct rspamd_config *cfg);
@@ -85,7 +85,7 @@ static gboolean dump_cache = FALSE;
 static gboolean is_debug = FALSE;
 static gboolean is_insecure = FALSE;
 static gboolean gen_keypair = FALSE;
-/* List of workers that are pending to start */
+/* List of dead workers that are pending to be replaced */
 static GList *workers_pending = NULL;
 
 #ifdef HAVE_SA_SIGINFO
@@ -98,6 +98,8 @@ static GArray *other_workers = NULL;
 
 /* List of active listen sockets indexed by worker type */
 static GHashTable *listen_sockets = NULL;
+/* Next free slot of memory usage of workers */
+static guint workers_mem_next = 0;
 
 struct rspamd_main *rspamd_main;
 
@@ -482,16 +484,116 @@ set_worker_limits (struct rspamd_worker_conf *cf)
 	}
 }
 
+static void
+set_worker_affinity (struct rspamd_worker_conf *cf, gint cpu)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+
+	if (sched_setaffinity (0, sizeof (set), &set) == -1) {
+		msg_warn ("cannot bind %s process to CPU %d: %s",
+			cf->worker->name,
+			cpu,
+			strerror (errno));
+	}
+	else {
+		msg_info ("bind %s process to CPU %d", cf->worker->name, cpu);
+	}
+#else
+	msg_warn ("cannot bind %s process to CPU %d: not supported",
+		cf->worker->name,
+		cpu);
+#endif
+}
+
+/*
+ * Check whether we should create sockets for each worker process
+ */
+static gboolean
+bind_conf_reuseport (struct rspamd_worker_conf *cf,
+	struct rspamd_worker_bind_conf *bcf)
+{
+	guint i;
+
+	if (!cf->reuseport || bcf->is_systemd) {
+		return FALSE;
+	}
+
+	for (i = 0; i < bcf->cnt; i ++) {
+		if (rspamd_inet_address_get_af (g_ptr_array_index (bcf->addrs, i)) ==
+				AF_UNIX) {
+			/* Unix sockets cannot be shared by SO_REUSEPORT */
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static GList *create_listen_socket (GPtrArray *addrs, guint cnt,
+	gint listen_type, gboolean reuseport);
+
+/*
+ * Start a worker process number index of the configuration cf, if old is not
+ * NULL, then the worker replaces a dead process and reuses its slot
+ */
 static struct rspamd_worker *
-fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
+fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf,
+	guint index, struct rspamd_worker *old)
 {
 	struct rspamd_worker *cur;
+	struct rspamd_worker_bind_conf *bcf;
+	GList *own_socks = NULL, *ls, *l;
 	/* Starting worker process */
 	cur = (struct rspamd_worker *)g_malloc (sizeof (struct rspamd_worker));
 	if (cur) {
 		bzero (cur, sizeof (struct rspamd_worker));
 		cur->srv = rspamd;
 		cur->type = cf->type;
+
+		if (old != NULL) {
+			cur->tasks_active = old->tasks_active;
+			cur->cpu = old->cpu;
+			cur->mem = old->mem;
+		}
+		else {
+			cur->tasks_active = rspamd_mempool_alloc0_shared (
+				rspamd->server_pool, sizeof (gint));
+			cur->cpu = -1;
+
+			if (workers_mem_next < rspamd->workers_mem_size) {
+				cur->mem = &rspamd->workers_mem[workers_mem_next ++];
+			}
+
+			if (cf->cpu_affinity) {
+#ifdef HAVE_SC_NPROCESSORS_ONLN
+				cur->cpu = index %
+					MAX ((guint)sysconf (_SC_NPROCESSORS_ONLN), 1);
+#else
+				cur->cpu = index;
+#endif
+			}
+		}
+
+		if (cf->worker->has_socket && cf->reuseport) {
+			/* Create sockets for this process only */
+			LL_FOREACH (cf->bind_conf, bcf) {
+				if (bind_conf_reuseport (cf, bcf)) {
+					ls = create_listen_socket (bcf->addrs, bcf->cnt,
+							cf->worker->listen_type, TRUE);
+					if (ls == NULL) {
+						msg_err ("cannot listen on socket %s: %s",
+							bcf->name,
+							strerror (errno));
+					}
+					own_socks = g_list_concat (own_socks, ls);
+				}
+			}
+		}
+
 		cur->pid = fork ();
 		cur->cf = g_malloc (sizeof (struct rspamd_worker_conf));
 		memcpy (cur->cf, cf, sizeof (struct rspamd_worker_conf));
@@ -501,6 +603,13 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 		case 0:
 			/* Update pid for logging */
 			rspamd_log_update_pid (cf->type, rspamd->logger);
+			if (own_socks != NULL) {
+				cur->cf->listen_socks = g_list_concat (
+					g_list_copy (cf->listen_socks), own_socks);
+			}
+			if (cur->cpu != -1) {
+				set_worker_affinity (cf, cur->cpu);
+			}
 			/* Lock statfile pool if possible XXX */
 			/* Init PRNG after fork */
 			ottery_init (NULL);
@@ -536,6 +645,13 @@ fork_worker (struct rspamd_main *rspamd, struct rspamd_worker_conf *cf)
 			/* Insert worker into worker's table, pid is index */
 			g_hash_table_insert (rspamd->workers, GSIZE_TO_POINTER (
 					cur->pid), cur);
+			/* Sockets of worker are re-created when it is respawned */
+			l = own_socks;
+			while (l) {
+				close (GPOINTER_TO_INT (l->data));
+				l = g_list_next (l);
+			}
+			g_list_free (own_socks);
 			break;
 		}
 	}
@@ -563,14 +679,15 @@ set_alarm (guint seconds)
 }
 
 static void
-delay_fork (struct rspamd_worker_conf *cf)
+delay_fork (struct rspamd_worker *old)
 {
-	workers_pending = g_list_prepend (workers_pending, cf);
+	workers_pending = g_list_prepend (workers_pending, old);
 	set_alarm (SOFT_FORK_TIME);
 }
 
 static GList *
-create_listen_socket (GPtrArray *addrs, guint cnt, gint listen_type)
+create_listen_socket (GPtrArray *addrs, guint cnt, gint listen_type,
+	gboolean reuseport)
 {
 	GList *result = NULL;
 	gint fd;
@@ -579,7 +696,7 @@ create_listen_socket (GPtrArray *addrs, guint cnt, gint listen_type)
 	g_ptr_array_sort (addrs, rspamd_inet_address_compare_ptr);
 	for (i = 0; i < cnt; i ++) {
 		fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
-				listen_type, TRUE);
+				listen_type, TRUE, reuseport);
 		if (fd != -1) {
 			result = g_list_prepend (result, GINT_TO_POINTER (fd));
 		}
@@ -638,14 +755,15 @@ static void
 fork_delayed (struct rspamd_main *rspamd)
 {
 	GList *cur;
-	struct rspamd_worker_conf *cf;
+	struct rspamd_worker *old;
 
 	while (workers_pending != NULL) {
 		cur = workers_pending;
-		cf = cur->data;
+		old = cur->data;
 
 		workers_pending = g_list_remove_link (workers_pending, cur);
-		fork_worker (rspamd, cf);
+		fork_worker (rspamd, old->cf, 0, old);
+		g_free (old);
 		g_list_free_1 (cur);
 	}
 }
@@ -689,6 +807,27 @@ spawn_workers (struct rspamd_main *rspamd)
 	guintptr key;
 	struct rspamd_worker_bind_conf *bcf;
 
+	/*
+	 * Collect garbage left by configuration before forking, otherwise each
+	 * worker collects it by itself and copies all pages touched by lua gc
+	 */
+	if (rspamd->cfg->lua_state) {
+		lua_gc (rspamd->cfg->lua_state, LUA_GCCOLLECT, 0);
+	}
+
+	/* Workers report memory usage to slots, the first slot is used by main */
+	rspamd->workers_mem_size = 1;
+
+	for (cur = rspamd->cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cf = cur->data;
+		rspamd->workers_mem_size += MAX (cf->count, 1);
+	}
+
+	rspamd->workers_mem = rspamd_mempool_alloc0_shared (rspamd->server_pool,
+			rspamd->workers_mem_size * sizeof (struct rspamd_worker_mem));
+	workers_mem_next = 1;
+	rspamd_worker_update_mem (&rspamd->workers_mem[0], "main");
+
 	cur = rspamd->cfg->workers;
 
 	while (cur) {
@@ -700,6 +839,10 @@ spawn_workers (struct rspamd_main *rspamd)
 		else {
 			if (cf->worker->has_socket) {
 				LL_FOREACH (cf->bind_conf, bcf) {
+					if (bind_conf_reuseport (cf, bcf)) {
+						/* Sockets are created for each process on fork */
+						continue;
+					}
 					key = make_listen_key (bcf);
 					if ((p =
 						g_hash_table_lookup (listen_sockets,
@@ -707,7 +850,7 @@ spawn_workers (struct rspamd_main *rspamd)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									cf->worker->listen_type, FALSE);
 						}
 						else {
 							ls = systemd_get_socket (bcf->cnt);
@@ -736,14 +879,14 @@ spawn_workers (struct rspamd_main *rspamd)
 					msg_err ("cannot spawn more than 1 %s worker, so spawn one",
 						cf->worker->name);
 				}
-				fork_worker (rspamd, cf);
+				fork_worker (rspamd, cf, 0, NULL);
 			}
 			else if (cf->worker->threaded) {
-				fork_worker (rspamd, cf);
+				fork_worker (rspamd, cf, 0, NULL);
 			}
 			else {
 				for (i = 0; i < cf->count; i++) {
-					fork_worker (rspamd, cf);
+					fork_worker (rspamd, cf, i, NULL);
 				}
 			}
 		}
@@ -1390,6 +1533,12 @@ main (gint argc, gchar **argv, gchar **env)
 			rspamd_main->cfg->history_file);
 	}
 
+	/* Shared keys cache is created once and it is kept on reload */
+	if (rspamd_main->cfg->keypair_cache_size > 0) {
+		rspamd_main->keys_cache = rspamd_keypair_shared_cache_new (
+			rspamd_main->server_pool, rspamd_main->cfg->keypair_cache_size);
+	}
+
 	/* Spawn workers */
 	rspamd_main->workers = g_hash_table_new (g_direct_hash, g_direct_equal);
 	spawn_workers (rspamd_main);
@@ -1406,6 +1555,8 @@ main (gint argc, gchar **argv, gchar **env)
 		cur_sg = 0;
 		print_signals_info ();
 #endif
+		rspamd_worker_update_mem (&rspamd_main->workers_mem[0], "main");
+
 		if (do_terminate) {
 			do_terminate = 0;
 			msg_info ("catch termination signal, waiting for children");
@@ -1424,12 +1575,21 @@ main (gint argc, gchar **argv, gchar **env)
 
 				g_hash_table_remove (rspamd_main->workers, GSIZE_TO_POINTER (
 						wrk));
+				/* Tasks of dead process are not finished by it */
+				g_atomic_int_add (&rspamd_main->stat->tasks_active,
+					-*cur->tasks_active);
+				*cur->tasks_active = 0;
+
+				if (cur->mem != NULL) {
+					cur->mem->pid = 0;
+				}
 
 				if (WIFEXITED (res) && WEXITSTATUS (res) == 0) {
 					/* Normal worker termination, do not fork one more */
 					msg_info ("%s process %P terminated normally",
 						g_quark_to_string (cur->type),
 						cur->pid);
+					g_free (cur);
 				}
 				else {
 					if (WIFSIGNALED (res)) {
@@ -1445,10 +1605,8 @@ main (gint argc, gchar **argv, gchar **env)
 							cur->pid);
 					}
 					/* Fork another worker in replace of dead one */
-					delay_fork (cur->cf);
+					delay_fork (cur);
 				}
-
-				g_free (cur);
 			}
 			else {
 				for (i = 0; i < (gint)other_workers->len; i++) {
@@ -57,6 +57,9 @@ struct rspamd_worker {
 	GList *accept_events;                                       /**< socket events									*/
 	struct rspamd_worker_conf *cf;                                      /**< worker config data								*/
 	gpointer ctx;                                               /**< worker's specific data							*/
+	gint *tasks_active;                                         /**< shared number of tasks processed by worker		*/
+	gint cpu;                                                   /**< CPU the process is bound to, -1 if not bound	*/
+	struct rspamd_worker_mem *mem;                              /**< shared memory usage slot, may be NULL			*/
 };
 
 struct rspamd_worker_signal_handler {
@@ -94,6 +97,19 @@ struct rspamd_stat {
 	guint messages_learned;                             /**< messages learned								*/
 	guint fuzzy_hashes;                                 /**< number of fuzzy hashes stored					*/
 	guint fuzzy_hashes_expired;                         /**< number of fuzzy hashes expired					*/
+	gint tasks_active;                                  /**< number of tasks being processed by workers		*/
+	guint accept_paused;                                /**< number of times workers stopped accepting		*/
+};
+
+/**
+ * Memory usage reported by a process itself, as processes of workers are not
+ * allowed to read memory maps of each other and of the main process
+ */
+struct rspamd_worker_mem {
+	pid_t pid;                                          /**< pid of process, 0 if nothing is reported		*/
+	gchar title[32];                                    /**< type of process								*/
+	time_t updated;                                     /**< time of the last update						*/
+	struct rspamd_process_mem_stat st;                  /**< memory usage									*/
 };
 
 /**
@@ -115,6 +131,9 @@ struct rspamd_main {
 	gid_t workers_gid;                                          /**< worker's gid running to						*/
 	gboolean is_privilleged;                                    /**< true if run in privilleged mode                */
 	struct roll_history *history;                               /**< rolling history								*/
+	struct rspamd_keypair_shared_cache *keys_cache;             /**< encryption keys shared by workers				*/
+	struct rspamd_worker_mem *workers_mem;                      /**< shared memory usage of processes				*/
+	guint workers_mem_size;                                     /**< number of memory usage slots					*/
 };
 
 /**
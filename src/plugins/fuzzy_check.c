@@ -42,12 +42,14 @@
 #include "config.h"
 #include "libmime/message.h"
 #include "libutil/map.h"
+#include "libutil/hash.h"
 #include "libmime/images.h"
 #include "fuzzy_storage.h"
 #include "utlist.h"
 #include "main.h"
 #include "blake2.h"
 #include "ottery.h"
+#include "xxhash.h"
 
 #define DEFAULT_SYMBOL "R_FUZZY_HASH"
 #define DEFAULT_UPSTREAM_ERROR_TIME 10
@@ -56,6 +58,11 @@
 
 #define DEFAULT_IO_TIMEOUT 500
 #define DEFAULT_PORT 11335
+/* Minimum number of chunks to generate shingles for binary parts */
+#define MIN_DATA_CHUNKS 4
+
+#define DEFAULT_CACHE_SIZE 4096
+#define DEFAULT_CACHE_EXPIRE 30
 
 struct fuzzy_mapping {
 	guint64 fuzzy_flag;
@@ -76,6 +83,9 @@ struct fuzzy_rule {
 	GList *mime_types;
 	GString *hash_key;
 	GString *shingles_key;
+	enum rspamd_shingle_alg shingles_alg;
+	gsize chunk_size;
+	gboolean image_phash;
 	double max_score;
 	gboolean read_only;
 	gboolean skip_unknown;
@@ -93,6 +103,15 @@ struct fuzzy_ctx {
 	guint32 min_height;
 	guint32 min_width;
 	guint32 io_timeout;
+	rspamd_lru_hash_t *cache;
+	guint32 cache_expire;
+};
+
+/* Fuzzy replies cached by a worker for a short time */
+struct fuzzy_cache_elt {
+	struct fuzzy_rule *rule;
+	gchar digest[64];
+	struct rspamd_fuzzy_reply rep;
 };
 
 struct fuzzy_client_session {
@@ -278,6 +297,30 @@ fuzzy_to_string (rspamd_fuzzy_t *h)
 	return strbuf;
 }
 
+static guint
+fuzzy_cache_hash (gconstpointer p)
+{
+	const struct fuzzy_cache_elt *elt = p;
+
+	return XXH32 (elt->digest, sizeof (elt->digest),
+			GPOINTER_TO_UINT (elt->rule));
+}
+
+static gboolean
+fuzzy_cache_equal (gconstpointer p1, gconstpointer p2)
+{
+	const struct fuzzy_cache_elt *e1 = p1, *e2 = p2;
+
+	return e1->rule == e2->rule &&
+			memcmp (e1->digest, e2->digest, sizeof (e1->digest)) == 0;
+}
+
+static void
+fuzzy_cache_elt_free (gpointer p)
+{
+	g_slice_free1 (sizeof (struct fuzzy_cache_elt), p);
+}
+
 static struct fuzzy_rule *
 fuzzy_rule_new (const char *default_symbol, rspamd_mempool_t *pool)
 {
@@ -346,6 +389,12 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj)
 	if ((value = ucl_object_find_key (obj, "skip_unknown")) != NULL) {
 		rule->skip_unknown = ucl_obj_toboolean (value);
 	}
+	if ((value = ucl_object_find_key (obj, "chunk_size")) != NULL) {
+		rule->chunk_size = ucl_obj_toint (value);
+	}
+	if ((value = ucl_object_find_key (obj, "image_phash")) != NULL) {
+		rule->image_phash = ucl_obj_toboolean (value);
+	}
 
 	if ((value = ucl_object_find_key (obj, "servers")) != NULL) {
 		rule->servers = rspamd_upstreams_create ();
@@ -385,6 +434,21 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj)
 	blake2 (rule->shingles_key->str, k, NULL, 16, strlen (k), 0);
 	rule->shingles_key->len = 16;
 
+	if ((value = ucl_object_find_key (obj, "shingles_algorithm")) != NULL) {
+		k = ucl_object_tostring (value);
+
+		if (k != NULL && g_ascii_strcasecmp (k, "fast") == 0) {
+			rule->shingles_alg = RSPAMD_SHINGLES_FAST;
+		}
+		else if (k != NULL && g_ascii_strcasecmp (k, "siphash") == 0) {
+			rule->shingles_alg = RSPAMD_SHINGLES_SIPHASH;
+		}
+		else {
+			msg_err ("unknown shingles algorithm: %s", k);
+			return -1;
+		}
+	}
+
 	if (rspamd_upstreams_count (rule->servers) == 0) {
 		msg_err ("no servers defined for fuzzy rule with symbol: %s",
 			rule->symbol);
@@ -423,7 +487,7 @@ gint
 fuzzy_check_module_config (struct rspamd_config *cfg)
 {
 	const ucl_object_t *value, *cur;
-	gint res = TRUE;
+	gint res = TRUE, cache_size;
 
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "fuzzy_check", "symbol")) != NULL) {
@@ -472,6 +536,28 @@ fuzzy_check_module_config (struct rspamd_config *cfg)
 	else {
 		fuzzy_module_ctx->io_timeout = DEFAULT_IO_TIMEOUT;
 	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "fuzzy_check",
+		"cache_size")) != NULL) {
+		cache_size = ucl_obj_toint (value);
+	}
+	else {
+		cache_size = DEFAULT_CACHE_SIZE;
+	}
+	if ((value =
+		rspamd_config_get_module_opt (cfg, "fuzzy_check",
+		"cache_expire")) != NULL) {
+		fuzzy_module_ctx->cache_expire = ucl_obj_todouble (value);
+	}
+	else {
+		fuzzy_module_ctx->cache_expire = DEFAULT_CACHE_EXPIRE;
+	}
+
+	if (cache_size > 0 && fuzzy_module_ctx->cache_expire > 0) {
+		fuzzy_module_ctx->cache = rspamd_lru_hash_new_full (cache_size,
+				fuzzy_module_ctx->cache_expire, NULL, fuzzy_cache_elt_free,
+				fuzzy_cache_hash, fuzzy_cache_equal);
+	}
 
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "fuzzy_check",
@@ -511,6 +597,10 @@ fuzzy_check_module_reconfig (struct rspamd_config *cfg)
 {
 	rspamd_mempool_delete (fuzzy_module_ctx->fuzzy_pool);
 
+	if (fuzzy_module_ctx->cache) {
+		rspamd_lru_hash_destroy (fuzzy_module_ctx->cache);
+	}
+
 	memset (fuzzy_module_ctx, 0, sizeof (*fuzzy_module_ctx));
 	fuzzy_module_ctx->fuzzy_pool = rspamd_mempool_new (
 		rspamd_mempool_suggest_size ());
@@ -538,10 +628,10 @@ fuzzy_preprocess_words (struct mime_text_part *part, rspamd_mempool_t *pool)
 	GArray *res;
 
 	if (!part->is_utf || !part->language || part->language[0] == '\0') {
-		res = part->words;
+		res = rspamd_text_part_get_words (part);
 	}
 	else {
-		res = part->normalized_words;
+		res = rspamd_text_part_get_normalized_words (part);
 	}
 
 	return res;
@@ -568,11 +658,14 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 	rspamd_fstring_t *word;
 	GArray *words;
 
-	if (legacy || part->words == NULL || part->words->len == 0) {
+	words = rspamd_text_part_get_words (part);
+
+	if (legacy || words == NULL || words->len == 0) {
 		cmd = rspamd_mempool_alloc0 (pool, sizeof (*cmd));
 
 		cmd->shingles_count = 0;
-		rspamd_strlcpy (cmd->digest, part->fuzzy->hash_pipe, sizeof (cmd->digest));
+		rspamd_strlcpy (cmd->digest, rspamd_text_part_get_fuzzy (part)->hash_pipe,
+				sizeof (cmd->digest));
 
 		if (size != NULL) {
 			*size = sizeof (struct rspamd_fuzzy_cmd);
@@ -597,7 +690,7 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 		msg_debug ("loading shingles with key %*xs", 16, rule->shingles_key->str);
 		sh = rspamd_shingles_generate (words,
 				rule->shingles_key->str, pool,
-				rspamd_shingles_default_filter, NULL);
+				rspamd_shingles_default_filter, NULL, rule->shingles_alg);
 		if (sh != NULL) {
 			memcpy (&shcmd->sgl, sh, sizeof (shcmd->sgl));
 			shcmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
@@ -633,15 +726,45 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 		gsize *size)
 {
 	struct rspamd_fuzzy_cmd *cmd;
+	struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_shingle *sh;
+	GArray *chunks = NULL;
+
+	if (!legacy && rule->chunk_size > 0) {
+		/*
+		 * Split data to chunks in place, so a local change of an attachment
+		 * modifies merely a few shingles
+		 */
+		chunks = rspamd_shingles_chunk_data (data, datalen, rule->chunk_size,
+				pool);
+
+		if (chunks->len < MIN_DATA_CHUNKS) {
+			g_array_free (chunks, TRUE);
+			chunks = NULL;
+		}
+	}
+
+	if (chunks != NULL) {
+		shcmd = rspamd_mempool_alloc0 (pool, sizeof (*shcmd));
+		sh = rspamd_shingles_generate (chunks,
+				rule->shingles_key->str, pool,
+				rspamd_shingles_default_filter, NULL, rule->shingles_alg);
+		memcpy (&shcmd->sgl, sh, sizeof (shcmd->sgl));
+		shcmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+		g_array_free (chunks, TRUE);
+		cmd = (struct rspamd_fuzzy_cmd *)shcmd;
+	}
+	else {
+		cmd = rspamd_mempool_alloc0 (pool, sizeof (*cmd));
+		cmd->shingles_count = 0;
+	}
 
-	cmd = rspamd_mempool_alloc0 (pool, sizeof (*cmd));
 	cmd->cmd = c;
 	cmd->version = RSPAMD_FUZZY_VERSION;
 	if (c != FUZZY_CHECK) {
 		cmd->flag = flag;
 		cmd->value = weight;
 	}
-	cmd->shingles_count = 0;
 	cmd->tag = ottery_rand_uint32 ();
 
 	if (legacy) {
@@ -664,7 +787,9 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 	}
 
 	if (size != NULL) {
-		*size = sizeof (struct rspamd_fuzzy_cmd);
+		*size = cmd->shingles_count > 0 ?
+				sizeof (struct rspamd_fuzzy_shingle_cmd) :
+				sizeof (struct rspamd_fuzzy_cmd);
 	}
 
 	return cmd;
@@ -708,7 +833,8 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
  * Read replies one-by-one and remove them from req array
  */
 static const struct rspamd_fuzzy_reply *
-fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req)
+fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
+		const struct rspamd_fuzzy_cmd **pcmd)
 {
 	const guchar *p = *pos;
 	gint remain = *r;
@@ -727,6 +853,9 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req)
 	for (i = 0; i < req->len; i ++) {
 		cmd = g_ptr_array_index (req, i);
 		if (cmd->tag == rep->tag) {
+			if (pcmd != NULL) {
+				*pcmd = cmd;
+			}
 			g_ptr_array_remove_index (req, i);
 			*pos += sizeof (struct rspamd_fuzzy_reply);
 			*r -= sizeof (struct rspamd_fuzzy_reply);
@@ -739,17 +868,119 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req)
 	return NULL;
 }
 
+static void
+fuzzy_insert_result (struct rspamd_task *task, struct fuzzy_rule *rule,
+		const struct rspamd_fuzzy_reply *rep)
+{
+	struct fuzzy_mapping *map;
+	const gchar *symbol;
+	gchar buf[64];
+	double nval;
+
+	/* Get mapping by flag */
+	if ((map =
+			g_hash_table_lookup (rule->mappings,
+					GINT_TO_POINTER (rep->flag))) == NULL) {
+		/* Default symbol and default weight */
+		symbol = rule->symbol;
+
+	}
+	else {
+		/* Get symbol and weight from map */
+		symbol = map->symbol;
+	}
+
+	if (rep->prob > 0.5) {
+		nval = fuzzy_normalize (rep->value, rule->max_score);
+		nval *= rep->prob;
+		msg_info (
+				"<%s>, found fuzzy hash with weight: %.2f, in list: %s:%d%s",
+				task->message_id,
+				nval,
+				symbol,
+				rep->flag,
+				map == NULL ? "(unknown)" : "");
+		if (map != NULL || !rule->skip_unknown) {
+			rspamd_snprintf (buf,
+					sizeof (buf),
+					"%d: %.2f / %.2f",
+					rep->flag,
+					rep->prob,
+					nval);
+			rspamd_task_insert_result_single (task,
+					symbol,
+					nval,
+					g_list_prepend (NULL,
+						rspamd_mempool_strdup (
+							task->task_pool, buf)));
+		}
+	}
+}
+
+static void
+fuzzy_cache_store (struct fuzzy_rule *rule, const struct rspamd_fuzzy_cmd *cmd,
+		const struct rspamd_fuzzy_reply *rep)
+{
+	struct fuzzy_cache_elt *elt;
+
+	if (fuzzy_module_ctx->cache == NULL) {
+		return;
+	}
+
+	elt = g_slice_alloc (sizeof (*elt));
+	elt->rule = rule;
+	memcpy (elt->digest, cmd->digest, sizeof (elt->digest));
+	memcpy (&elt->rep, rep, sizeof (elt->rep));
+	rspamd_lru_hash_insert (fuzzy_module_ctx->cache, elt, elt, time (NULL),
+			fuzzy_module_ctx->cache_expire);
+}
+
+/*
+ * Answer commands from the cache of replies and remove them from the vector.
+ * Shingles are derived from the same content as the digest, so digest is
+ * enough to identify a command within a rule
+ */
+static void
+fuzzy_cache_check (struct rspamd_task *task, struct fuzzy_rule *rule,
+		GPtrArray *commands)
+{
+	struct fuzzy_cache_elt search, *elt;
+	const struct rspamd_fuzzy_cmd *cmd;
+	time_t now;
+	guint i = 0;
+
+	if (fuzzy_module_ctx->cache == NULL) {
+		return;
+	}
+
+	now = time (NULL);
+	search.rule = rule;
+
+	while (i < commands->len) {
+		cmd = g_ptr_array_index (commands, i);
+		memcpy (search.digest, cmd->digest, sizeof (search.digest));
+		elt = rspamd_lru_hash_lookup (fuzzy_module_ctx->cache, &search, now);
+
+		if (elt != NULL) {
+			msg_debug ("<%s>, use cached fuzzy reply", task->message_id);
+			fuzzy_insert_result (task, rule, &elt->rep);
+			g_ptr_array_remove_index (commands, i);
+		}
+		else {
+			i ++;
+		}
+	}
+}
+
 /* Call this whenever we got data from fuzzy storage */
 static void
 fuzzy_io_callback (gint fd, short what, void *arg)
 {
 	struct fuzzy_client_session *session = arg;
 	const struct rspamd_fuzzy_reply *rep;
-	struct fuzzy_mapping *map;
+	const struct rspamd_fuzzy_cmd *cmd;
 	guchar buf[2048], *p;
-	const gchar *symbol;
 	gint r;
-	double nval;
 	gint ret = -1;
 
 	if (what == EV_WRITE) {
@@ -772,45 +1003,10 @@ fuzzy_io_callback (gint fd, short what, void *arg)
 		}
 		else {
 			p = buf;
-			while ((rep = fuzzy_process_reply (&p, &r, session->commands)) != NULL) {
-				/* Get mapping by flag */
-				if ((map =
-						g_hash_table_lookup (session->rule->mappings,
-								GINT_TO_POINTER (rep->flag))) == NULL) {
-					/* Default symbol and default weight */
-					symbol = session->rule->symbol;
-
-				}
-				else {
-					/* Get symbol and weight from map */
-					symbol = map->symbol;
-				}
-
-				if (rep->prob > 0.5) {
-					nval = fuzzy_normalize (rep->value, session->rule->max_score);
-					nval *= rep->prob;
-					msg_info (
-							"<%s>, found fuzzy hash with weight: %.2f, in list: %s:%d%s",
-							session->task->message_id,
-							nval,
-							symbol,
-							rep->flag,
-							map == NULL ? "(unknown)" : "");
-					if (map != NULL || !session->rule->skip_unknown) {
-						rspamd_snprintf (buf,
-								sizeof (buf),
-								"%d: %.2f / %.2f",
-								rep->flag,
-								rep->prob,
-								nval);
-						rspamd_task_insert_result_single (session->task,
-								symbol,
-								nval,
-								g_list_prepend (NULL,
-									rspamd_mempool_strdup (
-										session->task->task_pool, buf)));
-					}
-				}
+			while ((rep = fuzzy_process_reply (&p, &r, session->commands,
+					&cmd)) != NULL) {
+				fuzzy_cache_store (session->rule, cmd, rep);
+				fuzzy_insert_result (session->task, session->rule, rep);
 				ret = 1;
 			}
 		}
@@ -880,7 +1076,7 @@ fuzzy_learn_callback (gint fd, short what, void *arg)
 		}
 		else {
 			p = buf;
-			while ((rep = fuzzy_process_reply (&p, &r, session->commands)) != NULL) {
+			while ((rep = fuzzy_process_reply (&p, &r, session->commands, NULL)) != NULL) {
 				if ((map =
 						g_hash_table_lookup (session->rule->mappings,
 								GINT_TO_POINTER (rep->flag))) == NULL) {
@@ -964,6 +1160,8 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 	struct mime_part *mime_part;
 	struct rspamd_image *image;
 	struct rspamd_fuzzy_cmd *cmd;
+	GByteArray *content;
+	guint64 phash;
 	gsize hashlen;
 	GList *cur;
 	GPtrArray *res;
@@ -986,7 +1184,7 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 			continue;
 		}
 		/* Check length of hash */
-		hashlen = strlen (part->fuzzy->hash_pipe);
+		hashlen = strlen (rspamd_text_part_get_fuzzy (part)->hash_pipe);
 		if (hashlen == 0) {
 			msg_info ("<%s>, part hash empty, skip fuzzy check",
 				task->message_id, fuzzy_module_ctx->min_hash_len);
@@ -1024,28 +1222,42 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 	cur = task->images;
 	while (cur) {
 		image = cur->data;
-		if (image->data->len > 0) {
-			if (fuzzy_module_ctx->min_height <= 0 || image->height >=
-				fuzzy_module_ctx->min_height) {
-				if (fuzzy_module_ctx->min_width <= 0 || image->width >=
-					fuzzy_module_ctx->min_width) {
-					if (c == FUZZY_CHECK) {
-						cmd = fuzzy_cmd_from_data_part (rule, c, flag, value,
-								task->task_pool,
-								image->data->data, image->data->len,
-								TRUE, NULL);
-						if (cmd) {
-							g_ptr_array_add (res, cmd);
-						}
-					}
+		if ((fuzzy_module_ctx->min_height <= 0 || image->height >=
+			fuzzy_module_ctx->min_height) &&
+			(fuzzy_module_ctx->min_width <= 0 || image->width >=
+			fuzzy_module_ctx->min_width)) {
+			/* Images are decoded only if their sizes are suitable */
+			content = rspamd_mime_part_get_content (image->part);
+
+			if (content->len > 0) {
+				if (c == FUZZY_CHECK) {
 					cmd = fuzzy_cmd_from_data_part (rule, c, flag, value,
 							task->task_pool,
-							image->data->data, image->data->len,
-							FALSE, NULL);
+							content->data, content->len,
+							TRUE, NULL);
 					if (cmd) {
 						g_ptr_array_add (res, cmd);
 					}
 				}
+				cmd = fuzzy_cmd_from_data_part (rule, c, flag, value,
+						task->task_pool,
+						content->data, content->len,
+						FALSE, NULL);
+				if (cmd) {
+					g_ptr_array_add (res, cmd);
+				}
+			}
+
+			if (rule->image_phash &&
+					(phash = rspamd_image_get_phash (image)) != 0) {
+				phash = GUINT64_TO_LE (phash);
+				cmd = fuzzy_cmd_from_data_part (rule, c, flag, value,
+						task->task_pool,
+						(const guchar *)&phash, sizeof (phash),
+						FALSE, NULL);
+				if (cmd) {
+					g_ptr_array_add (res, cmd);
+				}
 			}
 		}
 		cur = g_list_next (cur);
@@ -1054,14 +1266,14 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 	cur = task->parts;
 	while (cur) {
 		mime_part = cur->data;
-		if (mime_part->content->len > 0 &&
-			fuzzy_check_content_type (rule, mime_part->type)) {
-			if (fuzzy_module_ctx->min_bytes <= 0 || mime_part->content->len >=
+		if (fuzzy_check_content_type (rule, mime_part->type) &&
+			(content = rspamd_mime_part_get_content (mime_part))->len > 0) {
+			if (fuzzy_module_ctx->min_bytes <= 0 || content->len >=
 				fuzzy_module_ctx->min_bytes) {
 				if (c == FUZZY_CHECK) {
 					cmd = fuzzy_cmd_from_data_part (rule, c, flag, value,
 							task->task_pool,
-							mime_part->content->data, mime_part->content->len,
+							content->data, content->len,
 							TRUE, NULL);
 					if (cmd) {
 						g_ptr_array_add (res, cmd);
@@ -1069,7 +1281,7 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 				}
 				cmd = fuzzy_cmd_from_data_part (rule, c, flag, value,
 						task->task_pool,
-						mime_part->content->data, mime_part->content->len,
+						content->data, content->len,
 						FALSE, NULL);
 				if (cmd) {
 					g_ptr_array_add (res, cmd);
@@ -1154,7 +1366,14 @@ fuzzy_symbol_callback (struct rspamd_task *task, void *unused)
 		rule = cur->data;
 		commands = fuzzy_generate_commands (task, rule, FUZZY_CHECK, 0, 0);
 		if (commands != NULL) {
-			register_fuzzy_client_call (task, rule, commands);
+			fuzzy_cache_check (task, rule, commands);
+
+			if (commands->len > 0) {
+				register_fuzzy_client_call (task, rule, commands);
+			}
+			else {
+				g_ptr_array_free (commands, TRUE);
+			}
 		}
 		cur = g_list_next (cur);
 	}
@@ -46,6 +46,14 @@
 
 /* 60 seconds for worker's IO */
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
+/* 30 seconds to wait for the next request on a persistent connection */
+#define DEFAULT_KEEPALIVE_TIMEOUT 30000
+/* Maximum number of requests served by a single connection */
+#define DEFAULT_KEEPALIVE_REQUESTS 1000
+/* Maximum number of messages in a batch request */
+#define DEFAULT_MAX_BATCH_MESSAGES 100
+/* Maximum number of connections accepted per a single event */
+#define MAX_ACCEPT_BATCH 64
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
@@ -67,6 +75,11 @@ worker_t normal_worker = {
 struct rspamd_worker_ctx {
 	guint32 timeout;
 	struct timeval io_tv;
+	/* Idle timeout for persistent connections */
+	guint32 keepalive_timeout;
+	struct timeval keepalive_tv;
+	/* Requests per persistent connection (0 - disable keep-alive) */
+	guint32 keepalive_requests;
 	/* Detect whether this worker is mime worker    */
 	gboolean is_mime;
 	/* HTTP worker									*/
@@ -75,16 +88,33 @@ struct rspamd_worker_ctx {
 	gboolean is_json;
 	/* Allow learning throught worker				*/
 	gboolean allow_learn;
+	/* Allow scanning of local files passed by path */
+	gboolean allow_local_files;
+	/* Directories where such files are allowed to be placed */
+	GList *local_files_dirs;
 	/* DNS resolver */
 	struct rspamd_dns_resolver *resolver;
 	/* Current tasks */
 	guint32 tasks;
 	/* Limit of tasks */
 	guint32 max_tasks;
+	/* Limit of messages in a batch request */
+	guint32 max_batch_messages;
+	/* Do not accept new connections until the number of tasks drops */
+	gboolean accept_paused;
+	/* Worker object */
+	struct rspamd_worker *worker;
 	/* Classify threads */
 	guint32 classify_threads;
 	/* Classify threads */
 	GThreadPool *classify_pool;
+	/* Mime parser threads (0 - parse messages in the main thread) */
+	guint32 mime_threads;
+	/* Mime parser threads pool */
+	GThreadPool *mime_pool;
+	/* Socketpair to pass parsed tasks back to the main thread */
+	gint mime_pair[2];
+	struct event mime_ev;
 	/* Events base */
 	struct event_base *ev_base;
 	/* Encryption key */
@@ -93,15 +123,449 @@ struct rspamd_worker_ctx {
 	struct rspamd_keypair_cache *keys_cache;
 };
 
+static void
+rspamd_worker_set_accept (struct rspamd_worker *worker, gboolean enable)
+{
+	GList *cur;
+	struct event *ev;
+
+	cur = worker->accept_events;
+	while (cur) {
+		ev = cur->data;
+		if (enable) {
+			event_add (ev, NULL);
+		}
+		else {
+			event_del (ev);
+		}
+		cur = g_list_next (cur);
+	}
+}
+
 /*
  * Reduce number of tasks proceeded
  */
 static void
 reduce_tasks_count (gpointer arg)
 {
-	guint32 *tasks = arg;
+	struct rspamd_worker_ctx *ctx = arg;
+
+	ctx->tasks--;
+	g_atomic_int_add (&ctx->worker->srv->stat->tasks_active, -1);
+	g_atomic_int_add (ctx->worker->tasks_active, -1);
+
+	if (ctx->accept_paused && ctx->tasks < ctx->max_tasks) {
+		msg_info ("current tasks is now: %uD, resume accepting connections",
+			ctx->tasks);
+		ctx->accept_paused = FALSE;
+		rspamd_worker_set_accept (ctx->worker, TRUE);
+	}
+}
+
+/*
+ * Account a task that processes a request
+ */
+static void
+rspamd_worker_count_task (struct rspamd_worker_ctx *ctx,
+	struct rspamd_task *task)
+{
+	ctx->tasks++;
+	g_atomic_int_inc (&ctx->worker->srv->stat->tasks_active);
+	g_atomic_int_inc (ctx->worker->tasks_active);
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t)reduce_tasks_count, ctx);
+}
+
+/*
+ * Tasks waiting for the next request on a persistent connection are idle, so
+ * they are not accounted and their time is not started until the request
+ * arrives
+ */
+static int
+rspamd_worker_headers_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+
+	if (task->conn_requests > 1) {
+		rspamd_task_reset_time (task);
+		rspamd_worker_count_task (task->worker->ctx, task);
+	}
+
+	return 0;
+}
+
+/*
+ * A message being parsed in the mime pool
+ */
+struct rspamd_worker_mime_job {
+	struct rspamd_task *task;
+	gint ret;
+};
+
+/*
+ * Called if the session of a task is destroyed while its message is parsed
+ */
+static void
+rspamd_worker_mime_job_fin (gpointer ud)
+{
+	struct rspamd_worker_mime_job *job = ud;
+
+	job->task = NULL;
+}
+
+/*
+ * Parse message in a thread of mime pool
+ */
+static void
+rspamd_worker_mime_thread (gpointer data, gpointer ud)
+{
+	struct rspamd_worker_mime_job *job = data;
+	struct rspamd_worker_ctx *ctx = ud;
+	struct rspamd_task *task = job->task;
+
+	job->ret = process_message (task);
+	/* Task must not be touched after this point */
+	remove_async_thread (task->s);
+
+	while (write (ctx->mime_pair[1], &job, sizeof (job)) == -1) {
+		if (errno != EINTR) {
+			msg_err ("cannot pass parsed task to the main thread: %s",
+				strerror (errno));
+			break;
+		}
+	}
+}
+
+/*
+ * Continue processing of tasks parsed by mime pool
+ */
+static void
+rspamd_worker_mime_done (gint fd, short what, void *arg)
+{
+	struct rspamd_worker_ctx *ctx = arg;
+	struct rspamd_worker_mime_job *job;
+	struct rspamd_task *task;
+
+	while (read (fd, &job, sizeof (job)) == sizeof (job)) {
+		task = job->task;
+
+		if (task != NULL) {
+			if (job->ret == -1) {
+				msg_warn ("processing of message failed");
+				task->last_error = "MIME processing error";
+				task->error_code = RSPAMD_FILTER_ERROR;
+				task->state = WRITE_REPLY;
+			}
+			else if (!rspamd_task_process_filters (task, ctx->classify_pool,
+					TRUE)) {
+				task->state = WRITE_REPLY;
+			}
+			/* This can finalize task and write reply */
+			remove_normal_event (task->s, rspamd_worker_mime_job_fin, job);
+		}
+
+		g_slice_free1 (sizeof (*job), job);
+	}
+}
+
+/*
+ * Push task to mime pool, processing is continued in the main thread
+ */
+static gboolean
+rspamd_worker_process_threaded (struct rspamd_worker_ctx *ctx,
+	struct rspamd_task *task,
+	struct rspamd_http_message *msg, const gchar *start, gsize len)
+{
+	struct rspamd_worker_mime_job *job;
+	GError *err = NULL;
+
+	if (!rspamd_task_load_message (task, msg, start, len)) {
+		return FALSE;
+	}
+
+	job = g_slice_alloc (sizeof (*job));
+	job->task = task;
+	job->ret = 0;
+
+	register_async_thread (task->s);
+	g_thread_pool_push (ctx->mime_pool, job, &err);
+
+	if (err != NULL) {
+		msg_err ("cannot push task to the mime pool: %s", err->message);
+		g_error_free (err);
+		remove_async_thread (task->s);
+		g_slice_free1 (sizeof (*job), job);
+
+		/* Parse message in the main thread */
+		if (process_message (task) == -1) {
+			msg_warn ("processing of message failed");
+			task->last_error = "MIME processing error";
+			task->error_code = RSPAMD_FILTER_ERROR;
+			task->state = WRITE_REPLY;
+			return FALSE;
+		}
+
+		return rspamd_task_process_filters (task, ctx->classify_pool, TRUE);
+	}
+
+	/*
+	 * Event prevents session from being finalized until message is parsed,
+	 * the job is returned to this thread not earlier than we return from here
+	 */
+	register_async_event (task->s, rspamd_worker_mime_job_fin, job,
+		g_quark_from_static_string ("mime"));
+
+	return TRUE;
+}
+
+/*
+ * A message of a batch request
+ */
+struct rspamd_worker_batch_msg {
+	const gchar *start;
+	gsize len;
+};
+
+/*
+ * Batch request: subtasks are started for its messages while the limit of
+ * tasks allows it, and the next ones are started when some of them finish
+ */
+struct rspamd_worker_batch {
+	struct rspamd_worker_ctx *ctx;
+	struct rspamd_task *task;
+	struct rspamd_http_message *msg;
+	struct rspamd_worker_batch_msg *messages;
+	guint nmessages;
+	guint next;
+	guint running;
+	gboolean starting;
+};
+
+/*
+ * Subtask is counted as an active task until it is finished, while its
+ * results are kept until the reply for the whole batch is written
+ */
+struct rspamd_worker_subtask {
+	struct rspamd_worker_batch *batch;
+	gboolean active;
+};
+
+static void rspamd_worker_batch_run (struct rspamd_worker_batch *batch);
+
+/*
+ * Batch event of a parent task is removed when all subtasks are finished
+ */
+static void
+rspamd_worker_batch_event_fin (gpointer ud)
+{
+	/* Do nothing */
+}
+
+static void
+rspamd_worker_subtask_done (gpointer ud)
+{
+	struct rspamd_worker_subtask *elt = ud;
+
+	if (elt->active) {
+		elt->active = FALSE;
+		elt->batch->running --;
+		reduce_tasks_count (elt->batch->ctx);
+	}
+}
+
+/*
+ * Called instead of writing reply when a subtask of batch is finished
+ */
+static gboolean
+rspamd_worker_subtask_fin (void *arg)
+{
+	struct rspamd_worker_subtask *elt = arg;
+
+	if (elt->active) {
+		rspamd_worker_subtask_done (elt);
+		rspamd_worker_batch_run (elt->batch);
+	}
+
+	return TRUE;
+}
+
+static struct rspamd_task *
+rspamd_worker_new_subtask (struct rspamd_worker_batch *batch)
+{
+	struct rspamd_worker_ctx *ctx = batch->ctx;
+	struct rspamd_task *parent = batch->task, *sub;
+	struct rspamd_worker_subtask *elt;
+
+	sub = rspamd_task_new (parent->worker);
+	sub->flags = parent->flags & ~RSPAMD_TASK_FLAG_KEEPALIVE;
+	sub->cmd = CMD_CHECK;
+	sub->client_addr = rspamd_inet_address_copy (parent->client_addr);
+	sub->resolver = ctx->resolver;
+	sub->ev_base = ctx->ev_base;
+	sub->classify_pool = ctx->classify_pool;
+
+	elt = rspamd_mempool_alloc (sub->task_pool, sizeof (*elt));
+	elt->batch = batch;
+	elt->active = TRUE;
+	sub->fin_callback = rspamd_worker_subtask_fin;
+	sub->fin_arg = elt;
+
+	batch->running ++;
+	ctx->tasks++;
+	g_atomic_int_inc (&ctx->worker->srv->stat->tasks_active);
+	g_atomic_int_inc (ctx->worker->tasks_active);
+	/* Subtask can be destroyed unfinished if the connection is closed */
+	rspamd_mempool_add_destructor (sub->task_pool, rspamd_worker_subtask_done,
+		elt);
+
+	sub->s = new_async_session (sub->task_pool, rspamd_task_fin,
+			rspamd_task_restore, rspamd_task_free_hard, sub);
+
+	return sub;
+}
+
+/*
+ * Start subtasks for the pending messages of batch
+ */
+static void
+rspamd_worker_batch_run (struct rspamd_worker_batch *batch)
+{
+	struct rspamd_worker_ctx *ctx = batch->ctx;
+	struct rspamd_task *task = batch->task, *sub;
+	struct rspamd_worker_batch_msg *m;
+	gboolean ret;
+
+	if (batch->starting) {
+		/* Subtask has been finished while being started */
+		return;
+	}
+
+	batch->starting = TRUE;
+
+	while (batch->next < batch->nmessages) {
+		/* At least one message is processed regardless of the limit */
+		if (ctx->max_tasks != 0 && ctx->tasks >= ctx->max_tasks &&
+				batch->running > 0) {
+			break;
+		}
+
+		m = &batch->messages[batch->next ++];
+		sub = rspamd_worker_new_subtask (batch);
+		g_ptr_array_add (task->subtasks, sub);
+
+		if (ctx->mime_pool != NULL) {
+			ret = rspamd_worker_process_threaded (ctx, sub, batch->msg,
+					m->start, m->len);
+		}
+		else {
+			ret = rspamd_task_process (sub, batch->msg, m->start, m->len,
+					ctx->classify_pool, TRUE);
+		}
+
+		if (!ret) {
+			sub->state = WRITE_REPLY;
+		}
+
+		/* Finish subtask if it has no pending events */
+		check_session_pending (sub->s);
+	}
+
+	batch->starting = FALSE;
+
+	if (batch->next == batch->nmessages && batch->running == 0 &&
+			task->state != WRITE_REPLY) {
+		task->state = WRITE_REPLY;
+		/* This can write reply for the whole batch */
+		remove_normal_event (task->s, rspamd_worker_batch_event_fin, task);
+	}
+}
+
+/*
+ * Read the length of the next message of batch followed by CRLF
+ */
+static gboolean
+rspamd_worker_batch_next (const gchar **pp, const gchar *end, gsize *mlen)
+{
+	const gchar *p = *pp;
+	gsize len = 0;
+
+	while (p < end && g_ascii_isdigit (*p)) {
+		if (len > (G_MAXSIZE - 9) / 10) {
+			return FALSE;
+		}
+		len = len * 10 + (*p - '0');
+		p ++;
+	}
 
-	(*tasks)--;
+	if (end - p < 2 || p[0] != '\r' || p[1] != '\n' ||
+			len == 0 || len > (gsize)(end - p - 2)) {
+		return FALSE;
+	}
+
+	*pp = p + 2;
+	*mlen = len;
+
+	return TRUE;
+}
+
+/*
+ * Split body of batch request to messages and process each of them by
+ * a separate subtask. Each message is prefixed by its length and CRLF.
+ */
+static void
+rspamd_worker_process_batch (struct rspamd_worker_ctx *ctx,
+	struct rspamd_task *task,
+	struct rspamd_http_message *msg, const gchar *start, gsize len)
+{
+	struct rspamd_worker_batch *batch;
+	const gchar *p = start, *end = start + len;
+	gsize mlen;
+	guint n = 0;
+
+	/* Check the whole batch before starting any of its messages */
+	while (p < end) {
+		if (!rspamd_worker_batch_next (&p, end, &mlen)) {
+			msg_err ("invalid batch format at offset %z", (gsize)(p - start));
+			task->last_error = "invalid batch format";
+			task->error_code = 400;
+			task->state = WRITE_REPLY;
+			return;
+		}
+
+		p += mlen;
+		n ++;
+
+		if (ctx->max_batch_messages != 0 && n > ctx->max_batch_messages) {
+			msg_err ("too many messages in batch, maximum is %uD",
+				ctx->max_batch_messages);
+			task->last_error = "too many messages in batch";
+			task->error_code = 400;
+			task->state = WRITE_REPLY;
+			return;
+		}
+	}
+
+	batch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*batch));
+	batch->ctx = ctx;
+	batch->task = task;
+	batch->msg = msg;
+	batch->nmessages = n;
+	batch->messages = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*batch->messages) * MAX (n, 1));
+
+	for (p = start, n = 0; p < end; n ++) {
+		rspamd_worker_batch_next (&p, end, &mlen);
+		batch->messages[n].start = p;
+		batch->messages[n].len = mlen;
+		p += mlen;
+	}
+
+	task->subtasks = g_ptr_array_sized_new (batch->nmessages);
+	register_async_event (task->s, rspamd_worker_batch_event_fin, task,
+		g_quark_from_static_string ("batch"));
+
+	rspamd_worker_batch_run (batch);
 }
 
 static gint
@@ -114,6 +578,11 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 
 	ctx = task->worker->ctx;
 
+	if ((msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE) &&
+			task->conn_requests < ctx->keepalive_requests) {
+		task->flags |= RSPAMD_TASK_FLAG_KEEPALIVE;
+	}
+
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		task->state = WRITE_REPLY;
 		return 0;
@@ -124,7 +593,7 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		return 0;
 	}
 
-	if (msg->body->len == 0) {
+	if (msg->body->len == 0 && !rspamd_protocol_has_file (msg)) {
 		msg_err ("got zero length body, cannot continue");
 		task->last_error = "message's body is empty";
 		task->error_code = RSPAMD_LENGTH_ERROR;
@@ -136,7 +605,26 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		task->peer_key = rspamd_http_connection_key_ref (msg->peer_key);
 	}
 
-	if (!rspamd_task_process (task, msg, chunk, len, ctx->classify_pool, TRUE)) {
+	if (task->cmd == CMD_CHECK_V) {
+		if (rspamd_protocol_has_file (msg)) {
+			task->last_error = "file cannot be scanned in batch mode";
+			task->error_code = 400;
+			task->state = WRITE_REPLY;
+		}
+		else {
+			rspamd_worker_process_batch (ctx, task, msg, chunk, len);
+		}
+
+		return 0;
+	}
+
+	if (ctx->mime_pool != NULL) {
+		if (!rspamd_worker_process_threaded (ctx, task, msg, chunk, len)) {
+			task->state = WRITE_REPLY;
+		}
+	}
+	else if (!rspamd_task_process (task, msg, chunk, len, ctx->classify_pool,
+			TRUE)) {
 		task->state = WRITE_REPLY;
 	}
 
@@ -148,12 +636,22 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
 
-	msg_info ("abnormally closing connection from: %s, error: %s",
-		rspamd_inet_address_to_string (task->client_addr), err->message);
+	if (task->conn_requests > 1 && task->state == READ_MESSAGE) {
+		msg_debug ("closing persistent connection from: %s, error: %s",
+			rspamd_inet_address_to_string (task->client_addr), err->message);
+	}
+	else {
+		msg_info ("abnormally closing connection from: %s, error: %s",
+			rspamd_inet_address_to_string (task->client_addr), err->message);
+	}
 	/* Terminate session immediately */
 	destroy_session (task->s);
 }
 
+static void rspamd_worker_new_task (struct rspamd_worker *worker, gint nfd,
+	rspamd_inet_addr_t *addr, struct rspamd_http_connection *conn,
+	guint32 nreq);
+
 static gint
 rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -162,8 +660,19 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 
 	if (task->state == CLOSING_CONNECTION || task->state == WRITING_REPLY) {
 		/* We are done here */
-		msg_debug ("normally closing connection from: %s",
-			rspamd_inet_address_to_string (task->client_addr));
+		if (msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE) {
+			msg_debug ("keeping connection from: %s alive",
+				rspamd_inet_address_to_string (task->client_addr));
+			/* Pass socket and connection to the task for the next request */
+			rspamd_worker_new_task (task->worker, task->sock,
+				rspamd_inet_address_copy (task->client_addr),
+				task->http_conn, task->conn_requests + 1);
+			task->sock = -1;
+		}
+		else {
+			msg_debug ("normally closing connection from: %s",
+				rspamd_inet_address_to_string (task->client_addr));
+		}
 		destroy_session (task->s);
 	}
 	else if (task->state == WRITE_REPLY) {
@@ -191,42 +700,20 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 }
 
 /*
- * Accept new connection and construct task
+ * Construct task for a request read from the specified socket
  */
 static void
-accept_socket (gint fd, short what, void *arg)
+rspamd_worker_new_task (struct rspamd_worker *worker, gint nfd,
+	rspamd_inet_addr_t *addr, struct rspamd_http_connection *conn,
+	guint32 nreq)
 {
-	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
 	struct rspamd_worker_ctx *ctx;
 	struct rspamd_task *new_task;
-	rspamd_inet_addr_t *addr;
-	gint nfd;
+	struct timeval *tv;
 
 	ctx = worker->ctx;
-
-	if (ctx->max_tasks != 0 && ctx->tasks > ctx->max_tasks) {
-		msg_info ("current tasks is now: %uD while maximum is: %uD",
-			ctx->tasks,
-			ctx->max_tasks);
-		return;
-	}
-
-	if ((nfd =
-		rspamd_accept_from_socket (fd, &addr)) == -1) {
-		msg_warn ("accept failed: %s", strerror (errno));
-		return;
-	}
-	/* Check for EAGAIN */
-	if (nfd == 0) {
-		return;
-	}
-
 	new_task = rspamd_task_new (worker);
 
-	msg_info ("accepted connection from %s port %d",
-		rspamd_inet_address_to_string (addr),
-		rspamd_inet_address_get_port (addr));
-
 	/* Copy some variables */
 	if (ctx->is_mime) {
 		new_task->flags |= RSPAMD_TASK_FLAG_MIME;
@@ -237,21 +724,37 @@ accept_socket (gint fd, short what, void *arg)
 
 	new_task->sock = nfd;
 	new_task->client_addr = addr;
-
-	worker->srv->stat->connections_count++;
+	new_task->conn_requests = nreq;
 	new_task->resolver = ctx->resolver;
 
-	new_task->http_conn = rspamd_http_connection_new (
-		rspamd_worker_body_handler,
-		rspamd_worker_error_handler,
-		rspamd_worker_finish_handler,
-		0,
-		RSPAMD_HTTP_SERVER,
-		ctx->keys_cache);
+	if (conn == NULL) {
+		new_task->http_conn = rspamd_http_connection_new (
+			rspamd_worker_body_handler,
+			rspamd_worker_error_handler,
+			rspamd_worker_finish_handler,
+			0,
+			RSPAMD_HTTP_SERVER,
+			ctx->keys_cache);
+
+		if (ctx->key) {
+			rspamd_http_connection_set_key (new_task->http_conn, ctx->key);
+		}
+
+		new_task->http_conn->headers_handler = rspamd_worker_headers_handler;
+		tv = &ctx->io_tv;
+	}
+	else {
+		/* Persistent connection, wait for the next request */
+		new_task->http_conn = rspamd_http_connection_ref (conn);
+		rspamd_http_connection_reset (conn);
+		tv = &ctx->keepalive_tv;
+	}
+
 	new_task->ev_base = ctx->ev_base;
-	ctx->tasks++;
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t)reduce_tasks_count, &ctx->tasks);
+
+	if (conn == NULL) {
+		rspamd_worker_count_task (ctx, new_task);
+	}
 
 	/* Set up async session */
 	new_task->s = new_async_session (new_task->task_pool, rspamd_task_fin,
@@ -259,17 +762,66 @@ accept_socket (gint fd, short what, void *arg)
 
 	new_task->classify_pool = ctx->classify_pool;
 
-	if (ctx->key) {
-		rspamd_http_connection_set_key (new_task->http_conn, ctx->key);
+	if (ctx->allow_local_files) {
+		new_task->local_dirs = ctx->local_files_dirs;
 	}
 
 	rspamd_http_connection_read_message (new_task->http_conn,
 		new_task,
 		nfd,
-		&ctx->io_tv,
+		tv,
 		ctx->ev_base);
 }
 
+/*
+ * Accept new connections and construct tasks
+ */
+static void
+accept_socket (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
+	struct rspamd_worker_ctx *ctx;
+	rspamd_inet_addr_t *addr;
+	gint nfd, i;
+
+	ctx = worker->ctx;
+
+	for (i = 0; i < MAX_ACCEPT_BATCH; i++) {
+		if (ctx->max_tasks != 0 && ctx->tasks >= ctx->max_tasks) {
+			/*
+			 * Leave pending connections in the listen queue, so other
+			 * workers can accept them
+			 */
+			msg_info ("current tasks is now: %uD while maximum is: %uD, "
+				"stop accepting connections",
+				ctx->tasks,
+				ctx->max_tasks);
+			ctx->accept_paused = TRUE;
+			worker->srv->stat->accept_paused++;
+			rspamd_worker_set_accept (worker, FALSE);
+			return;
+		}
+
+		if ((nfd =
+			rspamd_accept_from_socket (fd, &addr)) == -1) {
+			msg_warn ("accept failed: %s", strerror (errno));
+			return;
+		}
+		/* Check for EAGAIN */
+		if (nfd == 0) {
+			return;
+		}
+
+		msg_info ("accepted connection from %s port %d",
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+		worker->srv->stat->connections_count++;
+
+		rspamd_worker_new_task (worker, nfd, addr, NULL, 1);
+	}
+}
+
 gpointer
 init_worker (struct rspamd_config *cfg)
 {
@@ -282,6 +834,9 @@ init_worker (struct rspamd_config *cfg)
 
 	ctx->is_mime = TRUE;
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+	ctx->keepalive_requests = DEFAULT_KEEPALIVE_REQUESTS;
+	ctx->max_batch_messages = DEFAULT_MAX_BATCH_MESSAGES;
 	ctx->classify_threads = 1;
 
 	rspamd_rcl_register_worker_option (cfg, type, "mime",
@@ -300,21 +855,48 @@ init_worker (struct rspamd_config *cfg)
 		rspamd_rcl_parse_struct_boolean, ctx,
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx, allow_learn), 0);
 
+	rspamd_rcl_register_worker_option (cfg, type, "allow_local_files",
+		rspamd_rcl_parse_struct_boolean, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx, allow_local_files), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "local_files_dirs",
+		rspamd_rcl_parse_struct_string_list, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx, local_files_dirs), 0);
+
 	rspamd_rcl_register_worker_option (cfg, type, "timeout",
 		rspamd_rcl_parse_struct_time, ctx,
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
 		timeout), RSPAMD_CL_FLAG_TIME_INTEGER);
 
+	rspamd_rcl_register_worker_option (cfg, type, "keepalive_timeout",
+		rspamd_rcl_parse_struct_time, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		keepalive_timeout), RSPAMD_CL_FLAG_TIME_INTEGER);
+
+	rspamd_rcl_register_worker_option (cfg, type, "keepalive_requests",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		keepalive_requests), RSPAMD_CL_FLAG_INT_32);
+
 	rspamd_rcl_register_worker_option (cfg, type, "max_tasks",
 		rspamd_rcl_parse_struct_integer, ctx,
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
 		max_tasks), RSPAMD_CL_FLAG_INT_32);
 
+	rspamd_rcl_register_worker_option (cfg, type, "max_batch_messages",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		max_batch_messages), RSPAMD_CL_FLAG_INT_32);
+
 	rspamd_rcl_register_worker_option (cfg, type, "classify_threads",
 		rspamd_rcl_parse_struct_integer, ctx,
 		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
 		classify_threads), RSPAMD_CL_FLAG_INT_32);
 
+	rspamd_rcl_register_worker_option (cfg, type, "mime_threads",
+		rspamd_rcl_parse_struct_integer, ctx,
+		G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+		mime_threads), RSPAMD_CL_FLAG_INT_32);
 
 	rspamd_rcl_register_worker_option (cfg, type, "keypair",
 		rspamd_rcl_parse_struct_keypair, ctx,
@@ -324,6 +906,37 @@ init_worker (struct rspamd_config *cfg)
 	return ctx;
 }
 
+/*
+ * Resolve directories of local files, as paths of files are compared with
+ * them after resolving as well
+ */
+static void
+rspamd_worker_init_local_dirs (struct rspamd_worker_ctx *ctx)
+{
+	GList *cur, *dirs = NULL;
+	gchar *dir;
+
+	for (cur = ctx->local_files_dirs; cur != NULL; cur = g_list_next (cur)) {
+		dir = realpath (cur->data, NULL);
+
+		if (dir == NULL) {
+			msg_err ("cannot resolve directory %s: %s", (gchar *)cur->data,
+					strerror (errno));
+			continue;
+		}
+
+		dirs = g_list_prepend (dirs, dir);
+	}
+
+	ctx->local_files_dirs = dirs;
+
+	if (dirs == NULL) {
+		msg_warn ("no directories for local files are defined, "
+				"scanning of local files is disabled");
+		ctx->allow_local_files = FALSE;
+	}
+}
+
 /*
  * Start worker process
  */
@@ -334,11 +947,16 @@ start_worker (struct rspamd_worker *worker)
 	GError *err = NULL;
 	struct lua_locked_state *nL;
 
+	ctx->worker = worker;
 	ctx->ev_base = rspamd_prepare_worker (worker, "normal", accept_socket);
 	msec_to_tv (ctx->timeout, &ctx->io_tv);
+	msec_to_tv (ctx->keepalive_timeout, &ctx->keepalive_tv);
 
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base);
 
+	if (ctx->allow_local_files) {
+		rspamd_worker_init_local_dirs (ctx);
+	}
 
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
@@ -362,11 +980,50 @@ start_worker (struct rspamd_worker *worker)
 		}
 	}
 
-	/* XXX: stupid default */
+	/* Create mime pool */
+	ctx->mime_pool = NULL;
+	if (ctx->mime_threads > 0) {
+		if (rspamd_socketpair (ctx->mime_pair) == -1) {
+			msg_err ("cannot create socketpair: %s", strerror (errno));
+		}
+		else {
+			rspamd_socket_nonblocking (ctx->mime_pair[0]);
+			event_set (&ctx->mime_ev, ctx->mime_pair[0], EV_READ | EV_PERSIST,
+				rspamd_worker_mime_done, ctx);
+			event_base_set (ctx->ev_base, &ctx->mime_ev);
+			event_add (&ctx->mime_ev, NULL);
+
+			ctx->mime_pool = g_thread_pool_new (rspamd_worker_mime_thread,
+					ctx,
+					ctx->mime_threads,
+					TRUE,
+					&err);
+			if (err != NULL) {
+				msg_err ("pool create failed: %s", err->message);
+				g_error_free (err);
+				err = NULL;
+				ctx->mime_pool = NULL;
+				event_del (&ctx->mime_ev);
+				close (ctx->mime_pair[0]);
+				close (ctx->mime_pair[1]);
+			}
+		}
+	}
+
+	/* Recently used keys are cached locally, others are looked up in shm */
 	ctx->keys_cache = rspamd_keypair_cache_new (256);
+	if (worker->srv->keys_cache != NULL) {
+		rspamd_keypair_cache_set_shared (ctx->keys_cache,
+			worker->srv->keys_cache);
+	}
 
 	event_base_loop (ctx->ev_base, 0);
 
+	if (ctx->mime_pool != NULL) {
+		/* Wait for messages being parsed */
+		g_thread_pool_free (ctx->mime_pool, TRUE, TRUE);
+	}
+
 	g_mime_shutdown ();
 	rspamd_log_close (rspamd_main->logger);
 
@@ -0,0 +1,290 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "cryptobox.h"
+#include "base64/base64.h"
+#include "ottery.h"
+
+static const gchar qp_hex[] = "0123456789ABCDEF";
+
+/* Encode data with lines of 76 characters as MIME does */
+static gchar *
+encode_base64_lines (const guchar *in, gsize len, gsize *outlen)
+{
+	gchar *out;
+	gint state = 0, save = 0;
+	gsize olen;
+
+	/* Size required by glib for line breaking encoder */
+	olen = (len / 3 + 1) * 4 + 4;
+	out = g_malloc (olen + olen / 72 + 1);
+	olen = g_base64_encode_step (in, len, TRUE, out, &state, &save);
+	olen += g_base64_encode_close (TRUE, out + olen, &state, &save);
+	*outlen = olen;
+
+	return out;
+}
+
+static gchar *
+encode_qp (const guchar *in, gsize len, gsize *outlen)
+{
+	gchar *out;
+	gsize i, o = 0, col = 0;
+
+	out = g_malloc (len * 4 + 4);
+
+	for (i = 0; i < len; i ++) {
+		if (in[i] == '=' || in[i] < ' ' || in[i] > '~' ||
+				ottery_rand_range (8) == 0) {
+			out[o++] = '=';
+			out[o++] = qp_hex[in[i] >> 4];
+			out[o++] = qp_hex[in[i] & 0xf];
+			col += 3;
+		}
+		else {
+			out[o++] = in[i];
+			col ++;
+		}
+
+		if (col > 72) {
+			/* Soft line break with trailing whitespace sometimes */
+			out[o++] = '=';
+			if (ottery_rand_range (2) == 0) {
+				out[o++] = ' ';
+			}
+			out[o++] = '\r';
+			out[o++] = '\n';
+			col = 0;
+		}
+	}
+
+	*outlen = o;
+
+	return out;
+}
+
+static void
+test_base64_case (gsize len)
+{
+	guchar *data, *out;
+	gchar *enc;
+	gsize enclen, outlen, cap, i;
+
+	data = g_malloc (len + 1);
+	ottery_rand_bytes (data, len);
+	enc = encode_base64_lines (data, len, &enclen);
+	cap = RSPAMD_BASE64_DECODED_LEN (enclen);
+	/* Guard area to check that decoder does not write after the buffer */
+	out = g_malloc (cap + 64);
+	memset (out, 0xaa, cap + 64);
+
+	outlen = rspamd_decode_base64 ((const guchar *)enc, enclen, out);
+	g_assert_cmpuint (outlen, ==, len);
+	g_assert (memcmp (out, data, len) == 0);
+
+	/* Fuzz decoder with some damaged characters */
+	for (i = 0; i < enclen; i ++) {
+		if (ottery_rand_range (50) == 0) {
+			enc[i] = ottery_rand_range (255);
+		}
+	}
+
+	memset (out, 0xaa, cap + 64);
+	outlen = rspamd_decode_base64 ((const guchar *)enc, enclen, out);
+	g_assert_cmpuint (outlen, <=, cap);
+
+	for (i = cap; i < cap + 64; i ++) {
+		g_assert (out[i] == 0xaa);
+	}
+
+	g_free (data);
+	g_free (enc);
+	g_free (out);
+}
+
+static void
+test_qp_case (gsize len)
+{
+	guchar *data, *out;
+	gchar *enc;
+	gsize enclen, outlen;
+
+	data = g_malloc (len + 1);
+	ottery_rand_bytes (data, len);
+	enc = encode_qp (data, len, &enclen);
+	out = g_malloc (enclen + 1);
+
+	outlen = rspamd_decode_qp ((const guchar *)enc, enclen, out);
+	g_assert_cmpuint (outlen, ==, len);
+	g_assert (memcmp (out, data, len) == 0);
+
+	g_free (data);
+	g_free (enc);
+	g_free (out);
+}
+
+static const gchar *simd_impls[] = {"ssse3", "avx2"};
+
+/* Base64 alphabet mixed with whitespaces, padding and garbage */
+static gchar *
+encode_base64_noisy (gsize len)
+{
+	static const gchar b64[] =
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const gchar noise[] = " \t\r\n=-*.";
+	gchar *out;
+	gsize i;
+
+	out = g_malloc (len + 1);
+
+	for (i = 0; i < len; i ++) {
+		if (ottery_rand_range (8) == 0) {
+			out[i] = noise[ottery_rand_range (sizeof (noise) - 2)];
+		}
+		else {
+			out[i] = b64[ottery_rand_range (63)];
+		}
+	}
+
+	return out;
+}
+
+/* Vectorized decoders must produce exactly the same output as generic one */
+static void
+test_simd_case (const gchar *enc, gsize enclen)
+{
+	guchar *ref, *out;
+	gsize cap, reflen, outlen;
+	guint i;
+
+	cap = RSPAMD_BASE64_DECODED_LEN (enclen);
+	ref = g_malloc (cap + 1);
+	out = g_malloc (cap + 1);
+
+	g_assert (base64_select ("generic"));
+	reflen = rspamd_decode_base64 ((const guchar *)enc, enclen, ref);
+
+	for (i = 0; i < G_N_ELEMENTS (simd_impls); i ++) {
+		if (!base64_select (simd_impls[i])) {
+			continue;
+		}
+
+		outlen = rspamd_decode_base64 ((const guchar *)enc, enclen, out);
+		g_assert_cmpuint (outlen, ==, reflen);
+		g_assert (memcmp (out, ref, reflen) == 0);
+	}
+
+	base64_load ();
+	g_free (ref);
+	g_free (out);
+}
+
+static void
+test_simd (gsize len)
+{
+	guchar *data;
+	gchar *enc;
+	gsize enclen;
+
+	data = g_malloc (len + 1);
+	ottery_rand_bytes (data, len);
+	enc = encode_base64_lines (data, len, &enclen);
+	test_simd_case (enc, enclen);
+	g_free (enc);
+	g_free (data);
+
+	enc = encode_base64_noisy (len);
+	test_simd_case (enc, len);
+	g_free (enc);
+}
+
+static void
+test_bench (gsize len, gint iters)
+{
+	guchar *data, *out;
+	gchar *enc;
+	gsize enclen;
+	gint i, state;
+	guint save;
+	gdouble ts1, ts2, ts3;
+
+	data = g_malloc (len);
+	ottery_rand_bytes (data, len);
+	enc = encode_base64_lines (data, len, &enclen);
+	out = g_malloc (RSPAMD_BASE64_DECODED_LEN (enclen));
+
+	ts1 = rspamd_get_ticks ();
+
+	for (i = 0; i < iters; i ++) {
+		rspamd_decode_base64 ((const guchar *)enc, enclen, out);
+	}
+
+	ts2 = rspamd_get_ticks ();
+
+	for (i = 0; i < iters; i ++) {
+		state = 0;
+		save = 0;
+		g_base64_decode_step (enc, enclen, out, &state, &save);
+	}
+
+	ts3 = rspamd_get_ticks ();
+
+	msg_info ("base64 decoding of %z bytes: rspamd %.3f msec, glib %.3f msec",
+			enclen, (ts2 - ts1) * 1000. / iters, (ts3 - ts2) * 1000. / iters);
+
+	g_free (data);
+	g_free (enc);
+	g_free (out);
+}
+
+void
+rspamd_base64_test_func (void)
+{
+	gsize lens[] = {0, 1, 2, 3, 4, 31, 32, 33, 45, 57, 100, 1000, 4095, 65536};
+	guint i, j;
+
+	rspamd_cryptobox_init ();
+	msg_info ("using %s base64 decoder", base64_load ());
+
+	for (i = 0; i < G_N_ELEMENTS (lens); i ++) {
+		test_base64_case (lens[i]);
+		test_qp_case (lens[i]);
+	}
+
+	for (j = 0; j < 1000; j ++) {
+		test_base64_case (ottery_rand_range (8192));
+		test_qp_case (ottery_rand_range (8192));
+		test_simd (ottery_rand_range (8192));
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (lens); i ++) {
+		test_simd (lens[i]);
+	}
+
+	/* Benchmark is too slow for the default run */
+	if (g_getenv ("RSPAMD_TEST_BENCH") != NULL) {
+		test_bench (10 * 1024 * 1024, 10);
+	}
+}
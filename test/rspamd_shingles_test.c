@@ -87,7 +87,8 @@ free_fuzzy_words (GArray *ar)
 }
 
 static void
-test_case (gsize cnt, gsize max_len, gdouble perm_factor)
+test_case (gsize cnt, gsize max_len, gdouble perm_factor,
+		enum rspamd_shingle_alg alg)
 {
 	GArray *input;
 	struct rspamd_shingle *sgl, *sgl_permuted;
@@ -99,11 +100,11 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor)
 	input = generate_fuzzy_words (cnt, max_len);
 	ts1 = rspamd_get_ticks ();
 	sgl = rspamd_shingles_generate (input, key, NULL,
-			rspamd_shingles_default_filter, NULL);
+			rspamd_shingles_default_filter, NULL, alg);
 	ts2 = rspamd_get_ticks ();
 	permute_vector (input, perm_factor);
 	sgl_permuted = rspamd_shingles_generate (input, key, NULL,
-			rspamd_shingles_default_filter, NULL);
+			rspamd_shingles_default_filter, NULL, alg);
 
 	res = rspamd_shingles_compare (sgl, sgl_permuted);
 
@@ -116,13 +117,109 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor)
 	g_free (sgl_permuted);
 }
 
+static gdouble
+bench_case (GArray *input, const guchar *key, gint iters,
+		enum rspamd_shingle_alg alg)
+{
+	struct rspamd_shingle *sgl;
+	gdouble ts1, ts2;
+	gint i;
+
+	ts1 = rspamd_get_ticks ();
+
+	for (i = 0; i < iters; i ++) {
+		sgl = rspamd_shingles_generate (input, key, NULL,
+				rspamd_shingles_default_filter, NULL, alg);
+		g_free (sgl);
+	}
+
+	ts2 = rspamd_get_ticks ();
+
+	return (ts2 - ts1) / iters;
+}
+
+static void
+test_bench (gsize cnt, gsize max_len, gint iters)
+{
+	GArray *input;
+	guchar key[16];
+	gdouble t_sip, t_fast;
+
+	ottery_rand_bytes (key, sizeof (key));
+	input = generate_fuzzy_words (cnt, max_len);
+
+	t_sip = bench_case (input, key, iters, RSPAMD_SHINGLES_SIPHASH);
+	t_fast = bench_case (input, key, iters, RSPAMD_SHINGLES_FAST);
+
+	msg_info ("shingles of %z words: siphash %.3f usec, fast %.3f usec",
+			cnt, t_sip * 1e6, t_fast * 1e6);
+
+	free_fuzzy_words (input);
+}
+
+static void
+test_chunks (gsize len, gsize chunk_size)
+{
+	rspamd_mempool_t *pool;
+	GArray *chunks;
+	struct rspamd_shingle *sgl, *sgl_changed;
+	guchar key[16], *data;
+	gsize i;
+	gdouble res;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size ());
+	ottery_rand_bytes (key, sizeof (key));
+	data = g_malloc (len);
+	ottery_rand_bytes (data, len);
+
+	chunks = rspamd_shingles_chunk_data (data, len, chunk_size, pool);
+	sgl = rspamd_shingles_generate (chunks, key, pool,
+			rspamd_shingles_default_filter, NULL, RSPAMD_SHINGLES_FAST);
+	g_array_free (chunks, TRUE);
+
+	/* Change trailer and a few bytes in the middle */
+	for (i = len - len / 20; i < len; i ++) {
+		data[i] = ~data[i];
+	}
+	data[len / 2] = ~data[len / 2];
+
+	chunks = rspamd_shingles_chunk_data (data, len, chunk_size, pool);
+	sgl_changed = rspamd_shingles_generate (chunks, key, pool,
+			rspamd_shingles_default_filter, NULL, RSPAMD_SHINGLES_FAST);
+	g_array_free (chunks, TRUE);
+
+	res = rspamd_shingles_compare (sgl, sgl_changed);
+	msg_debug ("percentage of common shingles for chunked data: %.3f", res);
+	g_assert_cmpfloat (res, >=, 0.5);
+
+	g_free (data);
+	rspamd_mempool_delete (pool);
+}
+
 void
 rspamd_shingles_test_func (void)
 {
-	//test_case (5, 100, 0.5);
-	test_case (200, 10, 0.1);
-	test_case (500, 20, 0.01);
-	test_case (5000, 20, 0.01);
-	test_case (5000, 15, 0);
-	test_case (5000, 30, 1.0);
+	enum rspamd_shingle_alg algs[] = {
+		RSPAMD_SHINGLES_SIPHASH,
+		RSPAMD_SHINGLES_FAST
+	};
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (algs); i ++) {
+		//test_case (5, 100, 0.5, algs[i]);
+		test_case (200, 10, 0.1, algs[i]);
+		test_case (500, 20, 0.01, algs[i]);
+		test_case (5000, 20, 0.01, algs[i]);
+		test_case (5000, 15, 0, algs[i]);
+		test_case (5000, 30, 1.0, algs[i]);
+	}
+
+	test_chunks (512 * 1024, 1024);
+	test_chunks (64 * 1024, 256);
+
+	/* Benchmark is too slow for the default run */
+	if (g_getenv ("RSPAMD_TEST_BENCH") != NULL) {
+		test_bench (200, 10, 100);
+		test_bench (5000, 20, 10);
+	}
 }
@@ -59,6 +59,8 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/shingles", rspamd_shingles_test_func);
 	g_test_add_func ("/rspamd/http", rspamd_http_test_func);
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
+	g_test_add_func ("/rspamd/base64", rspamd_base64_test_func);
+	g_test_add_func ("/rspamd/utf8", rspamd_utf8_test_func);
 
 	g_test_run ();
 
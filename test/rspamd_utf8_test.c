@@ -0,0 +1,250 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "main.h"
+#include "cryptobox.h"
+#include "utf8/utf8.h"
+#include "ottery.h"
+
+/* Generate random utf8 text with characters up to `max_char` */
+static gsize
+generate_utf8 (gchar *out, gsize len, gunichar max_char)
+{
+	gsize o = 0;
+	gunichar c;
+
+	while (o + 4 < len) {
+		c = 1 + ottery_rand_range (max_char - 2);
+
+		if (c >= 0xd800 && c <= 0xdfff) {
+			c = 'a';
+		}
+
+		o += g_unichar_to_utf8 (c, out + o);
+	}
+
+	return o;
+}
+
+/* Old versions of glib reject noncharacters which are valid utf8 */
+static gboolean
+has_noncharacters (const gchar *p, gsize len)
+{
+	const gchar *end = p + len;
+	gunichar c;
+
+	while (p < end) {
+		c = g_utf8_get_char (p);
+
+		if ((c & 0xfffe) == 0xfffe || (c >= 0xfdd0 && c <= 0xfdef)) {
+			return TRUE;
+		}
+
+		p = g_utf8_next_char (p);
+	}
+
+	return FALSE;
+}
+
+static void
+test_utf8_case (gsize len, gunichar max_char)
+{
+	gchar *data;
+	gsize dlen, i;
+	gboolean res;
+
+	data = g_malloc (len + 1);
+	dlen = generate_utf8 (data, len, max_char);
+	g_assert (rspamd_fast_utf8_validate ((const guchar *)data, dlen));
+
+	/* Damage some bytes and compare results with glib */
+	for (i = 0; i < dlen; i ++) {
+		if (ottery_rand_range (200) == 0) {
+			data[i] = ottery_rand_range (255);
+		}
+	}
+
+	if (dlen > 0 && ottery_rand_range (2) == 0) {
+		/* Truncate the last character */
+		dlen --;
+	}
+
+	res = rspamd_fast_utf8_validate ((const guchar *)data, dlen);
+
+	if (!res || !has_noncharacters (data, dlen)) {
+		g_assert (res == g_utf8_validate (data, dlen, NULL));
+	}
+
+	g_free (data);
+}
+
+static const gchar *utf8_impls[] = {"generic", "ssse3", "avx2"};
+
+struct utf8_edge_case {
+	const gchar *seq;
+	gboolean valid;
+};
+
+static const struct utf8_edge_case edge_cases[] = {
+	{"\xc3\xa9", TRUE},
+	{"\xe2\x82\xac", TRUE},
+	{"\xf0\x9f\x98\x80", TRUE},
+	{"\xed\x9f\xbf", TRUE},
+	{"\xee\x80\x80", TRUE},
+	{"\xf4\x8f\xbf\xbf", TRUE},
+	/* Truncated sequences */
+	{"\xc3", FALSE},
+	{"\xe2\x82", FALSE},
+	{"\xf0\x9f\x98", FALSE},
+	/* Stray continuation bytes */
+	{"\x80", FALSE},
+	{"\xc3\xa9\xa9", FALSE},
+	/* Overlong forms */
+	{"\xc0\x80", FALSE},
+	{"\xc1\xbf", FALSE},
+	{"\xe0\x80\x80", FALSE},
+	{"\xe0\x9f\xbf", FALSE},
+	{"\xf0\x80\x80\x80", FALSE},
+	{"\xf0\x8f\xbf\xbf", FALSE},
+	/* Surrogates */
+	{"\xed\xa0\x80", FALSE},
+	{"\xed\xbf\xbf", FALSE},
+	/* Code points above U+10FFFF */
+	{"\xf4\x90\x80\x80", FALSE},
+	{"\xf5\x80\x80\x80", FALSE},
+	{"\xff", FALSE},
+};
+
+/* Compare results of all implementations with the scalar one */
+static gboolean
+test_utf8_impls (const guchar *data, gsize len)
+{
+	gboolean ref;
+	guint i;
+
+	g_assert (utf8_select ("generic"));
+	ref = rspamd_fast_utf8_validate (data, len);
+
+	for (i = 0; i < G_N_ELEMENTS (utf8_impls); i ++) {
+		if (utf8_select (utf8_impls[i])) {
+			g_assert (rspamd_fast_utf8_validate (data, len) == ref);
+		}
+	}
+
+	utf8_load ();
+
+	return ref;
+}
+
+/*
+ * Put sequence after ascii prefix of different lengths, so it crosses 16 and
+ * 32 bytes boundaries of vectorized validators or is cut by the end of data
+ */
+static void
+test_utf8_edge (const struct utf8_edge_case *ec)
+{
+	guchar buf[128];
+	gsize slen, prefix, tail, len;
+
+	slen = strlen (ec->seq);
+
+	for (prefix = 0; prefix < 72; prefix ++) {
+		memset (buf, 'a', sizeof (buf));
+		memcpy (buf + prefix, ec->seq, slen);
+
+		for (tail = 0; tail < 40; tail += 13) {
+			len = prefix + slen + tail;
+			g_assert (test_utf8_impls (buf, len) == ec->valid);
+			g_assert (ec->valid ==
+					g_utf8_validate ((const gchar *)buf, len, NULL));
+		}
+
+		if (slen > 1 && ec->valid) {
+			/* Truncated by the end of data */
+			g_assert (!test_utf8_impls (buf, prefix + slen - 1));
+		}
+	}
+}
+
+static void
+test_bench (gsize len, gint iters)
+{
+	gchar *data;
+	gsize dlen;
+	gint i;
+	gdouble ts1, ts2, ts3;
+
+	data = g_malloc (len);
+	dlen = generate_utf8 (data, len, 0x500);
+
+	ts1 = rspamd_get_ticks ();
+
+	for (i = 0; i < iters; i ++) {
+		g_assert (rspamd_fast_utf8_validate ((const guchar *)data, dlen));
+	}
+
+	ts2 = rspamd_get_ticks ();
+
+	for (i = 0; i < iters; i ++) {
+		g_assert (g_utf8_validate (data, dlen, NULL));
+	}
+
+	ts3 = rspamd_get_ticks ();
+
+	msg_info ("utf8 validation of %z bytes: rspamd %.3f msec, glib %.3f msec",
+			dlen, (ts2 - ts1) * 1000. / iters, (ts3 - ts2) * 1000. / iters);
+
+	g_free (data);
+}
+
+void
+rspamd_utf8_test_func (void)
+{
+	gsize lens[] = {0, 1, 2, 3, 4, 15, 16, 17, 31, 32, 33, 64, 100, 1000, 65536};
+	gunichar max_chars[] = {0x80, 0x800, 0x10000, 0x110000};
+	guint i, j;
+
+	rspamd_cryptobox_init ();
+	msg_info ("using %s utf8 validator", utf8_load ());
+
+	for (i = 0; i < G_N_ELEMENTS (lens); i ++) {
+		for (j = 0; j < G_N_ELEMENTS (max_chars); j ++) {
+			test_utf8_case (lens[i], max_chars[j]);
+		}
+	}
+
+	for (j = 0; j < 10000; j ++) {
+		test_utf8_case (ottery_rand_range (1024),
+				max_chars[ottery_rand_range (G_N_ELEMENTS (max_chars) - 1)]);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (edge_cases); i ++) {
+		test_utf8_edge (&edge_cases[i]);
+	}
+
+	/* Benchmark is too slow for the default run */
+	if (g_getenv ("RSPAMD_TEST_BENCH") != NULL) {
+		test_bench (10 * 1024 * 1024, 10);
+	}
+}
@@ -40,4 +40,8 @@ void rspamd_http_test_func (void);
 
 void rspamd_lua_test_func (void);
 
+void rspamd_base64_test_func (void);
+
+void rspamd_utf8_test_func (void);
+
 #endif